@@ -0,0 +1,341 @@
+#include "bandwidth.h"
+#include "mempool.h"
+#include "stats.h"
+#include "list.h"
+#include "log.h"
+
+/*
+ * bytes only grows and is added to without the lock, the window is
+ * rolled under it by whoever looks at the rate
+ * */
+struct bw_rate {
+	uint64_t bytes;
+	uint64_t start;	/* of the window */
+	uint64_t base;	/* bytes at its start */
+	uint64_t bps;	/* of the last window */
+};
+
+/* in debt after a large take, the taker sleeps it off */
+struct bw_bucket {
+	uint64_t bps;	/* 0 for no limit */
+	int64_t tokens;
+	uint64_t last;
+};
+
+/* an open file or the directory of open files */
+struct bw_entry {
+	struct list_head list;
+	struct list_head stream; /* on bw.streams while written */
+	uint32_t ino;
+	int is_dir;
+	int handles;
+	int writers;
+	struct bw_rate rd;
+	struct bw_rate wr;
+};
+
+struct bw_handle {
+	struct bw_entry *file;
+	struct bw_entry *dir;
+	int writer;
+	struct bw_bucket bucket;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct list_head entries;
+	struct list_head streams;
+	/* of the streams, summed once a window and on from there */
+	uint64_t committed;
+	uint64_t committed_at;
+
+	uint64_t read_limit_bps;
+	uint64_t write_budget_bps;
+	uint64_t stream_bps;
+
+	struct bw_bucket read_total;
+	struct bw_rate rd;
+	struct bw_rate wr;
+} bw = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.entries = LIST_HEAD_INIT(bw.entries),
+	.streams = LIST_HEAD_INIT(bw.streams),
+};
+
+static void rate_roll(struct bw_rate *r, uint64_t now)
+{
+	uint64_t d = now - r->start, bytes;
+
+	if (d < BW_WINDOW_NS)
+		return;
+
+	bytes = __atomic_load_n(&r->bytes, __ATOMIC_RELAXED);
+	r->bps = (bytes - r->base) * BW_WINDOW_NS / d;
+	r->base = bytes;
+	r->start = now;
+}
+
+static void rate_add(struct bw_rate *r, size_t size)
+{
+	__atomic_fetch_add(&r->bytes, size, __ATOMIC_RELAXED);
+}
+
+/* ns to wait for @size bytes */
+static uint64_t bucket_take(struct bw_bucket *b, uint64_t now, size_t size)
+{
+	uint64_t d, burst;
+
+	if (0 == b->bps)
+		return 0;
+
+	d = now - b->last;
+	if (d > BW_WINDOW_NS)
+		d = BW_WINDOW_NS;
+	burst = b->bps * BW_BURST_MS / 1000;
+
+	b->tokens += d / 1000 * b->bps / 1000000;
+	if (b->tokens > (int64_t) burst)
+		b->tokens = burst;
+	b->last = now;
+	b->tokens -= (int64_t) size;
+
+	return b->tokens < 0 ? -b->tokens * BW_WINDOW_NS / b->bps : 0;
+}
+
+static void bucket_init(struct bw_bucket *b, uint64_t bps)
+{
+	b->bps = bps;
+	b->tokens = bps * BW_BURST_MS / 1000;
+	b->last = stats_now();
+}
+
+void bw_init(const struct vbfs_mount_opts *opts)
+{
+	pthread_mutex_lock(&bw.lock);
+	bw.read_limit_bps = opts ? opts->read_limit_kbps * 1024ULL : 0;
+	bw.write_budget_bps = opts ? opts->write_budget_kbps * 1024ULL : 0;
+	bw.stream_bps = opts ? opts->stream_kbps * 1024ULL : 0;
+	bucket_init(&bw.read_total, opts ? opts->read_total_kbps * 1024ULL : 0);
+	memset(&bw.rd, 0, sizeof(bw.rd));
+	memset(&bw.wr, 0, sizeof(bw.wr));
+	bw.rd.start = bw.wr.start = stats_now();
+	bw.committed_at = 0;
+	pthread_mutex_unlock(&bw.lock);
+}
+
+static struct bw_entry *__entry_get(uint32_t ino, int is_dir)
+{
+	struct bw_entry *e;
+
+	list_for_each_entry(e, &bw.entries, list) {
+		if (e->ino == ino && e->is_dir == is_dir) {
+			e->handles ++;
+			return e;
+		}
+	}
+
+	e = mp_malloc(sizeof(struct bw_entry));
+	if (NULL == e)
+		return NULL;
+
+	memset(e, 0, sizeof(struct bw_entry));
+	e->ino = ino;
+	e->is_dir = is_dir;
+	e->handles = 1;
+	e->rd.start = e->wr.start = stats_now();
+	list_add_tail(&e->list, &bw.entries);
+
+	return e;
+}
+
+static void __entry_put(struct bw_entry *e)
+{
+	if (-- e->handles)
+		return;
+
+	list_del(&e->list);
+	mp_free(e);
+}
+
+static uint64_t __stream_bps(struct bw_entry *e, uint64_t now)
+{
+	rate_roll(&e->wr, now);
+
+	return e->wr.bps > bw.stream_bps ? e->wr.bps : bw.stream_bps;
+}
+
+/*
+ * the streams are walked once a window, or after one is closed, an
+ * admitted stream adds its floor to the sum meanwhile
+ * */
+static uint64_t __committed_bps(uint64_t now)
+{
+	struct bw_entry *e;
+	uint64_t sum = 0;
+
+	if (bw.committed_at && now - bw.committed_at < BW_WINDOW_NS)
+		return bw.committed;
+
+	list_for_each_entry(e, &bw.streams, stream)
+		sum += __stream_bps(e, now);
+
+	bw.committed = sum;
+	bw.committed_at = now;
+
+	return sum;
+}
+
+/* a file written already is one stream, any handle of it is let in */
+static int __admit(struct bw_entry *file, uint64_t now)
+{
+	uint64_t committed;
+
+	if (0 == bw.write_budget_bps || file->writers)
+		return 0;
+
+	committed = __committed_bps(now);
+	if (committed + bw.stream_bps <= bw.write_budget_bps)
+		return 0;
+
+	log_warning("write stream of %u refused, %llu KB/s committed of %llu\n",
+		file->ino, (unsigned long long) committed / 1024,
+		(unsigned long long) bw.write_budget_bps / 1024);
+	stats_inc(CNT_BW_REFUSED);
+
+	return -EBUSY;
+}
+
+int bw_open(uint32_t ino, uint32_t pino, int flags, struct bw_handle **hp)
+{
+	struct bw_handle *h;
+	int ret = -ENOMEM;
+
+	h = mp_malloc(sizeof(struct bw_handle));
+	if (NULL == h)
+		return -ENOMEM;
+	memset(h, 0, sizeof(struct bw_handle));
+	h->writer = (flags & O_ACCMODE) != O_RDONLY;
+
+	pthread_mutex_lock(&bw.lock);
+	h->file = __entry_get(ino, 0);
+	if (NULL == h->file)
+		goto err;
+	h->dir = __entry_get(pino, 1);
+	if (NULL == h->dir)
+		goto err_file;
+
+	if (h->writer) {
+		ret = __admit(h->file, stats_now());
+		if (ret)
+			goto err_dir;
+		if (0 == h->file->writers ++) {
+			list_add_tail(&h->file->stream, &bw.streams);
+			bw.committed += bw.stream_bps;
+		}
+		h->dir->writers ++;
+	}
+	bucket_init(&h->bucket, bw.read_limit_bps);
+	pthread_mutex_unlock(&bw.lock);
+
+	*hp = h;
+
+	return 0;
+
+err_dir:
+	__entry_put(h->dir);
+err_file:
+	__entry_put(h->file);
+err:
+	pthread_mutex_unlock(&bw.lock);
+	mp_free(h);
+
+	return ret;
+}
+
+void bw_close(struct bw_handle *h)
+{
+	pthread_mutex_lock(&bw.lock);
+	if (h->writer) {
+		if (0 == -- h->file->writers) {
+			list_del(&h->file->stream);
+			bw.committed_at = 0;
+		}
+		h->dir->writers --;
+	}
+	__entry_put(h->dir);
+	__entry_put(h->file);
+	pthread_mutex_unlock(&bw.lock);
+
+	mp_free(h);
+}
+
+void bw_read_wait(struct bw_handle *h, size_t size)
+{
+	uint64_t now, wait, total;
+
+	if (0 == bw.read_limit_bps && 0 == bw.read_total.bps)
+		return;
+
+	pthread_mutex_lock(&bw.lock);
+	now = stats_now();
+	wait = bucket_take(&h->bucket, now, size);
+	total = bucket_take(&bw.read_total, now, size);
+	pthread_mutex_unlock(&bw.lock);
+
+	if (total > wait)
+		wait = total;
+	if (0 == wait)
+		return;
+
+	stats_inc(CNT_BW_READ_WAIT);
+	usleep(wait / 1000);
+}
+
+/* the handle keeps its entries, no lock is needed to count on them */
+void bw_read_done(struct bw_handle *h, size_t size)
+{
+	rate_add(&h->file->rd, size);
+	rate_add(&h->dir->rd, size);
+	rate_add(&bw.rd, size);
+}
+
+void bw_write_done(struct bw_handle *h, size_t size)
+{
+	rate_add(&h->file->wr, size);
+	rate_add(&h->dir->wr, size);
+	rate_add(&bw.wr, size);
+}
+
+void bw_get_stats(struct bw_stats *st)
+{
+	struct bw_stream_stats *s;
+	struct bw_entry *e;
+	uint64_t now;
+
+	pthread_mutex_lock(&bw.lock);
+	now = stats_now();
+	st->write_budget_bps = bw.write_budget_bps;
+	st->stream_bps = bw.stream_bps;
+	st->committed_bps = __committed_bps(now);
+	rate_roll(&bw.rd, now);
+	rate_roll(&bw.wr, now);
+	st->read_bps = bw.rd.bps;
+	st->write_bps = bw.wr.bps;
+
+	st->nr_streams = 0;
+	list_for_each_entry(e, &bw.entries, list) {
+		if (st->nr_streams == BW_STATS_MAX)
+			break;
+		rate_roll(&e->rd, now);
+		rate_roll(&e->wr, now);
+
+		s = &st->streams[st->nr_streams ++];
+		s->ino = e->ino;
+		s->is_dir = e->is_dir;
+		s->handles = e->handles;
+		s->writers = e->writers;
+		s->read_bps = e->rd.bps;
+		s->write_bps = e->wr.bps;
+	}
+	pthread_mutex_unlock(&bw.lock);
+}
@@ -0,0 +1,52 @@
+#ifndef __BANDWIDTH_H__
+#define __BANDWIDTH_H__
+
+#include "utils.h"
+#include "libvbfs.h"
+
+/*
+ * read and write bandwidth of the open files and of their directories,
+ * in one second windows. a write stream is a file with a write handle,
+ * it is committed at least the configured stream rate.
+ * */
+#define BW_WINDOW_NS 1000000000ULL
+/* a reader bucket holds this much of its rate */
+#define BW_BURST_MS 100
+/* streams listed by the stats */
+#define BW_STATS_MAX 256
+
+struct bw_handle;
+
+struct bw_stream_stats {
+	uint32_t ino;
+	int is_dir;
+	int handles;
+	int writers;
+	uint64_t read_bps;
+	uint64_t write_bps;
+};
+
+struct bw_stats {
+	uint64_t write_budget_bps;
+	uint64_t stream_bps;
+	uint64_t committed_bps; /* of the write streams */
+	uint64_t read_bps;
+	uint64_t write_bps;
+	int nr_streams;
+	struct bw_stream_stats streams[BW_STATS_MAX];
+};
+
+void bw_init(const struct vbfs_mount_opts *opts);
+
+/* -EBUSY when a new write stream does not fit in the budget */
+int bw_open(uint32_t ino, uint32_t pino, int flags, struct bw_handle **hp);
+void bw_close(struct bw_handle *h);
+
+/* before a read, sleeps while the reader buckets are empty */
+void bw_read_wait(struct bw_handle *h, size_t size);
+void bw_read_done(struct bw_handle *h, size_t size);
+void bw_write_done(struct bw_handle *h, size_t size);
+
+void bw_get_stats(struct bw_stats *st);
+
+#endif
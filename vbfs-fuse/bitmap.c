@@ -1,9 +1,46 @@
 #include "err.h"
 #include "log.h"
 #include "vbfs-fuse.h"
+#include "stats.h"
+#include "iosched.h"
 
 static pthread_mutex_t bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
 
+static int group_ready(uint32_t group);
+int __free_extend_bitmap(const uint32_t extend_no, int sync);
+
+/*
+ * on a split layout the data extends below get_meta_zone_end() are on
+ * the metadata device, directories and file indexes are allocated
+ * there and file data above it. one device is one zone.
+ * */
+enum {
+	ZONE_DATA = 0,
+	ZONE_META,
+};
+
+/* the meta zone has no cursor on disk, the search starts here */
+static uint32_t meta_next;
+
+/* the bits [*lo, *hi) of @group in @zone, 0 when it has none */
+static int zone_bits(uint32_t group, int zone, uint32_t *lo, uint32_t *hi)
+{
+	uint64_t first = (uint64_t) group * get_bitmap_capacity();
+	uint64_t zlo = first, zhi = first + get_bitmap_capacity();
+	uint32_t meta_end = get_meta_zone_end();
+
+	if (meta_end && ZONE_META == zone && meta_end < zhi)
+		zhi = meta_end;
+	if (meta_end && ZONE_DATA == zone && meta_end > zlo)
+		zlo = meta_end;
+	if (zlo >= zhi)
+		return 0;
+
+	*lo = zlo - first;
+	*hi = zhi - first;
+	return 1;
+}
+
 void init_bitmap(struct vbfs_bitmap *bitmap, uint32_t total_bits)
 {
 	bitmap->max_bit = total_bits;
@@ -31,29 +68,44 @@ static void load_bitmap_header(bitmap_header_dk_t *bm_hd_dk, struct bitmap_heade
 	bm_hd->current_position = le32_to_cpu(bm_hd_dk->bitmap_dk.current_position);
 }
 
-static int __alloc_bitmap_by_ebuf(struct extend_buf *b)
+static int __alloc_bitmap_by_ebuf(struct extend_buf *b, int zone)
 {
 	int ret, pos;
 	struct vbfs_bitmap bm;
 	char *buf;
 	struct bitmap_header bm_header;
+	uint32_t lo, hi, first;
 
 	buf = b->data;
 	load_bitmap_header((bitmap_header_dk_t *) buf, &bm_header);
 	if (0 == bm_header.free_cnt)
 		return -1;
+	if (! zone_bits(bm_header.group_no, zone, &lo, &hi))
+		return -1;
 
 	init_bitmap(&bm, bm_header.total_cnt);
 	bm.bitmap = (__u32 *)(buf + BITMAP_META_SIZE);
 
-	pos = bm_header.current_position - 1;
+	first = bm_header.group_no * get_bitmap_capacity();
+	if (ZONE_META == zone)
+		pos = meta_next > first ? meta_next - first : 0;
+	else
+		pos = bm_header.current_position;
+	if (pos < lo)
+		pos = lo;
 	//log_dbg("pos %d, header pos %d, free_cnt %d", pos, bm_header.current_position, bm_header.free_cnt);
-	ret = bitmap_next_clear_bit(&bm, pos);
+	ret = bitmap_next_clear_bit(&bm, pos - 1);
+	if (ret >= (int) hi)
+		ret = -1;
 	if (-1 != ret) {
 		bm_header.free_cnt --;
-		bm_header.current_position = ret;
+		if (ZONE_META == zone)
+			meta_next = first + ret;
+		else
+			bm_header.current_position = ret;
 		bitmap_set_bit(&bm, ret);
-	} else
+		add_free_count(bm_header.group_no, -1);
+	} else if (ZONE_DATA == zone)
 		bm_header.current_position = 0;
 
 	save_bitmap_header((bitmap_header_dk_t *) buf, &bm_header);
@@ -62,17 +114,28 @@ static int __alloc_bitmap_by_ebuf(struct extend_buf *b)
 	return ret;
 }
 
-static int __alloc_bitmap(uint32_t eno)
+static int __alloc_bitmap(uint32_t eno, int zone)
 {
 	struct extend_buf *b;
 	char *data;
+	uint32_t lo, hi;
 	int ret;
 
+	/* a full group is passed by its summary, not read */
+	if (0 == get_group_free(eno - get_bitmap_offset()))
+		return -1;
+	if (! zone_bits(eno - get_bitmap_offset(), zone, &lo, &hi))
+		return -1;
+
+	ret = group_ready(eno - get_bitmap_offset());
+	if (ret)
+		return ret;
+
 	data = extend_read(get_meta_queue(), eno, &b);
 	if (IS_ERR(data))
 		return PTR_ERR(data);
 
-	ret = __alloc_bitmap_by_ebuf(b);
+	ret = __alloc_bitmap_by_ebuf(b, zone);
 
 #ifdef SYNC_METADATA
 	extend_write_dirty(b);
@@ -91,7 +154,7 @@ int __alloc_extend_bitmap(uint32_t *extend_no)
 	start_no = curr_no;
 
 	while (1) {
-		ret = __alloc_bitmap(curr_no);
+		ret = __alloc_bitmap(curr_no, ZONE_DATA);
 		//log_dbg("currno %u, %d\n", curr_no, ret);
 		if (ret >= 0) {
 			*extend_no = (curr_no - get_bitmap_offset()) * get_bitmap_capacity() + ret;
@@ -103,7 +166,7 @@ int __alloc_extend_bitmap(uint32_t *extend_no)
 	}
 	sync_super();
 
-	ret = __alloc_bitmap(curr_no);
+	ret = __alloc_bitmap(curr_no, ZONE_DATA);
 	//log_dbg("currno %u, %d\n", curr_no, ret);
 	if (ret >= 0) {
 		*extend_no = (curr_no - get_bitmap_offset())* get_bitmap_capacity() + ret;
@@ -112,17 +175,243 @@ int __alloc_extend_bitmap(uint32_t *extend_no)
 		return -ENOSPC;
 }
 
-int alloc_extend_bitmap(uint32_t *extend_no)
+/* @nr clear bits in a row of the data zone, after the current position first */
+static int __alloc_run_by_ebuf(struct extend_buf *b, int nr)
+{
+	int i, pos, end, pass;
+	struct vbfs_bitmap bm;
+	char *buf;
+	struct bitmap_header bm_header;
+	uint32_t lo, hi;
+
+	buf = b->data;
+	load_bitmap_header((bitmap_header_dk_t *) buf, &bm_header);
+	if (bm_header.free_cnt < nr)
+		return -1;
+	if (! zone_bits(bm_header.group_no, ZONE_DATA, &lo, &hi))
+		return -1;
+
+	init_bitmap(&bm, bm_header.total_cnt);
+	bm.bitmap = (__u32 *)(buf + BITMAP_META_SIZE);
+
+	for (pass = 0; pass < 2; pass ++) {
+		pos = pass ? 0 : bm_header.current_position;
+		if (pos < lo)
+			pos = lo;
+		pos --;
+		while ((pos = bitmap_next_clear_bit(&bm, pos)) >= 0) {
+			end = bitmap_next_set_bit(&bm, pos);
+			if (end < 0)
+				end = bm_header.total_cnt;
+			if (end - pos >= nr)
+				goto found;
+			pos = end;
+		}
+	}
+
+	return -1;
+
+found:
+	for (i = 0; i < nr; i ++)
+		bitmap_set_bit(&bm, pos + i);
+	bm_header.free_cnt -= nr;
+	bm_header.current_position = pos + nr - 1;
+	add_free_count(bm_header.group_no, -nr);
+
+	save_bitmap_header((bitmap_header_dk_t *) buf, &bm_header);
+	extend_mark_dirty(b);
+
+	return pos;
+}
+
+/*
+ * @nr extends in a row within one bitmap group, recycled extends are
+ * not looked at, they are scattered
+ * */
+int alloc_extend_run(int nr, uint32_t *start)
 {
 	int ret;
+	uint32_t start_no, curr_no, lo, hi;
+	struct extend_buf *b;
+	char *data;
+	STATS_OP(STAT_ALLOC);
+
+	pthread_mutex_lock(&bitmap_lock);
+	curr_no = get_bitmap_curr();
+	start_no = curr_no;
+
+	while (1) {
+		if (get_group_free(curr_no - get_bitmap_offset()) < nr
+				|| ! zone_bits(curr_no - get_bitmap_offset(), ZONE_DATA,
+					&lo, &hi))
+			goto next;
+
+		ret = group_ready(curr_no - get_bitmap_offset());
+		if (ret)
+			break;
+
+		data = extend_read(get_meta_queue(), curr_no, &b);
+		if (IS_ERR(data)) {
+			ret = PTR_ERR(data);
+			break;
+		}
+
+		ret = __alloc_run_by_ebuf(b, nr);
+#ifdef SYNC_METADATA
+		extend_write_dirty(b);
+#endif
+		extend_put(b);
+
+		if (ret >= 0) {
+			*start = (curr_no - get_bitmap_offset()) * get_bitmap_capacity() + ret;
+			ret = 0;
+			break;
+		}
+next:
+		curr_no = add_bitmap_curr();
+		if (start_no == curr_no) {
+			ret = -ENOSPC;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&bitmap_lock);
+
+	return ret;
+}
+
+/*
+ * extends of files dropped by recycle mode, their bits stay set and
+ * the allocator hands them out again before it looks at the bitmap.
+ * a crash leaks those not handed out yet, nothing frees them after.
+ * */
+static struct {
+	uint32_t *enos;
+	int nr;
+	int size;
+} recycled;
+
+int reserve_recycled_extends(int nr)
+{
+	uint32_t *enos;
+	int size, ret = 0;
 
 	pthread_mutex_lock(&bitmap_lock);
-	ret = __alloc_extend_bitmap(extend_no);
+	size = recycled.size ? recycled.size : 64;
+	while (size < recycled.nr + nr)
+		size *= 2;
+
+	if (size != recycled.size) {
+		enos = realloc(recycled.enos, size * sizeof(uint32_t));
+		if (NULL == enos) {
+			ret = -ENOMEM;
+		} else {
+			recycled.enos = enos;
+			recycled.size = size;
+		}
+	}
 	pthread_mutex_unlock(&bitmap_lock);
 
 	return ret;
 }
 
+/* room for @nr is reserved by the caller */
+void put_recycled_extends(const uint32_t *enos, int nr)
+{
+	int i;
+
+	pthread_mutex_lock(&bitmap_lock);
+	BUG_ON(recycled.nr + nr > recycled.size);
+	for (i = 0; i < nr; i ++) {
+		/* only file data is handed out again, metadata goes to its zone */
+		if (enos[i] < get_meta_zone_end())
+			__free_extend_bitmap(enos[i], 0);
+		else
+			recycled.enos[recycled.nr ++] = enos[i];
+	}
+	pthread_mutex_unlock(&bitmap_lock);
+}
+
+int nr_recycled_extends(void)
+{
+	int nr;
+
+	pthread_mutex_lock(&bitmap_lock);
+	nr = recycled.nr;
+	pthread_mutex_unlock(&bitmap_lock);
+
+	return nr;
+}
+
+int alloc_extend_bitmap(uint32_t *extend_no)
+{
+	int ret;
+	STATS_OP(STAT_ALLOC);
+
+	while (1) {
+		pthread_mutex_lock(&bitmap_lock);
+		if (recycled.nr) {
+			*extend_no = recycled.enos[-- recycled.nr];
+			ret = 0;
+		} else
+			ret = __alloc_extend_bitmap(extend_no);
+		pthread_mutex_unlock(&bitmap_lock);
+
+		if (ret != -ENOSPC)
+			return ret;
+
+		/* outside bitmap_lock, unlink takes it under the active lock */
+		ret = vbfs_recycle_oldest();
+		if (ret)
+			return -ENOSPC;
+	}
+}
+
+/* from the last meta extend on, then from the start of the zone */
+static int __alloc_meta_extend(uint32_t *extend_no)
+{
+	uint32_t group, last;
+	int ret, pass;
+
+	last = (get_meta_zone_end() - 1) / get_bitmap_capacity();
+	for (pass = 0; pass < 2; pass ++) {
+		group = pass ? 0 : meta_next / get_bitmap_capacity();
+		for (; group <= last; group ++) {
+			ret = __alloc_bitmap(group + get_bitmap_offset(), ZONE_META);
+			if (ret >= 0) {
+				*extend_no = group * get_bitmap_capacity() + ret;
+				return 0;
+			}
+		}
+		meta_next = 0;
+	}
+
+	return -ENOSPC;
+}
+
+/* directories and file indexes, on the metadata device of a split layout */
+int alloc_meta_extend(uint32_t *extend_no)
+{
+	int ret;
+
+	if (0 == get_meta_zone_end())
+		return alloc_extend_bitmap(extend_no);
+
+	STATS_OP(STAT_ALLOC);
+	while (1) {
+		pthread_mutex_lock(&bitmap_lock);
+		ret = __alloc_meta_extend(extend_no);
+		pthread_mutex_unlock(&bitmap_lock);
+
+		if (ret != -ENOSPC)
+			return ret;
+
+		/* the oldest file gives its index back to the zone */
+		ret = vbfs_recycle_oldest();
+		if (ret)
+			return -ENOSPC;
+	}
+}
+
 int __free_extend_bitmap(const uint32_t extend_no, int sync)
 {
 	struct extend_buf *b;
@@ -130,11 +419,12 @@ int __free_extend_bitmap(const uint32_t extend_no, int sync)
 	char *data;
 	uint32_t data_no, offset;
 	struct bitmap_header bm_header;
+	int set = 0;
 
-	data_no = extend_no / get_bitmap_capacity();
-	offset = extend_no % get_bitmap_capacity();
+	BUG_ON(ROOT_INO == extend_no);
 
-	BUG_ON(data_no == 0 && offset == 0);
+	data_no = extend_no / get_bitmap_capacity() + get_bitmap_offset();
+	offset = extend_no % get_bitmap_capacity();
 
 	data = extend_read(get_meta_queue(), data_no, &b);
 	if (IS_ERR(data))
@@ -145,11 +435,16 @@ int __free_extend_bitmap(const uint32_t extend_no, int sync)
 	init_bitmap(&bm, bm_header.total_cnt);
 	bm.bitmap = (__u32 *)(data + BITMAP_META_SIZE);
 
-	if (bitmap_clear_bit(&bm, offset)) {
+	/* a double free must not count twice */
+	bitmap_get_bit(&bm, offset, &set);
+	if (set) {
+		bitmap_clear_bit(&bm, offset);
 		bm_header.free_cnt ++;
 		save_bitmap_header((bitmap_header_dk_t *) data, &bm_header);
 		extend_mark_dirty(b);
-	}
+		add_free_count(data_no - get_bitmap_offset(), 1);
+	} else
+		log_err("extend %u is not in use", extend_no);
 
 	if (sync)
 		extend_write_dirty(b);
@@ -161,6 +456,7 @@ int __free_extend_bitmap(const uint32_t extend_no, int sync)
 int free_extend_bitmap(const uint32_t extend_no)
 {
 	int ret;
+	STATS_OP(STAT_FREE);
 
 	pthread_mutex_lock(&bitmap_lock);
 	ret = __free_extend_bitmap(extend_no, 1);
@@ -172,6 +468,7 @@ int free_extend_bitmap(const uint32_t extend_no)
 int free_extend_bitmap_async(const uint32_t extend_no)
 {
 	int ret;
+	STATS_OP(STAT_FREE);
 
 	pthread_mutex_lock(&bitmap_lock);
 	ret = __free_extend_bitmap(extend_no, 0);
@@ -180,3 +477,138 @@ int free_extend_bitmap_async(const uint32_t extend_no)
 	return ret;
 }
 
+/* the extends of a punched range, under one hold of the lock */
+void free_extend_batch(const uint32_t *enos, int nr)
+{
+	int i;
+	STATS_OP(STAT_FREE);
+
+	pthread_mutex_lock(&bitmap_lock);
+	for (i = 0; i < nr; i ++)
+		__free_extend_bitmap(enos[i], 0);
+	pthread_mutex_unlock(&bitmap_lock);
+}
+
+/* back to the bitmap at umount, so a clean umount leaks none */
+void release_recycled_extends(void)
+{
+	pthread_mutex_lock(&bitmap_lock);
+	while (recycled.nr)
+		__free_extend_bitmap(recycled.enos[-- recycled.nr], 0);
+	free(recycled.enos);
+	recycled.enos = NULL;
+	recycled.size = 0;
+	pthread_mutex_unlock(&bitmap_lock);
+}
+
+/*
+ * lazy group init begin
+ *
+ * mkfs -l writes the first bitmap group only, the superblock keeps the
+ * first one left. groups are written in order, by a background thread
+ * or ahead of their first allocation, whichever comes first.
+ * */
+#define LAZY_INIT_INTERVAL_MS 10
+
+static struct {
+	pthread_t tid;
+	int running;
+	int stop;
+} lazy_init;
+
+static int __init_group(uint32_t group)
+{
+	struct extend_buf *b;
+	struct bitmap_header bm_header;
+	char *data;
+	int ret;
+
+	/* nothing on disk worth reading */
+	data = extend_new(get_meta_queue(), get_bitmap_offset() + group, &b);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+
+	memset(data, 0, get_extend_size());
+	bm_header.group_no = group;
+	bm_header.total_cnt = get_group_total(group);
+	bm_header.free_cnt = bm_header.total_cnt;
+	bm_header.current_position = 0;
+	save_bitmap_header((bitmap_header_dk_t *) data, &bm_header);
+	extend_mark_dirty(b);
+
+	extend_write_dirty(b);
+	ret = b->error;
+	extend_put(b);
+
+	return ret;
+}
+
+/* bitmap_lock held, @group and the ones before it are written */
+static int group_ready(uint32_t group)
+{
+	uint32_t next;
+	int ret;
+
+	for (next = get_uninit_group(); next && next <= group; next ++) {
+		ret = __init_group(next);
+		if (ret)
+			return ret;
+		ret = set_uninit_group(next + 1);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void *lazy_init_thread(void *args)
+{
+	uint32_t next;
+	int ret = 0;
+
+	iosched_set_thread_class(IO_CLASS_BG);
+	while (! __atomic_load_n(&lazy_init.stop, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&bitmap_lock);
+		next = get_uninit_group();
+		if (next)
+			ret = group_ready(next);
+		pthread_mutex_unlock(&bitmap_lock);
+
+		if (0 == next || ret)
+			break;
+		usleep(LAZY_INIT_INTERVAL_MS * 1000);
+	}
+
+	if (ret)
+		log_err("bitmap group %u init error %d\n", next, ret);
+	else if (0 == next)
+		log_dbg("bitmap groups all written\n");
+
+	return NULL;
+}
+
+int lazy_init_start(void)
+{
+	int ret;
+
+	if (0 == get_uninit_group())
+		return 0;
+
+	lazy_init.stop = 0;
+	ret = pthread_create(&lazy_init.tid, NULL, lazy_init_thread, NULL);
+	if (ret)
+		return -ret;
+	lazy_init.running = 1;
+
+	return 0;
+}
+
+void lazy_init_stop(void)
+{
+	if (! lazy_init.running)
+		return;
+
+	__atomic_store_n(&lazy_init.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(lazy_init.tid, NULL);
+	lazy_init.running = 0;
+}
@@ -13,8 +13,19 @@ struct bitmap_header {
 void init_bitmap(struct vbfs_bitmap *bitmap, uint32_t total_bits);
 
 int alloc_extend_bitmap(uint32_t *extend_no);
+int alloc_extend_run(int nr, uint32_t *start);
+int alloc_meta_extend(uint32_t *extend_no);
 int free_extend_bitmap(const uint32_t extend_no);
 int free_extend_bitmap_async(const uint32_t extend_no);
+void free_extend_batch(const uint32_t *enos, int nr);
+
+int reserve_recycled_extends(int nr);
+void put_recycled_extends(const uint32_t *enos, int nr);
+int nr_recycled_extends(void);
+void release_recycled_extends(void);
+
+int lazy_init_start(void);
+void lazy_init_stop(void);
 //int free_extends(struct inode_info *inode);
 
 #endif
@@ -1,6 +1,7 @@
 #include "log.h"
 #include "err.h"
 #include "vbfs-fuse.h"
+#include "stats.h"
 
 void fill_stbuf_by_dirent(struct stat *stbuf, struct vbfs_dirent *dirent)
 {
@@ -30,6 +31,9 @@ void fill_stbuf_by_dirent(struct stat *stbuf, struct vbfs_dirent *dirent)
 	stbuf->st_blocks = extends * get_extend_size() / 512;
 }
 
+/* dir whose lock this thread holds while it may allocate */
+static __thread struct inode_info *dir_locked;
+
 static void active_inode_lock()
 {
 	struct active_inode *active_i;
@@ -46,6 +50,22 @@ static void active_inode_unlock()
 	pthread_mutex_unlock(&active_i->lock);
 }
 
+/*
+ * the active inode lock, then @inode->lock. an allocation under an inode
+ * lock may recycle a file, which takes the active lock, so the inode lock
+ * is only tried here and both are let go for such a thread to finish.
+ * */
+static void active_inode_lock_with(struct inode_info *inode)
+{
+	while (1) {
+		active_inode_lock();
+		if (0 == pthread_mutex_trylock(&inode->lock))
+			return;
+		active_inode_unlock();
+		sched_yield();
+	}
+}
+
 static void load_dirent_header(vbfs_dir_header_dk_t *dh_dk, struct vbfs_dirent_header *dh)
 {
 	dh->group_no = le32_to_cpu(dh_dk->vbfs_dir_header.group_no);
@@ -55,6 +75,7 @@ static void load_dirent_header(vbfs_dir_header_dk_t *dh_dk, struct vbfs_dirent_h
 	dh->next_extend = le32_to_cpu(dh_dk->vbfs_dir_header.next_extend);
 	dh->dir_capacity = le32_to_cpu(dh_dk->vbfs_dir_header.dir_capacity);
 	dh->bitmap_size = le32_to_cpu(dh_dk->vbfs_dir_header.bitmap_size);
+	dh->seg_extends = le32_to_cpu(dh_dk->vbfs_dir_header.seg_extends);
 }
 
 static void save_dirent_header(vbfs_dir_header_dk_t *dh_dk, struct vbfs_dirent_header *dh)
@@ -68,6 +89,7 @@ static void save_dirent_header(vbfs_dir_header_dk_t *dh_dk, struct vbfs_dirent_h
 	dh_dk->vbfs_dir_header.next_extend = cpu_to_le32(dh->next_extend);
 	dh_dk->vbfs_dir_header.dir_capacity = cpu_to_le32(dh->dir_capacity);
 	dh_dk->vbfs_dir_header.bitmap_size = cpu_to_le32(dh->bitmap_size);
+	dh_dk->vbfs_dir_header.seg_extends = cpu_to_le32(dh->seg_extends);
 }
 
 static void load_dirent(struct vbfs_dirent_disk *dir_dk, struct vbfs_dirent *dir)
@@ -79,6 +101,9 @@ static void load_dirent(struct vbfs_dirent_disk *dir_dk, struct vbfs_dirent *dir
 	dir->i_atime = le32_to_cpu(dir_dk->i_atime);
 	dir->i_ctime = le32_to_cpu(dir_dk->i_ctime);
 	dir->i_mtime = le32_to_cpu(dir_dk->i_mtime);
+	dir->i_reserved = le32_to_cpu(dir_dk->i_reserved);
+	dir->i_seek_nr = le32_to_cpu(dir_dk->i_seek_nr);
+	dir->i_flat_nr = le32_to_cpu(dir_dk->i_flat_nr);
 
 	dir->name[NAME_LEN] = '\0';
 	strncpy(dir->name, dir_dk->name, NAME_LEN - 1);
@@ -95,6 +120,9 @@ static void save_dirent(struct vbfs_dirent_disk *dir_dk, struct vbfs_dirent *dir
 	dir_dk->i_atime = cpu_to_le32(dir->i_atime);
 	dir_dk->i_ctime = cpu_to_le32(dir->i_ctime);
 	dir_dk->i_mtime = cpu_to_le32(dir->i_mtime);
+	dir_dk->i_reserved = cpu_to_le32(dir->i_reserved);
+	dir_dk->i_seek_nr = cpu_to_le32(dir->i_seek_nr);
+	dir_dk->i_flat_nr = cpu_to_le32(dir->i_flat_nr);
 
 	strncpy(dir_dk->name, dir->name, NAME_LEN - 1);
 }
@@ -151,6 +179,7 @@ static struct inode_info *__alloc_inode(struct vbfs_dirent *dir,
 {
 	struct inode_info *inode;
 	struct vbfs_dirent *dir_tmp; 
+	pthread_rwlockattr_t attr;
 
 	inode = mp_malloc(sizeof(*inode));
 	if (NULL == inode) {
@@ -165,7 +194,19 @@ static struct inode_info *__alloc_inode(struct vbfs_dirent *dir,
 	inode->flags = 0;
 	inode->ref = 1;
 	pthread_mutex_init(&inode->lock, NULL);
+	/* a truncate is not held off by a stream of readers */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&inode->trim_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
 	INIT_LIST_HEAD(&inode->extend_list);
+	INIT_LIST_HEAD(&inode->wc_list);
+	inode->map = NULL;
+	inode->pub_size = dir->i_size;
+	inode->writers = 0;
+	inode->watchers = 0;
+	INIT_LIST_HEAD(&inode->watch_list);
 
 	return inode;
 }
@@ -307,7 +348,9 @@ static struct inode_info *get_root_inode()
 static void free_inode(struct inode_info *inode)
 {
 	__unlink_active_inode(inode);
+	__file_map_drop(inode);
 	pthread_mutex_destroy(&inode->lock);
+	pthread_rwlock_destroy(&inode->trim_lock);
 	mp_free(inode->dirent);
 	mp_free(inode);
 }
@@ -344,16 +387,21 @@ int __writeback_inode(struct inode_info *inode, int sync)
 	return ret;
 }
 
-int vbfs_inode_sync(struct inode_info *inode)
+static void __vbfs_inode_sync(struct inode_info *inode)
 {
 	struct extend_buf *b;
 
-	pthread_mutex_lock(&inode->lock);
 	__writeback_inode(inode, 1);
 
 	list_for_each_entry(b, &inode->extend_list, inode_list) {
 		extend_write_dirty(b);
 	}
+}
+
+int vbfs_inode_sync(struct inode_info *inode)
+{
+	pthread_mutex_lock(&inode->lock);
+	__vbfs_inode_sync(inode);
 	pthread_mutex_unlock(&inode->lock);
 
 	return 0;
@@ -388,7 +436,7 @@ int vbfs_inode_close(struct inode_info *inode)
 }
 
 static int __readdir_by_inode(struct inode_info *inode, off_t filler_pos,
-				fuse_fill_dir_t filler, void *filler_buf)
+				vbfs_filldir_t filler, void *filler_buf)
 {
 	int pos;
 	uint32_t data_no;
@@ -553,7 +601,7 @@ struct inode_info *pathname_to_inode(const char *pathname)
 }
 
 int __vbfs_readdir(struct inode_info *inode, off_t filler_pos,
-		fuse_fill_dir_t filler, void *filler_buf)
+		vbfs_filldir_t filler, void *filler_buf)
 {
 	struct inode_info *inode_tmp;
 	struct stat stbuf;
@@ -575,8 +623,8 @@ int __vbfs_readdir(struct inode_info *inode, off_t filler_pos,
 	return ret;
 }
 
-int vbfs_readdir(struct inode_info *inode, off_t filler_pos,
-		fuse_fill_dir_t filler, void *filler_buf)
+int vbfs_inode_readdir(struct inode_info *inode, off_t filler_pos,
+		vbfs_filldir_t filler, void *filler_buf)
 {
 	int ret;
 
@@ -587,6 +635,292 @@ int vbfs_readdir(struct inode_info *inode, off_t filler_pos,
 	return ret;
 }
 
+/*
+ * segment pool begin
+ *
+ * a directory with a segment template creates its files with the first
+ * extend and seg_extends - 1 data extends allocated in one run, index
+ * filled and i_reserved set. a deleted file that is still such a
+ * segment goes to the pool of its directory and is handed to the next
+ * create as it is. pools live in memory, umount frees them.
+ * */
+#define SEG_POOL_MAX 8
+#define SEG_POOL_PREFILL 2
+
+struct seg_pool {
+	struct list_head list;
+	uint32_t dir_ino;
+	uint32_t seg_extends;
+	int nr;
+	uint32_t ino[SEG_POOL_MAX];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct list_head pools;
+} seg_ctx = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.pools = LIST_HEAD_INIT(seg_ctx.pools),
+};
+
+static struct seg_pool *__seg_pool_find(uint32_t dir_ino)
+{
+	struct seg_pool *pool;
+
+	list_for_each_entry(pool, &seg_ctx.pools, list) {
+		if (pool->dir_ino == dir_ino)
+			return pool;
+	}
+
+	return NULL;
+}
+
+/* @nr extends in a row, the index of the first one points at the rest */
+static int seg_new(uint32_t nr, uint32_t *ino)
+{
+	int i, ret;
+	uint32_t first, start, *p_index;
+	struct extend_buf *b;
+	char *data;
+
+	/* on a split layout the inode extend is metadata, the run is not */
+	if (get_meta_zone_end()) {
+		ret = alloc_meta_extend(&first);
+		if (ret)
+			return ret;
+		ret = nr > 1 ? alloc_extend_run(nr - 1, &start) : 0;
+		if (ret) {
+			free_extend_bitmap(first);
+			return ret;
+		}
+	} else {
+		ret = alloc_extend_run(nr, &first);
+		if (ret)
+			return ret;
+		start = first + 1;
+	}
+
+	data = extend_new(get_data_queue(), first, &b);
+	if (IS_ERR(data)) {
+		for (i = 1; i < nr; i ++)
+			free_extend_bitmap(start + i - 1);
+		free_extend_bitmap(first);
+		return PTR_ERR(data);
+	}
+
+	memset(data, 0, get_file_idx_size());
+	p_index = (uint32_t *) data;
+	for (i = 1; i < nr; i ++)
+		p_index[i - 1] = cpu_to_le32(start + i - 1);
+
+	extend_mark_dirty(b);
+	extend_put(b);
+
+	*ino = first;
+
+	return 0;
+}
+
+static void seg_free(uint32_t ino, uint32_t nr)
+{
+	int i;
+	uint32_t *p_index;
+	struct extend_buf *b;
+	char *data;
+
+	data = extend_read(get_data_queue(), ino, &b);
+	if (IS_ERR(data))
+		return;
+
+	p_index = (uint32_t *) data;
+	for (i = 0; i < nr - 1; i ++)
+		free_extend_bitmap_async(le32_to_cpu(p_index[i])
+					& ~EXTEND_UNWRITTEN);
+	extend_put(b);
+
+	free_extend_bitmap(ino);
+}
+
+/* a ready segment for a new file of @dir_ino */
+static int seg_get(uint32_t dir_ino, uint32_t nr, uint32_t *ino)
+{
+	struct seg_pool *pool;
+
+	pthread_mutex_lock(&seg_ctx.lock);
+	pool = __seg_pool_find(dir_ino);
+	if (pool && pool->seg_extends == nr && pool->nr) {
+		*ino = pool->ino[-- pool->nr];
+		pthread_mutex_unlock(&seg_ctx.lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&seg_ctx.lock);
+
+	return seg_new(nr, ino);
+}
+
+/* 0 when the pool of @dir_ino took the segment */
+static int seg_put(uint32_t dir_ino, uint32_t nr, uint32_t ino)
+{
+	struct seg_pool *pool;
+	int ret = -ENOSPC;
+
+	pthread_mutex_lock(&seg_ctx.lock);
+	pool = __seg_pool_find(dir_ino);
+	if (NULL == pool) {
+		pool = malloc(sizeof(*pool));
+		if (NULL == pool)
+			goto out;
+		pool->dir_ino = dir_ino;
+		pool->seg_extends = nr;
+		pool->nr = 0;
+		list_add(&pool->list, &seg_ctx.pools);
+	}
+
+	if (pool->seg_extends == nr && pool->nr < SEG_POOL_MAX) {
+		pool->ino[pool->nr ++] = ino;
+		ret = 0;
+	}
+
+out:
+	pthread_mutex_unlock(&seg_ctx.lock);
+
+	return ret;
+}
+
+/* drop the pool of @dir_ino unless its segments have @nr extends */
+static void seg_pool_drain(uint32_t dir_ino, uint32_t nr)
+{
+	struct seg_pool *pool;
+	uint32_t ino[SEG_POOL_MAX], seg_extends = 0;
+	int i, cnt = 0;
+
+	pthread_mutex_lock(&seg_ctx.lock);
+	pool = __seg_pool_find(dir_ino);
+	if (pool && pool->seg_extends != nr) {
+		seg_extends = pool->seg_extends;
+		cnt = pool->nr;
+		memcpy(ino, pool->ino, cnt * sizeof(uint32_t));
+		list_del(&pool->list);
+		free(pool);
+	}
+	pthread_mutex_unlock(&seg_ctx.lock);
+
+	for (i = 0; i < cnt; i ++)
+		seg_free(ino[i], seg_extends);
+}
+
+void vbfs_seg_pool_release(void)
+{
+	struct seg_pool *pool;
+
+	while (1) {
+		pthread_mutex_lock(&seg_ctx.lock);
+		if (list_empty(&seg_ctx.pools)) {
+			pthread_mutex_unlock(&seg_ctx.lock);
+			break;
+		}
+		pool = list_entry(seg_ctx.pools.next, struct seg_pool, list);
+		pthread_mutex_unlock(&seg_ctx.lock);
+
+		seg_pool_drain(pool->dir_ino, 0);
+	}
+}
+
+static uint32_t dir_seg_extends(uint32_t dir_ino)
+{
+	struct extend_buf *b;
+	struct vbfs_dirent_header dir_header;
+	char *data;
+
+	data = extend_read(get_data_queue(), dir_ino, &b);
+	if (IS_ERR(data))
+		return 0;
+
+	load_dirent_header((vbfs_dir_header_dk_t *) data, &dir_header);
+	extend_put(b);
+
+	return dir_header.seg_extends;
+}
+
+static void count_holes(uint32_t eno, void *arg)
+{
+	if (ROOT_INO == eno)
+		(* (int *) arg) ++;
+}
+
+/* a file that is still a whole segment of its dir goes to the pool */
+static int __seg_unlink(struct inode_info *inode)
+{
+	struct vbfs_dirent *dir = inode->dirent;
+	uint32_t nr;
+	int holes = 0;
+
+	nr = dir_seg_extends(dir->i_pino);
+	if (0 == nr || dir->i_reserved + 1 != nr || dir->i_flat_nr
+			|| file_index_count(dir->i_size) > dir->i_reserved)
+		return -EINVAL;
+
+	/* a punched one is not whole any more */
+	if (__file_index_walk(dir, 0, dir->i_reserved, INDEX_WALK_DATA,
+				count_holes, &holes) || holes)
+		return -EINVAL;
+
+	return seg_put(dir->i_pino, nr, dir->i_ino);
+}
+
+int vbfs_inode_set_segment(struct inode_info *inode, uint32_t nr)
+{
+	struct extend_buf *b;
+	struct vbfs_dirent_header dir_header;
+	uint32_t ino;
+	char *data;
+	int i;
+
+	if (inode->dirent->i_mode != VBFS_FT_DIR)
+		return -ENOTDIR;
+	/* the reserved entries leave the two indirect ones in the array */
+	if (nr + 1 > get_file_max_index())
+		return -EFBIG;
+
+	pthread_mutex_lock(&inode->lock);
+	data = extend_read(get_data_queue(), inode->dirent->i_ino, &b);
+	if (IS_ERR(data)) {
+		pthread_mutex_unlock(&inode->lock);
+		return PTR_ERR(data);
+	}
+
+	load_dirent_header((vbfs_dir_header_dk_t *) data, &dir_header);
+	dir_header.seg_extends = nr;
+	save_dirent_header((vbfs_dir_header_dk_t *) data, &dir_header);
+
+	extend_mark_dirty(b);
+	extend_write_dirty(b);
+	extend_put(b);
+	pthread_mutex_unlock(&inode->lock);
+
+	/* segments of an old template do not fit */
+	seg_pool_drain(inode->dirent->i_ino, nr);
+	if (0 == nr)
+		return 0;
+
+	for (i = 0; i < SEG_POOL_PREFILL; i ++) {
+		if (seg_new(nr, &ino))
+			break;
+		if (seg_put(inode->dirent->i_ino, nr, ino))
+			seg_free(ino, nr);
+	}
+
+	return 0;
+}
+
+uint32_t vbfs_inode_get_segment(struct inode_info *inode)
+{
+	if (inode->dirent->i_mode != VBFS_FT_DIR)
+		return 0;
+
+	return dir_seg_extends(inode->dirent->i_ino);
+}
+
 static void init_dirent(struct vbfs_dirent *dir, uint32_t ino, uint32_t pino, uint32_t mode)
 {
 	dir->i_ino = ino;
@@ -601,6 +935,9 @@ static void init_dirent(struct vbfs_dirent *dir, uint32_t ino, uint32_t pino, ui
 	dir->i_atime = time(NULL);
 	dir->i_mtime = time(NULL);
 	dir->i_ctime = time(NULL);
+	dir->i_reserved = 0;
+	dir->i_seek_nr = 0;
+	dir->i_flat_nr = 0;
 }
 
 static void init_dirent_header(struct vbfs_dirent_header *dir_header, uint32_t group_no)
@@ -612,6 +949,7 @@ static void init_dirent_header(struct vbfs_dirent_header *dir_header, uint32_t g
 	dir_header->dir_self_count = 1;
 	dir_header->total_extends = 1; /* useless now */
 	dir_header->dir_total_count = 1; /* useless now */
+	dir_header->seg_extends = 0;
 }
 
 static void new_dirent_header(struct vbfs_dirent_header *dir_header)
@@ -623,6 +961,7 @@ static void new_dirent_header(struct vbfs_dirent_header *dir_header)
 	dir_header->dir_self_count = 0;
 	dir_header->total_extends = 0; /* useless now */
 	dir_header->dir_total_count = 0; /* useless now */
+	dir_header->seg_extends = 0;
 }
 
 static int init_newdir_extend(uint32_t eno)
@@ -647,9 +986,10 @@ static int init_newdir_extend(uint32_t eno)
 }
 
 static int __vbfs_parent_fill_dir(uint32_t data_no, uint32_t pino, char *subname,
-			struct vbfs_dirent_header *dir_header, int is_new, uint32_t mode)
+			struct vbfs_dirent_header *dir_header, int is_new, uint32_t mode,
+			uint32_t seg_extends)
 {
-	int pos, ret = 0;
+	int pos, ret = -ENOSPC, reserved = 0;
 	char *data, *data_pos;
 	struct vbfs_bitmap bm;
 	struct extend_buf *b;
@@ -659,28 +999,39 @@ static int __vbfs_parent_fill_dir(uint32_t data_no, uint32_t pino, char *subname
 	if (is_new) {
 		init_dirent_header(dir_header, dir_header->group_no + 1);
 		data = extend_new(get_data_queue(), data_no, &b);
-	} else {
-		dir_header->dir_self_count ++;
+	} else
 		data = extend_read(get_data_queue(), data_no, &b);
-	}
 	if (IS_ERR(data))
 		return PTR_ERR(data);
 	if (is_new)
 		memset(data, 0, get_extend_size());
 
+	if (VBFS_FT_REG_FILE == mode && seg_extends) {
+		ret = seg_get(pino, seg_extends, &ino);
+		if (0 == ret)
+			reserved = seg_extends - 1;
+	}
+	if (ret)
+		ret = alloc_meta_extend(&ino);
+	if (ret) {
+		extend_put(b);
+		return ret;
+	}
+
+	/* the allocation may have recycled a file of this extend */
+	if (! is_new) {
+		load_dirent_header((vbfs_dir_header_dk_t *) data, dir_header);
+		dir_header->dir_self_count ++;
+	}
+
 	init_bitmap(&bm, get_dir_capacity());
 	bm.bitmap = (uint32_t *)(data + VBFS_DIR_META_SIZE);
 
 	pos = bitmap_next_clear_bit(&bm, -1);
 	if (pos < 0) {
 		log_err("BUG");
-		return -EINVAL;
-	}
-
-	ret = alloc_extend_bitmap(&ino);
-	if (ret) {
 		extend_put(b);
-		return ret;
+		return -EINVAL;
 	}
 
 	if (VBFS_FT_DIR == mode)
@@ -691,6 +1042,7 @@ static int __vbfs_parent_fill_dir(uint32_t data_no, uint32_t pino, char *subname
 			VBFS_DIR_SIZE * (get_dir_bm_size() + pos);
 
 	init_dirent(&dir, ino, pino, mode);
+	dir.i_reserved = reserved;
 	strncpy(dir.name, subname, NAME_LEN - 1);
 	save_dirent((struct vbfs_dirent_disk *) data_pos, &dir);
 	log_dbg("%u, new inode no is %u, pos is %u", data_no, ino, pos);
@@ -706,7 +1058,7 @@ static int __vbfs_parent_fill_dir(uint32_t data_no, uint32_t pino, char *subname
 static int __vbfs_create(struct inode_info *inode, char *subname, uint32_t mode)
 {
 	int pos, has_room = 0, ret = 0;
-	uint32_t data_no, data_no_mk;
+	uint32_t data_no, data_no_mk, seg_extends = 0;
 	char *data, *data_pos;
 	struct vbfs_bitmap bm;
 	struct extend_buf *ebuf;
@@ -723,6 +1075,8 @@ static int __vbfs_create(struct inode_info *inode, char *subname, uint32_t mode)
 			return PTR_ERR(data);
 
 		load_dirent_header((vbfs_dir_header_dk_t *) data, &dir_header);
+		if (data_no == inode->dirent->i_ino)
+			seg_extends = dir_header.seg_extends;
 
 		if (ROOT_INO == data_no)
 			pos = 0;
@@ -762,14 +1116,14 @@ static int __vbfs_create(struct inode_info *inode, char *subname, uint32_t mode)
 	if (! has_room) {
 		uint32_t new_data_no;
 
-		ret = alloc_extend_bitmap(&new_data_no);
+		ret = alloc_meta_extend(&new_data_no);
 		if (ret) {
 			extend_put(ebuf);
 			return ret;
 		}
 
 		ret = __vbfs_parent_fill_dir(new_data_no, inode->dirent->i_ino,
-					subname, &dir_header_tmp, 1, mode);
+					subname, &dir_header_tmp, 1, mode, seg_extends);
 		goto err;
 
 		dir_header.next_extend = new_data_no;
@@ -779,7 +1133,7 @@ static int __vbfs_create(struct inode_info *inode, char *subname, uint32_t mode)
 		extend_write_dirty(ebuf);
 	} else
 		ret = __vbfs_parent_fill_dir(data_no_mk, inode->dirent->i_ino,
-						subname, &dir_header_tmp, 0, mode);
+						subname, &dir_header_tmp, 0, mode, seg_extends);
 
 
 err:
@@ -793,78 +1147,176 @@ int vbfs_create(struct inode_info *inode, char *subname, uint32_t mode)
 	int ret;
 
 	pthread_mutex_lock(&inode->lock);
+	dir_locked = inode;
 	ret = __vbfs_create(inode, subname, mode);
+	dir_locked = NULL;
 	pthread_mutex_unlock(&inode->lock);
 
 	return ret;
 }
 
+static void truncate_free(uint32_t data_no, void *arg)
+{
+	/* a punched hole */
+	if (ROOT_INO == data_no)
+		return;
+	data_no &= ~EXTEND_UNWRITTEN;
+	log_dbg("data_no %u", data_no);
+	free_extend_bitmap_async(data_no);
+}
+
 int __vbfs_truncate(struct inode_info *inode, off_t size)
 {
-	struct extend_buf *b;
-	char *data;
-	uint32_t offset, data_no, fst_data_len;
-	uint32_t *start_off, *p_idx;
-	int i, j;
-	uint64_t tmp;
+	int i, j, ret;
 
 	if (inode->dirent->i_size <= size)
 		return 0;
 
-	fst_data_len = get_extend_size() - get_file_idx_size();
+	/* entries kept for @size, up to the ones in use or reserved */
+	i = file_index_count(size);
+	j = file_index_count(inode->dirent->i_size);
+	if (j < inode->dirent->i_reserved)
+		j = inode->dirent->i_reserved;
 
-	log_dbg("size %llu, fst %u", inode->dirent->i_size, fst_data_len);
-	if (inode->dirent->i_size <= fst_data_len)
-		return 0;
+	log_dbg("size %llu, free index %d to %d", inode->dirent->i_size, i, j);
+	__file_map_drop(inode);
+	ret = __file_index_walk(inode->dirent, i, j, INDEX_WALK_TRIM,
+				truncate_free, NULL);
+	if (ret)
+		return ret;
+	if (i < j)
+		queue_write_dirty(get_meta_queue());
 
-	data = extend_read(get_data_queue(), inode->dirent->i_ino, &b);
-	if (IS_ERR(data))
-		return PTR_ERR(data);
+	if (inode->dirent->i_reserved > file_index_count(size))
+		inode->dirent->i_reserved = file_index_count(size);
+	__vbfs_seek_trim(inode, size);
+	inode->dirent->i_size = size;
+	__atomic_store_n(&inode->pub_size, size, __ATOMIC_SEQ_CST);
+	inode->status = DIRTY;
 
-	/*   */
-	if (size > fst_data_len) {
-		tmp = inode->dirent->i_size - size;
-		if (tmp % get_extend_size())
-			i = tmp / get_extend_size() + 1;
-		else
-			i = tmp / get_extend_size();
-	} else
-		i = 0;
+	return 0;
+}
 
-	start_off = (uint32_t *) data;
-	start_off += i;
+int vbfs_inode_truncate(struct inode_info *inode, off_t size)
+{
+	int ret;
 
-	tmp = inode->dirent->i_size - fst_data_len;
-	if (tmp % get_extend_size())
-		j = tmp / get_extend_size() + 1;
-	else
-		j = tmp / get_extend_size();
-	offset = j - i;
-	log_dbg("size %llu, offset %u", inode->dirent->i_size, offset);
-	for (i = 0; i < offset; i ++) {
-		p_idx = start_off + i;
-		data_no = le32_to_cpu(*p_idx);
-		BUG_ON(ROOT_INO == data_no);
-		log_dbg("data_no %u", data_no);
-		free_extend_bitmap_async(data_no);
-	}
+	pthread_rwlock_wrlock(&inode->trim_lock);
+	pthread_mutex_lock(&inode->lock);
+	ret = __vbfs_truncate(inode, size);
+	pthread_mutex_unlock(&inode->lock);
+	pthread_rwlock_unlock(&inode->trim_lock);
 
-	queue_write_dirty(get_meta_queue());
-	extend_put(b);
+	vbfs_inode_sync(inode);
 
-	inode->dirent->i_size = size;
+	return ret;
+}
+
+/*
+ * the default mode zeroes the rest of the extend at end of file, the
+ * extends after it are flagged unwritten and i_size moves over them.
+ * */
+static int __vbfs_fallocate(struct inode_info *inode, int mode, off_t offset,
+			off_t len)
+{
+	uint64_t size = inode->dirent->i_size, end = offset + len, next;
+	uint32_t esize = get_extend_size(), isize = get_file_idx_size();
+	int ret;
+
+	ret = __file_reserve(inode, file_index_count(end));
+	if (ret || (mode & FALLOC_FL_KEEP_SIZE) || end <= size)
+		return ret;
+
+	next = ((size + isize) / esize + 1) * esize - isize;
+	if ((size + isize) % esize)
+		ret = __file_zero(inode, size, (next < end ? next : end) - size);
+	if (0 == ret)
+		ret = __file_unwritten(inode, file_index_count(size),
+					file_index_count(end));
+	if (ret)
+		return ret;
+
+	inode->dirent->i_size = end;
 	inode->status = DIRTY;
 
 	return 0;
 }
 
-int vbfs_truncate(struct inode_info *inode, off_t size)
+/* bytes [@from, @to) are zeroed, up to i_size, past it is not read */
+static int punch_zero(struct inode_info *inode, uint64_t from, uint64_t to)
+{
+	if (to > inode->dirent->i_size)
+		to = inode->dirent->i_size;
+	if (from >= to)
+		return 0;
+
+	return __file_zero(inode, from, to - from);
+}
+
+/*
+ * the whole extends of the range go, the rest of it below i_size is
+ * zeroed. the range ends with the extends in use or reserved, the one
+ * holding its end is kept.
+ * */
+static int __vbfs_punch(struct inode_info *inode, off_t offset, off_t len)
+{
+	uint64_t size = inode->dirent->i_size, end, head, tail, limit;
+	uint32_t esize = get_extend_size(), isize = get_file_idx_size();
+	int from, to, ret;
+
+	limit = (uint64_t) (inode->dirent->i_reserved + 1) * esize - isize;
+	if (limit < size)
+		limit = size;
+	end = offset + len < limit ? offset + len : limit;
+	if (offset >= end)
+		return 0;
+
+	/* extends [from, to) lie within, the first one never does */
+	from = (offset + isize + esize - 1) / esize;
+	to = (end + isize) / esize;
+	if (from >= to)
+		return punch_zero(inode, offset, end);
+
+	head = (uint64_t) from * esize - isize;
+	tail = (uint64_t) to * esize - isize;
+	ret = punch_zero(inode, offset, head);
+	if (0 == ret)
+		ret = punch_zero(inode, tail, end);
+	if (0 == ret)
+		ret = __file_punch(inode, from - 1, to - 1);
+
+	return ret;
+}
+
+int vbfs_inode_fallocate(struct inode_info *inode, int mode, off_t offset,
+			off_t len)
 {
 	int ret;
 
-	pthread_mutex_lock(&inode->lock);
-	ret = __vbfs_truncate(inode, size);
-	pthread_mutex_unlock(&inode->lock);
+	if (VBFS_FT_DIR == inode->dirent->i_mode)
+		return -EISDIR;
+	if (offset < 0 || len <= 0)
+		return -EINVAL;
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+		return -EOPNOTSUPP;
+
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		if (! (mode & FALLOC_FL_KEEP_SIZE))
+			return -EOPNOTSUPP;
+
+		pthread_rwlock_wrlock(&inode->trim_lock);
+		pthread_mutex_lock(&inode->lock);
+		ret = __vbfs_punch(inode, offset, len);
+		pthread_mutex_unlock(&inode->lock);
+		pthread_rwlock_unlock(&inode->trim_lock);
+	} else {
+		if ((uint64_t) offset + len > file_max_size())
+			return -EFBIG;
+
+		pthread_mutex_lock(&inode->lock);
+		ret = __vbfs_fallocate(inode, mode, offset, len);
+		pthread_mutex_unlock(&inode->lock);
+	}
 
 	vbfs_inode_sync(inode);
 
@@ -933,6 +1385,7 @@ static int __vbfs_remove_inode(struct inode_info *inode)
 	return 0;
 }
 
+/* caller holds inode->lock */
 static int __vbfs_remove(struct inode_info *inode)
 {
 	//struct inode_info *parent;
@@ -944,9 +1397,7 @@ static int __vbfs_remove(struct inode_info *inode)
 
 	//parent = __find_active_inode(inode->dirent->i_pino);
 
-	pthread_mutex_lock(&inode->lock);
 	__vbfs_remove_inode(inode);
-	pthread_mutex_unlock(&inode->lock);
 
 	return 0;
 }
@@ -968,20 +1419,22 @@ static int __vbfs_rmdir(struct inode_info *inode)
 	return 0;
 }
 
-int vbfs_rmdir(struct inode_info *inode)
+int vbfs_inode_rmdir(struct inode_info *inode)
 {
 	int ret;
 
 	if (inode->dirent->i_mode != VBFS_FT_DIR)
 		return -ENOTDIR;
 
-	active_inode_lock();
+	active_inode_lock_with(inode);
 	ret = __vbfs_rmdir(inode);
+	pthread_mutex_unlock(&inode->lock);
 	active_inode_unlock();
 
 	return ret;
 }
 
+/* caller holds trim_lock, the active inode lock and inode->lock */
 int __vbfs_unlink(struct inode_info *inode)
 {
 	int ret;
@@ -989,10 +1442,17 @@ int __vbfs_unlink(struct inode_info *inode)
 	if (inode->ref > 1)
 		return -EBUSY;
 
+	if (0 == __seg_unlink(inode)) {
+		inode->flags |= INODE_REMOVE;
+		__vbfs_remove_inode(inode);
+		return 0;
+	}
+
 	/* truncate file */
-	ret = vbfs_truncate(inode, 0);
+	ret = __vbfs_truncate(inode, 0);
 	if (ret)
 		return ret;
+	__vbfs_inode_sync(inode);
 
 	/* remove inode */
 	__vbfs_remove(inode);
@@ -1000,21 +1460,24 @@ int __vbfs_unlink(struct inode_info *inode)
 	return 0;
 }
 
-int vbfs_unlink(struct inode_info *inode)
+int vbfs_inode_unlink(struct inode_info *inode)
 {
 	int ret;
 
 	if (inode->dirent->i_mode == VBFS_FT_DIR)
 		return -EISDIR;
 
-	active_inode_lock();
+	pthread_rwlock_wrlock(&inode->trim_lock);
+	active_inode_lock_with(inode);
 	ret = __vbfs_unlink(inode);
+	pthread_mutex_unlock(&inode->lock);
 	active_inode_unlock();
+	pthread_rwlock_unlock(&inode->trim_lock);
 
 	return ret;
 }
 
-int vbfs_rename(struct inode_info *inode, const char *to)
+int vbfs_inode_rename(struct inode_info *inode, const char *to)
 {
 	pthread_mutex_lock(&inode->lock);
 	//strncpy(inode->dirent->name, to, NAME_LEN - 1);
@@ -1025,3 +1488,282 @@ int vbfs_rename(struct inode_info *inode, const char *to)
 
 	return 0;
 }
+
+/*
+ * recycle begin
+ *
+ * when the disk is full the oldest closed file (by i_ctime) is
+ * dropped and its extends go straight to the allocator. candidates
+ * come from a walk of the tree in batches of RECYCLE_BATCH and are
+ * checked again under the active inode lock before they are taken.
+ * */
+#define RECYCLE_BATCH 64
+
+struct recycle_cand {
+	uint32_t ctime;
+	uint32_t ino;
+	uint32_t pino;
+	uint32_t data_no;
+	int pos;
+};
+
+static struct {
+	int on;
+	pthread_mutex_t lock;
+	struct recycle_cand cand[RECYCLE_BATCH];
+	int nr;
+	int next;
+} recycle = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void vbfs_recycle_enable(int on)
+{
+	pthread_mutex_lock(&recycle.lock);
+	recycle.on = on;
+	recycle.nr = recycle.next = 0;
+	pthread_mutex_unlock(&recycle.lock);
+}
+
+/* keep the batch sorted, oldest first */
+static void recycle_add_cand(struct vbfs_dirent *dir, uint32_t data_no, int pos)
+{
+	struct recycle_cand *c;
+	int i;
+
+	if (RECYCLE_BATCH == recycle.nr) {
+		c = &recycle.cand[RECYCLE_BATCH - 1];
+		if (dir->i_ctime >= c->ctime)
+			return;
+		recycle.nr --;
+	}
+
+	for (i = recycle.nr; i > 0; i --) {
+		if (recycle.cand[i - 1].ctime <= dir->i_ctime)
+			break;
+		recycle.cand[i] = recycle.cand[i - 1];
+	}
+
+	c = &recycle.cand[i];
+	c->ctime = dir->i_ctime;
+	c->ino = dir->i_ino;
+	c->pino = dir->i_pino;
+	c->data_no = data_no;
+	c->pos = pos;
+	recycle.nr ++;
+}
+
+/* unlocked walk, whatever it finds is checked again by __recycle_file */
+static int recycle_scan(void)
+{
+	int pos, nr_dirs = 1, size = 64, d, ret = 0;
+	uint32_t data_no, *dirs, *tmp;
+	char *data, *data_pos;
+	struct extend_buf *b;
+	struct vbfs_bitmap bm;
+	struct vbfs_dirent dir;
+	struct vbfs_dirent_header dir_header;
+
+	recycle.nr = recycle.next = 0;
+
+	dirs = malloc(size * sizeof(uint32_t));
+	if (NULL == dirs)
+		return -ENOMEM;
+	dirs[0] = ROOT_INO;
+
+	for (d = 0; d < nr_dirs; d ++) {
+		data_no = dirs[d];
+
+		while (1) {
+			data = extend_read(get_data_queue(), data_no, &b);
+			if (IS_ERR(data)) {
+				ret = PTR_ERR(data);
+				goto out;
+			}
+
+			load_dirent_header((vbfs_dir_header_dk_t *) data, &dir_header);
+
+			init_bitmap(&bm, get_dir_capacity());
+			bm.bitmap = (uint32_t *)(data + VBFS_DIR_META_SIZE);
+			pos = (ROOT_INO == data_no) ? 0 : -1;
+
+			while ((pos = bitmap_next_set_bit(&bm, pos)) >= 0) {
+				data_pos = data + VBFS_DIR_META_SIZE +
+						VBFS_DIR_SIZE * (get_dir_bm_size() + pos);
+				load_dirent((struct vbfs_dirent_disk *) data_pos, &dir);
+
+				if (VBFS_FT_REG_FILE == dir.i_mode) {
+					recycle_add_cand(&dir, data_no, pos);
+					continue;
+				}
+				if (VBFS_FT_DIR != dir.i_mode)
+					continue;
+
+				if (nr_dirs == size) {
+					tmp = realloc(dirs, 2 * size * sizeof(uint32_t));
+					if (NULL == tmp) {
+						extend_put(b);
+						ret = -ENOMEM;
+						goto out;
+					}
+					dirs = tmp;
+					size *= 2;
+				}
+				dirs[nr_dirs ++] = dir.i_ino;
+			}
+
+			extend_put(b);
+
+			if (0 == dir_header.next_extend)
+				break;
+			data_no = dir_header.next_extend;
+		}
+	}
+
+out:
+	free(dirs);
+
+	return ret;
+}
+
+/*
+ * drop the dirent of a closed file and hand its extends to the
+ * allocator, with the active inode lock held nobody can open it.
+ * lookups hold the parent lock, so it must be ours or free.
+ * */
+struct recycle_enos {
+	uint32_t *enos;
+	int n;
+};
+
+static void recycle_collect(uint32_t eno, void *arg)
+{
+	struct recycle_enos *e = arg;
+
+	if (eno != ROOT_INO)
+		e->enos[e->n ++] = eno & ~EXTEND_UNWRITTEN;
+}
+
+static int __recycle_file(struct recycle_cand *c)
+{
+	int nr, set = 0, ret = 0;
+	struct recycle_enos e;
+	char *data;
+	struct extend_buf *b;
+	struct inode_info *parent;
+	struct vbfs_bitmap bm;
+	struct vbfs_dirent dir;
+	struct vbfs_dirent_header dir_header;
+
+	if (__find_active_inode(c->ino))
+		return -EBUSY;
+
+	parent = __find_active_inode(c->pino);
+	if (parent == dir_locked)
+		parent = NULL;
+	if (parent && pthread_mutex_trylock(&parent->lock))
+		return -EBUSY;
+
+	data = extend_read(get_data_queue(), c->data_no, &b);
+	if (IS_ERR(data)) {
+		ret = PTR_ERR(data);
+		goto out;
+	}
+
+	init_bitmap(&bm, get_dir_capacity());
+	bm.bitmap = (uint32_t *)(data + VBFS_DIR_META_SIZE);
+	load_dirent((struct vbfs_dirent_disk *) (data + VBFS_DIR_META_SIZE +
+			VBFS_DIR_SIZE * (get_dir_bm_size() + c->pos)), &dir);
+
+	bitmap_get_bit(&bm, c->pos, &set);
+	if (! set || dir.i_ino != c->ino || VBFS_FT_REG_FILE != dir.i_mode) {
+		ret = -ESTALE;
+		goto out_put;
+	}
+
+	/* index entries in use or reserved, the first extend last */
+	nr = file_index_count(dir.i_size);
+	if (nr < dir.i_reserved)
+		nr = dir.i_reserved;
+
+	/* with the indirect extends, one per extend of entries at most */
+	e.n = 0;
+	e.enos = malloc((nr + 4 + nr / (get_extend_size() / sizeof(uint32_t)))
+			* sizeof(uint32_t));
+	if (NULL == e.enos) {
+		ret = -ENOMEM;
+		goto out_put;
+	}
+
+	ret = __file_index_walk(&dir, 0, nr, INDEX_WALK_FREE, recycle_collect, &e);
+	if (ret)
+		goto out_free;
+	e.enos[e.n ++] = dir.i_ino;
+
+	ret = reserve_recycled_extends(e.n);
+	if (ret)
+		goto out_free;
+
+	load_dirent_header((vbfs_dir_header_dk_t *) data, &dir_header);
+	dir_header.dir_self_count --;
+	save_dirent_header((vbfs_dir_header_dk_t *) data, &dir_header);
+	bitmap_clear_bit(&bm, c->pos);
+
+	/* the dirent is gone on disk before its extends are reused */
+	extend_mark_dirty(b);
+	extend_write_dirty(b);
+
+	put_recycled_extends(e.enos, e.n);
+	stats_inc(CNT_RECYCLE_FILES);
+	stats_add(CNT_RECYCLE_EXTENDS, e.n);
+	log_dbg("recycle %s, ctime %u, %d extends\n", dir.name, dir.i_ctime, e.n);
+
+out_free:
+	free(e.enos);
+out_put:
+	extend_put(b);
+out:
+	if (parent)
+		pthread_mutex_unlock(&parent->lock);
+
+	return ret;
+}
+
+/*
+ * called by the allocator on ENOSPC, returns 0 once there are recycled
+ * extends to take and -ENOSPC when recycle is off or nothing is closed
+ * */
+int vbfs_recycle_oldest(void)
+{
+	int ret = -ENOSPC, scanned = 0;
+
+	pthread_mutex_lock(&recycle.lock);
+	if (! recycle.on)
+		goto out;
+
+	/* another thread recycled while we waited */
+	if (nr_recycled_extends()) {
+		ret = 0;
+		goto out;
+	}
+
+	while (1) {
+		if (recycle.next == recycle.nr) {
+			if (scanned ++ || recycle_scan() || 0 == recycle.nr) {
+				ret = -ENOSPC;
+				break;
+			}
+		}
+
+		active_inode_lock();
+		ret = __recycle_file(&recycle.cand[recycle.next ++]);
+		active_inode_unlock();
+		if (0 == ret)
+			break;
+	}
+
+out:
+	pthread_mutex_unlock(&recycle.lock);
+
+	return ret;
+}
@@ -3,6 +3,7 @@
 
 #include "utils.h"
 #include "list.h"
+#include "libvbfs.h"
 
 typedef enum {
 	UPDATE_ATIME = 1 << 0,
@@ -23,6 +24,7 @@ struct vbfs_dirent_header {
 	uint32_t next_extend;
 	uint32_t dir_capacity;
 	uint32_t bitmap_size;
+	uint32_t seg_extends;
 };
 
 struct vbfs_dirent {
@@ -34,6 +36,9 @@ struct vbfs_dirent {
 	uint32_t i_atime;
 	uint32_t i_ctime;
 	uint32_t i_mtime;
+	uint32_t i_reserved;
+	uint32_t i_seek_nr;
+	uint32_t i_flat_nr;
 
 	char name[NAME_LEN];
 };
@@ -47,10 +52,20 @@ struct inode_info {
 	unsigned int flags;
 	int ref;
 	pthread_mutex_t lock;
+	/* extends of the file are freed with it held for write */
+	pthread_rwlock_t trim_lock;
 
 	struct hlist_node hash_list;
 	struct list_head active_list;
 	struct list_head extend_list;
+	struct list_head wc_list; /* write combining buffers of open files */
+	struct file_map *map; /* extend runs of a file, see file.c */
+
+	/* live tail, see libvbfs.c */
+	off_t pub_size; /* written without inode->lock taken to read it */
+	int writers;
+	int watchers;
+	struct list_head watch_list;
 };
 
 int init_root_inode(void);
@@ -64,12 +79,21 @@ int __writeback_inode(struct inode_info *inode, int sync);
 
 void fill_stbuf_by_dirent(struct stat *stbuf, struct vbfs_dirent *dirent);
 int vbfs_update_times(struct inode_info *inode, time_update_flags mask);
-int vbfs_readdir(struct inode_info *inode, off_t filler_pos,
-		fuse_fill_dir_t filler, void *filler_buf);
+int vbfs_inode_readdir(struct inode_info *inode, off_t filler_pos,
+		vbfs_filldir_t filler, void *filler_buf);
 int vbfs_create(struct inode_info *inode, char *subname, uint32_t mode);
-int vbfs_truncate(struct inode_info *inode, off_t size);
-int vbfs_rmdir(struct inode_info *inode);
-int vbfs_unlink(struct inode_info *inode);
-int vbfs_rename(struct inode_info *inode, const char *to);
+int vbfs_inode_truncate(struct inode_info *inode, off_t size);
+int vbfs_inode_fallocate(struct inode_info *inode, int mode, off_t offset,
+			off_t len);
+int vbfs_inode_rmdir(struct inode_info *inode);
+int vbfs_inode_unlink(struct inode_info *inode);
+int vbfs_inode_rename(struct inode_info *inode, const char *to);
+
+int vbfs_inode_set_segment(struct inode_info *inode, uint32_t nr);
+uint32_t vbfs_inode_get_segment(struct inode_info *inode);
+void vbfs_seg_pool_release(void);
+
+void vbfs_recycle_enable(int on);
+int vbfs_recycle_oldest(void);
 
 #endif
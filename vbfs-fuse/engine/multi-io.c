@@ -1,6 +1,8 @@
 #include "../utils.h"
 #include "../log.h"
 #include "../ioengine.h"
+#include "../stats.h"
+#include "../iosched.h"
 
 #define NR_THREAD 4
 
@@ -8,13 +10,7 @@ struct thread_info {
 	pthread_t *worker_thread;
 	int nr_threads;
 
-	pthread_cond_t pending_cond;
-	pthread_mutex_t pending_lock;
-	struct list_head pending_list;
-
 	pthread_mutex_t startup_lock;
-
-	int stop;
 };
 
 static struct thread_info info;
@@ -22,6 +18,10 @@ static struct thread_info info;
 static void extend_bufio(struct extend_buf *b)
 {
 	int ret = 0;
+	uint64_t start;
+
+	start = stats_now();
+	stats_record(STAT_IO_QUEUE, b->submit_ts);
 
 	if (WRITE == b->rw) {
 		ret = write_extend(b->real_eno, b->data);
@@ -30,31 +30,22 @@ static void extend_bufio(struct extend_buf *b)
 	} else {
 		b->error = -EINVAL;
 	}
-	if (ret < 0)
+	if (ret < 0) {
 		b->error = -errno;
+		stats_inc(CNT_IO_ERROR);
+	}
+
+	stats_record(WRITE == b->rw ? STAT_IO_WRITE : STAT_IO_READ, start);
 }
 
 static void *extend_worker_fn(void *args)
 {
 	struct extend_buf *b = NULL;
 
-	while (! info.stop) {
-		pthread_mutex_lock(&info.pending_lock);
-
-		while (list_empty(&info.pending_list)) {
-			pthread_cond_wait(&info.pending_cond, &info.pending_lock);
-			if (info.stop) {
-				pthread_mutex_unlock(&info.pending_lock);
-				pthread_exit(NULL);
-			}
-		}
-		b = list_first_entry(&info.pending_list, struct extend_buf, data_list);
-
-		list_del(&b->data_list);
-
-		pthread_mutex_unlock(&info.pending_lock);
-
+	/* the class scheduler picks, NULL when the engine stops */
+	while ((b = iosched_next())) {
 		extend_bufio(b);
+		iosched_done(b);
 		b->end_io_fn(b);
 	}
 
@@ -68,10 +59,7 @@ int rdwr_thread_open(int nr_threads)
 	info.worker_thread = malloc(sizeof(pthread_t) * nr_threads);
 	memset(info.worker_thread, 0, sizeof(pthread_t) * nr_threads);
 
-	INIT_LIST_HEAD(&info.pending_list);
-
-	pthread_cond_init(&info.pending_cond, NULL);
-	pthread_mutex_init(&info.pending_lock, NULL);
+	iosched_init();
 	pthread_mutex_init(&info.startup_lock, NULL);
 
 	pthread_mutex_lock(&info.startup_lock);
@@ -90,15 +78,13 @@ int rdwr_thread_open(int nr_threads)
 	return 0;
 
 destroy_threads:
-	info.stop = 1;
+	iosched_stop();
 
 	pthread_mutex_unlock(&info.startup_lock);
 	for (; i > 0; i--) {
 		pthread_join(info.worker_thread[i - 1], NULL);
 	}
 
-	pthread_cond_destroy(&info.pending_cond);
-	pthread_mutex_destroy(&info.pending_lock);
 	pthread_mutex_destroy(&info.startup_lock);
 	free(info.worker_thread);
 
@@ -110,28 +96,20 @@ static int rdwr_exit()
 	int i = 0;
 
 	log_err("close io threads\n");
-	info.stop = 1;
-	pthread_cond_broadcast(&info.pending_cond);
+	iosched_stop();
 
-	for (i = 0; info.worker_thread[i] && i < info.nr_threads; i ++)
+	for (i = 0; i < info.nr_threads && info.worker_thread[i]; i ++)
 		pthread_join(info.worker_thread[i], NULL);
 
-	pthread_cond_destroy(&info.pending_cond);
-	pthread_mutex_destroy(&info.pending_lock);
 	pthread_mutex_destroy(&info.startup_lock);
 	free(info.worker_thread);
 
-	info.stop = 0;
-
 	return 0;
 }
 
 int rdwr_submit(struct extend_buf *b)
 {
-	pthread_mutex_lock(&info.pending_lock);
-	list_add_tail(&b->data_list, &info.pending_list);
-	pthread_cond_signal(&info.pending_cond);
-	pthread_mutex_unlock(&info.pending_lock);
+	iosched_add(b);
 
 	return 0;
 }
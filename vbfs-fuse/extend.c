@@ -1,8 +1,11 @@
 #include "err.h"
 #include "utils.h"
+#include "mempool.h"
 #include "super.h"
 #include "extend.h"
 #include "ioengine.h"
+#include "iosched.h"
+#include "stats.h"
 
 /* wait for the bit to be cleared when want to set it */
 static void buffer_wait_on_bit_lock(struct extend_buf *b, int bit)
@@ -138,6 +141,8 @@ static void submit_io(struct extend_buf *b, int rw, end_io_fn_t end_io)
 	b->end_io_fn = end_io;
 	b->rw = rw;
 	b->real_eno = b->eno + b->q->eno_prefix;
+	b->io_class = iosched_classify(b);
+	b->submit_ts = stats_now();
 
 	ioengine->io_submit(b);
 }
@@ -198,6 +203,7 @@ static struct extend_buf *__get_unclaimed_buffer(struct queue *q)
 		if (!b->hold_cnt) {
 			__make_buffer_clean(b);
 			__unlink_buffer(b);
+			stats_inc(CNT_ECACHE_EVICT);
 			return b;
 		}
 	}
@@ -208,6 +214,7 @@ static struct extend_buf *__get_unclaimed_buffer(struct queue *q)
 		if (!b->hold_cnt) {
 			__make_buffer_clean(b);
 			__unlink_buffer(b);
+			stats_inc(CNT_ECACHE_EVICT);
 			return b;
 		}
 	}
@@ -231,6 +238,7 @@ static struct extend_buf *__find(struct queue *q, uint32_t eno)
 
 static void __wait_for_free_buffer(struct queue *q)
 {
+	stats_inc(CNT_ECACHE_WAIT);
 	queue_unlock(q);
 
 	pthread_mutex_lock(&q->free_buffer_lock);
@@ -312,11 +320,12 @@ static struct extend_buf *__extend_new(struct queue *q, uint32_t eno,
 	if (b)
 		goto found_buffer;
 
-	new_b = __alloc_buffer_wait(q);
-	if (!new_b)
+	/* only a cached buffer, do not take one from the pool */
+	if (nf == NF_GET)
 		return NULL;
 
-	if (nf == NF_GET)
+	new_b = __alloc_buffer_wait(q);
+	if (!new_b)
 		return NULL;
 	/* 
  	 * mutex was unlocked, so need to recheck.
@@ -344,9 +353,6 @@ static struct extend_buf *__extend_new(struct queue *q, uint32_t eno,
 	return b;
 
 found_buffer:
-	if (nf == NF_GET && test_bit(B_READING, &b->state))
-		return NULL;
-
 	b->hold_cnt++;
 	__relink_lru(b, test_bit(B_DIRTY, &b->state) ||
 		test_bit(B_WRITING, &b->state));
@@ -358,6 +364,7 @@ static void *new_extend(struct queue *q, uint32_t eno, int nf, struct extend_buf
 {
 	int need_submit;
 	struct extend_buf *b;
+	STATS_OP(STAT_EXTEND_GET);
 
 	queue_lock(q);
 	b = __extend_new(q, eno, nf, &need_submit);
@@ -366,8 +373,11 @@ static void *new_extend(struct queue *q, uint32_t eno, int nf, struct extend_buf
 	if (!b)
 		return b;
 
-	if (need_submit)
+	if (need_submit) {
+		stats_inc(CNT_ECACHE_MISS);
 		submit_io(b, READ, read_endio);
+	} else if (nf != NF_FRESH)
+		stats_inc(CNT_ECACHE_HIT);
 
 	buffer_wait_on_bit(b, B_READING);
 
@@ -561,6 +571,8 @@ static void cleanup_old_buffers(struct queue *q)
 static void *work_fn(void *args)
 {
 	struct queue *q = (struct queue *) args;
+
+	iosched_set_thread_class(IO_CLASS_BG);
 	while (1) {
 		pthread_mutex_lock(&q->clean_lock);
 		if (q->clean_stop) {
@@ -53,6 +53,7 @@ struct extend_buf {
 	char *data;
 
 	int rw;
+	int io_class;
 	int error;
 	unsigned int list_mode;
 	unsigned int hold_cnt;
@@ -64,6 +65,7 @@ struct extend_buf {
 
 	end_io_fn_t end_io_fn;
 	void *args;
+	uint64_t submit_ts;
 	struct list_head data_list;
 	struct queue *q;
 
@@ -23,29 +23,436 @@ int sync_file(struct inode_info *inode)
 	return 0;
 }
 
-static int __rd_ebuf_by_file_idx(struct inode_info *inode, int idx, struct extend_buf **bp)
+/*
+ * file index begin
+ *
+ * the first extend holds the index as an array until it meets the seek
+ * table, then the index goes on in an indirect extend and a double
+ * indirect one, which the two entries after the array point to. small
+ * files map with the one read of the first extend they always had.
+ * */
+static uint32_t index_per_extend(void)
+{
+	return get_extend_size() / sizeof(uint32_t);
+}
+
+/* index entries left to a file next to its seek table */
+static int file_index_limit(struct vbfs_dirent *dir)
+{
+	uint32_t seek_len;
+
+	seek_len = dir->i_seek_nr * sizeof(struct vbfs_seek_disk);
+
+	return (get_file_idx_size() - seek_len) / sizeof(uint32_t);
+}
+
+/* largest file, bounded by the extends of the disk */
+uint64_t file_max_size(void)
+{
+	uint64_t per = index_per_extend(), nr;
+
+	nr = get_file_max_index() - 2 + per + per * per;
+	if (nr > get_extend_count())
+		nr = get_extend_count();
+
+	return nr * get_extend_size();
+}
+
+/* the extend entry @p points to, with @alloc a new zeroed one if empty */
+static char *__index_next(uint32_t *p, int alloc, struct extend_buf *pb,
+			struct extend_buf **bp)
 {
+	uint32_t eno;
 	char *data;
-	struct extend_buf *b;
-	uint32_t *p_index, data_no;
+	int ret;
 
-	if (idx > get_file_max_index()) {
+	eno = le32_to_cpu(*p);
+	if (eno != ROOT_INO)
+		return extend_read(get_data_queue(), eno, bp);
+	if (! alloc) {
 		log_err("BUG");
-		return -EINVAL;
+		return ERR_PTR(-EIO);
 	}
 
-	data = extend_read(get_data_queue(), inode->dirent->i_ino, &b);
-	if (IS_ERR(data))
-		return PTR_ERR(data);
+	ret = alloc_meta_extend(&eno);
+	if (ret)
+		return ERR_PTR(ret);
+	data = extend_new(get_data_queue(), eno, bp);
+	if (IS_ERR(data)) {
+		free_extend_bitmap_async(eno);
+		return data;
+	}
 
-	p_index = (uint32_t *) data;
-	p_index += idx;
-	data_no = le32_to_cpu(*p_index);
+	memset(data, 0, get_extend_size());
+	extend_mark_dirty(*bp);
+	*p = cpu_to_le32(eno);
+	extend_mark_dirty(pb);
 
-	data = extend_read(get_data_queue(), data_no, bp);
+	return data;
+}
+
+/*
+ * the index entry of @idx, *@bp holds it until put. with @alloc the
+ * missing indirect extends are made, and a full array turns indirect.
+ * */
+static uint32_t *__index_entry(struct inode_info *inode, int idx, int alloc,
+			struct extend_buf **bp)
+{
+	struct vbfs_dirent *dir = inode->dirent;
+	uint32_t per = index_per_extend(), flat;
+	struct extend_buf *b, *nb;
+	uint32_t *first;
+	char *data;
+
+	first = extend_read(get_data_queue(), dir->i_ino, &b);
+	if (IS_ERR(first))
+		return first;
+
+	flat = dir->i_flat_nr;
+	if (0 == flat) {
+		if (idx < file_index_limit(dir) - 2 || (! alloc
+				&& idx < get_file_max_index())) {
+			*bp = b;
+			return first + idx;
+		}
+		if (! alloc || idx < 1 || idx != file_index_limit(dir) - 2) {
+			extend_put(b);
+			return ERR_PTR(alloc ? -EFBIG : -EINVAL);
+		}
+
+		first[idx] = first[idx + 1] = 0;
+		data = __index_next(first + idx, 1, b, &nb);
+		if (IS_ERR(data)) {
+			extend_put(b);
+			return (uint32_t *) data;
+		}
+		extend_put(nb);
+
+		dir->i_flat_nr = flat = idx;
+		inode->status = DIRTY;
+	}
+
+	if (idx < flat) {
+		*bp = b;
+		return first + idx;
+	}
+
+	idx -= flat;
+	if (idx < per) {
+		data = __index_next(first + flat, alloc, b, &nb);
+		extend_put(b);
+		if (IS_ERR(data))
+			return (uint32_t *) data;
+		*bp = nb;
+		return (uint32_t *) data + idx;
+	}
+
+	idx -= per;
+	if (idx / per >= per) {
+		extend_put(b);
+		return ERR_PTR(-EFBIG);
+	}
+
+	data = __index_next(first + flat + 1, alloc, b, &nb);
 	extend_put(b);
 	if (IS_ERR(data))
-		return PTR_ERR(data);
+		return (uint32_t *) data;
+
+	b = nb;
+	data = __index_next((uint32_t *) data + idx / per, alloc, b, &nb);
+	extend_put(b);
+	if (IS_ERR(data))
+		return (uint32_t *) data;
+	*bp = nb;
+
+	return (uint32_t *) data + idx % per;
+}
+
+/*
+ * @fn gets the extends of index entries [@from, @to), and by @how the
+ * indirect extends holding only entries from @from on. @to covers the
+ * entries in use, indirect extends past it are found too.
+ * */
+int __file_index_walk(struct vbfs_dirent *dir, int from, int to, int how,
+			void (*fn)(uint32_t eno, void *arg), void *arg)
+{
+	uint32_t per = index_per_extend(), flat, k, eno;
+	struct extend_buf *b, *ib, *lb;
+	uint32_t *first, *ind, *l1;
+	int i, base, trim = INDEX_WALK_TRIM == how;
+
+	if (from >= to && (INDEX_WALK_DATA == how || 0 == dir->i_flat_nr
+				|| from > dir->i_flat_nr))
+		return 0;
+
+	first = extend_read(get_data_queue(), dir->i_ino, &b);
+	if (IS_ERR(first))
+		return PTR_ERR(first);
+
+	flat = dir->i_flat_nr ? dir->i_flat_nr : get_file_max_index();
+	for (i = from; i < to && i < flat; i ++)
+		fn(le32_to_cpu(first[i]), arg);
+
+	if (0 == dir->i_flat_nr)
+		goto out;
+
+	eno = le32_to_cpu(first[flat]);
+	if (eno != ROOT_INO) {
+		ind = extend_read(get_data_queue(), eno, &ib);
+		if (IS_ERR(ind)) {
+			extend_put(b);
+			return PTR_ERR(ind);
+		}
+		for (i = from > flat ? from - flat : 0; i < per && i + flat < to; i ++)
+			fn(le32_to_cpu(ind[i]), arg);
+		extend_put(ib);
+
+		if (from <= flat && how != INDEX_WALK_DATA) {
+			fn(eno, arg);
+			if (trim)
+				first[flat] = 0;
+		}
+	}
+
+	eno = le32_to_cpu(first[flat + 1]);
+	if (eno != ROOT_INO) {
+		ind = extend_read(get_data_queue(), eno, &ib);
+		if (IS_ERR(ind)) {
+			extend_put(b);
+			return PTR_ERR(ind);
+		}
+		for (k = 0; k < per; k ++) {
+			base = flat + per + k * per;
+			if (base >= to && INDEX_WALK_DATA == how)
+				break;
+			if (ROOT_INO == ind[k] || base + per <= from)
+				continue;
+
+			l1 = extend_read(get_data_queue(), le32_to_cpu(ind[k]), &lb);
+			if (IS_ERR(l1)) {
+				extend_put(ib);
+				extend_put(b);
+				return PTR_ERR(l1);
+			}
+			for (i = from > base ? from - base : 0; i < per && i + base < to; i ++)
+				fn(le32_to_cpu(l1[i]), arg);
+			extend_put(lb);
+
+			if (from <= base && how != INDEX_WALK_DATA) {
+				fn(le32_to_cpu(ind[k]), arg);
+				if (trim) {
+					ind[k] = 0;
+					extend_mark_dirty(ib);
+				}
+			}
+		}
+		extend_put(ib);
+
+		if (from <= flat + per && how != INDEX_WALK_DATA) {
+			fn(eno, arg);
+			if (trim)
+				first[flat + 1] = 0;
+		}
+	}
+
+	if (trim && from <= flat)
+		dir->i_flat_nr = 0;
+out:
+	if (trim)
+		extend_mark_dirty(b);
+	extend_put(b);
+
+	return 0;
+}
+
+/*
+ * extend map begin
+ *
+ * runs of consecutive extends of an open file, built from the index by
+ * the first lookup and grown by appends, so a file laid out in a few
+ * runs maps by arithmetic without touching its index extends.
+ * */
+struct file_run {
+	uint32_t idx;
+	uint32_t eno;
+	uint32_t len;
+};
+
+struct file_map {
+	struct file_run *runs;
+	int nr;
+	int size;
+	int mapped; /* index entries covered from 0 */
+	int error;
+};
+
+static void file_map_add(uint32_t eno, void *arg)
+{
+	struct file_map *map = arg;
+	struct file_run *run;
+	int size;
+
+	if (map->error)
+		return;
+
+	if (map->nr) {
+		run = &map->runs[map->nr - 1];
+		/* a hole run takes holes only, an extend run the next extend */
+		if (ROOT_INO == run->eno ? ROOT_INO == eno
+				: ROOT_INO != eno && run->eno + run->len == eno) {
+			run->len ++;
+			map->mapped ++;
+			return;
+		}
+	}
+
+	if (map->nr == map->size) {
+		size = map->size ? map->size * 2 : 8;
+		run = realloc(map->runs, size * sizeof(*run));
+		if (NULL == run) {
+			map->error = -ENOMEM;
+			return;
+		}
+		map->runs = run;
+		map->size = size;
+	}
+
+	run = &map->runs[map->nr ++];
+	run->idx = map->mapped ++;
+	run->eno = eno;
+	run->len = 1;
+}
+
+void __file_map_drop(struct inode_info *inode)
+{
+	if (NULL == inode->map)
+		return;
+
+	free(inode->map->runs);
+	free(inode->map);
+	inode->map = NULL;
+}
+
+/* the last run starting at or before @idx */
+static struct file_run *file_map_find(struct file_map *map, int idx)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = map->nr;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (map->runs[mid].idx <= idx)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return &map->runs[lo];
+}
+
+/*
+ * extend of index entry @idx, -ENOENT when it can not be mapped.
+ * ROOT_INO for a punched hole.
+ * */
+static int __file_map_eno(struct inode_info *inode, int idx, uint32_t *eno)
+{
+	struct file_map *map = inode->map;
+	struct file_run *run;
+	int nr;
+
+	if (NULL == map || idx >= map->mapped) {
+		nr = file_index_count(inode->dirent->i_size);
+		if (nr < inode->dirent->i_reserved)
+			nr = inode->dirent->i_reserved;
+		if (idx >= nr)
+			return -ENOENT;
+
+		if (NULL == map) {
+			map = calloc(1, sizeof(*map));
+			if (NULL == map)
+				return -ENOENT;
+			inode->map = map;
+		}
+
+		if (__file_index_walk(inode->dirent, map->mapped, nr,
+				INDEX_WALK_DATA, file_map_add, map) || map->error) {
+			__file_map_drop(inode);
+			return -ENOENT;
+		}
+	}
+
+	run = file_map_find(map, idx);
+	*eno = ROOT_INO == run->eno ? ROOT_INO : run->eno + idx - run->idx;
+
+	return 0;
+}
+
+/* a new index entry, the map takes it when it ends right before */
+static void __file_map_append(struct inode_info *inode, int idx, uint32_t eno)
+{
+	struct file_map *map = inode->map;
+
+	if (NULL == map || idx > map->mapped)
+		return;
+
+	if (idx < map->mapped) {
+		__file_map_drop(inode);
+		return;
+	}
+
+	file_map_add(eno, map);
+	if (map->error)
+		__file_map_drop(inode);
+}
+
+/*
+ * entry @idx of an unwritten run now holds @eno, a run of written
+ * extends ending right before takes it. writing a preallocated file in
+ * order moves each extend over without walking the index again.
+ * */
+static void __file_map_set(struct inode_info *inode, int idx, uint32_t eno)
+{
+	struct file_map *map = inode->map;
+	struct file_run *run, *prev;
+
+	if (NULL == map || idx >= map->mapped)
+		return;
+
+	run = file_map_find(map, idx);
+	if (1 == run->len) {
+		run->eno = eno;
+		return;
+	}
+
+	prev = run - 1;
+	if (run->idx == idx && run != map->runs && ROOT_INO != prev->eno
+			&& prev->eno + prev->len == eno) {
+		prev->len ++;
+		run->idx ++;
+		run->eno ++;
+		run->len --;
+		return;
+	}
+
+	__file_map_drop(inode);
+}
+
+/* the extend of index entry @idx, from the map or the index */
+static int __file_idx_eno(struct inode_info *inode, int idx, uint32_t *eno)
+{
+	struct extend_buf *b;
+	uint32_t *p_index;
+
+	if (0 == __file_map_eno(inode, idx, eno))
+		return 0;
+
+	p_index = __index_entry(inode, idx, 0, &b);
+	if (IS_ERR(p_index))
+		return PTR_ERR(p_index);
+
+	*eno = le32_to_cpu(*p_index);
+	extend_put(b);
 
 	return 0;
 }
@@ -57,17 +464,23 @@ static int __alloc_ebuf_by_file_idx(struct inode_info *inode, int idx, struct ex
 	uint32_t *p_index, data_no;
 	int ret;
 
-	if (idx > get_file_max_index()) {
-		log_err("BUG");
-		return -EINVAL;
-	}
+	/* reserved with the file, the index already has it */
+	if (idx < inode->dirent->i_reserved) {
+		ret = __file_idx_eno(inode, idx, &data_no);
+		if (ret)
+			return ret;
 
-	data = extend_read(get_data_queue(), inode->dirent->i_ino, &b);
-	if (IS_ERR(data))
-		return PTR_ERR(data);
+		if (ROOT_INO != data_no) {
+			data = extend_new(get_data_queue(), data_no, bp);
+			if (IS_ERR(data))
+				return PTR_ERR(data);
+			return 0;
+		}
+	}
 
-	p_index = (uint32_t *) data;
-	p_index += idx;
+	p_index = __index_entry(inode, idx, 1, &b);
+	if (IS_ERR(p_index))
+		return PTR_ERR(p_index);
 
 	ret = alloc_extend_bitmap(&data_no);
 	if (ret) {
@@ -86,16 +499,114 @@ static int __alloc_ebuf_by_file_idx(struct inode_info *inode, int idx, struct ex
 	extend_write_dirty(b);
 #endif
 	extend_put(b);
+	__file_map_append(inode, idx, data_no);
 
 	return 0;
 }
 
-int __vbfs_read_buf(struct inode_info *inode, char *buf, size_t size, off_t offset)
+/*
+ * the unwritten extend @data_no of entry @idx is zeroed in the cache and
+ * the flag cleared, *@bp holds it dirty until put.
+ * */
+static int __file_written(struct inode_info *inode, int idx, uint32_t data_no,
+			struct extend_buf **bp)
 {
-	int buf_size, index = -1, ret = 0, need_cache;
-	off_t buf_off, tocopy;
 	struct extend_buf *b;
-	char *data, *pos, *buf_pos;
+	uint32_t *p_index;
+	char *data;
+
+	p_index = __index_entry(inode, idx, 0, &b);
+	if (IS_ERR(p_index))
+		return PTR_ERR(p_index);
+
+	data_no &= ~EXTEND_UNWRITTEN;
+	data = extend_new(get_data_queue(), data_no, bp);
+	if (IS_ERR(data)) {
+		extend_put(b);
+		return PTR_ERR(data);
+	}
+	memset(data, 0, get_extend_size());
+	extend_mark_dirty(*bp);
+
+	*p_index = cpu_to_le32(data_no);
+	extend_mark_dirty(b);
+#ifdef SYNC_METADATA
+	extend_write_dirty(b);
+#endif
+	extend_put(b);
+	__file_map_set(inode, idx, data_no);
+
+	return 0;
+}
+
+static int __rd_ebuf_by_file_idx(struct inode_info *inode, int idx, struct extend_buf **bp)
+{
+	char *data;
+	uint32_t data_no;
+	int ret;
+
+	ret = __file_idx_eno(inode, idx, &data_no);
+	if (ret)
+		return ret;
+
+	/* a write into a hole gets a new extend, zero around it */
+	if (ROOT_INO == data_no) {
+		ret = __alloc_ebuf_by_file_idx(inode, idx, bp);
+		if (0 == ret)
+			memset((*bp)->data, 0, get_extend_size());
+		return ret;
+	}
+	if (data_no & EXTEND_UNWRITTEN)
+		return __file_written(inode, idx, data_no, bp);
+
+	data = extend_read(get_data_queue(), data_no, bp);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+
+	return 0;
+}
+
+/*
+ * copies @buf_size bytes from @buf_off of the file out of extend @data_no,
+ * up to its end. an extend read to the end is not kept in the cache,
+ * except the first one that holds the index.
+ * */
+static int read_from_extend(uint32_t data_no, char *buf, off_t buf_off,
+			size_t buf_size)
+{
+	struct extend_buf *b;
+	char *data;
+	size_t tocopy;
+
+	tocopy = get_extend_size() - buf_off % get_extend_size();
+	if (buf_size < tocopy)
+		tocopy = buf_size;
+
+	if (ROOT_INO == data_no || data_no & EXTEND_UNWRITTEN) {
+		memset(buf, 0, tocopy);
+		return tocopy;
+	}
+
+	data = extend_read(get_data_queue(), data_no, &b);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+
+	memcpy(buf, data + buf_off % get_extend_size(), tocopy);
+
+	if (buf_off < get_extend_size()
+		|| (buf_off + tocopy) % get_extend_size())
+		extend_put(b);
+	else
+		extend_release(b);
+
+	return tocopy;
+}
+
+int __vbfs_read_buf(struct inode_info *inode, char *buf, size_t size, off_t offset)
+{
+	int buf_size, ret;
+	off_t buf_off;
+	uint32_t data_no;
 	size_t rd_len = 0;
 
 	if (inode->dirent->i_size < offset)
@@ -107,56 +618,92 @@ int __vbfs_read_buf(struct inode_info *inode, char *buf, size_t size, off_t offs
 
 	while (buf_size > 0) {
 		if (buf_off < get_extend_size()) {
-			data = extend_read(get_data_queue(), inode->dirent->i_ino, &b);
-			if (IS_ERR(data))
-				return PTR_ERR(data);
+			data_no = inode->dirent->i_ino;
 		} else {
-			index = buf_off / get_extend_size() - 1;
-			ret = __rd_ebuf_by_file_idx(inode, index, &b);
+			ret = __file_idx_eno(inode, buf_off / get_extend_size() - 1,
+					&data_no);
 			if (ret)
 				return ret;
-			data = b->data;
 		}
 
-		if (buf_size < get_extend_size() - buf_off % get_extend_size()) {
-			need_cache = 1;
-			tocopy = buf_size;
-		} else {
-			if (buf_off < get_extend_size())
-				need_cache = 1;
-			else
-				need_cache = 0;
-			tocopy = get_extend_size() - buf_off % get_extend_size();
-		}
+		ret = read_from_extend(data_no, buf + rd_len, buf_off, buf_size);
+		if (ret < 0)
+			return ret;
 
-		pos = data + buf_off % get_extend_size();
-		buf_pos = buf + rd_len;
-		memcpy(buf_pos, pos, tocopy);
-
-		if (need_cache)
-			extend_put(b);
-		else
-			extend_release(b);
-
-		buf_off += tocopy;
-		buf_size -= tocopy;
-		rd_len += tocopy;
+		buf_off += ret;
+		buf_size -= ret;
+		rd_len += ret;
 	}
 
 	return rd_len;
 }
 
+/*
+ * data below i_size stays where it is while the file grows, a reader
+ * takes inode->lock to find each extend only and reads it unlocked, so
+ * it does not hold up the writer over the io. trim_lock keeps the
+ * extends from being freed under it.
+ * */
 int vbfs_read_buf(struct inode_info *inode, char *buf, size_t size, off_t offset)
 {
-	int ret;
+	int buf_size = 0, ret = 0;
+	off_t buf_off;
+	uint32_t data_no;
+	size_t rd_len = 0;
+
+	pthread_rwlock_rdlock(&inode->trim_lock);
 
 	pthread_mutex_lock(&inode->lock);
-	ret = __vbfs_read_buf(inode, buf, size, offset);
+	if (inode->dirent->i_size < offset)
+		ret = -EINVAL;
+	else
+		buf_size = (size + offset < inode->dirent->i_size) ?
+				size : (inode->dirent->i_size - offset);
 	pthread_mutex_unlock(&inode->lock);
+	if (ret)
+		goto out;
+
+	buf_off = offset + get_file_idx_size();
+	while (buf_size > 0) {
+		if (buf_off < get_extend_size()) {
+			data_no = inode->dirent->i_ino;
+		} else {
+			pthread_mutex_lock(&inode->lock);
+			ret = __file_idx_eno(inode, buf_off / get_extend_size() - 1,
+					&data_no);
+			pthread_mutex_unlock(&inode->lock);
+			if (ret)
+				goto out;
+		}
+
+		ret = read_from_extend(data_no, buf + rd_len, buf_off, buf_size);
+		if (ret < 0)
+			goto out;
+
+		buf_off += ret;
+		buf_size -= ret;
+		rd_len += ret;
+	}
+	ret = rd_len;
+
+out:
+	pthread_rwlock_unlock(&inode->trim_lock);
 
 	return ret;
 }
 
+/* index entries in use by a file of @size bytes */
+int file_index_count(uint64_t size)
+{
+	uint32_t fst_data_len;
+
+	fst_data_len = get_extend_size() - get_file_idx_size();
+	if (size <= fst_data_len)
+		return 0;
+
+	return (size - fst_data_len + get_extend_size() - 1) / get_extend_size();
+}
+
 static int is_need_alloc(uint64_t size, off_t buf_off)
 {
 	if (size > (buf_off - get_file_idx_size()))
@@ -179,14 +726,14 @@ int __vbfs_write_buf(struct inode_info *inode, const char *buf, size_t size, off
 
 	//log_dbg("size %u, offset %llu", size, offset);
 
-	max_size = (__u64) get_file_max_index() * get_extend_size();
+	max_size = file_max_size();
 
 	if (inode->dirent->i_size < offset || offset > max_size)
 		return -EINVAL;
 
 	buf_off = offset + get_file_idx_size();
 	if (offset + size > max_size)
-		buf_size = max_size - offset - size;
+		buf_size = max_size - offset;
 	else
 		buf_size = size;
 
@@ -260,3 +807,428 @@ int vbfs_write_buf(struct inode_info *inode, const char *buf, size_t size, off_t
 
 	return ret;
 }
+
+/*
+ * preallocation and holes begin
+ *
+ * fallocate hooks extends past the ones in use into the index in order,
+ * taken in runs as long as the bitmap groups give them, and counts them
+ * in i_reserved. a punched extend is freed and its entry set to
+ * ROOT_INO: reads see zeros there and a write gets a new extend.
+ * */
+int __file_reserve(struct inode_info *inode, int nr)
+{
+	struct vbfs_dirent *dir = inode->dirent;
+	struct extend_buf *b;
+	uint32_t *p_index, start;
+	int idx, run, i, ret = 0;
+
+	/* reserved ones punched past end of file get an extend again */
+	for (idx = file_index_count(dir->i_size);
+			idx < dir->i_reserved && idx < nr; idx ++) {
+		p_index = __index_entry(inode, idx, 0, &b);
+		if (IS_ERR(p_index)) {
+			ret = PTR_ERR(p_index);
+			goto out;
+		}
+		if (ROOT_INO == le32_to_cpu(*p_index)) {
+			ret = alloc_extend_bitmap(&start);
+			if (0 == ret) {
+				*p_index = cpu_to_le32(start);
+				extend_mark_dirty(b);
+				__file_map_drop(inode);
+			}
+		}
+		extend_put(b);
+		if (ret)
+			goto out;
+	}
+
+	if (idx < dir->i_reserved)
+		idx = dir->i_reserved;
+
+	run = nr - idx;
+	while (idx < nr) {
+		if (run > nr - idx)
+			run = nr - idx;
+		if (run > 1)
+			ret = alloc_extend_run(run, &start);
+		else
+			ret = alloc_extend_bitmap(&start);
+		/* no group has that many in a row, take shorter runs */
+		if (-ENOSPC == ret && run > 1) {
+			run /= 2;
+			continue;
+		}
+		if (ret)
+			break;
+
+		for (i = 0; i < run; i ++) {
+			p_index = __index_entry(inode, idx, 1, &b);
+			if (IS_ERR(p_index)) {
+				ret = PTR_ERR(p_index);
+				for (; i < run; i ++)
+					free_extend_bitmap_async(start + i);
+				goto out;
+			}
+			*p_index = cpu_to_le32(start + i);
+			extend_mark_dirty(b);
+			extend_put(b);
+
+			__file_map_append(inode, idx, start + i);
+			dir->i_reserved = ++ idx;
+		}
+	}
+
+out:
+	inode->status = DIRTY;
+
+	return ret;
+}
+
+/*
+ * @len bytes at @offset below i_size become zeros, holes and unwritten
+ * extends are already
+ * */
+int __file_zero(struct inode_info *inode, off_t offset, off_t len)
+{
+	struct extend_buf *b;
+	uint32_t data_no;
+	off_t buf_off;
+	size_t tocopy;
+	char *data;
+	int ret;
+
+	buf_off = offset + get_file_idx_size();
+	while (len > 0) {
+		if (buf_off < get_extend_size()) {
+			data_no = inode->dirent->i_ino;
+		} else {
+			ret = __file_idx_eno(inode, buf_off / get_extend_size() - 1,
+					&data_no);
+			if (ret)
+				return ret;
+		}
+
+		tocopy = get_extend_size() - buf_off % get_extend_size();
+		if (len < tocopy)
+			tocopy = len;
+
+		if (ROOT_INO != data_no && ! (data_no & EXTEND_UNWRITTEN)) {
+			data = extend_read(get_data_queue(), data_no, &b);
+			if (IS_ERR(data))
+				return PTR_ERR(data);
+			memset(data + buf_off % get_extend_size(), 0, tocopy);
+			extend_mark_dirty(b);
+			extend_put(b);
+		}
+
+		buf_off += tocopy;
+		len -= tocopy;
+	}
+
+	return 0;
+}
+
+/* the extends of index entries [@from, @to) are flagged unwritten */
+int __file_unwritten(struct inode_info *inode, int from, int to)
+{
+	struct extend_buf *b;
+	uint32_t *p_index, eno;
+	int i;
+
+	for (i = from; i < to; i ++) {
+		p_index = __index_entry(inode, i, 0, &b);
+		if (IS_ERR(p_index)) {
+			__file_map_drop(inode);
+			return PTR_ERR(p_index);
+		}
+		eno = le32_to_cpu(*p_index);
+		if (ROOT_INO != eno && ! (eno & EXTEND_UNWRITTEN)) {
+			*p_index = cpu_to_le32(eno | EXTEND_UNWRITTEN);
+			extend_mark_dirty(b);
+		}
+		extend_put(b);
+	}
+	__file_map_drop(inode);
+
+	return 0;
+}
+
+/* index entries [@from, @to) become holes, their extends go in one batch */
+int __file_punch(struct inode_info *inode, int from, int to)
+{
+	struct extend_buf *b;
+	uint32_t *p_index, *enos;
+	int i, n = 0, ret = 0;
+
+	enos = malloc((to - from) * sizeof(uint32_t));
+	if (NULL == enos)
+		return -ENOMEM;
+
+	for (i = from; i < to; i ++) {
+		p_index = __index_entry(inode, i, 0, &b);
+		if (IS_ERR(p_index)) {
+			ret = PTR_ERR(p_index);
+			break;
+		}
+		if (ROOT_INO != le32_to_cpu(*p_index)) {
+			enos[n ++] = le32_to_cpu(*p_index) & ~EXTEND_UNWRITTEN;
+			*p_index = cpu_to_le32(ROOT_INO);
+			extend_mark_dirty(b);
+		}
+		extend_put(b);
+	}
+	__file_map_drop(inode);
+
+	free_extend_batch(enos, n);
+	if (n)
+		queue_write_dirty(get_meta_queue());
+	free(enos);
+
+	return ret;
+}
+
+/*
+ * tail writes begin
+ *
+ * a page aligned range of one extend goes to disk directly when the
+ * extend is not cached, so a growing file does not keep its tail extend
+ * in the cache. a cached extend is updated in place instead, it would
+ * write its stale copy back otherwise. a reader can cache the extend
+ * while it is written directly, with the pages from before, so it is
+ * looked up again after the write and any copy found is updated too.
+ * */
+static int __tail_extend_no(struct inode_info *inode, int index, int alloc,
+			struct tail_extend *te)
+{
+	struct extend_buf *b;
+	uint32_t *p_index, data_no;
+	int ret;
+
+	if (te->index == index && ! alloc)
+		return 0;
+
+	if (alloc && index >= inode->dirent->i_reserved) {
+		p_index = __index_entry(inode, index, 1, &b);
+		if (IS_ERR(p_index))
+			return PTR_ERR(p_index);
+
+		ret = alloc_extend_bitmap(&data_no);
+		if (ret) {
+			extend_put(b);
+			return ret;
+		}
+		*p_index = cpu_to_le32(data_no);
+		extend_mark_dirty(b);
+#ifdef SYNC_METADATA
+		extend_write_dirty(b);
+#endif
+		extend_put(b);
+		__file_map_append(inode, index, data_no);
+	} else {
+		ret = __file_idx_eno(inode, index, &data_no);
+		if (ret)
+			return ret;
+
+		/* a hole or an unwritten extend is left zeroed in the cache */
+		if (ROOT_INO == data_no || data_no & EXTEND_UNWRITTEN) {
+			ret = __rd_ebuf_by_file_idx(inode, index, &b);
+			if (ret)
+				return ret;
+			data_no = b->eno;
+			extend_put(b);
+		}
+	}
+
+	te->index = index;
+	te->eno = data_no;
+
+	return 0;
+}
+
+/*
+ * @buf is page aligned and holds @len bytes for @offset, the page after
+ * them is padded with whatever @buf has there, it is past end of file.
+ * */
+int __vbfs_write_tail(struct inode_info *inode, const char *buf, size_t len,
+			off_t offset, struct tail_extend *te)
+{
+	int ret, index, fd;
+	uint32_t eno;
+	off_t buf_off;
+	size_t pos;
+	uint64_t disk_off;
+	struct extend_buf *b;
+	char *data;
+
+	buf_off = offset + get_file_idx_size();
+	pos = buf_off % get_extend_size();
+
+	if (inode->dirent->i_size < offset || pos % TAIL_PAGE_SIZE
+			|| pos + len > get_extend_size())
+		return -EINVAL;
+
+	index = buf_off / get_extend_size() - 1;
+	if (index < 0) {
+		eno = inode->dirent->i_ino;
+	} else {
+		ret = __tail_extend_no(inode, index,
+				is_need_alloc(inode->dirent->i_size, buf_off), te);
+		if (ret)
+			return ret;
+		eno = te->eno;
+	}
+
+	/* pages past the cache would be partial stripe writes on a raid */
+	if (get_full_stripe())
+		data = extend_read(get_data_queue(), eno, &b);
+	else
+		data = extend_get(get_data_queue(), eno, &b);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+
+	if (data) {
+		memcpy(data + pos, buf, len);
+		extend_mark_dirty(b);
+		extend_put(b);
+	} else {
+		fd = get_extend_disk(eno + get_data_queue()->eno_prefix, &disk_off);
+		if (write_to_disk(fd, (void *) buf, disk_off + pos,
+				(len + TAIL_PAGE_SIZE - 1) & ~(TAIL_PAGE_SIZE - 1)))
+			return -EIO;
+
+		/* a read of the extend started from now on sees the pages */
+		data = extend_get(get_data_queue(), eno, &b);
+		if (! IS_ERR_OR_NULL(data)) {
+			memcpy(data + pos, buf, len);
+			extend_put(b);
+		}
+	}
+
+	if (inode->dirent->i_size < offset + len) {
+		inode->dirent->i_size = offset + len;
+		inode->status = DIRTY;
+	}
+
+#ifdef SYNC_METADATA
+	__writeback_inode(inode, 1);
+#else
+	__writeback_inode(inode, 0);
+#endif
+
+	return len;
+}
+
+/*
+ * seek table begin
+ *
+ * (time, offset) pairs added by the recorder in time order, stored from
+ * the end of the index area of the first extend down, so a lookup is one
+ * read of an extend the reads of the file keep cached anyway.
+ * */
+static struct vbfs_seek_disk *seek_entry(char *data, int i)
+{
+	return (struct vbfs_seek_disk *) (data + get_file_idx_size()) - i - 1;
+}
+
+int __vbfs_seek_add(struct inode_info *inode, uint64_t time, uint64_t offset)
+{
+	struct vbfs_dirent *dir = inode->dirent;
+	struct vbfs_seek_disk *se;
+	struct extend_buf *b;
+	uint32_t used, nr;
+	char *data;
+
+	if (dir->i_mode != VBFS_FT_REG_FILE)
+		return -EISDIR;
+
+	used = file_index_count(dir->i_size > offset ? dir->i_size : offset);
+	if (used < dir->i_reserved)
+		used = dir->i_reserved;
+	/* the array keeps room for the two indirect entries */
+	if (dir->i_flat_nr)
+		used = dir->i_flat_nr;
+	used += 2;
+
+	nr = dir->i_seek_nr;
+	if (used * sizeof(uint32_t) + (nr + 1) * sizeof(*se) > get_file_idx_size())
+		return -ENOSPC;
+
+	data = extend_read(get_data_queue(), dir->i_ino, &b);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+
+	if (nr && le64_to_cpu(seek_entry(data, nr - 1)->time) > time) {
+		extend_put(b);
+		return -EINVAL;
+	}
+
+	se = seek_entry(data, nr);
+	se->time = cpu_to_le64(time);
+	se->offset = cpu_to_le64(offset);
+	extend_mark_dirty(b);
+	extend_put(b);
+
+	dir->i_seek_nr ++;
+	inode->status = DIRTY;
+
+	return 0;
+}
+
+/* offset of the last entry at or before @time */
+int __vbfs_seek_find(struct inode_info *inode, uint64_t time, uint64_t *offset)
+{
+	struct extend_buf *b;
+	char *data;
+	int lo, hi, mid;
+
+	if (0 == inode->dirent->i_seek_nr)
+		return -ENOENT;
+
+	data = extend_read(get_data_queue(), inode->dirent->i_ino, &b);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+
+	lo = 0;
+	hi = inode->dirent->i_seek_nr;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (le64_to_cpu(seek_entry(data, mid)->time) <= time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo)
+		*offset = le64_to_cpu(seek_entry(data, lo - 1)->offset);
+	extend_put(b);
+
+	return lo ? 0 : -ENOENT;
+}
+
+/* entries past a truncate are dropped */
+void __vbfs_seek_trim(struct inode_info *inode, uint64_t size)
+{
+	struct extend_buf *b;
+	char *data;
+	uint32_t nr;
+
+	nr = inode->dirent->i_seek_nr;
+	if (0 == nr)
+		return;
+
+	if (0 == size) {
+		nr = 0;
+	} else {
+		data = extend_read(get_data_queue(), inode->dirent->i_ino, &b);
+		if (IS_ERR(data))
+			return;
+		while (nr && le64_to_cpu(seek_entry(data, nr - 1)->offset) >= size)
+			nr --;
+		extend_put(b);
+	}
+
+	inode->dirent->i_seek_nr = nr;
+	inode->status = DIRTY;
+}
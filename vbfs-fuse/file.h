@@ -3,8 +3,40 @@
 
 #include "vbfs-fuse.h"
 
+#define TAIL_PAGE_SIZE 4096
+
+/* extend of the file tail, saves the index lookup per tail write */
+struct tail_extend {
+	int index;	/* file index, -1 when not known */
+	uint32_t eno;
+};
+
 int sync_file(struct inode_info *inode);
+int file_index_count(uint64_t size);
+uint64_t file_max_size(void);
+
+enum {
+	INDEX_WALK_DATA,	/* data extends only */
+	INDEX_WALK_FREE,	/* and the indirect extends left without entries */
+	INDEX_WALK_TRIM,	/* as FREE, unhooking those */
+};
+
+int __file_index_walk(struct vbfs_dirent *dir, int from, int to, int how,
+			void (*fn)(uint32_t eno, void *arg), void *arg);
+void __file_map_drop(struct inode_info *inode);
+int __vbfs_read_buf(struct inode_info *inode, char *buf, size_t size, off_t offset);
 int vbfs_read_buf(struct inode_info *inode, char *buf, size_t size, off_t offset);
 int vbfs_write_buf(struct inode_info *inode, const char *buf, size_t size, off_t offset);
+int __vbfs_write_buf(struct inode_info *inode, const char *buf, size_t size, off_t offset);
+int __file_reserve(struct inode_info *inode, int nr);
+int __file_zero(struct inode_info *inode, off_t offset, off_t len);
+int __file_unwritten(struct inode_info *inode, int from, int to);
+int __file_punch(struct inode_info *inode, int from, int to);
+int __vbfs_write_tail(struct inode_info *inode, const char *buf, size_t len,
+			off_t offset, struct tail_extend *te);
+
+int __vbfs_seek_add(struct inode_info *inode, uint64_t time, uint64_t offset);
+int __vbfs_seek_find(struct inode_info *inode, uint64_t time, uint64_t *offset);
+void __vbfs_seek_trim(struct inode_info *inode, uint64_t size);
 
 #endif
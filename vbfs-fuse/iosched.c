@@ -0,0 +1,219 @@
+#include "utils.h"
+#include "super.h"
+#include "iosched.h"
+#include "ioengine.h"
+#include "stats.h"
+
+struct io_class {
+	struct list_head list;
+	unsigned int deadline_ms;
+	unsigned int weight;
+	unsigned int credit;
+
+	unsigned long depth;
+	unsigned long max_depth;
+	unsigned long dispatched;
+	unsigned long late;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct io_class cls[IO_CLASS_NR];
+	int rr; /* next class of the round robin */
+	int stop;
+} sched = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.cls = {
+		[IO_CLASS_META] = { .deadline_ms = IOSCHED_META_DEADLINE_MS, .weight = 8 },
+		[IO_CLASS_RECORD] = { .deadline_ms = IOSCHED_RECORD_DEADLINE_MS, .weight = 8 },
+		[IO_CLASS_READ] = { .deadline_ms = IOSCHED_READ_DEADLINE_MS, .weight = 4 },
+		[IO_CLASS_BG] = { .deadline_ms = IOSCHED_BG_DEADLINE_MS, .weight = 1 },
+	},
+};
+
+static const char *class_names[IO_CLASS_NR] = {
+	[IO_CLASS_META] = "meta",
+	[IO_CLASS_RECORD] = "record",
+	[IO_CLASS_READ] = "read",
+	[IO_CLASS_BG] = "background",
+};
+
+static const unsigned int default_deadline_ms[IO_CLASS_NR] = {
+	[IO_CLASS_META] = IOSCHED_META_DEADLINE_MS,
+	[IO_CLASS_RECORD] = IOSCHED_RECORD_DEADLINE_MS,
+	[IO_CLASS_READ] = IOSCHED_READ_DEADLINE_MS,
+	[IO_CLASS_BG] = IOSCHED_BG_DEADLINE_MS,
+};
+
+static __thread int thread_class = -1;
+
+const char *iosched_class_name(int cls)
+{
+	return class_names[cls];
+}
+
+void iosched_set_deadline(int cls, unsigned int ms)
+{
+	sched.cls[cls].deadline_ms = ms ? ms : default_deadline_ms[cls];
+}
+
+void iosched_set_thread_class(int cls)
+{
+	thread_class = cls;
+}
+
+int iosched_classify(struct extend_buf *b)
+{
+	if (thread_class >= 0)
+		return thread_class;
+	if (b->q == get_meta_queue())
+		return IO_CLASS_META;
+
+	return READ == b->rw ? IO_CLASS_READ : IO_CLASS_RECORD;
+}
+
+void iosched_init(void)
+{
+	int i;
+
+	pthread_mutex_lock(&sched.lock);
+	for (i = 0; i < IO_CLASS_NR; i ++) {
+		INIT_LIST_HEAD(&sched.cls[i].list);
+		sched.cls[i].credit = sched.cls[i].weight;
+		sched.cls[i].depth = 0;
+		sched.cls[i].max_depth = 0;
+		sched.cls[i].dispatched = 0;
+		sched.cls[i].late = 0;
+	}
+	sched.rr = 0;
+	sched.stop = 0;
+	pthread_mutex_unlock(&sched.lock);
+}
+
+void iosched_stop(void)
+{
+	pthread_mutex_lock(&sched.lock);
+	sched.stop = 1;
+	pthread_cond_broadcast(&sched.cond);
+	pthread_mutex_unlock(&sched.lock);
+}
+
+void iosched_add(struct extend_buf *b)
+{
+	struct io_class *c = &sched.cls[b->io_class];
+
+	pthread_mutex_lock(&sched.lock);
+	list_add_tail(&b->data_list, &c->list);
+	c->depth ++;
+	if (c->depth > c->max_depth)
+		c->max_depth = c->depth;
+	pthread_cond_signal(&sched.cond);
+	pthread_mutex_unlock(&sched.lock);
+}
+
+/* the due head with the earliest deadline, -1 for none */
+static int __pick_due(uint64_t now)
+{
+	struct extend_buf *b;
+	uint64_t deadline, best = 0;
+	int i, cls = -1;
+
+	for (i = 0; i < IO_CLASS_NR; i ++) {
+		if (list_empty(&sched.cls[i].list))
+			continue;
+
+		b = list_first_entry(&sched.cls[i].list, struct extend_buf, data_list);
+		deadline = b->submit_ts + sched.cls[i].deadline_ms * 1000000ULL;
+		if (now + sched.cls[i].deadline_ms * 500000ULL < deadline)
+			continue;
+		if (-1 == cls || deadline < best) {
+			best = deadline;
+			cls = i;
+		}
+	}
+
+	return cls;
+}
+
+static int __pick_weighted(void)
+{
+	int i, cls, pass;
+
+	for (pass = 0; pass < 2; pass ++) {
+		for (i = 0; i < IO_CLASS_NR; i ++) {
+			cls = (sched.rr + i) % IO_CLASS_NR;
+			if (list_empty(&sched.cls[cls].list) || 0 == sched.cls[cls].credit)
+				continue;
+
+			if (0 == -- sched.cls[cls].credit)
+				sched.rr = (cls + 1) % IO_CLASS_NR;
+			return cls;
+		}
+
+		/* every class with work has used its turn */
+		for (i = 0; i < IO_CLASS_NR; i ++)
+			sched.cls[i].credit = sched.cls[i].weight;
+	}
+
+	return -1;
+}
+
+struct extend_buf *iosched_next(void)
+{
+	struct extend_buf *b;
+	struct io_class *c;
+	int cls;
+
+	pthread_mutex_lock(&sched.lock);
+	while (1) {
+		if (sched.stop) {
+			pthread_mutex_unlock(&sched.lock);
+			return NULL;
+		}
+
+		cls = __pick_due(stats_now());
+		if (cls < 0)
+			cls = __pick_weighted();
+		if (cls >= 0)
+			break;
+
+		pthread_cond_wait(&sched.cond, &sched.lock);
+	}
+
+	c = &sched.cls[cls];
+	b = list_first_entry(&c->list, struct extend_buf, data_list);
+	list_del(&b->data_list);
+	c->depth --;
+	c->dispatched ++;
+	pthread_mutex_unlock(&sched.lock);
+
+	return b;
+}
+
+void iosched_done(struct extend_buf *b)
+{
+	struct io_class *c = &sched.cls[b->io_class];
+	uint64_t d = stats_now() - b->submit_ts;
+
+	stats_record(STAT_IO_META + b->io_class, b->submit_ts);
+	if (d > c->deadline_ms * 1000000ULL)
+		__atomic_add_fetch(&c->late, 1, __ATOMIC_RELAXED);
+}
+
+void iosched_get_stats(struct iosched_class_stats *st)
+{
+	int i;
+
+	pthread_mutex_lock(&sched.lock);
+	for (i = 0; i < IO_CLASS_NR; i ++) {
+		st[i].deadline_ms = sched.cls[i].deadline_ms;
+		st[i].weight = sched.cls[i].weight;
+		st[i].depth = sched.cls[i].depth;
+		st[i].max_depth = sched.cls[i].max_depth;
+		st[i].dispatched = sched.cls[i].dispatched;
+		st[i].late = __atomic_load_n(&sched.cls[i].late, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&sched.lock);
+}
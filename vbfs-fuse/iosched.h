@@ -0,0 +1,53 @@
+#ifndef __IOSCHED_H__
+#define __IOSCHED_H__
+
+#include "extend.h"
+
+/*
+ * io classes between the extend cache and the engine threads.
+ *
+ * a class head that has waited half its deadline is due, due heads go
+ * earliest deadline first. with none due the classes share the engine
+ * by weight, round robin.
+ * */
+enum {
+	IO_CLASS_META = 0,	/* bitmaps, sync waits on them */
+	IO_CLASS_RECORD,	/* file data from the recorders */
+	IO_CLASS_READ,		/* playback and export reads */
+	IO_CLASS_BG,		/* old buffer flush, lazy init, free */
+
+	IO_CLASS_NR,
+};
+
+#define IOSCHED_META_DEADLINE_MS 20
+#define IOSCHED_RECORD_DEADLINE_MS 50
+#define IOSCHED_READ_DEADLINE_MS 200
+#define IOSCHED_BG_DEADLINE_MS 1000
+
+struct iosched_class_stats {
+	unsigned int deadline_ms;
+	unsigned int weight;
+	unsigned long depth;
+	unsigned long max_depth;
+	unsigned long dispatched;
+	unsigned long late; /* done past the deadline */
+};
+
+const char *iosched_class_name(int cls);
+/* 0 for the default, before the engine is started */
+void iosched_set_deadline(int cls, unsigned int ms);
+
+/* io of the calling thread goes to @cls, -1 to classify by the buffer */
+void iosched_set_thread_class(int cls);
+int iosched_classify(struct extend_buf *b);
+
+void iosched_init(void);
+void iosched_stop(void);
+void iosched_add(struct extend_buf *b);
+/* blocks for the next buffer, NULL once stopped */
+struct extend_buf *iosched_next(void);
+void iosched_done(struct extend_buf *b);
+
+void iosched_get_stats(struct iosched_class_stats *st);
+
+#endif
@@ -0,0 +1,1360 @@
+#include "vbfs-fuse.h"
+#include "err.h"
+#include "ioengine.h"
+#include "iosched.h"
+#include "bandwidth.h"
+#include "log.h"
+#include "stats.h"
+
+/*
+ * small appends of an open file are staged in a write combining buffer
+ * and reach the file in chunks ending on a VBFS_WC_SIZE boundary of the
+ * extend. staged data is always the tail of the file: readers of any
+ * handle see it through inode->wc_list, other writes flush it first.
+ * lock order is inode->lock, then wc->lock.
+ *
+ * in small tail mode the buffer starts on a page and doubles up to
+ * VBFS_WC_SIZE, chunks go to disk without the extend cache, and the spill
+ * thread writes out the staged data of an idle file and leaves it one page.
+ * */
+#define VBFS_WC_SIZE (64 * 1024)
+#define VBFS_TAIL_IDLE_MS 5000
+#define VBFS_TAIL_POLL_MS 100
+
+struct vbfs_wc {
+	pthread_mutex_t lock;
+	struct list_head list;		/* inode->wc_list, under inode->lock */
+	struct list_head tail_list;	/* wc_ctx.tails, small tail mode */
+	struct inode_info *inode;
+
+	off_t base;		/* file offset of buf */
+	off_t off;		/* first staged byte, i_size while staged */
+	size_t len;		/* bytes in buf, the file tail while != 0 */
+	size_t size;		/* of buf */
+	char *buf;
+
+	struct tail_extend te;
+	off_t seen;		/* end at the last spill scan */
+	int error;		/* sticky until the owner sees it */
+};
+
+static struct {
+	int small_tail;
+	unsigned int idle_ms;
+
+	pthread_mutex_t lock;
+	struct list_head tails;
+	pthread_t spill_thread;
+	int stop;
+} wc_ctx = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.tails = LIST_HEAD_INIT(wc_ctx.tails),
+};
+
+struct vbfs_file {
+	vbfs_t *fs;
+	struct inode_info *inode;
+	int flags;
+	struct vbfs_wc *wc;
+	struct bw_handle *bw; /* NULL for a dir */
+
+	off_t read_end;		/* end of the last read */
+	vbfs_watch_fn_t watch_fn;
+	void *watch_arg;
+	struct list_head watch_list; /* inode->watch_list, under tail_ctx.lock */
+};
+
+/*
+ * live tail begin
+ * */
+/*
+ * writers publish the file size in inode->pub_size once the data is
+ * readable, a read at or past it returns 0 without inode->lock. a handle
+ * watching the inode is fired when the size passes its last read or the
+ * last writer closes. the size is stored before watchers is loaded and
+ * watchers added to before the size is loaded, so one side sees the
+ * other and no wakeup is lost.
+ * */
+static struct {
+	pthread_mutex_t lock;
+} tail_ctx = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int tail_ready(vbfs_file_t *fp)
+{
+	struct inode_info *inode = fp->inode;
+
+	return __atomic_load_n(&inode->pub_size, __ATOMIC_SEQ_CST) > fp->read_end
+		|| 0 == __atomic_load_n(&inode->writers, __ATOMIC_SEQ_CST);
+}
+
+/* caller holds tail_ctx.lock */
+static void __watch_fire(vbfs_file_t *fp, int ready)
+{
+	vbfs_watch_fn_t fn = fp->watch_fn;
+
+	if (NULL == fn)
+		return;
+
+	list_del(&fp->watch_list);
+	__atomic_sub_fetch(&fp->inode->watchers, 1, __ATOMIC_SEQ_CST);
+	fp->watch_fn = NULL;
+	fn(fp->watch_arg, ready);
+}
+
+/* after the size is published or the last writer is gone */
+static void tail_wake(struct inode_info *inode)
+{
+	vbfs_file_t *fp, *n;
+
+	if (0 == __atomic_load_n(&inode->watchers, __ATOMIC_SEQ_CST))
+		return;
+
+	pthread_mutex_lock(&tail_ctx.lock);
+	list_for_each_entry_safe(fp, n, &inode->watch_list, watch_list) {
+		if (tail_ready(fp)) {
+			__watch_fire(fp, 1);
+			stats_inc(CNT_TAIL_WAKE);
+		}
+	}
+	pthread_mutex_unlock(&tail_ctx.lock);
+}
+
+static void tail_publish(struct inode_info *inode, off_t size)
+{
+	__atomic_store_n(&inode->pub_size, size, __ATOMIC_SEQ_CST);
+}
+
+int vbfs_watch(vbfs_file_t *fp, vbfs_watch_fn_t fn, void *arg)
+{
+	int ready;
+
+	pthread_mutex_lock(&tail_ctx.lock);
+	__watch_fire(fp, 0);
+	if (fn) {
+		fp->watch_fn = fn;
+		fp->watch_arg = arg;
+		list_add_tail(&fp->watch_list, &fp->inode->watch_list);
+		__atomic_add_fetch(&fp->inode->watchers, 1, __ATOMIC_SEQ_CST);
+	}
+
+	ready = tail_ready(fp);
+	if (ready && fn) {
+		list_del(&fp->watch_list);
+		__atomic_sub_fetch(&fp->inode->watchers, 1, __ATOMIC_SEQ_CST);
+		fp->watch_fn = NULL;
+	}
+	pthread_mutex_unlock(&tail_ctx.lock);
+
+	return ready;
+}
+
+int vbfs_is_growing(vbfs_file_t *fp)
+{
+	return __atomic_load_n(&fp->inode->writers, __ATOMIC_SEQ_CST) > 0;
+}
+
+/*
+ * write combining begin
+ * */
+/* bytes from @base to the end of its chunk */
+static size_t wc_room(off_t base)
+{
+	off_t buf_off = base + get_file_idx_size();
+	size_t chunk, ext;
+
+	chunk = VBFS_WC_SIZE - buf_off % VBFS_WC_SIZE;
+	ext = get_extend_size() - buf_off % get_extend_size();
+
+	return chunk < ext ? chunk : ext;
+}
+
+static int wc_staged(struct vbfs_wc *wc)
+{
+	return wc->base + (off_t) wc->len > wc->off;
+}
+
+/*
+ * room for @size bytes, a power of two of pages so a growing tail is
+ * copied a few times only. 0 frees the buffer, buffered bytes are kept.
+ * */
+static int wc_resize(struct vbfs_wc *wc, size_t size)
+{
+	size_t new_size = 0;
+	char *buf = NULL;
+
+	if (size) {
+		new_size = TAIL_PAGE_SIZE;
+		while (new_size < size)
+			new_size <<= 1;
+	}
+	if (new_size == wc->size)
+		return 0;
+
+	if (new_size) {
+		buf = Valloc(new_size);
+		if (NULL == buf)
+			return -ENOMEM;
+		if (wc->len)
+			memcpy(buf, wc->buf, wc->len);
+	}
+
+	free(wc->buf);
+	wc->buf = buf;
+	wc->size = new_size;
+
+	return 0;
+}
+
+/* the buffer no longer follows the file, the next append starts over */
+static void __wc_reset(struct vbfs_wc *wc)
+{
+	wc->base += wc->len;
+	wc->off = wc->base;
+	wc->len = 0;
+	wc->te.index = -1;
+}
+
+/*
+ * caller holds inode->lock and wc->lock. with @keep a small tail leaves
+ * its last partial page in the buffer, the next append needs no read.
+ * */
+static int __wc_flush(struct inode_info *inode, struct vbfs_wc *wc, int keep)
+{
+	size_t tail;
+	int ret = 0;
+
+	if (wc_staged(wc)) {
+		if (wc_ctx.small_tail)
+			ret = __vbfs_write_tail(inode, wc->buf, wc->len, wc->base,
+						&wc->te);
+		else
+			ret = __vbfs_write_buf(inode, wc->buf, wc->len, wc->base);
+		if (ret >= 0 && ret != wc->len)
+			ret = -EIO;
+		if (ret < 0) {
+			log_err("flush %zu staged bytes of inode %u at %lld error %d\n",
+				(size_t) (wc->base + wc->len - wc->off),
+				inode->dirent->i_ino, (long long) wc->off, ret);
+			wc->error = ret;
+		} else {
+			stats_add(CNT_WC_BYTES, wc->base + wc->len - wc->off);
+			stats_inc(CNT_WC_FLUSH);
+			ret = 0;
+		}
+	}
+
+	if (! keep || ret) {
+		__wc_reset(wc);
+		return ret;
+	}
+
+	tail = wc_ctx.small_tail ? wc->len % TAIL_PAGE_SIZE : 0;
+	memmove(wc->buf, wc->buf + wc->len - tail, tail);
+	wc->base += wc->len - tail;
+	wc->len = tail;
+	wc->off = wc->base + tail;
+
+	return 0;
+}
+
+/* caller holds inode->lock, a failure is left in the wc for its owner */
+static void __wc_flush_inode(struct inode_info *inode, struct vbfs_wc *own)
+{
+	struct vbfs_wc *wc;
+
+	list_for_each_entry(wc, &inode->wc_list, list) {
+		pthread_mutex_lock(&wc->lock);
+		__wc_flush(inode, wc, wc == own);
+		pthread_mutex_unlock(&wc->lock);
+	}
+}
+
+static void wc_flush_inode(struct inode_info *inode)
+{
+	pthread_mutex_lock(&inode->lock);
+	__wc_flush_inode(inode, NULL);
+	pthread_mutex_unlock(&inode->lock);
+}
+
+/* caller holds inode->lock */
+static int __wc_take_error(struct vbfs_wc *wc)
+{
+	int ret;
+
+	if (NULL == wc)
+		return 0;
+
+	pthread_mutex_lock(&wc->lock);
+	ret = wc->error;
+	wc->error = 0;
+	pthread_mutex_unlock(&wc->lock);
+
+	return ret;
+}
+
+/* file size with staged data, caller holds inode->lock */
+static off_t __wc_size(struct inode_info *inode)
+{
+	struct vbfs_wc *wc;
+	off_t size = inode->dirent->i_size;
+
+	list_for_each_entry(wc, &inode->wc_list, list) {
+		pthread_mutex_lock(&wc->lock);
+		if (wc_staged(wc) && wc->base + (off_t) wc->len > size)
+			size = wc->base + wc->len;
+		pthread_mutex_unlock(&wc->lock);
+	}
+
+	return size;
+}
+
+/* caller holds inode->lock */
+static int __wc_read(struct inode_info *inode, char *buf, size_t size, off_t offset)
+{
+	struct vbfs_wc *wc;
+	off_t pos;
+	size_t tocopy;
+	int ret = 0;
+
+	if (list_empty(&inode->wc_list))
+		return __vbfs_read_buf(inode, buf, size, offset);
+
+	if (offset > __wc_size(inode))
+		return -EINVAL;
+
+	if (offset < inode->dirent->i_size) {
+		ret = __vbfs_read_buf(inode, buf, size, offset);
+		if (ret < 0 || ret == size)
+			return ret;
+	}
+
+	/* the rest, if any, is staged past i_size */
+	list_for_each_entry(wc, &inode->wc_list, list) {
+		pthread_mutex_lock(&wc->lock);
+		pos = offset + ret;
+		if (wc_staged(wc) && pos >= wc->off
+				&& pos < wc->base + (off_t) wc->len) {
+			tocopy = wc->base + wc->len - pos;
+			if (tocopy > size - ret)
+				tocopy = size - ret;
+			memcpy(buf + ret, wc->buf + (pos - wc->base), tocopy);
+			ret += tocopy;
+		}
+		pthread_mutex_unlock(&wc->lock);
+	}
+
+	return ret;
+}
+
+/* caller holds inode->lock and wc->lock, the append is at i_size */
+static ssize_t __wc_append(struct inode_info *inode, struct vbfs_wc *wc,
+			const char *buf, size_t size)
+{
+	off_t i_size = inode->dirent->i_size;
+	size_t head, room, tocopy, done = 0;
+	int ret;
+
+	if (0 == wc->len || wc->base + (off_t) wc->len != i_size) {
+		/* start over at the end of file, a small tail on its page */
+		head = 0;
+		if (wc_ctx.small_tail)
+			head = (i_size + get_file_idx_size()) % TAIL_PAGE_SIZE;
+
+		wc->len = 0;
+		if (head > wc->size) {
+			ret = wc_resize(wc, head);
+			if (ret)
+				return ret;
+		}
+		if (head) {
+			ret = __vbfs_read_buf(inode, wc->buf, head, i_size - head);
+			if (ret != head)
+				return ret < 0 ? ret : -EIO;
+		}
+
+		wc->base = i_size - head;
+		wc->len = head;
+		wc->off = i_size;
+	}
+
+	while (done < size) {
+		room = wc_room(wc->base);
+		tocopy = room - wc->len;
+		if (tocopy > size - done)
+			tocopy = size - done;
+
+		if (wc->len + tocopy > wc->size) {
+			ret = wc_resize(wc, wc->len + tocopy);
+			if (ret)
+				return done ? done : ret;
+		}
+		memcpy(wc->buf + wc->len, buf + done, tocopy);
+		wc->len += tocopy;
+		done += tocopy;
+
+		if (wc->len == room) {
+			ret = __wc_flush(inode, wc, 1);
+			if (ret) {
+				wc->error = 0;
+				return ret;
+			}
+		}
+	}
+
+	return done;
+}
+
+/* caller holds inode->lock */
+static struct vbfs_wc *wc_alloc(struct inode_info *inode)
+{
+	struct vbfs_wc *wc;
+
+	wc = mp_malloc(sizeof(*wc));
+	if (NULL == wc)
+		return NULL;
+
+	pthread_mutex_init(&wc->lock, NULL);
+	wc->inode = inode;
+	wc->base = 0;
+	wc->off = 0;
+	wc->len = 0;
+	wc->size = 0;
+	wc->buf = NULL;
+	wc->te.index = -1;
+	wc->seen = -1;
+	wc->error = 0;
+	list_add_tail(&wc->list, &inode->wc_list);
+
+	if (wc_ctx.small_tail) {
+		pthread_mutex_lock(&wc_ctx.lock);
+		list_add_tail(&wc->tail_list, &wc_ctx.tails);
+		pthread_mutex_unlock(&wc_ctx.lock);
+	}
+
+	return wc;
+}
+
+static int wc_release(vbfs_file_t *fp)
+{
+	struct vbfs_wc *wc = fp->wc;
+	struct inode_info *inode = fp->inode;
+	int ret;
+
+	if (NULL == wc)
+		return 0;
+
+	pthread_mutex_lock(&inode->lock);
+	pthread_mutex_lock(&wc->lock);
+	__wc_flush(inode, wc, 0);
+	ret = wc->error;
+	list_del(&wc->list);
+	pthread_mutex_unlock(&wc->lock);
+	pthread_mutex_unlock(&inode->lock);
+
+	if (wc_ctx.small_tail) {
+		pthread_mutex_lock(&wc_ctx.lock);
+		list_del(&wc->tail_list);
+		pthread_mutex_unlock(&wc_ctx.lock);
+	}
+
+	pthread_mutex_destroy(&wc->lock);
+	free(wc->buf);
+	mp_free(wc);
+	fp->wc = NULL;
+
+	return ret;
+}
+
+/* @offset is ignored for an append, the end of file is taken under the lock */
+static ssize_t wc_write(vbfs_file_t *fp, const char *buf, size_t size,
+			off_t offset, int append)
+{
+	struct inode_info *inode = fp->inode;
+	struct vbfs_wc *wc = fp->wc;
+	uint64_t max_size;
+	int ret;
+
+	if (wc && size < VBFS_WC_SIZE) {
+		pthread_mutex_lock(&wc->lock);
+		if (wc->len && ! wc->error
+			&& (append || offset == wc->base + (off_t) wc->len)
+			&& wc->len + size < wc_room(wc->base)
+			&& (wc->len + size <= wc->size
+				|| 0 == wc_resize(wc, wc->len + size))) {
+			memcpy(wc->buf + wc->len, buf, size);
+			wc->len += size;
+			tail_publish(inode, wc->base + wc->len);
+			pthread_mutex_unlock(&wc->lock);
+			tail_wake(inode);
+			return size;
+		}
+		pthread_mutex_unlock(&wc->lock);
+	}
+
+	pthread_mutex_lock(&inode->lock);
+
+	/* staged data of every handle goes first, so i_size is the tail */
+	__wc_flush_inode(inode, wc);
+	ret = __wc_take_error(wc);
+	if (ret)
+		goto out;
+
+	if (append)
+		offset = inode->dirent->i_size;
+
+	max_size = file_max_size();
+	if (offset != inode->dirent->i_size || offset + size > max_size
+			|| (! wc_ctx.small_tail && size >= VBFS_WC_SIZE)) {
+		if (wc) {
+			pthread_mutex_lock(&wc->lock);
+			__wc_reset(wc);
+			pthread_mutex_unlock(&wc->lock);
+		}
+		ret = __vbfs_write_buf(inode, buf, size, offset);
+		goto out;
+	}
+
+	if (NULL == wc) {
+		wc = wc_alloc(inode);
+		if (NULL == wc) {
+			ret = __vbfs_write_buf(inode, buf, size, offset);
+			goto out;
+		}
+		fp->wc = wc;
+	}
+
+	pthread_mutex_lock(&wc->lock);
+	ret = __wc_append(inode, wc, buf, size);
+	pthread_mutex_unlock(&wc->lock);
+
+out:
+	if (ret > 0)
+		tail_publish(inode, __wc_size(inode));
+	pthread_mutex_unlock(&inode->lock);
+	if (ret > 0)
+		tail_wake(inode);
+
+	return ret;
+}
+
+/*
+ * the staged data of a file with no append for a scan period is written
+ * out and its buffer cut to the last partial page. a busy inode is not
+ * idle, it is skipped rather than waited for.
+ * */
+static void wc_spill_scan(void)
+{
+	struct vbfs_wc *wc;
+	struct inode_info *inode;
+	off_t end;
+
+	pthread_mutex_lock(&wc_ctx.lock);
+	list_for_each_entry(wc, &wc_ctx.tails, tail_list) {
+		inode = wc->inode;
+		if (pthread_mutex_trylock(&inode->lock))
+			continue;
+		pthread_mutex_lock(&wc->lock);
+
+		end = wc->base + wc->len;
+		if (end == wc->seen) {
+			if (wc_staged(wc)) {
+				__wc_flush(inode, wc, 1);
+				stats_inc(CNT_WC_SPILL);
+			}
+			wc_resize(wc, wc->len);
+		}
+		wc->seen = end;
+
+		pthread_mutex_unlock(&wc->lock);
+		pthread_mutex_unlock(&inode->lock);
+	}
+	pthread_mutex_unlock(&wc_ctx.lock);
+}
+
+static void *wc_spill_thread(void *args)
+{
+	unsigned int slept = 0;
+
+	while (! __atomic_load_n(&wc_ctx.stop, __ATOMIC_ACQUIRE)) {
+		usleep(VBFS_TAIL_POLL_MS * 1000);
+		slept += VBFS_TAIL_POLL_MS;
+		if (slept < wc_ctx.idle_ms)
+			continue;
+
+		slept = 0;
+		wc_spill_scan();
+	}
+
+	return NULL;
+}
+
+static int wc_spill_start(const struct vbfs_mount_opts *opts)
+{
+	int ret;
+
+	if (NULL == opts || ! opts->small_tail)
+		return 0;
+
+	wc_ctx.small_tail = 1;
+	wc_ctx.idle_ms = opts->tail_idle_ms ? opts->tail_idle_ms : VBFS_TAIL_IDLE_MS;
+	wc_ctx.stop = 0;
+
+	ret = pthread_create(&wc_ctx.spill_thread, NULL, wc_spill_thread, NULL);
+	if (ret) {
+		wc_ctx.small_tail = 0;
+		return -ret;
+	}
+
+	return 0;
+}
+
+static void wc_spill_stop(void)
+{
+	if (! wc_ctx.small_tail)
+		return;
+
+	__atomic_store_n(&wc_ctx.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(wc_ctx.spill_thread, NULL);
+	wc_ctx.small_tail = 0;
+}
+
+/*
+ * mount and umount begin
+ * */
+int vbfs_load(const char *dev, vbfs_t **fsp)
+{
+	if (NULL == ioengine)
+		rdwr_register();
+
+	return init_super(dev, fsp);
+}
+
+int vbfs_start(vbfs_t *fs, const struct vbfs_mount_opts *opts)
+{
+	int ret, backing = MP_BACKING_PAGE;
+
+	if (super_check(fs))
+		return -EBADF;
+	if (fs->started)
+		return -EBUSY;
+
+	ret = super_open_data_dev(opts ? opts->data_dev : NULL);
+	if (ret)
+		return ret;
+
+	if (opts && opts->hugepages) {
+		backing = mp_parse_backing(opts->hugepages);
+		if (backing < 0)
+			return backing;
+	}
+
+	ret = mempool_init(get_extend_size(), BM_RESERVED_MAX + DATA_RESERVED_MAX,
+				backing);
+	if (ret) {
+		log_err("extend buffer pool init error\n");
+		return ret;
+	}
+
+	if (opts && opts->membench) {
+		struct mp_stats st;
+		double mbps;
+
+		mbps = mp_ebuf_memcpy_bench(DATA_RESERVED_MAX, 4UL << 30);
+		mp_get_stats(&st);
+		log_warning("extend buffer pool %s (%s asked, thp arenas %lu, "
+			"hugetlb arenas %lu), memcpy %.1f MB/s\n",
+			mp_backing_name(st.ebuf_backing), mp_backing_name(backing),
+			st.ebuf_thp_arenas, st.ebuf_hugetlb_arenas, mbps);
+	}
+
+	ret = wc_spill_start(opts);
+	if (ret) {
+		log_err("tail spill thread error\n");
+		goto err_mempool;
+	}
+
+	ret = meta_queue_create();
+	if (ret) {
+		log_err("meta queue create error\n");
+		goto err_spill;
+	}
+
+	ret = data_queue_create();
+	if (ret) {
+		log_err("data queue create error\n");
+		goto err_meta;
+	}
+
+	iosched_set_deadline(IO_CLASS_RECORD, opts ? opts->record_deadline_ms : 0);
+	bw_init(opts);
+	ret = ioengine->io_init();
+	if (ret) {
+		log_err("io thread init error\n");
+		goto err_data;
+	}
+
+	ret = super_load_summary();
+	if (ret) {
+		log_err("allocator summary load error\n");
+		goto err_io;
+	}
+
+	ret = init_root_inode();
+	if (ret < 0) {
+		log_err("root inode init error\n");
+		goto err_io;
+	}
+
+	/* groups mkfs left are also written on first use */
+	if (lazy_init_start())
+		log_warning("bitmap groups are written on first use only\n");
+
+	vbfs_recycle_enable(opts && opts->recycle);
+	sync_super();
+	fs->started = 1;
+
+	return 0;
+
+err_io:
+	ioengine->io_exit();
+err_data:
+	queue_destroy(get_data_queue());
+err_meta:
+	queue_destroy(get_meta_queue());
+err_spill:
+	wc_spill_stop();
+err_mempool:
+	mempool_destroy();
+	return ret < 0 ? ret : -EIO;
+}
+
+int vbfs_mount(const char *dev, const struct vbfs_mount_opts *opts, vbfs_t **fsp)
+{
+	vbfs_t *fs;
+	int ret;
+
+	ret = vbfs_load(dev, &fs);
+	if (ret)
+		return ret;
+
+	ret = vbfs_start(fs, opts);
+	if (ret) {
+		super_release();
+		return ret;
+	}
+
+	*fsp = fs;
+
+	return 0;
+}
+
+int vbfs_umount(vbfs_t *fs)
+{
+	int ret;
+
+	if (super_check(fs))
+		return -EBADF;
+
+	if (fs->started) {
+		vbfs_ring_serve_stop(fs);
+		wc_spill_stop();
+		lazy_init_stop();
+		vbfs_recycle_enable(0);
+		vbfs_seg_pool_release();
+		release_recycled_extends();
+		queue_destroy(get_meta_queue());
+		queue_destroy(get_data_queue());
+		ioengine->io_exit();
+		mempool_destroy();
+	}
+
+	ret = super_umount_clean();
+	super_release();
+
+	return ret ? -EIO : 0;
+}
+
+/*
+ * namespace operations begin
+ * */
+/* a handle of another or a gone mount, the core has one context for now */
+static int vbfs_check(vbfs_t *fs)
+{
+	return super_check(fs) || ! fs->started;
+}
+
+static int vbfs_create_obj(const char *path, uint32_t mode)
+{
+	int ret;
+	struct inode_info *inode;
+
+	char last_name[NAME_LEN];
+	char *name = NULL;
+	char *pos = NULL;
+
+	if (is_stats_path(path))
+		return -EEXIST;
+
+	memset(last_name, 0, sizeof(last_name));
+	name = strdup(path);
+	if (NULL == name)
+		return -ENOMEM;
+	pos = name;
+
+	ret = get_lastname(pos, last_name, PATH_SEP);
+	if (ret) {
+		free(name);
+		return -EINVAL;
+	}
+	if (strlen(last_name) == 0) {
+		free(name);
+		return -EEXIST;
+	}
+
+	inode = pathname_to_inode(pos);
+	free(name);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+
+	ret = vbfs_create(inode, last_name, mode);
+	if (ret) {
+		vbfs_inode_close(inode);
+		return ret;
+	}
+
+	vbfs_update_times(inode, UPDATE_ATIME | UPDATE_MTIME);
+	vbfs_inode_close(inode);
+
+	return 0;
+}
+
+int vbfs_stat(vbfs_t *fs, const char *path, struct stat *stbuf)
+{
+	struct inode_info *inode;
+	STATS_OP(STAT_GETATTR);
+
+	if (vbfs_check(fs))
+		return -EBADF;
+
+	inode = pathname_to_inode(path);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+
+	pthread_mutex_lock(&inode->lock);
+	fill_stbuf_by_dirent(stbuf, inode->dirent);
+	stbuf->st_size = __wc_size(inode);
+	pthread_mutex_unlock(&inode->lock);
+
+	vbfs_inode_close(inode);
+
+	return 0;
+}
+
+int vbfs_statfs(vbfs_t *fs, struct statvfs *stbuf)
+{
+	uint64_t free_nr;
+
+	if (vbfs_check(fs))
+		return -EBADF;
+
+	/* extends recycle mode took back are free too */
+	free_nr = get_free_count() + nr_recycled_extends();
+
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->f_bsize = get_extend_size();
+	stbuf->f_frsize = get_extend_size();
+	stbuf->f_blocks = get_data_extend_count();
+	stbuf->f_bfree = free_nr;
+	stbuf->f_bavail = free_nr;
+	stbuf->f_files = get_data_extend_count();
+	stbuf->f_ffree = free_nr;
+	stbuf->f_favail = free_nr;
+	stbuf->f_namemax = NAME_LEN - 1;
+
+	return 0;
+}
+
+int vbfs_mkdir(vbfs_t *fs, const char *path)
+{
+	STATS_OP(STAT_MKDIR);
+
+	if (vbfs_check(fs))
+		return -EBADF;
+
+	return vbfs_create_obj(path, VBFS_FT_DIR);
+}
+
+int vbfs_rmdir(vbfs_t *fs, const char *path)
+{
+	int ret;
+	struct inode_info *inode;
+	STATS_OP(STAT_RMDIR);
+
+	if (vbfs_check(fs))
+		return -EBADF;
+
+	if (is_stats_path(path))
+		return -EACCES;
+
+	inode = pathname_to_inode(path);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+
+	/* a removed inode is left to the core */
+	ret = vbfs_inode_rmdir(inode);
+	if (ret)
+		vbfs_inode_close(inode);
+
+	return ret;
+}
+
+int vbfs_unlink(vbfs_t *fs, const char *path)
+{
+	int ret;
+	struct inode_info *inode;
+	STATS_OP(STAT_UNLINK);
+
+	if (vbfs_check(fs))
+		return -EBADF;
+
+	if (is_stats_path(path))
+		return -EACCES;
+
+	inode = pathname_to_inode(path);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+
+	ret = vbfs_inode_unlink(inode);
+	if (ret)
+		vbfs_inode_close(inode);
+
+	return ret;
+}
+
+int vbfs_rename(vbfs_t *fs, const char *from, const char *to)
+{
+	int ret;
+	struct inode_info *inode;
+	STATS_OP(STAT_RENAME);
+
+	if (vbfs_check(fs))
+		return -EBADF;
+
+	if (is_stats_path(from) || is_stats_path(to))
+		return -EACCES;
+
+	inode = pathname_to_inode(from);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+
+	ret = vbfs_inode_rename(inode, to);
+	vbfs_inode_close(inode);
+
+	return ret;
+}
+
+int vbfs_truncate(vbfs_t *fs, const char *path, off_t size)
+{
+	int ret;
+	struct inode_info *inode;
+	STATS_OP(STAT_TRUNCATE);
+
+	if (vbfs_check(fs))
+		return -EBADF;
+
+	if (is_stats_path(path))
+		return -EACCES;
+
+	inode = pathname_to_inode(path);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+
+	wc_flush_inode(inode);
+	ret = vbfs_inode_truncate(inode, size);
+	vbfs_inode_close(inode);
+
+	return ret;
+}
+
+int vbfs_set_segment(vbfs_t *fs, const char *dir, off_t size)
+{
+	int ret;
+	struct inode_info *inode;
+
+	if (vbfs_check(fs))
+		return -EBADF;
+
+	if (is_stats_path(dir))
+		return -EACCES;
+	if (size < 0)
+		return -EINVAL;
+
+	inode = pathname_to_inode(dir);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+
+	ret = vbfs_inode_set_segment(inode, size ? 1 + file_index_count(size) : 0);
+	vbfs_inode_close(inode);
+
+	return ret;
+}
+
+int vbfs_get_segment(vbfs_t *fs, const char *dir, off_t *size)
+{
+	struct inode_info *inode;
+	uint32_t nr;
+
+	if (vbfs_check(fs))
+		return -EBADF;
+
+	if (is_stats_path(dir))
+		return -EACCES;
+
+	inode = pathname_to_inode(dir);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+
+	nr = vbfs_inode_get_segment(inode);
+	vbfs_inode_close(inode);
+
+	if (nr)
+		*size = (off_t) nr * get_extend_size() - get_file_idx_size();
+	else
+		*size = 0;
+
+	return 0;
+}
+
+/*
+ * file handle operations begin
+ * */
+static int __vbfs_open(const char *path, int flags, struct inode_info **inodep,
+			int *created)
+{
+	int ret;
+	struct inode_info *inode;
+
+	inode = pathname_to_inode(path);
+	if (! IS_ERR(inode)) {
+		if ((flags & O_CREAT) && (flags & O_EXCL)) {
+			vbfs_inode_close(inode);
+			return -EEXIST;
+		}
+		*inodep = inode;
+		return 0;
+	}
+
+	ret = PTR_ERR(inode);
+	if (-ENOENT != ret || ! (flags & O_CREAT))
+		return ret;
+
+	/* create file type inode */
+	ret = vbfs_create_obj(path, VBFS_FT_REG_FILE);
+	if (ret)
+		return ret;
+
+	inode = pathname_to_inode(path);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+
+	*inodep = inode;
+	*created = 1;
+
+	return 0;
+}
+
+int vbfs_open(vbfs_t *fs, const char *path, int flags, vbfs_file_t **fp)
+{
+	int ret, is_dir, created = 0;
+	struct inode_info *inode;
+	vbfs_file_t *f;
+	uint64_t start;
+
+	if (vbfs_check(fs))
+		return -EBADF;
+
+	if (is_stats_path(path))
+		return -EACCES;
+
+	start = stats_now();
+
+	f = mp_malloc(sizeof(vbfs_file_t));
+	if (NULL == f)
+		return -ENOMEM;
+
+	ret = __vbfs_open(path, flags, &inode, &created);
+	if (ret) {
+		mp_free(f);
+		return ret;
+	}
+
+	is_dir = VBFS_FT_DIR == inode->dirent->i_mode;
+	if ((flags & O_DIRECTORY) && ! is_dir)
+		ret = -ENOTDIR;
+	else if (is_dir && (flags & O_ACCMODE) != O_RDONLY)
+		ret = -EISDIR;
+	f->bw = NULL;
+	if (0 == ret && ! is_dir) {
+		ret = bw_open(inode->dirent->i_ino, inode->dirent->i_pino, flags,
+				&f->bw);
+		/* a refused stream leaves no file behind */
+		if (ret && created && 0 == vbfs_inode_unlink(inode)) {
+			mp_free(f);
+			return ret;
+		}
+	}
+	if (0 == ret && (flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY)
+		ret = vbfs_inode_truncate(inode, 0);
+	if (ret) {
+		if (f->bw)
+			bw_close(f->bw);
+		vbfs_inode_close(inode);
+		mp_free(f);
+		return ret;
+	}
+
+	f->fs = fs;
+	f->inode = inode;
+	f->flags = flags;
+	f->wc = NULL;
+	f->read_end = 0;
+	f->watch_fn = NULL;
+	if (! is_dir && (flags & O_ACCMODE) != O_RDONLY)
+		__atomic_add_fetch(&inode->writers, 1, __ATOMIC_SEQ_CST);
+	*fp = f;
+
+	if (is_dir)
+		stats_record(STAT_OPENDIR, start);
+	else
+		stats_record(flags & O_CREAT ? STAT_CREATE : STAT_OPEN, start);
+
+	return 0;
+}
+
+int vbfs_close(vbfs_file_t *fp)
+{
+	int ret, err, is_dir;
+	uint64_t start;
+
+	start = stats_now();
+
+	err = wc_release(fp);
+	if (fp->bw)
+		bw_close(fp->bw);
+	vbfs_watch(fp, NULL, NULL);
+	is_dir = VBFS_FT_DIR == fp->inode->dirent->i_mode;
+	/* a finished file wakes its tail readers for the end */
+	if (! is_dir && (fp->flags & O_ACCMODE) != O_RDONLY
+		&& 0 == __atomic_sub_fetch(&fp->inode->writers, 1, __ATOMIC_SEQ_CST))
+		tail_wake(fp->inode);
+	ret = vbfs_inode_close(fp->inode);
+	if (0 == ret)
+		ret = err;
+	if (is_dir)
+		stats_record(STAT_RELEASEDIR, start);
+	else
+		stats_record(STAT_RELEASE, start);
+
+	mp_free(fp);
+
+	return ret;
+}
+
+static int wc_sync(vbfs_file_t *fp)
+{
+	int ret;
+
+	pthread_mutex_lock(&fp->inode->lock);
+	__wc_flush_inode(fp->inode, fp->wc);
+	ret = __wc_take_error(fp->wc);
+	pthread_mutex_unlock(&fp->inode->lock);
+
+	vbfs_update_times(fp->inode, UPDATE_ATIME | UPDATE_MTIME);
+	if (ret)
+		return ret;
+
+	return sync_file(fp->inode);
+}
+
+ssize_t vbfs_pread(vbfs_file_t *fp, void *buf, size_t size, off_t offset)
+{
+	int ret, more;
+	struct inode_info *inode = fp->inode;
+	STATS_OP(STAT_READ);
+
+	/* a tail reader at the end does not wait on the writer */
+	if (offset >= __atomic_load_n(&inode->pub_size, __ATOMIC_SEQ_CST)) {
+		fp->read_end = offset;
+		return 0;
+	}
+
+	if (fp->bw)
+		bw_read_wait(fp->bw, size);
+
+	/* below i_size without inode->lock, the staged tail under it */
+	ret = vbfs_read_buf(inode, buf, size, offset);
+	if (-EINVAL == ret)
+		ret = 0;
+	if (ret >= 0 && ret < size && offset + ret
+			< __atomic_load_n(&inode->pub_size, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&inode->lock);
+		more = __wc_read(inode, buf + ret, size - ret, offset + ret);
+		pthread_mutex_unlock(&inode->lock);
+		if (more > 0)
+			ret += more;
+		else if (0 == ret)
+			ret = more;
+	}
+	if (ret >= 0)
+		fp->read_end = offset + ret;
+	if (ret > 0) {
+		stats_add(CNT_READ_BYTES, ret);
+		if (fp->bw)
+			bw_read_done(fp->bw, ret);
+	}
+
+	return ret;
+}
+
+ssize_t vbfs_pwrite(vbfs_file_t *fp, const void *buf, size_t size, off_t offset)
+{
+	int ret;
+	STATS_OP(STAT_WRITE);
+
+	if ((fp->flags & O_ACCMODE) == O_RDONLY)
+		return -EBADF;
+
+	ret = wc_write(fp, buf, size, offset, 0);
+	if (ret > 0) {
+		stats_add(CNT_WRITE_BYTES, ret);
+		bw_write_done(fp->bw, ret);
+	}
+
+	return ret;
+}
+
+ssize_t vbfs_append(vbfs_file_t *fp, const void *buf, size_t size)
+{
+	int ret;
+	STATS_OP(STAT_WRITE);
+
+	if ((fp->flags & O_ACCMODE) == O_RDONLY)
+		return -EBADF;
+
+	ret = wc_write(fp, buf, size, 0, 1);
+	if (ret > 0) {
+		stats_add(CNT_WRITE_BYTES, ret);
+		bw_write_done(fp->bw, ret);
+	}
+
+	return ret;
+}
+
+int vbfs_readdir(vbfs_file_t *dir, off_t offset, vbfs_filldir_t filler, void *buf)
+{
+	int ret;
+	STATS_OP(STAT_READDIR);
+
+	if (VBFS_FT_DIR != dir->inode->dirent->i_mode)
+		return -ENOTDIR;
+
+	ret = vbfs_inode_readdir(dir->inode, offset, filler, buf);
+	vbfs_update_times(dir->inode, UPDATE_ATIME);
+
+	return ret;
+}
+
+int vbfs_fstat(vbfs_file_t *fp, struct stat *stbuf)
+{
+	STATS_OP(STAT_FGETATTR);
+
+	pthread_mutex_lock(&fp->inode->lock);
+	fill_stbuf_by_dirent(stbuf, fp->inode->dirent);
+	stbuf->st_size = __wc_size(fp->inode);
+	pthread_mutex_unlock(&fp->inode->lock);
+
+	return 0;
+}
+
+int vbfs_ftruncate(vbfs_file_t *fp, off_t size)
+{
+	STATS_OP(STAT_FTRUNCATE);
+
+	if ((fp->flags & O_ACCMODE) == O_RDONLY)
+		return -EBADF;
+
+	wc_flush_inode(fp->inode);
+
+	return vbfs_inode_truncate(fp->inode, size);
+}
+
+int vbfs_flush(vbfs_file_t *fp)
+{
+	STATS_OP(STAT_FLUSH);
+
+	return wc_sync(fp);
+}
+
+int vbfs_fsync(vbfs_file_t *fp)
+{
+	STATS_OP(STAT_FSYNC);
+
+	return wc_sync(fp);
+}
+
+int vbfs_fallocate(vbfs_file_t *fp, int mode, off_t offset, off_t len)
+{
+	struct inode_info *inode = fp->inode;
+	int ret;
+
+	STATS_OP(STAT_FALLOCATE);
+
+	if ((fp->flags & O_ACCMODE) == O_RDONLY)
+		return -EBADF;
+
+	wc_flush_inode(inode);
+
+	ret = vbfs_inode_fallocate(inode, mode, offset, len);
+	if (ret || (mode & FALLOC_FL_KEEP_SIZE))
+		return ret;
+
+	pthread_mutex_lock(&inode->lock);
+	tail_publish(inode, __wc_size(inode));
+	pthread_mutex_unlock(&inode->lock);
+	tail_wake(inode);
+
+	return 0;
+}
+
+/*
+ * seek table begin
+ * */
+int vbfs_seek_add(vbfs_file_t *fp, uint64_t time, off_t offset)
+{
+	int ret;
+
+	if ((fp->flags & O_ACCMODE) == O_RDONLY)
+		return -EBADF;
+	if (offset < 0)
+		return -EINVAL;
+
+	pthread_mutex_lock(&fp->inode->lock);
+	ret = __vbfs_seek_add(fp->inode, time, offset);
+	pthread_mutex_unlock(&fp->inode->lock);
+
+	return ret;
+}
+
+off_t vbfs_seek_time(vbfs_file_t *fp, uint64_t time)
+{
+	uint64_t offset;
+	int ret;
+
+	pthread_mutex_lock(&fp->inode->lock);
+	ret = __vbfs_seek_find(fp->inode, time, &offset);
+	pthread_mutex_unlock(&fp->inode->lock);
+
+	return ret ? ret : (off_t) offset;
+}
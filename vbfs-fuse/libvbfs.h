@@ -0,0 +1,182 @@
+#ifndef __LIBVBFS_H__
+#define __LIBVBFS_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+
+/*
+ * vbfs in the calling process, no fuse and no kernel round trip.
+ *
+ * only one filesystem can be mounted per process, the core keeps its
+ * state in a single context and a second vbfs_load() gets -EBUSY.
+ * vbfs_t stays opaque and every call takes it, a handle of an umounted
+ * or not started filesystem gets -EBADF, so the context can move into
+ * the handle later with no change here. calls return 0 (or a byte
+ * count) on success and a negative errno on failure.
+ *
+ * off_t is 64 bit in the library, 32 bit users must build with
+ * -D_FILE_OFFSET_BITS=64.
+ * */
+
+typedef struct vbfs vbfs_t;
+typedef struct vbfs_file vbfs_file_t;
+
+/* same as fuse_fill_dir_t, so a fuse filler can be passed through */
+typedef int (*vbfs_filldir_t)(void *buf, const char *name,
+				const struct stat *stbuf, off_t off);
+
+struct vbfs_mount_opts {
+	const char *hugepages;	/* none, thp or hugetlb, NULL for none */
+	int membench;		/* log extend buffer memcpy speed at start */
+
+	/*
+	 * tails of growing files in page sized buffers written to disk
+	 * past the extend cache, a file with no append for tail_idle_ms
+	 * (0 for 5000) has its tail written out and keeps one page
+	 * */
+	int small_tail;
+	unsigned int tail_idle_ms;
+
+	/*
+	 * on a full disk the oldest closed file (by ctime) is removed and
+	 * its extends reused, recording goes on instead of ENOSPC. they are
+	 * marked used on disk until reused or umount, a crash leaks those
+	 * not yet taken for good.
+	 * */
+	int recycle;
+
+	/*
+	 * bulk device of an image formatted with a metadata device (mkfs
+	 * -m), @dev is then the metadata one. must be set for such images.
+	 * */
+	const char *data_dev;
+
+	/*
+	 * a recording write is on the disk this long after it left the
+	 * extend cache, ahead of playback reads and background flushes.
+	 * 0 for 50.
+	 * */
+	unsigned int record_deadline_ms;
+
+	/*
+	 * bandwidth in KB/s, 0 for no limit. a read handle waits for
+	 * read_limit_kbps of its own and all of them for read_total_kbps.
+	 * an open for write of a file no handle writes is a new stream, it
+	 * fails with EBUSY when the streams would need more than
+	 * write_budget_kbps. a stream counts at least stream_kbps.
+	 * */
+	unsigned int read_limit_kbps;
+	unsigned int read_total_kbps;
+	unsigned int write_budget_kbps;
+	unsigned int stream_kbps;
+};
+
+int vbfs_mount(const char *dev, const struct vbfs_mount_opts *opts, vbfs_t **fsp);
+int vbfs_umount(vbfs_t *fs);
+
+/*
+ * vbfs_mount() in two halves for daemons that fork in between:
+ * vbfs_load() only reads the superblock, vbfs_start() starts threads
+ * */
+int vbfs_load(const char *dev, vbfs_t **fsp);
+int vbfs_start(vbfs_t *fs, const struct vbfs_mount_opts *opts);
+
+int vbfs_stat(vbfs_t *fs, const char *path, struct stat *stbuf);
+/*
+ * a block is an extend. every file and dir takes an extend of its own,
+ * so free inodes are the free extends. exact, no disk access.
+ * */
+int vbfs_statfs(vbfs_t *fs, struct statvfs *stbuf);
+int vbfs_mkdir(vbfs_t *fs, const char *path);
+int vbfs_rmdir(vbfs_t *fs, const char *path);
+int vbfs_unlink(vbfs_t *fs, const char *path);
+int vbfs_rename(vbfs_t *fs, const char *from, const char *to);
+int vbfs_truncate(vbfs_t *fs, const char *path, off_t size);
+
+/*
+ * segment template of a directory: its new files get the extends for
+ * @size bytes reserved in one run, deleted ones that did not outgrow it
+ * are kept in a pool for the next create. 0 turns it off. the pool is
+ * in memory only, its extends stay marked used and a crash leaks them.
+ * */
+int vbfs_set_segment(vbfs_t *fs, const char *dir, off_t size);
+int vbfs_get_segment(vbfs_t *fs, const char *dir, off_t *size);
+
+/* O_CREAT, O_EXCL, O_TRUNC and O_DIRECTORY are honoured */
+int vbfs_open(vbfs_t *fs, const char *path, int flags, vbfs_file_t **fp);
+int vbfs_close(vbfs_file_t *fp);
+
+/*
+ * small appends are combined per handle and reach the extend cache in
+ * 64K chunks, reads and stats of any handle see them. a failure of a
+ * deferred write is returned by a later write, fsync or close.
+ * */
+ssize_t vbfs_pread(vbfs_file_t *fp, void *buf, size_t size, off_t offset);
+ssize_t vbfs_pwrite(vbfs_file_t *fp, const void *buf, size_t size, off_t offset);
+/* write at the end of file, the offset is taken under the inode lock */
+ssize_t vbfs_append(vbfs_file_t *fp, const void *buf, size_t size);
+
+/*
+ * live tail: the callback is fired once, with 1 when the file grows past
+ * the last read of the handle or its last writer closes, with 0 when the
+ * watch is replaced or the handle closed. it runs under the watch lock
+ * and must not call back into the file. vbfs_watch() returns 1 instead
+ * of a watch when the handle can read on already, a NULL @fn only drops
+ * the watch and tells.
+ * */
+typedef void (*vbfs_watch_fn_t)(void *arg, int ready);
+int vbfs_watch(vbfs_file_t *fp, vbfs_watch_fn_t fn, void *arg);
+/* a handle open for write */
+int vbfs_is_growing(vbfs_file_t *fp);
+
+int vbfs_readdir(vbfs_file_t *dir, off_t offset, vbfs_filldir_t filler, void *buf);
+int vbfs_fstat(vbfs_file_t *fp, struct stat *stbuf);
+int vbfs_ftruncate(vbfs_file_t *fp, off_t size);
+int vbfs_flush(vbfs_file_t *fp);
+int vbfs_fsync(vbfs_file_t *fp);
+
+/*
+ * FALLOC_FL_KEEP_SIZE reserves the extends up to @offset + @len in as few
+ * runs as the bitmap has, the size is kept. with no flag the size moves
+ * up to there as well, the new extends read as zeros until written and
+ * are not written meanwhile. FALLOC_FL_PUNCH_HOLE frees the whole
+ * extends of the range, reserved ones past the size too, and zeroes the
+ * rest of it. reserving again fills the holes past the size.
+ * */
+int vbfs_fallocate(vbfs_file_t *fp, int mode, off_t offset, off_t len);
+
+/*
+ * seek table of a file: the recorder adds (time, offset) pairs in time
+ * order, in any unit it likes, they are kept in the spare index room of
+ * the file. vbfs_seek_time() returns the offset of the last entry at or
+ * before @time with one metadata read, -ENOENT before the first one.
+ * -ENOSPC when the room is taken by the index.
+ * */
+int vbfs_seek_add(vbfs_file_t *fp, uint64_t time, off_t offset);
+off_t vbfs_seek_time(vbfs_file_t *fp, uint64_t time);
+
+/*
+ * shared memory append rings for recorder processes on the same box.
+ * the filesystem process serves a unix socket, a recorder opens a ring
+ * per stream over it and appends without a syscall, the data reaches
+ * the file in large batches. a connection is used by one thread at a
+ * time, rings of a dropped connection are drained and closed.
+ * */
+typedef struct vbfs_ring vbfs_ring_t;
+
+int vbfs_ring_serve(vbfs_t *fs, const char *sock_path);
+void vbfs_ring_serve_stop(vbfs_t *fs);
+
+int vbfs_ring_connect(const char *sock_path);
+/* @flags: O_TRUNC, O_EXCL, @size: power of two, 0 for the default 1M */
+int vbfs_ring_open(int conn, const char *path, int flags, unsigned int size,
+			vbfs_ring_t **rp);
+/* all or nothing, -EAGAIN while the ring is full */
+ssize_t vbfs_ring_append(vbfs_ring_t *r, const void *buf, size_t len);
+int vbfs_ring_fsync(vbfs_ring_t *r);
+int vbfs_ring_close(vbfs_ring_t *r);
+
+#endif
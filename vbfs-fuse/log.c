@@ -1,29 +1,278 @@
 #include <syslog.h>
 #include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "log.h"
 
-int is_debug = 0;
+/*
+ * every thread formats its messages into its own ring, a background
+ * thread drains the rings into syslog. the owner thread only moves
+ * head and the drain thread only moves tail, so no lock is taken
+ * on the logging path. a full ring drops the message and counts it.
+ *
+ * before log_async_start() and after log_close() messages go to
+ * syslog on the calling thread.
+ * */
+#define LOG_RING_SIZE 64 /* power of two */
+#define LOG_DRAIN_INTERVAL_MS 20
+
+struct log_entry {
+	int prio;
+	char line[LOG_LINE_LEN];
+};
+
+struct log_ring {
+	unsigned int head;
+	unsigned int tail;
+	unsigned long dropped;
+	unsigned long dropped_reported;
+	int dead;
+
+	struct log_ring *next;
+	struct log_entry ents[LOG_RING_SIZE];
+};
+
+int log_level = LOG_LV_WARNING;
+
+static struct {
+	int running;
+	int stop;
+	pthread_t thread;
+	pthread_key_t ring_key;
+
+	/* protects the ring list, taken once per thread and by the drainer */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct log_ring *rings;
+} log_ctx = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* the ring key and the exit hook outlive a stop, set up once */
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static int log_once_err;
+
+static __thread struct log_ring *log_ring;
+
+static const char *log_level_names[] = {
+	[LOG_LV_ERR] = "error",
+	[LOG_LV_WARNING] = "warning",
+	[LOG_LV_DEBUG] = "debug",
+};
 
 int log_init(void)
 {
 	openlog("vbfs-fuse", 0, LOG_DAEMON);
 	setlogmask(LOG_UPTO(LOG_DEBUG));
 
-	is_debug = 1;
-
 	return 0;
 }
 
+void log_set_level(int level)
+{
+	if (level > LOG_LV_MAX)
+		level = LOG_LV_MAX;
+
+	log_level = level;
+}
+
+int log_parse_level(const char *name)
+{
+	int i;
+
+	for (i = 0; i <= LOG_LV_DEBUG; i++) {
+		if (0 == strcmp(name, log_level_names[i]))
+			return i;
+	}
+
+	return -EINVAL;
+}
+
+static void ring_destructor(void *args)
+{
+	struct log_ring *ring = args;
+
+	/* freed by the drain thread once it is empty */
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+	log_ring = NULL;
+}
+
+static struct log_ring *get_ring(void)
+{
+	struct log_ring *ring;
+
+	if (log_ring)
+		return log_ring;
+
+	ring = calloc(1, sizeof(struct log_ring));
+	if (NULL == ring)
+		return NULL;
+
+	pthread_mutex_lock(&log_ctx.lock);
+	ring->next = log_ctx.rings;
+	log_ctx.rings = ring;
+	pthread_mutex_unlock(&log_ctx.lock);
+
+	pthread_setspecific(log_ctx.ring_key, ring);
+	log_ring = ring;
+
+	return ring;
+}
+
+static void ring_log(int prio, const char *fmt, va_list ap)
+{
+	struct log_ring *ring;
+	struct log_entry *ent;
+	unsigned int head, tail;
+
+	ring = get_ring();
+	if (NULL == ring) {
+		vsyslog(prio, fmt, ap);
+		return;
+	}
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head - tail >= LOG_RING_SIZE) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	ent = &ring->ents[head & (LOG_RING_SIZE - 1)];
+	ent->prio = prio;
+	vsnprintf(ent->line, LOG_LINE_LEN, fmt, ap);
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
 static void dolog(int prio, const char *fmt, va_list ap)
 {
-	vsyslog(prio, fmt, ap);
+	if (__atomic_load_n(&log_ctx.running, __ATOMIC_ACQUIRE))
+		ring_log(prio, fmt, ap);
+	else
+		vsyslog(prio, fmt, ap);
+}
+
+static int drain_ring(struct log_ring *ring)
+{
+	struct log_entry *ent;
+	unsigned int head, tail;
+	unsigned long dropped;
+	int nr = 0;
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	while (tail != head) {
+		ent = &ring->ents[tail & (LOG_RING_SIZE - 1)];
+		syslog(ent->prio, "%s", ent->line);
+		tail++;
+		nr++;
+	}
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	if (dropped != ring->dropped_reported) {
+		syslog(LOG_WARNING, "%lu log messages dropped\n",
+			dropped - ring->dropped_reported);
+		ring->dropped_reported = dropped;
+	}
+
+	return nr;
+}
+
+static void drain_all(void)
+{
+	struct log_ring **pp, *ring;
+
+	pthread_mutex_lock(&log_ctx.lock);
+	pp = &log_ctx.rings;
+	while ((ring = *pp) != NULL) {
+		if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE)) {
+			drain_ring(ring);
+			*pp = ring->next;
+			free(ring);
+			continue;
+		}
+
+		drain_ring(ring);
+		pp = &ring->next;
+	}
+	pthread_mutex_unlock(&log_ctx.lock);
+}
+
+static void *log_drain_thread(void *args)
+{
+	struct timespec ts;
+
+	while (1) {
+		drain_all();
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LOG_DRAIN_INTERVAL_MS * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		pthread_mutex_lock(&log_ctx.lock);
+		if (log_ctx.stop) {
+			pthread_mutex_unlock(&log_ctx.lock);
+			break;
+		}
+		pthread_cond_timedwait(&log_ctx.cond, &log_ctx.lock, &ts);
+		pthread_mutex_unlock(&log_ctx.lock);
+	}
+
+	return NULL;
+}
+
+static void log_once_init(void)
+{
+	log_once_err = pthread_key_create(&log_ctx.ring_key, ring_destructor);
+	/* exit() on error paths still gets the last messages out */
+	if (0 == log_once_err)
+		atexit(log_close);
+}
+
+/*
+ * start the drain thread, must be called after fuse daemonized,
+ * threads do not survive the fork
+ * */
+int log_async_start(void)
+{
+	int ret;
+
+	if (log_ctx.running)
+		return 0;
+
+	pthread_once(&log_once, log_once_init);
+	if (log_once_err)
+		return -log_once_err;
+
+	log_ctx.stop = 0;
+	ret = pthread_create(&log_ctx.thread, NULL, log_drain_thread, NULL);
+	if (ret)
+		return -ret;
+
+	__atomic_store_n(&log_ctx.running, 1, __ATOMIC_RELEASE);
+
+	return 0;
 }
 
 void log_warning(const char *fmt, ...)
 {
 	va_list ap;
 
+	if (LOG_LV_MAX < LOG_LV_WARNING || log_level < LOG_LV_WARNING)
+		return;
+
 	va_start(ap, fmt);
 	dolog(LOG_WARNING, fmt, ap);
 	va_end(ap);
@@ -49,5 +298,16 @@ void log_debug(const char *fmt, ...)
 
 void log_close(void)
 {
+	if (__atomic_exchange_n(&log_ctx.running, 0, __ATOMIC_ACQ_REL)) {
+		pthread_mutex_lock(&log_ctx.lock);
+		log_ctx.stop = 1;
+		pthread_cond_signal(&log_ctx.cond);
+		pthread_mutex_unlock(&log_ctx.lock);
+
+		pthread_join(log_ctx.thread, NULL);
+		/* messages raced with the stop */
+		drain_all();
+	}
+
 	closelog();
 }
@@ -0,0 +1,839 @@
+#include <sys/mman.h>
+
+#include "mempool.h"
+#include "list.h"
+
+#define MP_MAGIC 0x6d70626c
+#define MP_MAGIC_FREE 0x6d706672
+
+#define MP_MIN_SIZE 32
+#define MP_SLAB_SIZE (64 * 1024)
+
+#define EBUF_ARENA_MAX 256
+#define EBUF_GROW 16
+
+enum {
+	MP_SLAB,
+	MP_HEAP,
+	MP_HEAP_ALIGNED,
+};
+
+/* 16 bytes, keeps the object behind it 16 bytes aligned */
+struct mp_hdr {
+	uint32_t magic;
+	uint16_t type;
+	uint16_t cls;
+	union {
+		uint64_t offset; /* MP_HEAP_ALIGNED: distance to the real start */
+		struct mp_hdr *next; /* MP_SLAB: free list link */
+	};
+};
+#define MP_HDR_SIZE sizeof(struct mp_hdr)
+
+struct mp_class {
+	unsigned int obj_size; /* header included */
+	struct mp_hdr *free_list;
+	char *slab_pos;
+	char *slab_end;
+
+	struct mp_class_stats stats;
+	pthread_mutex_t lock;
+};
+
+#define MP_CLASS_INIT(size) {				\
+	.obj_size = (size) + MP_HDR_SIZE,		\
+	.stats = { .obj_size = (size) },		\
+	.lock = PTHREAD_MUTEX_INITIALIZER,		\
+}
+
+static struct mp_class mp_classes[MP_NR_CLASSES] = {
+	MP_CLASS_INIT(32),
+	MP_CLASS_INIT(64),
+	MP_CLASS_INIT(128),
+	MP_CLASS_INIT(256),
+	MP_CLASS_INIT(512),
+	MP_CLASS_INIT(1024),
+	MP_CLASS_INIT(2048),
+};
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long heap_alloc_cnt;
+static unsigned long heap_in_use;
+
+/* nr and hit are written by the owner thread only, read by any */
+struct ebuf_magazine {
+	int nr;
+	void *bufs[MP_MAG_SIZE];
+	unsigned long hit;
+	unsigned int gen; /* of the pool its buffers came from */
+
+	struct list_head list;
+};
+
+struct ebuf_arena {
+	char *base;
+	size_t len;
+	int backing;
+};
+
+struct ebuf_pool {
+	unsigned int size;
+	size_t stride;
+	int backing;
+
+	/* free buffers not cached by any thread */
+	void **depot;
+	unsigned long depot_nr;
+	unsigned long total;
+
+	struct ebuf_arena arenas[EBUF_ARENA_MAX];
+	int nr_arenas;
+	char *lo;
+	char *hi;
+
+	/*
+	 * a destroy leaves the address range of its arenas reserved with
+	 * no pages, a late free of one of their buffers is told apart.
+	 * */
+	struct ebuf_arena *retired;
+	int nr_retired;
+
+	/* outlives a destroy, a thread keeps its magazine over a remount */
+	struct list_head mags;
+	unsigned int gen; /* bumped by a destroy */
+	unsigned long retired_hit;
+	unsigned long miss;
+
+	pthread_mutex_t lock;
+};
+
+static struct ebuf_pool ebuf_pool = {
+	.mags = LIST_HEAD_INIT(ebuf_pool.mags),
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static __thread struct ebuf_magazine *ebuf_mag;
+
+/* created once for the process, the magazines are per thread */
+static pthread_key_t mag_key;
+static pthread_once_t mag_key_once = PTHREAD_ONCE_INIT;
+static int mag_key_err;
+
+/*
+ * memory operations begin
+ * */
+void *Valloc(unsigned int size)
+{
+	void *p = NULL;
+
+	if ((p = valloc(size)) != NULL) {
+		return p;
+	} else {
+		log_err("valloc error, no memory\n");
+		return NULL;
+	}
+}
+
+void *Malloc(unsigned int size)
+{
+	void *p = NULL;
+
+	if ((p = malloc(size)) != NULL) {
+		return p;
+	} else {
+		log_err("malloc error, no memory\n");
+		return NULL;
+	}
+}
+
+static void *mp_mmap(size_t len)
+{
+	void *p;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == p) {
+		log_err("mmap %zu error, %s\n", len, strerror(errno));
+		return NULL;
+	}
+
+	return p;
+}
+
+/*
+ * 2M aligned mapping, trimmed from a bigger one so the kernel is able
+ * to back it with transparent huge pages
+ * */
+static void *mp_mmap_aligned(size_t len)
+{
+	char *p, *aligned;
+	size_t head, tail;
+
+	p = mmap(NULL, len + MP_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == p)
+		return NULL;
+
+	aligned = (char *) (((unsigned long) p + MP_HUGE_PAGE_SIZE - 1)
+				& ~((unsigned long) MP_HUGE_PAGE_SIZE - 1));
+	head = aligned - p;
+	tail = MP_HUGE_PAGE_SIZE - head;
+
+	if (head)
+		munmap(p, head);
+	if (tail)
+		munmap(aligned + len, tail);
+
+	return aligned;
+}
+
+/*
+ * map @len bytes with the best backing not better than @backing,
+ * @backing is updated to the one actually got
+ * */
+static void *mp_mmap_backing(size_t len, int *backing)
+{
+	void *p;
+
+	if (MP_BACKING_HUGETLB == *backing) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (MAP_FAILED != p)
+			return p;
+
+		log_warning("no hugetlb pages for %zu bytes, try thp\n", len);
+		*backing = MP_BACKING_THP;
+	}
+
+	if (MP_BACKING_THP == *backing) {
+		p = mp_mmap_aligned(len);
+		if (NULL == p) {
+			log_err("mmap %zu error, %s\n", len, strerror(errno));
+			return NULL;
+		}
+
+		if (0 == madvise(p, len, MADV_HUGEPAGE))
+			return p;
+
+		log_warning("madvise hugepage error, %s\n", strerror(errno));
+		*backing = MP_BACKING_PAGE;
+		return p;
+	}
+
+	return mp_mmap(len);
+}
+
+/*
+ * slab operations begin
+ * */
+static int size_to_class(unsigned int size)
+{
+	int cls;
+
+	for (cls = 0; cls < MP_NR_CLASSES; cls++) {
+		if (size <= (MP_MIN_SIZE << cls))
+			return cls;
+	}
+
+	return -1;
+}
+
+static int __slab_grow(struct mp_class *c)
+{
+	char *slab;
+
+	slab = mp_mmap(MP_SLAB_SIZE);
+	if (NULL == slab)
+		return -ENOMEM;
+
+	c->slab_pos = slab;
+	c->slab_end = slab + MP_SLAB_SIZE;
+	c->stats.nr_slabs++;
+
+	return 0;
+}
+
+static void *slab_alloc(int cls)
+{
+	struct mp_class *c = &mp_classes[cls];
+	struct mp_hdr *hdr;
+
+	pthread_mutex_lock(&c->lock);
+	if (c->free_list) {
+		hdr = c->free_list;
+		c->free_list = hdr->next;
+	} else {
+		if (c->slab_pos + c->obj_size > c->slab_end &&
+		    __slab_grow(c)) {
+			pthread_mutex_unlock(&c->lock);
+			return NULL;
+		}
+		hdr = (struct mp_hdr *) c->slab_pos;
+		c->slab_pos += c->obj_size;
+	}
+
+	c->stats.nr_alloc++;
+	if (++c->stats.in_use > c->stats.peak)
+		c->stats.peak = c->stats.in_use;
+	pthread_mutex_unlock(&c->lock);
+
+	hdr->magic = MP_MAGIC;
+	hdr->type = MP_SLAB;
+	hdr->cls = cls;
+
+	return hdr + 1;
+}
+
+static void slab_free(struct mp_hdr *hdr)
+{
+	struct mp_class *c = &mp_classes[hdr->cls];
+
+	hdr->magic = MP_MAGIC_FREE;
+
+	pthread_mutex_lock(&c->lock);
+	hdr->next = c->free_list;
+	c->free_list = hdr;
+	c->stats.nr_free++;
+	c->stats.in_use--;
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void heap_account(int alloc)
+{
+	pthread_mutex_lock(&heap_lock);
+	if (alloc) {
+		heap_alloc_cnt++;
+		heap_in_use++;
+	} else
+		heap_in_use--;
+	pthread_mutex_unlock(&heap_lock);
+}
+
+static void *heap_alloc(unsigned int size)
+{
+	struct mp_hdr *hdr;
+
+	hdr = Malloc(size + MP_HDR_SIZE);
+	if (NULL == hdr)
+		return NULL;
+
+	hdr->magic = MP_MAGIC;
+	hdr->type = MP_HEAP;
+	hdr->offset = 0;
+	heap_account(1);
+
+	return hdr + 1;
+}
+
+static void *heap_valloc(unsigned int size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	struct mp_hdr *hdr;
+	char *p;
+
+	p = Valloc(size + page);
+	if (NULL == p)
+		return NULL;
+
+	hdr = (struct mp_hdr *) (p + page) - 1;
+	hdr->magic = MP_MAGIC;
+	hdr->type = MP_HEAP_ALIGNED;
+	hdr->offset = page;
+	heap_account(1);
+
+	return p + page;
+}
+
+/*
+ * extend buffer pool begin
+ * */
+static int __ebuf_grow(unsigned int nr)
+{
+	struct ebuf_pool *pool = &ebuf_pool;
+	struct ebuf_arena *arena;
+	void **depot;
+	unsigned int i;
+
+	if (pool->nr_arenas >= EBUF_ARENA_MAX) {
+		log_err("too many extend buffer arenas\n");
+		return -ENOMEM;
+	}
+
+	arena = &pool->arenas[pool->nr_arenas];
+	arena->len = pool->stride * nr;
+	arena->backing = pool->backing;
+	if (MP_BACKING_PAGE != arena->backing) {
+		/* fill the huge pages up, the tail would be wasted anyway */
+		arena->len = (arena->len + MP_HUGE_PAGE_SIZE - 1)
+				/ MP_HUGE_PAGE_SIZE * MP_HUGE_PAGE_SIZE;
+		nr = arena->len / pool->stride;
+	}
+
+	depot = realloc(pool->depot, (pool->total + nr) * sizeof(void *));
+	if (NULL == depot)
+		return -ENOMEM;
+	pool->depot = depot;
+
+	arena->base = mp_mmap_backing(arena->len, &arena->backing);
+	if (NULL == arena->base)
+		return -ENOMEM;
+	/* do not retry a backing the kernel already refused */
+	pool->backing = arena->backing;
+
+	for (i = 0; i < nr; i++)
+		pool->depot[pool->depot_nr++] = arena->base + i * pool->stride;
+
+	if (NULL == pool->lo || arena->base < pool->lo)
+		pool->lo = arena->base;
+	if (arena->base + arena->len > pool->hi)
+		pool->hi = arena->base + arena->len;
+
+	pool->total += nr;
+	pool->nr_arenas++;
+
+	return 0;
+}
+
+static int arena_has(struct ebuf_arena *arena, char *cp)
+{
+	return cp >= arena->base && cp < arena->base + arena->len;
+}
+
+/* 1 for a buffer of the pool, -1 for one of a retired arena */
+static int ebuf_owns(void *p)
+{
+	struct ebuf_pool *pool = &ebuf_pool;
+	char *cp = p;
+	int i, ret = 0;
+
+	if (cp < pool->lo || cp >= pool->hi)
+		return 0;
+
+	for (i = pool->nr_arenas - 1; i >= 0; i--) {
+		if (arena_has(&pool->arenas[i], cp))
+			return 1;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < pool->nr_retired; i++) {
+		if (arena_has(&pool->retired[i], cp)) {
+			ret = -1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return ret;
+}
+
+/* the pages are freed, the range is kept out of any other mapping */
+static void __ebuf_retire(struct ebuf_arena *arena)
+{
+	struct ebuf_pool *pool = &ebuf_pool;
+	struct ebuf_arena *retired;
+	void *p;
+
+	retired = realloc(pool->retired,
+			(pool->nr_retired + 1) * sizeof(struct ebuf_arena));
+	if (retired) {
+		pool->retired = retired;
+		p = mmap(arena->base, arena->len, PROT_NONE, MAP_PRIVATE
+			| MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+		if (MAP_FAILED != p) {
+			pool->retired[pool->nr_retired++] = *arena;
+			return;
+		}
+	}
+
+	munmap(arena->base, arena->len);
+}
+
+static void mag_set_nr(struct ebuf_magazine *mag, int nr)
+{
+	__atomic_store_n(&mag->nr, nr, __ATOMIC_RELAXED);
+}
+
+static void __mag_flush(struct ebuf_magazine *mag, int keep)
+{
+	struct ebuf_pool *pool = &ebuf_pool;
+	int nr = mag->nr;
+
+	while (nr > keep)
+		pool->depot[pool->depot_nr++] = mag->bufs[--nr];
+	mag_set_nr(mag, nr);
+}
+
+/* buffers of a destroyed pool are dropped by the thread owning them */
+static void __mag_renew(struct ebuf_magazine *mag)
+{
+	struct ebuf_pool *pool = &ebuf_pool;
+
+	mag_set_nr(mag, 0);
+	pool->retired_hit += mag->hit;
+	__atomic_store_n(&mag->hit, 0, __ATOMIC_RELAXED);
+	mag->gen = pool->gen;
+}
+
+static void mag_destructor(void *args)
+{
+	struct ebuf_magazine *mag = args;
+	struct ebuf_pool *pool = &ebuf_pool;
+
+	pthread_mutex_lock(&pool->lock);
+	if (mag->gen == pool->gen)
+		__mag_flush(mag, 0);
+	pool->retired_hit += mag->hit;
+	list_del(&mag->list);
+	pthread_mutex_unlock(&pool->lock);
+
+	ebuf_mag = NULL;
+	mp_free(mag);
+}
+
+static struct ebuf_magazine *get_magazine(void)
+{
+	struct ebuf_pool *pool = &ebuf_pool;
+	struct ebuf_magazine *mag;
+
+	mag = ebuf_mag;
+	if (mag) {
+		if (mag->gen != __atomic_load_n(&pool->gen, __ATOMIC_ACQUIRE)) {
+			pthread_mutex_lock(&pool->lock);
+			__mag_renew(mag);
+			pthread_mutex_unlock(&pool->lock);
+		}
+		return mag;
+	}
+
+	mag = mp_malloc(sizeof(struct ebuf_magazine));
+	if (NULL == mag)
+		return NULL;
+	memset(mag, 0, sizeof(*mag));
+
+	pthread_mutex_lock(&pool->lock);
+	mag->gen = pool->gen;
+	list_add(&mag->list, &pool->mags);
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_setspecific(mag_key, mag);
+	ebuf_mag = mag;
+
+	return mag;
+}
+
+static void *ebuf_alloc(void)
+{
+	struct ebuf_pool *pool = &ebuf_pool;
+	struct ebuf_magazine *mag;
+	void *p;
+
+	mag = get_magazine();
+	if (mag && mag->nr) {
+		__atomic_store_n(&mag->hit, mag->hit + 1, __ATOMIC_RELAXED);
+		mag_set_nr(mag, mag->nr - 1);
+		return mag->bufs[mag->nr];
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if (0 == pool->depot_nr && __ebuf_grow(EBUF_GROW)) {
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+	pool->miss++;
+
+	p = pool->depot[--pool->depot_nr];
+	/* take half a magazine, the next allocations will hit */
+	while (mag && pool->depot_nr && mag->nr < MP_MAG_SIZE / 2) {
+		mag->bufs[mag->nr] = pool->depot[--pool->depot_nr];
+		mag_set_nr(mag, mag->nr + 1);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return p;
+}
+
+static void ebuf_free(void *p)
+{
+	struct ebuf_pool *pool = &ebuf_pool;
+	struct ebuf_magazine *mag;
+
+	mag = get_magazine();
+	if (mag && mag->nr < MP_MAG_SIZE) {
+		mag->bufs[mag->nr] = p;
+		mag_set_nr(mag, mag->nr + 1);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->depot[pool->depot_nr++] = p;
+	if (mag)
+		__mag_flush(mag, MP_MAG_SIZE / 2);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void mag_key_create(void)
+{
+	mag_key_err = pthread_key_create(&mag_key, mag_destructor);
+}
+
+/*
+ * @ebuf_size: size of one extend buffer, mp_valloc(ebuf_size) is served
+ *             by the pool
+ * @nr_ebufs: buffers allocated up front, the pool grows by EBUF_GROW
+ *            buffers when they are all in use
+ * @backing: MP_BACKING_*, huge page backed arenas are rounded up to
+ *           MP_HUGE_PAGE_SIZE
+ * */
+int mempool_init(unsigned int ebuf_size, unsigned int nr_ebufs, int backing)
+{
+	struct ebuf_pool *pool = &ebuf_pool;
+	size_t page = sysconf(_SC_PAGESIZE);
+	int ret = 0;
+
+	pthread_once(&mag_key_once, mag_key_create);
+	if (mag_key_err)
+		return -mag_key_err;
+
+	pthread_mutex_lock(&pool->lock);
+
+	pool->size = ebuf_size;
+	pool->stride = (ebuf_size + page - 1) / page * page;
+	pool->backing = backing;
+
+	if (nr_ebufs) {
+		ret = __ebuf_grow(nr_ebufs);
+		if (ret)
+			pool->size = 0;
+	}
+
+	if (0 == ret && pool->backing != backing)
+		log_warning("extend buffer pool fall back from %s to %s\n",
+			mp_backing_name(backing),
+			mp_backing_name(pool->backing));
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return ret;
+}
+
+void mempool_destroy(void)
+{
+	struct ebuf_pool *pool = &ebuf_pool;
+	struct ebuf_magazine *mag;
+	unsigned long cached = 0, hit;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	hit = pool->retired_hit;
+
+	/* left to the threads, they empty them on their next use */
+	list_for_each_entry(mag, &pool->mags, list) {
+		if (mag->gen != pool->gen)
+			continue;
+		cached += __atomic_load_n(&mag->nr, __ATOMIC_RELAXED);
+		hit += __atomic_load_n(&mag->hit, __ATOMIC_RELAXED);
+	}
+	log_dbg("extend buffers %lu, arenas %d, magazine hit %lu, miss %lu\n",
+		pool->total, pool->nr_arenas, hit, pool->miss);
+
+	if (pool->depot_nr + cached != pool->total)
+		log_err("%lu extend buffers still in use\n",
+			pool->total - pool->depot_nr - cached);
+
+	for (i = 0; i < pool->nr_arenas; i++)
+		__ebuf_retire(&pool->arenas[i]);
+
+	free(pool->depot);
+	pool->depot = NULL;
+	pool->depot_nr = 0;
+	pool->total = 0;
+	pool->nr_arenas = 0;
+	pool->size = 0;
+	__atomic_store_n(&pool->gen, pool->gen + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void *mp_malloc(unsigned int size)
+{
+	int cls;
+
+	cls = size_to_class(size);
+	if (cls < 0)
+		return heap_alloc(size);
+
+	return slab_alloc(cls);
+}
+
+void *mp_valloc(unsigned int size)
+{
+	if (ebuf_pool.size && size == ebuf_pool.size)
+		return ebuf_alloc();
+
+	return heap_valloc(size);
+}
+
+void mp_free(void *p)
+{
+	struct mp_hdr *hdr;
+	int owner;
+
+	if (NULL == p)
+		return;
+
+	owner = ebuf_owns(p);
+	if (owner > 0) {
+		ebuf_free(p);
+		return;
+	}
+	if (owner < 0) {
+		log_err("BUG: free %p after the extend buffer pool is gone\n", p);
+		return;
+	}
+
+	hdr = (struct mp_hdr *) p - 1;
+	if (MP_MAGIC != hdr->magic) {
+		log_err("BUG: bad free %p, magic %x\n", p, hdr->magic);
+		return;
+	}
+
+	switch (hdr->type) {
+	case MP_SLAB:
+		slab_free(hdr);
+		break;
+	case MP_HEAP:
+		heap_account(0);
+		free(hdr);
+		break;
+	case MP_HEAP_ALIGNED:
+		heap_account(0);
+		free((char *) p - hdr->offset);
+		break;
+	default:
+		log_err("BUG: bad free %p, type %u\n", p, hdr->type);
+		break;
+	}
+}
+
+void mp_get_stats(struct mp_stats *st)
+{
+	struct ebuf_pool *pool = &ebuf_pool;
+	struct ebuf_magazine *mag;
+	int i;
+
+	memset(st, 0, sizeof(*st));
+
+	for (i = 0; i < MP_NR_CLASSES; i++) {
+		pthread_mutex_lock(&mp_classes[i].lock);
+		st->classes[i] = mp_classes[i].stats;
+		pthread_mutex_unlock(&mp_classes[i].lock);
+	}
+
+	pthread_mutex_lock(&heap_lock);
+	st->heap_alloc = heap_alloc_cnt;
+	st->heap_in_use = heap_in_use;
+	pthread_mutex_unlock(&heap_lock);
+
+	pthread_mutex_lock(&pool->lock);
+	st->ebuf_size = pool->size;
+	st->ebuf_total = pool->total;
+	st->ebuf_depot = pool->depot_nr;
+	st->ebuf_arenas = pool->nr_arenas;
+	st->ebuf_backing = pool->backing;
+	for (i = 0; i < pool->nr_arenas; i++) {
+		if (MP_BACKING_THP == pool->arenas[i].backing)
+			st->ebuf_thp_arenas++;
+		else if (MP_BACKING_HUGETLB == pool->arenas[i].backing)
+			st->ebuf_hugetlb_arenas++;
+	}
+	st->ebuf_mag_miss = pool->miss;
+	st->ebuf_mag_hit = pool->retired_hit;
+	list_for_each_entry(mag, &pool->mags, list) {
+		if (mag->gen != pool->gen)
+			continue;
+		st->ebuf_cached += __atomic_load_n(&mag->nr, __ATOMIC_RELAXED);
+		st->ebuf_mag_hit += __atomic_load_n(&mag->hit, __ATOMIC_RELAXED);
+	}
+	st->ebuf_in_use = pool->total - pool->depot_nr - st->ebuf_cached;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static const char *mp_backing_names[] = {
+	[MP_BACKING_PAGE] = "none",
+	[MP_BACKING_THP] = "thp",
+	[MP_BACKING_HUGETLB] = "hugetlb",
+};
+
+const char *mp_backing_name(int backing)
+{
+	if (backing < 0 || backing > MP_BACKING_HUGETLB)
+		return "unknown";
+
+	return mp_backing_names[backing];
+}
+
+int mp_parse_backing(const char *name)
+{
+	int i;
+
+	for (i = 0; i <= MP_BACKING_HUGETLB; i++) {
+		if (0 == strcmp(name, mp_backing_names[i]))
+			return i;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * copy @bytes between @nr_bufs extend buffers of the pool, the access
+ * pattern of vbfs_read_buf/vbfs_write_buf over a big cache.
+ * return MB/s, or a negative errno
+ * */
+double mp_ebuf_memcpy_bench(unsigned int nr_bufs, unsigned long bytes)
+{
+	struct ebuf_pool *pool = &ebuf_pool;
+	struct timespec start, end;
+	unsigned long copied = 0;
+	unsigned int i, n = 0;
+	double secs;
+	void **bufs;
+
+	if (0 == pool->size || nr_bufs < 2)
+		return -EINVAL;
+
+	bufs = Malloc(nr_bufs * sizeof(void *));
+	if (NULL == bufs)
+		return -ENOMEM;
+
+	for (n = 0; n < nr_bufs; n++) {
+		bufs[n] = ebuf_alloc();
+		if (NULL == bufs[n])
+			break;
+		/* fault the pages in before the clock starts */
+		memset(bufs[n], n, pool->size);
+	}
+	if (n < 2) {
+		copied = 0;
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; copied < bytes; i++) {
+		memcpy(bufs[(i + n / 2) % n], bufs[i % n], pool->size);
+		copied += pool->size;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+out:
+	while (n)
+		ebuf_free(bufs[--n]);
+	free(bufs);
+
+	if (0 == copied)
+		return -ENOMEM;
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (secs <= 0)
+		return -EINVAL;
+
+	return copied / secs / (1024 * 1024);
+}
@@ -0,0 +1,75 @@
+#ifndef __MEMPOOL_H__
+#define __MEMPOOL_H__
+
+#include "utils.h"
+#include "log.h"
+
+/*
+ * small objects: 32 .. 2048 bytes, power of two size classes
+ * carved from 64K slabs.
+ *
+ * extend buffers: mp_valloc() of the size given to mempool_init()
+ * comes from a preallocated, page aligned pool fronted by per-thread
+ * magazines, so the io path does not take any lock in the common case.
+ * */
+#define MP_NR_CLASSES 7
+#define MP_MAG_SIZE 8
+
+#define MP_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * backing of the extend buffer arenas, MP_BACKING_HUGETLB falls back
+ * to MP_BACKING_THP and then to normal pages when the kernel has no
+ * huge page to give
+ * */
+enum {
+	MP_BACKING_PAGE,
+	MP_BACKING_THP,
+	MP_BACKING_HUGETLB,
+};
+
+struct mp_class_stats {
+	unsigned int obj_size;
+	unsigned long nr_slabs;
+	unsigned long nr_alloc;
+	unsigned long nr_free;
+	unsigned long in_use;
+	unsigned long peak;
+};
+
+struct mp_stats {
+	struct mp_class_stats classes[MP_NR_CLASSES];
+
+	/* requests bigger than the largest class */
+	unsigned long heap_alloc;
+	unsigned long heap_in_use;
+
+	unsigned int ebuf_size;
+	unsigned long ebuf_total;
+	unsigned long ebuf_in_use;
+	unsigned long ebuf_depot;
+	unsigned long ebuf_cached; /* held by thread magazines */
+	unsigned long ebuf_arenas;
+	unsigned long ebuf_thp_arenas;
+	unsigned long ebuf_hugetlb_arenas;
+	int ebuf_backing; /* MP_BACKING_* got, after any fall back */
+	unsigned long ebuf_mag_hit;
+	unsigned long ebuf_mag_miss;
+};
+
+void *Valloc(unsigned int size);
+void *Malloc(unsigned int size);
+
+int mempool_init(unsigned int ebuf_size, unsigned int nr_ebufs, int backing);
+void mempool_destroy(void);
+const char *mp_backing_name(int backing);
+int mp_parse_backing(const char *name);
+
+void *mp_malloc(unsigned int size);
+void *mp_valloc(unsigned int size);
+void mp_free(void *p);
+
+void mp_get_stats(struct mp_stats *st);
+double mp_ebuf_memcpy_bench(unsigned int nr_bufs, unsigned long bytes);
+
+#endif
@@ -0,0 +1,667 @@
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "vbfs-fuse.h"
+#include "err.h"
+#include "ring.h"
+#include "log.h"
+#include "stats.h"
+
+#define RING_MAX_CONNS 1024
+
+/*
+ * server side of a ring, lives in the filesystem process
+ * */
+struct ring_srv {
+	uint32_t id;
+	int conn;
+
+	struct vbfs_ring_hdr *hdr;
+	char *data;
+	size_t map_len;
+	uint32_t size; /* hdr->size is the client's to write, not used */
+
+	vbfs_file_t *file;
+	uint64_t pending_since; /* first time seen non empty, 0 when empty */
+	uint64_t full_seen;
+
+	pthread_mutex_t lock; /* serializes draining */
+	struct list_head list;
+};
+
+static struct {
+	int running;
+	int stop;
+	vbfs_t *fs;
+	char sock_path[108];
+
+	int listen_fd;
+	pthread_t ctl_thread;
+	pthread_t drain_thread;
+
+	pthread_mutex_t lock; /* protects rings and next_id */
+	struct list_head rings;
+	uint32_t next_id;
+} ring_ctx = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.listen_fd = -1,
+};
+
+static int ring_size_valid(uint32_t size)
+{
+	if (size < VBFS_RING_MIN_SIZE || size > VBFS_RING_MAX_SIZE)
+		return 0;
+
+	return 0 == (size & (size - 1));
+}
+
+/* append whatever is in the ring, @all: also a partial batch */
+static int __ring_drain(struct ring_srv *r, int all)
+{
+	struct vbfs_ring_hdr *hdr = r->hdr;
+	uint64_t head, tail, used, full, start;
+	uint32_t off, len;
+	ssize_t ret;
+
+	if (hdr->error)
+		return hdr->error;
+
+	head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	tail = hdr->tail;
+	used = head - tail;
+	if (used > r->size) {
+		log_err("ring %u corrupted, head %lu, tail %lu\n", r->id, head, tail);
+		__atomic_store_n(&hdr->error, -EIO, __ATOMIC_RELEASE);
+		return -EIO;
+	}
+
+	full = __atomic_load_n(&hdr->full, __ATOMIC_RELAXED);
+	if (full != r->full_seen) {
+		stats_add(CNT_RING_FULL, full - r->full_seen);
+		r->full_seen = full;
+	}
+
+	if (0 == used) {
+		r->pending_since = 0;
+		return 0;
+	}
+
+	start = stats_now();
+	if (! r->pending_since)
+		r->pending_since = start;
+
+	if (! all && used < VBFS_RING_BATCH && used < r->size / 2 &&
+	    start - r->pending_since < VBFS_RING_FLUSH_MS * 1000000ULL)
+		return 0;
+
+	while (tail != head) {
+		off = tail & (r->size - 1);
+		len = r->size - off;
+		if (len > head - tail)
+			len = head - tail;
+
+		ret = vbfs_append(r->file, r->data + off, len);
+		if (ret <= 0) {
+			ret = ret ? ret : -EIO;
+			log_err("ring %u append error, %s\n", r->id, strerror(-ret));
+			__atomic_store_n(&hdr->error, (int32_t) ret, __ATOMIC_RELEASE);
+			return ret;
+		}
+
+		tail += ret;
+		__atomic_store_n(&hdr->tail, tail, __ATOMIC_RELEASE);
+		stats_add(CNT_RING_BYTES, ret);
+	}
+
+	stats_record(STAT_RING_DRAIN, start);
+	r->pending_since = 0;
+
+	return 0;
+}
+
+static int ring_drain(struct ring_srv *r, int all)
+{
+	int ret;
+
+	pthread_mutex_lock(&r->lock);
+	ret = __ring_drain(r, all);
+	pthread_mutex_unlock(&r->lock);
+
+	return ret;
+}
+
+static void *ring_drain_thread(void *args)
+{
+	struct ring_srv *r;
+
+	while (! __atomic_load_n(&ring_ctx.stop, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&ring_ctx.lock);
+		list_for_each_entry(r, &ring_ctx.rings, list)
+			ring_drain(r, 0);
+		pthread_mutex_unlock(&ring_ctx.lock);
+
+		usleep(VBFS_RING_POLL_MS * 1000);
+	}
+
+	return NULL;
+}
+
+static struct ring_srv *ring_create(int conn, struct vbfs_ring_msg *msg, int *memfd)
+{
+	struct ring_srv *r;
+	int fd, ret, flags;
+
+	if (0 == msg->size)
+		msg->size = VBFS_RING_DEF_SIZE;
+	if (! ring_size_valid(msg->size))
+		return ERR_PTR(-EINVAL);
+	msg->path[VBFS_RING_PATH_MAX - 1] = '\0';
+
+	r = calloc(1, sizeof(struct ring_srv));
+	if (NULL == r)
+		return ERR_PTR(-ENOMEM);
+
+	flags = O_WRONLY | O_CREAT | (msg->flags & (O_TRUNC | O_EXCL));
+	ret = vbfs_open(ring_ctx.fs, msg->path, flags, &r->file);
+	if (ret)
+		goto err;
+
+	fd = memfd_create("vbfs-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		ret = -errno;
+		goto err_file;
+	}
+
+	/* sealed, a client resizing it would fault the drain thread */
+	r->map_len = VBFS_RING_HDR_SIZE + msg->size;
+	if (ftruncate(fd, r->map_len) < 0 || fcntl(fd, F_ADD_SEALS,
+			F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+		ret = -errno;
+		goto err_fd;
+	}
+
+	r->hdr = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == r->hdr) {
+		ret = -errno;
+		goto err_fd;
+	}
+	r->data = (char *) r->hdr + VBFS_RING_HDR_SIZE;
+	r->hdr->magic = VBFS_RING_MAGIC;
+	r->hdr->size = r->size = msg->size;
+
+	r->conn = conn;
+	pthread_mutex_init(&r->lock, NULL);
+
+	pthread_mutex_lock(&ring_ctx.lock);
+	r->id = ++ring_ctx.next_id;
+	list_add_tail(&r->list, &ring_ctx.rings);
+	pthread_mutex_unlock(&ring_ctx.lock);
+
+	*memfd = fd;
+
+	return r;
+
+err_fd:
+	close(fd);
+err_file:
+	vbfs_close(r->file);
+err:
+	free(r);
+	return ERR_PTR(ret);
+}
+
+/* unlink from the list first, then drain what is left and close */
+static int ring_destroy(struct ring_srv *r)
+{
+	int ret;
+
+	pthread_mutex_lock(&ring_ctx.lock);
+	list_del(&r->list);
+	pthread_mutex_unlock(&ring_ctx.lock);
+
+	ret = ring_drain(r, 1);
+	vbfs_close(r->file);
+
+	munmap(r->hdr, r->map_len);
+	pthread_mutex_destroy(&r->lock);
+	free(r);
+
+	return ret;
+}
+
+static struct ring_srv *ring_lookup(int conn, uint32_t id)
+{
+	struct ring_srv *r;
+
+	pthread_mutex_lock(&ring_ctx.lock);
+	list_for_each_entry(r, &ring_ctx.rings, list) {
+		if (r->id == id && r->conn == conn) {
+			pthread_mutex_unlock(&ring_ctx.lock);
+			return r;
+		}
+	}
+	pthread_mutex_unlock(&ring_ctx.lock);
+
+	return NULL;
+}
+
+static int send_reply(int conn, struct vbfs_ring_msg *msg, int memfd)
+{
+	struct msghdr mh;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+	struct cmsghdr *cmsg;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = msg;
+	iov.iov_len = sizeof(*msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if (memfd >= 0) {
+		mh.msg_control = cbuf.buf;
+		mh.msg_controllen = sizeof(cbuf.buf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+	}
+
+	if (sendmsg(conn, &mh, MSG_NOSIGNAL) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void ring_handle_msg(int conn, struct vbfs_ring_msg *msg)
+{
+	struct ring_srv *r;
+	int memfd = -1;
+
+	switch (msg->op) {
+	case VBFS_RING_OPEN:
+		r = ring_create(conn, msg, &memfd);
+		if (IS_ERR(r)) {
+			msg->status = PTR_ERR(r);
+			break;
+		}
+		msg->id = r->id;
+		msg->status = 0;
+		break;
+	case VBFS_RING_FSYNC:
+		r = ring_lookup(conn, msg->id);
+		if (NULL == r) {
+			msg->status = -EBADF;
+			break;
+		}
+		msg->status = ring_drain(r, 1);
+		if (0 == msg->status)
+			msg->status = vbfs_fsync(r->file);
+		break;
+	case VBFS_RING_CLOSE:
+		r = ring_lookup(conn, msg->id);
+		if (NULL == r) {
+			msg->status = -EBADF;
+			break;
+		}
+		msg->status = ring_destroy(r);
+		break;
+	default:
+		msg->status = -EINVAL;
+	}
+
+	send_reply(conn, msg, memfd);
+	if (memfd >= 0)
+		close(memfd);
+}
+
+/* a recorder went away, what it appended is still written */
+static void ring_conn_close(int conn)
+{
+	struct ring_srv *r;
+
+	while (1) {
+		pthread_mutex_lock(&ring_ctx.lock);
+		r = NULL;
+		list_for_each_entry(r, &ring_ctx.rings, list) {
+			if (r->conn == conn)
+				break;
+		}
+		if (&r->list == &ring_ctx.rings)
+			r = NULL;
+		pthread_mutex_unlock(&ring_ctx.lock);
+
+		if (NULL == r)
+			break;
+		ring_destroy(r);
+	}
+
+	close(conn);
+}
+
+static void *ring_ctl_thread(void *args)
+{
+	struct pollfd *pfds;
+	struct vbfs_ring_msg msg;
+	int nr = 1, i, fd;
+	ssize_t len;
+
+	pfds = calloc(RING_MAX_CONNS + 1, sizeof(struct pollfd));
+	if (NULL == pfds) {
+		log_err("ring control thread, no memory\n");
+		return NULL;
+	}
+	pfds[0].fd = ring_ctx.listen_fd;
+	pfds[0].events = POLLIN;
+
+	while (! __atomic_load_n(&ring_ctx.stop, __ATOMIC_ACQUIRE)) {
+		if (poll(pfds, nr, 100) <= 0)
+			continue;
+
+		for (i = nr - 1; i > 0; i--) {
+			if (! pfds[i].revents)
+				continue;
+
+			len = recv(pfds[i].fd, &msg, sizeof(msg), 0);
+			if (len == sizeof(msg)) {
+				ring_handle_msg(pfds[i].fd, &msg);
+				continue;
+			}
+			if (len < 0 && EINTR == errno)
+				continue;
+
+			ring_conn_close(pfds[i].fd);
+			pfds[i] = pfds[--nr];
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			fd = accept4(ring_ctx.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd < 0)
+				continue;
+			if (nr > RING_MAX_CONNS) {
+				log_warning("too many ring connections\n");
+				close(fd);
+				continue;
+			}
+			pfds[nr].fd = fd;
+			pfds[nr].events = POLLIN;
+			pfds[nr].revents = 0;
+			nr++;
+		}
+	}
+
+	for (i = 1; i < nr; i++)
+		ring_conn_close(pfds[i].fd);
+	free(pfds);
+
+	return NULL;
+}
+
+int vbfs_ring_serve(vbfs_t *fs, const char *sock_path)
+{
+	struct sockaddr_un addr;
+	int fd, ret;
+
+	if (super_check(fs))
+		return -EBADF;
+	if (ring_ctx.running)
+		return -EBUSY;
+
+	if (strlen(sock_path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sock_path);
+	unlink(sock_path);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    listen(fd, 64) < 0) {
+		ret = -errno;
+		log_err("ring socket %s, %s\n", sock_path, strerror(errno));
+		close(fd);
+		return ret;
+	}
+
+	ring_ctx.fs = fs;
+	ring_ctx.listen_fd = fd;
+	ring_ctx.stop = 0;
+	strcpy(ring_ctx.sock_path, sock_path);
+	INIT_LIST_HEAD(&ring_ctx.rings);
+
+	ret = pthread_create(&ring_ctx.drain_thread, NULL, ring_drain_thread, NULL);
+	if (ret)
+		goto err;
+
+	ret = pthread_create(&ring_ctx.ctl_thread, NULL, ring_ctl_thread, NULL);
+	if (ret) {
+		__atomic_store_n(&ring_ctx.stop, 1, __ATOMIC_RELEASE);
+		pthread_join(ring_ctx.drain_thread, NULL);
+		goto err;
+	}
+
+	ring_ctx.running = 1;
+
+	return 0;
+
+err:
+	close(fd);
+	unlink(sock_path);
+	ring_ctx.listen_fd = -1;
+	return -ret;
+}
+
+void vbfs_ring_serve_stop(vbfs_t *fs)
+{
+	if (! ring_ctx.running)
+		return;
+
+	/* the control thread closes every connection and its rings */
+	__atomic_store_n(&ring_ctx.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(ring_ctx.ctl_thread, NULL);
+	pthread_join(ring_ctx.drain_thread, NULL);
+
+	close(ring_ctx.listen_fd);
+	unlink(ring_ctx.sock_path);
+	ring_ctx.listen_fd = -1;
+	ring_ctx.running = 0;
+}
+
+/*
+ * client side, lives in the recorder process
+ * */
+struct vbfs_ring {
+	int conn;
+	uint32_t id;
+
+	struct vbfs_ring_hdr *hdr;
+	char *data;
+	size_t map_len;
+	uint64_t head; /* private copy, only we move it */
+};
+
+int vbfs_ring_connect(const char *sock_path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(sock_path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sock_path);
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	return fd;
+}
+
+/* send @msg and wait for the reply, the ring memfd comes with OPEN */
+static int ring_call(int conn, struct vbfs_ring_msg *msg, int *memfd)
+{
+	struct msghdr mh;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+	struct cmsghdr *cmsg;
+	ssize_t len;
+
+	if (send(conn, msg, sizeof(*msg), MSG_NOSIGNAL) < 0)
+		return -errno;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = msg;
+	iov.iov_len = sizeof(*msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf.buf;
+	mh.msg_controllen = sizeof(cbuf.buf);
+
+	do {
+		len = recvmsg(conn, &mh, MSG_CMSG_CLOEXEC);
+	} while (len < 0 && EINTR == errno);
+	if (len < 0)
+		return -errno;
+	if (len != sizeof(*msg))
+		return -EPROTO;
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (cmsg && SCM_RIGHTS == cmsg->cmsg_type) {
+		if (memfd)
+			memcpy(memfd, CMSG_DATA(cmsg), sizeof(int));
+		else
+			close(*(int *) CMSG_DATA(cmsg));
+	}
+
+	return msg->status;
+}
+
+int vbfs_ring_open(int conn, const char *path, int flags, unsigned int size,
+			vbfs_ring_t **rp)
+{
+	struct vbfs_ring_msg msg;
+	vbfs_ring_t *r;
+	int ret, memfd = -1;
+
+	if (strlen(path) >= VBFS_RING_PATH_MAX)
+		return -ENAMETOOLONG;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = VBFS_RING_OPEN;
+	msg.size = size;
+	msg.flags = flags;
+	strcpy(msg.path, path);
+
+	ret = ring_call(conn, &msg, &memfd);
+	if (ret)
+		return ret;
+	if (memfd < 0)
+		return -EPROTO;
+
+	r = calloc(1, sizeof(vbfs_ring_t));
+	if (NULL == r) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	r->map_len = VBFS_RING_HDR_SIZE + msg.size;
+	r->hdr = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (MAP_FAILED == r->hdr) {
+		ret = -errno;
+		free(r);
+		goto err;
+	}
+	close(memfd);
+
+	r->data = (char *) r->hdr + VBFS_RING_HDR_SIZE;
+	r->conn = conn;
+	r->id = msg.id;
+	r->head = r->hdr->head;
+	*rp = r;
+
+	return 0;
+
+err:
+	close(memfd);
+	msg.op = VBFS_RING_CLOSE;
+	ring_call(conn, &msg, NULL);
+	return ret;
+}
+
+ssize_t vbfs_ring_append(vbfs_ring_t *r, const void *buf, size_t len)
+{
+	struct vbfs_ring_hdr *hdr = r->hdr;
+	uint64_t tail;
+	uint32_t off, first;
+	int32_t error;
+
+	error = __atomic_load_n(&hdr->error, __ATOMIC_ACQUIRE);
+	if (error)
+		return error;
+
+	tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+	if (len > hdr->size - (r->head - tail)) {
+		__atomic_store_n(&hdr->full, hdr->full + 1, __ATOMIC_RELAXED);
+		return -EAGAIN;
+	}
+
+	off = r->head & (hdr->size - 1);
+	first = hdr->size - off;
+	if (first > len)
+		first = len;
+	memcpy(r->data + off, buf, first);
+	memcpy(r->data, (const char *) buf + first, len - first);
+
+	r->head += len;
+	__atomic_store_n(&hdr->head, r->head, __ATOMIC_RELEASE);
+
+	return len;
+}
+
+int vbfs_ring_fsync(vbfs_ring_t *r)
+{
+	struct vbfs_ring_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = VBFS_RING_FSYNC;
+	msg.id = r->id;
+
+	return ring_call(r->conn, &msg, NULL);
+}
+
+int vbfs_ring_close(vbfs_ring_t *r)
+{
+	struct vbfs_ring_msg msg;
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = VBFS_RING_CLOSE;
+	msg.id = r->id;
+
+	ret = ring_call(r->conn, &msg, NULL);
+
+	munmap(r->hdr, r->map_len);
+	free(r);
+
+	return ret;
+}
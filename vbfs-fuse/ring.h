@@ -0,0 +1,59 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdint.h>
+
+/*
+ * shared memory append ring, one recorder stream per ring.
+ *
+ * the recorder is the only producer and moves head, the drain thread
+ * of the filesystem is the only consumer and moves tail, so an append
+ * is a memcpy and a release store. the control socket only carries
+ * open, fsync and close, the ring memory is passed back as a memfd.
+ *
+ * 	|vbfs_ring_hdr (4K)|data (size bytes)|
+ * */
+#define VBFS_RING_MAGIC 0x56425247 /* VBRG */
+#define VBFS_RING_HDR_SIZE 4096
+
+#define VBFS_RING_MIN_SIZE (64 * 1024)
+#define VBFS_RING_MAX_SIZE (64 * 1024 * 1024)
+#define VBFS_RING_DEF_SIZE (1024 * 1024)
+
+/* drain a ring once it holds a batch or its oldest byte is this old */
+#define VBFS_RING_BATCH (256 * 1024)
+#define VBFS_RING_FLUSH_MS 50
+#define VBFS_RING_POLL_MS 2
+
+#define VBFS_RING_PATH_MAX 256
+
+struct vbfs_ring_hdr {
+	uint32_t magic;
+	uint32_t size; /* power of two */
+
+	/* written by the producer */
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t full; /* appends refused for lack of room */
+
+	/* written by the consumer */
+	uint64_t tail __attribute__((aligned(64)));
+	int32_t error; /* negative errno, the ring stops accepting data */
+};
+
+enum {
+	VBFS_RING_OPEN = 1,
+	VBFS_RING_FSYNC,
+	VBFS_RING_CLOSE,
+};
+
+/* request and reply on the control socket */
+struct vbfs_ring_msg {
+	uint32_t op;
+	int32_t status;
+	uint32_t id;
+	uint32_t size;
+	int32_t flags;
+	char path[VBFS_RING_PATH_MAX];
+};
+
+#endif
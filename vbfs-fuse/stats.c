@@ -0,0 +1,467 @@
+#include <stdarg.h>
+
+#include "stats.h"
+#include "mempool.h"
+#include "iosched.h"
+#include "bandwidth.h"
+#include "log.h"
+
+/*
+ * everything is updated with relaxed atomics from the io path,
+ * a reader gets a snapshot that is only approximately consistent
+ * */
+static struct stats_hist hists[STAT_NR_HIST];
+static unsigned long counters[CNT_NR];
+
+static const char *hist_names[STAT_NR_HIST] = {
+	[STAT_GETATTR] = "getattr",
+	[STAT_FGETATTR] = "fgetattr",
+	[STAT_ACCESS] = "access",
+	[STAT_OPENDIR] = "opendir",
+	[STAT_READDIR] = "readdir",
+	[STAT_RELEASEDIR] = "releasedir",
+	[STAT_MKDIR] = "mkdir",
+	[STAT_RMDIR] = "rmdir",
+	[STAT_UNLINK] = "unlink",
+	[STAT_RENAME] = "rename",
+	[STAT_TRUNCATE] = "truncate",
+	[STAT_FTRUNCATE] = "ftruncate",
+	[STAT_CREATE] = "create",
+	[STAT_OPEN] = "open",
+	[STAT_READ] = "read",
+	[STAT_WRITE] = "write",
+	[STAT_STATFS] = "statfs",
+	[STAT_FLUSH] = "flush",
+	[STAT_RELEASE] = "release",
+	[STAT_FSYNC] = "fsync",
+	[STAT_FALLOCATE] = "fallocate",
+	[STAT_EXTEND_GET] = "extend_get",
+	[STAT_ALLOC] = "extend_alloc",
+	[STAT_FREE] = "extend_free",
+	[STAT_IO_QUEUE] = "io_queue",
+	[STAT_IO_READ] = "io_read",
+	[STAT_IO_WRITE] = "io_write",
+	[STAT_IO_META] = "io_meta",
+	[STAT_IO_RECORD] = "io_record",
+	[STAT_IO_PLAYBACK] = "io_playback",
+	[STAT_IO_BG] = "io_background",
+	[STAT_RING_DRAIN] = "ring_drain",
+};
+
+static const char *cnt_names[CNT_NR] = {
+	[CNT_ECACHE_HIT] = "extend_cache_hit",
+	[CNT_ECACHE_MISS] = "extend_cache_miss",
+	[CNT_ECACHE_EVICT] = "extend_cache_evict",
+	[CNT_ECACHE_WAIT] = "extend_cache_wait",
+	[CNT_READ_BYTES] = "read_bytes",
+	[CNT_WRITE_BYTES] = "write_bytes",
+	[CNT_IO_ERROR] = "io_error",
+	[CNT_RING_BYTES] = "ring_bytes",
+	[CNT_RING_FULL] = "ring_full",
+	[CNT_WC_BYTES] = "wc_bytes",
+	[CNT_WC_FLUSH] = "wc_flush",
+	[CNT_WC_SPILL] = "wc_spill",
+	[CNT_RECYCLE_FILES] = "recycle_files",
+	[CNT_RECYCLE_EXTENDS] = "recycle_extends",
+	[CNT_BW_REFUSED] = "bw_open_refused",
+	[CNT_BW_READ_WAIT] = "bw_read_wait",
+	[CNT_TAIL_WAKE] = "tail_wakeup",
+};
+
+static int value_to_bucket(uint64_t v)
+{
+	int msb, shift;
+
+	if (v < STATS_SUB_COUNT)
+		return v;
+
+	msb = 63 - __builtin_clzll(v);
+	if (msb >= STATS_MAX_BITS)
+		return STATS_NR_BUCKETS - 1;
+
+	shift = msb - STATS_SUB_BITS;
+
+	return (shift + 1) * STATS_SUB_COUNT + (v >> shift) - STATS_SUB_COUNT;
+}
+
+/* middle of the bucket */
+static uint64_t bucket_to_value(int idx)
+{
+	int shift;
+
+	if (idx < STATS_SUB_COUNT)
+		return idx;
+
+	shift = idx / STATS_SUB_COUNT - 1;
+
+	return ((uint64_t) (STATS_SUB_COUNT + idx % STATS_SUB_COUNT) << shift)
+		+ ((1ULL << shift) >> 1);
+}
+
+void stats_record(int id, uint64_t start)
+{
+	struct stats_hist *h = &hists[id];
+	uint64_t d = stats_now() - start;
+	unsigned long max;
+
+	__atomic_add_fetch(&h->buckets[value_to_bucket(d)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum, d, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while (d > max) {
+		if (__atomic_compare_exchange_n(&h->max, &max, d, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+}
+
+void stats_add(int id, unsigned long n)
+{
+	__atomic_add_fetch(&counters[id], n, __ATOMIC_RELAXED);
+}
+
+static uint64_t hist_percentile(struct stats_hist *h, double q)
+{
+	unsigned long target, seen = 0;
+	uint64_t v;
+	int i;
+
+	if (0 == h->count)
+		return 0;
+
+	target = (unsigned long) (h->count * q);
+	if (target == 0)
+		target = 1;
+
+	for (i = 0; i < STATS_NR_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target) {
+			v = bucket_to_value(i);
+			return v < h->max ? v : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+/*
+ * snapshot formatting begin
+ * */
+struct stats_snap {
+	struct stats_hist hists[STAT_NR_HIST];
+	unsigned long counters[CNT_NR];
+	struct mp_stats mp;
+	struct iosched_class_stats io[IO_CLASS_NR];
+	struct bw_stats bw;
+};
+
+struct stats_file {
+	size_t len;
+	char data[0];
+};
+
+struct sbuf {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static void sb_printf(struct sbuf *sb, const char *fmt, ...)
+{
+	va_list ap;
+	size_t room;
+	int n;
+
+	room = sb->len < sb->size ? sb->size - sb->len : 0;
+
+	va_start(ap, fmt);
+	n = vsnprintf(room ? sb->buf + sb->len : NULL, room, fmt, ap);
+	va_end(ap);
+
+	if (n > 0)
+		sb->len += n;
+}
+
+static void take_snapshot(struct stats_snap *snap)
+{
+	int i, j;
+
+	for (i = 0; i < STAT_NR_HIST; i++) {
+		snap->hists[i].count = __atomic_load_n(&hists[i].count, __ATOMIC_RELAXED);
+		snap->hists[i].sum = __atomic_load_n(&hists[i].sum, __ATOMIC_RELAXED);
+		snap->hists[i].max = __atomic_load_n(&hists[i].max, __ATOMIC_RELAXED);
+		for (j = 0; j < STATS_NR_BUCKETS; j++)
+			snap->hists[i].buckets[j] = __atomic_load_n(
+				&hists[i].buckets[j], __ATOMIC_RELAXED);
+	}
+
+	for (i = 0; i < CNT_NR; i++)
+		snap->counters[i] = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+
+	mp_get_stats(&snap->mp);
+	iosched_get_stats(snap->io);
+	bw_get_stats(&snap->bw);
+}
+
+static double ns_to_us(uint64_t ns)
+{
+	return ns / 1000.0;
+}
+
+static void format_text(struct sbuf *sb, struct stats_snap *snap)
+{
+	struct stats_hist *h;
+	struct bw_stream_stats *s;
+	int i;
+
+	sb_printf(sb, "%-14s %10s %10s %10s %10s %10s %10s\n", "op", "count",
+		"avg_us", "p50_us", "p99_us", "p999_us", "max_us");
+
+	for (i = 0; i < STAT_NR_HIST; i++) {
+		h = &snap->hists[i];
+		sb_printf(sb, "%-14s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			hist_names[i], h->count,
+			h->count ? ns_to_us(h->sum / h->count) : 0.0,
+			ns_to_us(hist_percentile(h, 0.5)),
+			ns_to_us(hist_percentile(h, 0.99)),
+			ns_to_us(hist_percentile(h, 0.999)),
+			ns_to_us(h->max));
+	}
+
+	sb_printf(sb, "\n");
+	for (i = 0; i < CNT_NR; i++)
+		sb_printf(sb, "%-20s %lu\n", cnt_names[i], snap->counters[i]);
+
+	sb_printf(sb, "%-20s %lu\n", "ebuf_total", snap->mp.ebuf_total);
+	sb_printf(sb, "%-20s %lu\n", "ebuf_in_use", snap->mp.ebuf_in_use);
+	sb_printf(sb, "%-20s %lu\n", "ebuf_mag_hit", snap->mp.ebuf_mag_hit);
+	sb_printf(sb, "%-20s %lu\n", "ebuf_mag_miss", snap->mp.ebuf_mag_miss);
+	sb_printf(sb, "%-20s %lu\n", "heap_in_use", snap->mp.heap_in_use);
+
+	sb_printf(sb, "\n%-14s %10s %10s %10s %10s %10s %10s\n", "io_class",
+		"deadline", "weight", "depth", "max_depth", "dispatched", "late");
+	for (i = 0; i < IO_CLASS_NR; i++)
+		sb_printf(sb, "%-14s %10u %10u %10lu %10lu %10lu %10lu\n",
+			iosched_class_name(i), snap->io[i].deadline_ms,
+			snap->io[i].weight, snap->io[i].depth, snap->io[i].max_depth,
+			snap->io[i].dispatched, snap->io[i].late);
+
+	sb_printf(sb, "\n%-20s %lu\n", "bw_read_kbps",
+		(unsigned long) (snap->bw.read_bps / 1024));
+	sb_printf(sb, "%-20s %lu\n", "bw_write_kbps",
+		(unsigned long) (snap->bw.write_bps / 1024));
+	sb_printf(sb, "%-20s %lu\n", "bw_committed_kbps",
+		(unsigned long) (snap->bw.committed_bps / 1024));
+	sb_printf(sb, "%-20s %lu\n", "bw_budget_kbps",
+		(unsigned long) (snap->bw.write_budget_bps / 1024));
+
+	sb_printf(sb, "\n%-6s %10s %8s %8s %12s %12s\n", "stream", "ino",
+		"handles", "writers", "read_kbps", "write_kbps");
+	for (i = 0; i < snap->bw.nr_streams; i++) {
+		s = &snap->bw.streams[i];
+		sb_printf(sb, "%-6s %10u %8d %8d %12lu %12lu\n",
+			s->is_dir ? "dir" : "file", s->ino, s->handles, s->writers,
+			(unsigned long) (s->read_bps / 1024),
+			(unsigned long) (s->write_bps / 1024));
+	}
+}
+
+static void format_json(struct sbuf *sb, struct stats_snap *snap)
+{
+	struct stats_hist *h;
+	struct bw_stream_stats *s;
+	int i;
+
+	sb_printf(sb, "{\n  \"ops\": {\n");
+	for (i = 0; i < STAT_NR_HIST; i++) {
+		h = &snap->hists[i];
+		sb_printf(sb, "    \"%s\": {\"count\": %lu, \"avg_us\": %.1f, "
+			"\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+			"\"max_us\": %.1f}%s\n",
+			hist_names[i], h->count,
+			h->count ? ns_to_us(h->sum / h->count) : 0.0,
+			ns_to_us(hist_percentile(h, 0.5)),
+			ns_to_us(hist_percentile(h, 0.99)),
+			ns_to_us(hist_percentile(h, 0.999)),
+			ns_to_us(h->max),
+			i == STAT_NR_HIST - 1 ? "" : ",");
+	}
+
+	sb_printf(sb, "  },\n  \"counters\": {\n");
+	for (i = 0; i < CNT_NR; i++)
+		sb_printf(sb, "    \"%s\": %lu,\n", cnt_names[i], snap->counters[i]);
+
+	sb_printf(sb, "    \"ebuf_total\": %lu,\n", snap->mp.ebuf_total);
+	sb_printf(sb, "    \"ebuf_in_use\": %lu,\n", snap->mp.ebuf_in_use);
+	sb_printf(sb, "    \"ebuf_mag_hit\": %lu,\n", snap->mp.ebuf_mag_hit);
+	sb_printf(sb, "    \"ebuf_mag_miss\": %lu,\n", snap->mp.ebuf_mag_miss);
+	sb_printf(sb, "    \"heap_in_use\": %lu\n", snap->mp.heap_in_use);
+
+	sb_printf(sb, "  },\n  \"io_classes\": {\n");
+	for (i = 0; i < IO_CLASS_NR; i++)
+		sb_printf(sb, "    \"%s\": {\"deadline_ms\": %u, \"weight\": %u, "
+			"\"depth\": %lu, \"max_depth\": %lu, \"dispatched\": %lu, "
+			"\"late\": %lu}%s\n",
+			iosched_class_name(i), snap->io[i].deadline_ms,
+			snap->io[i].weight, snap->io[i].depth, snap->io[i].max_depth,
+			snap->io[i].dispatched, snap->io[i].late,
+			i == IO_CLASS_NR - 1 ? "" : ",");
+
+	sb_printf(sb, "  },\n  \"bandwidth\": {\"read_kbps\": %lu, "
+		"\"write_kbps\": %lu, \"committed_kbps\": %lu, "
+		"\"budget_kbps\": %lu, \"streams\": [\n",
+		(unsigned long) (snap->bw.read_bps / 1024),
+		(unsigned long) (snap->bw.write_bps / 1024),
+		(unsigned long) (snap->bw.committed_bps / 1024),
+		(unsigned long) (snap->bw.write_budget_bps / 1024));
+	for (i = 0; i < snap->bw.nr_streams; i++) {
+		s = &snap->bw.streams[i];
+		sb_printf(sb, "    {\"type\": \"%s\", \"ino\": %u, \"handles\": %d, "
+			"\"writers\": %d, \"read_kbps\": %lu, \"write_kbps\": %lu}%s\n",
+			s->is_dir ? "dir" : "file", s->ino, s->handles, s->writers,
+			(unsigned long) (s->read_bps / 1024),
+			(unsigned long) (s->write_bps / 1024),
+			i == snap->bw.nr_streams - 1 ? "" : ",");
+	}
+	sb_printf(sb, "  ]}\n}\n");
+}
+
+static struct stats_file *stats_snapshot(int json)
+{
+	struct stats_snap *snap;
+	struct stats_file *sf;
+	struct sbuf sb;
+
+	snap = Malloc(sizeof(struct stats_snap));
+	if (NULL == snap)
+		return NULL;
+	take_snapshot(snap);
+
+	/* first pass for the length */
+	memset(&sb, 0, sizeof(sb));
+	if (json)
+		format_json(&sb, snap);
+	else
+		format_text(&sb, snap);
+
+	sf = Malloc(sizeof(struct stats_file) + sb.len + 1);
+	if (NULL == sf) {
+		free(snap);
+		return NULL;
+	}
+
+	sb.buf = sf->data;
+	sb.size = sb.len + 1;
+	sb.len = 0;
+	if (json)
+		format_json(&sb, snap);
+	else
+		format_text(&sb, snap);
+	sf->len = sb.len;
+
+	free(snap);
+
+	return sf;
+}
+
+/*
+ * virtual files begin
+ * */
+static int stats_file_type(const char *path)
+{
+	if (0 == strcmp(path, VBFS_STATS_FILE))
+		return 0;
+	if (0 == strcmp(path, VBFS_STATS_JSON))
+		return 1;
+
+	return -ENOENT;
+}
+
+int stats_getattr(const char *path, struct stat *stbuf)
+{
+	struct stats_file *sf;
+	int json;
+
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+
+	if (0 == strcmp(path, VBFS_STATS_DIR)) {
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+		return 0;
+	}
+
+	json = stats_file_type(path);
+	if (json < 0)
+		return json;
+
+	sf = stats_snapshot(json);
+	if (NULL == sf)
+		return -ENOMEM;
+
+	stbuf->st_mode = S_IFREG | 0444;
+	stbuf->st_nlink = 1;
+	stbuf->st_size = sf->len;
+	free(sf);
+
+	return 0;
+}
+
+/* the content is fixed at open, so a reader sees one snapshot */
+int stats_open(const char *path, int flags, void **fh)
+{
+	struct stats_file *sf;
+	int json;
+
+	json = stats_file_type(path);
+	if (json < 0)
+		return 0 == strcmp(path, VBFS_STATS_DIR) ? -EISDIR : json;
+
+	if ((flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	sf = stats_snapshot(json);
+	if (NULL == sf)
+		return -ENOMEM;
+
+	*fh = sf;
+
+	return 0;
+}
+
+int stats_read(void *fh, char *buf, size_t size, off_t offset)
+{
+	struct stats_file *sf = fh;
+
+	if (NULL == sf)
+		return -EBADF;
+
+	if (offset >= sf->len)
+		return 0;
+
+	if (size > sf->len - offset)
+		size = sf->len - offset;
+	memcpy(buf, sf->data + offset, size);
+
+	return size;
+}
+
+int stats_release(void *fh)
+{
+	free(fh);
+
+	return 0;
+}
+
+int stats_readdir(void *buf, vbfs_filldir_t filler)
+{
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+	filler(buf, VBFS_STATS_FILE + sizeof(VBFS_STATS_DIR), NULL, 0);
+	filler(buf, VBFS_STATS_JSON + sizeof(VBFS_STATS_DIR), NULL, 0);
+
+	return 0;
+}
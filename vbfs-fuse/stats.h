@@ -0,0 +1,146 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "utils.h"
+#include "libvbfs.h"
+
+/*
+ * latency histograms, log-linear buckets in nanoseconds:
+ * 2^STATS_SUB_BITS buckets per power of two, ~3% precision
+ * up to 2^STATS_MAX_BITS ns (~18 minutes)
+ * */
+#define STATS_SUB_BITS 5
+#define STATS_SUB_COUNT (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 40
+#define STATS_NR_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB_COUNT)
+
+#define VBFS_STATS_DIR "/.vbfs"
+#define VBFS_STATS_FILE VBFS_STATS_DIR "/stats"
+#define VBFS_STATS_JSON VBFS_STATS_DIR "/stats.json"
+
+enum {
+	/* filesystem entry points */
+	STAT_GETATTR,
+	STAT_FGETATTR,
+	STAT_ACCESS,
+	STAT_OPENDIR,
+	STAT_READDIR,
+	STAT_RELEASEDIR,
+	STAT_MKDIR,
+	STAT_RMDIR,
+	STAT_UNLINK,
+	STAT_RENAME,
+	STAT_TRUNCATE,
+	STAT_FTRUNCATE,
+	STAT_CREATE,
+	STAT_OPEN,
+	STAT_READ,
+	STAT_WRITE,
+	STAT_STATFS,
+	STAT_FLUSH,
+	STAT_RELEASE,
+	STAT_FSYNC,
+	STAT_FALLOCATE,
+
+	/* extend cache lookup, disk read included on a miss */
+	STAT_EXTEND_GET,
+
+	/* extend allocator */
+	STAT_ALLOC,
+	STAT_FREE,
+
+	/* ioengine: waiting in the queue, then on the disk */
+	STAT_IO_QUEUE,
+	STAT_IO_READ,
+	STAT_IO_WRITE,
+
+	/* submit to done, per io class */
+	STAT_IO_META,
+	STAT_IO_RECORD,
+	STAT_IO_PLAYBACK,
+	STAT_IO_BG,
+
+	/* one append of a shared memory ring into its file */
+	STAT_RING_DRAIN,
+
+	STAT_NR_HIST,
+};
+
+enum {
+	CNT_ECACHE_HIT,
+	CNT_ECACHE_MISS,
+	CNT_ECACHE_EVICT,
+	CNT_ECACHE_WAIT,
+	CNT_READ_BYTES,
+	CNT_WRITE_BYTES,
+	CNT_IO_ERROR,
+	CNT_RING_BYTES,
+	CNT_RING_FULL,
+	CNT_WC_BYTES,
+	CNT_WC_FLUSH,
+	CNT_WC_SPILL,
+	CNT_RECYCLE_FILES,
+	CNT_RECYCLE_EXTENDS,
+	CNT_BW_REFUSED,
+	CNT_BW_READ_WAIT,
+	CNT_TAIL_WAKE,
+
+	CNT_NR,
+};
+
+struct stats_hist {
+	unsigned long count;
+	unsigned long sum;
+	unsigned long max;
+	unsigned long buckets[STATS_NR_BUCKETS];
+};
+
+struct stats_timer {
+	int id;
+	uint64_t start;
+};
+
+static inline uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_record(int id, uint64_t start);
+void stats_add(int id, unsigned long n);
+
+static inline void stats_inc(int id)
+{
+	stats_add(id, 1);
+}
+
+static inline void stats_timer_end(struct stats_timer *t)
+{
+	stats_record(t->id, t->start);
+}
+
+/* time the rest of the enclosing scope into histogram @id */
+#define STATS_OP(id) \
+	struct stats_timer __stats_timer \
+		__attribute__((cleanup(stats_timer_end))) = { (id), stats_now() }
+
+static inline int is_stats_path(const char *path)
+{
+	size_t len = sizeof(VBFS_STATS_DIR) - 1;
+
+	if (path[1] != '.' || strncmp(path, VBFS_STATS_DIR, len))
+		return 0;
+
+	return path[len] == '\0' || path[len] == '/';
+}
+
+int stats_getattr(const char *path, struct stat *stbuf);
+int stats_open(const char *path, int flags, void **fh);
+int stats_read(void *fh, char *buf, size_t size, off_t offset);
+int stats_release(void *fh);
+int stats_readdir(void *buf, vbfs_filldir_t filler);
+
+#endif
@@ -4,73 +4,118 @@
 #include "err.h"
 #include "extend.h"
 
-static vbfs_fuse_context_t vbfs_ctx;
+/* the core keeps one mounted filesystem per process */
+static vbfs_fuse_context_t *vbfs_ctx;
 static vbfs_superblock_dk_t *vbfs_superblock_disk;
 
-static int init_vbfs_ctx(int fd)
+static int init_vbfs_ctx(vbfs_fuse_context_t *ctx, int fd)
 {
 	int i;
 
-	memset(&vbfs_ctx, 0, sizeof(vbfs_ctx));
-	vbfs_ctx.fd = fd;
+	ctx->fd = fd;
 
-	vbfs_ctx.active_i.inode_cache = mp_malloc(sizeof(struct hlist_head) << INODE_HASH_BITS);
-	if (NULL == vbfs_ctx.active_i.inode_cache) {
-		fprintf(stderr, "malloc error, %s\n", strerror(errno));
-		return -1;
+	ctx->active_i.inode_cache = mp_malloc(sizeof(struct hlist_head) << INODE_HASH_BITS);
+	if (NULL == ctx->active_i.inode_cache) {
+		log_err("malloc error, %s\n", strerror(errno));
+		return -ENOMEM;
 	}
 	for (i = 0; i < 1 << INODE_HASH_BITS; i++)
-		INIT_HLIST_HEAD(&vbfs_ctx.active_i.inode_cache[i]);
+		INIT_HLIST_HEAD(&ctx->active_i.inode_cache[i]);
 
-	INIT_LIST_HEAD(&vbfs_ctx.active_i.inode_list);
-	pthread_mutex_init(&vbfs_ctx.active_i.lock, NULL);
+	INIT_LIST_HEAD(&ctx->active_i.inode_list);
+	pthread_mutex_init(&ctx->active_i.lock, NULL);
+	pthread_mutex_init(&ctx->super.lock, NULL);
 
 	return 0;
 }
 
+static void free_vbfs_ctx(vbfs_fuse_context_t *ctx)
+{
+	if (ctx->fd >= 0)
+		close(ctx->fd);
+	if (ctx->data_fd >= 0)
+		close(ctx->data_fd);
+	mp_free(ctx->active_i.inode_cache);
+	free(ctx->super.group_free);
+	free(ctx->super.stripe_buf);
+	pthread_mutex_destroy(&ctx->active_i.lock);
+	pthread_mutex_destroy(&ctx->super.lock);
+	free(ctx);
+}
+
 static int load_super(void)
 {
-	vbfs_ctx.super.s_magic = le32_to_cpu(vbfs_superblock_disk->vbfs_super.s_magic);
-	if (vbfs_ctx.super.s_magic != VBFS_SUPER_MAGIC) {
+	vbfs_ctx->super.s_magic = le32_to_cpu(vbfs_superblock_disk->vbfs_super.s_magic);
+	if (vbfs_ctx->super.s_magic != VBFS_SUPER_MAGIC) {
 		fprintf(stderr, "device is not vbfs filesystem\n");
 		return -1;
 	}
 
-	vbfs_ctx.super.s_extend_size =
+	vbfs_ctx->super.s_extend_size =
 		le32_to_cpu(vbfs_superblock_disk->vbfs_super.s_extend_size);
-	vbfs_ctx.super.s_extend_count =
+	vbfs_ctx->super.s_extend_count =
 		le32_to_cpu(vbfs_superblock_disk->vbfs_super.s_extend_count);
-	vbfs_ctx.super.s_file_idx_len =
+	vbfs_ctx->super.s_file_idx_len =
 		le32_to_cpu(vbfs_superblock_disk->vbfs_super.s_file_idx_len);
+	/* bit 31 of a file index entry is EXTEND_UNWRITTEN */
+	if (vbfs_ctx->super.s_extend_count > EXTEND_COUNT_MAX) {
+		fprintf(stderr, "%u extends, at most %u are supported\n",
+			vbfs_ctx->super.s_extend_count, EXTEND_COUNT_MAX);
+		return -1;
+	}
 
-	vbfs_ctx.super.bad_count =
+	vbfs_ctx->super.bad_count =
 		le32_to_cpu(vbfs_superblock_disk->vbfs_super.bad_count);
-	vbfs_ctx.super.bad_extend_count =
+	vbfs_ctx->super.bad_extend_count =
 		le32_to_cpu(vbfs_superblock_disk->vbfs_super.bad_extend_count);
-	vbfs_ctx.super.bad_extend_current =
+	vbfs_ctx->super.bad_extend_current =
 		le32_to_cpu(vbfs_superblock_disk->vbfs_super.bad_extend_current);
-	vbfs_ctx.super.bad_extend_offset =
+	vbfs_ctx->super.bad_extend_offset =
 		le32_to_cpu(vbfs_superblock_disk->vbfs_super.bad_extend_offset);
 
-	vbfs_ctx.super.bitmap_count =
+	vbfs_ctx->super.bitmap_count =
 		le32_to_cpu(vbfs_superblock_disk->vbfs_super.bitmap_count);
-	vbfs_ctx.super.bitmap_current =
+	vbfs_ctx->super.bitmap_current =
 		le32_to_cpu(vbfs_superblock_disk->vbfs_super.bitmap_current);
-	vbfs_ctx.super.bitmap_offset =
+	vbfs_ctx->super.bitmap_offset =
 		le32_to_cpu(vbfs_superblock_disk->vbfs_super.bitmap_offset);
 
-	vbfs_ctx.super.s_ctime =
+	vbfs_ctx->super.s_ctime =
 		le32_to_cpu(vbfs_superblock_disk->vbfs_super.s_ctime);
-	vbfs_ctx.super.s_mount_time =
+	vbfs_ctx->super.s_mount_time =
 		le32_to_cpu(vbfs_superblock_disk->vbfs_super.s_mount_time);
-	vbfs_ctx.super.s_state =
+	vbfs_ctx->super.s_state =
 		le32_to_cpu(vbfs_superblock_disk->vbfs_super.s_state);
-	if (vbfs_ctx.super.s_state != CLEAN) {
+	if (vbfs_ctx->super.s_state != CLEAN) {
 		log_warning("vbfs not umount cleanly last time\n");
 	}
+	vbfs_ctx->super.s_free_count =
+		le32_to_cpu(vbfs_superblock_disk->vbfs_super.s_free_count);
+	vbfs_ctx->super.s_uninit_group =
+		le32_to_cpu(vbfs_superblock_disk->vbfs_super.s_uninit_group);
+	vbfs_ctx->super.s_meta_extends =
+		le32_to_cpu(vbfs_superblock_disk->vbfs_super.s_meta_extends);
+	vbfs_ctx->super.full_stripe =
+		le32_to_cpu(vbfs_superblock_disk->vbfs_super.s_stripe_unit)
+		* le32_to_cpu(vbfs_superblock_disk->vbfs_super.s_stripe_width);
+	/* mkfs makes an extend whole stripes, anything else is not used */
+	if (vbfs_ctx->super.full_stripe
+			&& vbfs_ctx->super.s_extend_size % vbfs_ctx->super.full_stripe) {
+		log_warning("extend size is not whole stripes, stripe ignored\n");
+		vbfs_ctx->super.full_stripe = 0;
+	}
 
 	memcpy(vbfs_superblock_disk->vbfs_super.uuid,
-		vbfs_ctx.super.uuid, sizeof(vbfs_ctx.super.uuid));
+		vbfs_ctx->super.uuid, sizeof(vbfs_ctx->super.uuid));
+
+	return 0;
+}
+
+/* -EBADF unless @fs is the loaded context */
+int super_check(const struct vbfs *fs)
+{
+	if (NULL == fs || fs != vbfs_ctx)
+		return -EBADF;
 
 	return 0;
 }
@@ -80,76 +125,157 @@ static int init_bad_extend(void)
 	return 0;
 }
 
-int init_super(const char *dev_name)
+int init_super(const char *dev_name, struct vbfs **ctxp)
 {
-	int fd;
-	int ret;
+	vbfs_fuse_context_t *ctx;
+	int fd, ret;
 
-	pthread_mutex_init(&vbfs_ctx.super.lock, NULL);
+	if (vbfs_ctx)
+		return -EBUSY;
 
-	if ((vbfs_superblock_disk = Valloc(VBFS_SUPER_SIZE)) == NULL)
-		goto err;
+	ctx = calloc(1, sizeof(vbfs_fuse_context_t));
+	if (NULL == ctx)
+		return -ENOMEM;
+	ctx->fd = -1;
+	ctx->data_fd = -1;
 
+	if ((vbfs_superblock_disk = Valloc(VBFS_SUPER_SIZE)) == NULL) {
+		free(ctx);
+		return -ENOMEM;
+	}
 	memset(vbfs_superblock_disk, 0, VBFS_SUPER_SIZE);
+
 	fd = open(dev_name, O_RDWR | O_DIRECT | O_LARGEFILE);
 	if (fd < 0) {
-		fprintf(stderr, "open %s error, %s\n", dev_name, strerror(errno));
+		ret = -errno;
+		log_err("open %s error, %s\n", dev_name, strerror(errno));
 		goto err;
 	}
-	ret = init_vbfs_ctx(fd);
-	if (ret)
+	ret = init_vbfs_ctx(ctx, fd);
+	if (ret) {
+		close(fd);
 		goto err;
+	}
 
-	if (read_from_disk(fd, vbfs_superblock_disk, VBFS_SUPER_OFFSET, VBFS_SUPER_SIZE))
-		goto err;
+	vbfs_ctx = ctx;
 
-	if (load_super())
-		goto err;
+	if (read_from_disk(fd, vbfs_superblock_disk, VBFS_SUPER_OFFSET, VBFS_SUPER_SIZE)) {
+		ret = -EIO;
+		goto err_ctx;
+	}
 
-	vbfs_ctx.super.bits_bm_capacity =
-			(vbfs_ctx.super.s_extend_size - BITMAP_META_SIZE) * CHAR_BIT;
+	if (load_super()) {
+		ret = -EINVAL;
+		goto err_ctx;
+	}
 
-	vbfs_ctx.super.s_mount_time = time(NULL);
-	vbfs_ctx.super.s_state = DIRTY;
-	vbfs_ctx.super.super_vbfs_dirty = DIRTY;
+	vbfs_ctx->super.bits_bm_capacity =
+			(vbfs_ctx->super.s_extend_size - BITMAP_META_SIZE) * CHAR_BIT;
+
+	/* the rest of extend 0 is zeroes from mkfs */
+	if (vbfs_ctx->super.full_stripe) {
+		vbfs_ctx->super.stripe_buf = Valloc(vbfs_ctx->super.full_stripe);
+		if (NULL == vbfs_ctx->super.stripe_buf) {
+			ret = -ENOMEM;
+			goto err_ctx;
+		}
+		memset(vbfs_ctx->super.stripe_buf, 0, vbfs_ctx->super.full_stripe);
+	}
+
+	vbfs_ctx->super.s_mount_time = time(NULL);
+	vbfs_ctx->super.s_state = DIRTY;
+	vbfs_ctx->super.super_vbfs_dirty = DIRTY;
 
 	/* bad extend init */
-	if (init_bad_extend())
-		goto err;
+	if (init_bad_extend()) {
+		ret = -EIO;
+		goto err_ctx;
+	}
 
-	/* calculate free extend */
-	/* */
+	*ctxp = ctx;
 
 	return 0;
 
+err_ctx:
+	vbfs_ctx = NULL;
+	free_vbfs_ctx(ctx);
+	free(vbfs_superblock_disk);
+	vbfs_superblock_disk = NULL;
+	return ret;
 err:
-	return -1;
+	free(ctx);
+	free(vbfs_superblock_disk);
+	vbfs_superblock_disk = NULL;
+	return ret;
+}
+
+/* drop the context after super_umount_clean(), the device is closed */
+void super_release(void)
+{
+	if (NULL == vbfs_ctx)
+		return;
+
+	free_vbfs_ctx(vbfs_ctx);
+	vbfs_ctx = NULL;
+
+	free(vbfs_superblock_disk);
+	vbfs_superblock_disk = NULL;
+}
+
+/* only read back after a clean umount, the state says so */
+static void save_checkpoint(void)
+{
+	struct vbfs_superblock_disk *sd = &vbfs_superblock_disk->vbfs_super;
+	__le32 *ckpt = (__le32 *) vbfs_superblock_disk->padding;
+	uint32_t i, nr = vbfs_ctx->super.bitmap_count;
+
+	if (NULL == vbfs_ctx->super.group_free || nr > VBFS_CKPT_MAX) {
+		sd->s_ckpt_groups = 0;
+		return;
+	}
+
+	for (i = 0; i < nr; i ++)
+		ckpt[i] = cpu_to_le32(vbfs_ctx->super.group_free[i]);
+	sd->s_ckpt_groups = cpu_to_le32(nr);
 }
 
 static int sync_super_unlocked(void)
 {
 	int fd;
 
-	fd = vbfs_ctx.fd;
-	if (vbfs_ctx.super.super_vbfs_dirty == CLEAN)
+	fd = vbfs_ctx->fd;
+	if (vbfs_ctx->super.super_vbfs_dirty == CLEAN)
 		return 0;
 
 	vbfs_superblock_disk->vbfs_super.bad_extend_current =
-		cpu_to_le32(vbfs_ctx.super.bad_extend_current);
+		cpu_to_le32(vbfs_ctx->super.bad_extend_current);
 	vbfs_superblock_disk->vbfs_super.bitmap_current =
-		cpu_to_le32(vbfs_ctx.super.bitmap_current);
+		cpu_to_le32(vbfs_ctx->super.bitmap_current);
 	vbfs_superblock_disk->vbfs_super.s_mount_time =
-		cpu_to_le32(vbfs_ctx.super.s_mount_time);
+		cpu_to_le32(vbfs_ctx->super.s_mount_time);
 	vbfs_superblock_disk->vbfs_super.s_state =
-		cpu_to_le32(vbfs_ctx.super.s_state);
+		cpu_to_le32(vbfs_ctx->super.s_state);
+	vbfs_superblock_disk->vbfs_super.s_free_count =
+		cpu_to_le32(get_free_count());
+	vbfs_superblock_disk->vbfs_super.s_uninit_group =
+		cpu_to_le32(vbfs_ctx->super.s_uninit_group);
+	save_checkpoint();
 
 	/* bad extend array sync */
 	/* */
 
-	if (write_to_disk(fd, vbfs_superblock_disk, VBFS_SUPER_OFFSET, VBFS_SUPER_SIZE))
+	if (vbfs_ctx->super.stripe_buf) {
+		/* a 4K write is a read-modify-write on a parity raid */
+		memcpy(vbfs_ctx->super.stripe_buf + VBFS_SUPER_OFFSET,
+			vbfs_superblock_disk, VBFS_SUPER_SIZE);
+		if (write_to_disk(fd, vbfs_ctx->super.stripe_buf, 0,
+				vbfs_ctx->super.full_stripe))
+			return -1;
+	} else if (write_to_disk(fd, vbfs_superblock_disk, VBFS_SUPER_OFFSET,
+				VBFS_SUPER_SIZE))
 		return -1;
 
-	vbfs_ctx.super.super_vbfs_dirty = CLEAN;
+	vbfs_ctx->super.super_vbfs_dirty = CLEAN;
 		
 	return 0;
 }
@@ -158,9 +284,9 @@ int sync_super(void)
 {
 	int ret;
 
-	pthread_mutex_lock(&vbfs_ctx.super.lock);
+	pthread_mutex_lock(&vbfs_ctx->super.lock);
 	ret = sync_super_unlocked();
-	pthread_mutex_unlock(&vbfs_ctx.super.lock);
+	pthread_mutex_unlock(&vbfs_ctx->super.lock);
 
 	return ret;
 }
@@ -169,10 +295,11 @@ int super_umount_clean(void)
 {
 	int ret;
 
-	pthread_mutex_lock(&vbfs_ctx.super.lock);
-	vbfs_ctx.super.s_state = CLEAN;
+	pthread_mutex_lock(&vbfs_ctx->super.lock);
+	vbfs_ctx->super.s_state = CLEAN;
+	vbfs_ctx->super.super_vbfs_dirty = DIRTY;
 	ret = sync_super_unlocked();
-	pthread_mutex_unlock(&vbfs_ctx.super.lock);
+	pthread_mutex_unlock(&vbfs_ctx->super.lock);
 
 	return ret;
 }
@@ -181,10 +308,10 @@ uint32_t get_bitmap_curr(void)
 {
 	uint32_t bm_offset = 0;
 
-	pthread_mutex_lock(&vbfs_ctx.super.lock);
-	bm_offset = vbfs_ctx.super.bitmap_current
-			+ vbfs_ctx.super.bitmap_offset;
-	pthread_mutex_unlock(&vbfs_ctx.super.lock);
+	pthread_mutex_lock(&vbfs_ctx->super.lock);
+	bm_offset = vbfs_ctx->super.bitmap_current
+			+ vbfs_ctx->super.bitmap_offset;
+	pthread_mutex_unlock(&vbfs_ctx->super.lock);
 
 	return bm_offset;
 }
@@ -193,15 +320,15 @@ uint32_t add_bitmap_curr(void)
 {
 	uint32_t bm_offset = 0;
 
-	pthread_mutex_lock(&vbfs_ctx.super.lock);
+	pthread_mutex_lock(&vbfs_ctx->super.lock);
 
-	++ vbfs_ctx.super.bitmap_current;
-	vbfs_ctx.super.bitmap_current %= vbfs_ctx.super.bitmap_count;
-	bm_offset = vbfs_ctx.super.bitmap_current + vbfs_ctx.super.bitmap_offset;
+	++ vbfs_ctx->super.bitmap_current;
+	vbfs_ctx->super.bitmap_current %= vbfs_ctx->super.bitmap_count;
+	bm_offset = vbfs_ctx->super.bitmap_current + vbfs_ctx->super.bitmap_offset;
 
-	vbfs_ctx.super.super_vbfs_dirty = DIRTY;
+	vbfs_ctx->super.super_vbfs_dirty = DIRTY;
 
-	pthread_mutex_unlock(&vbfs_ctx.super.lock);
+	pthread_mutex_unlock(&vbfs_ctx->super.lock);
 
 	return bm_offset;
 }
@@ -210,15 +337,15 @@ int meta_queue_create(void)
 {
 	int ret = 0, reserved_bufs, hash_bits;
 
-	if (vbfs_ctx.super.bitmap_count < BM_RESERVED_MAX)
-		reserved_bufs = vbfs_ctx.super.bitmap_count;
+	if (vbfs_ctx->super.bitmap_count < BM_RESERVED_MAX)
+		reserved_bufs = vbfs_ctx->super.bitmap_count;
 	else
 		reserved_bufs = BM_RESERVED_MAX;
 	hash_bits = 4;
 
-	vbfs_ctx.meta_queue = queue_create(reserved_bufs, hash_bits, 0);
-	if (IS_ERR(vbfs_ctx.meta_queue))
-		ret = PTR_ERR(vbfs_ctx.meta_queue);
+	vbfs_ctx->meta_queue = queue_create(reserved_bufs, hash_bits, 0);
+	if (IS_ERR(vbfs_ctx->meta_queue))
+		ret = PTR_ERR(vbfs_ctx->meta_queue);
 
 	return ret;
 }
@@ -228,82 +355,374 @@ int data_queue_create(void)
 	int ret = 0, reserved_bufs, hash_bits;
 	uint32_t data_offset;
 
-	if (vbfs_ctx.super.s_extend_count < DATA_RESERVED_MAX)
-		reserved_bufs = vbfs_ctx.super.s_extend_count;
+	if (vbfs_ctx->super.s_extend_count < DATA_RESERVED_MAX)
+		reserved_bufs = vbfs_ctx->super.s_extend_count;
 	else
 		reserved_bufs = DATA_RESERVED_MAX;
 	hash_bits = 10;
 
-	data_offset = vbfs_ctx.super.bitmap_count + vbfs_ctx.super.bitmap_offset;
-	vbfs_ctx.data_queue = queue_create(reserved_bufs, hash_bits, data_offset);
-	if (IS_ERR(vbfs_ctx.data_queue)) {
-		ret = PTR_ERR(vbfs_ctx.data_queue);
+	data_offset = vbfs_ctx->super.bitmap_count + vbfs_ctx->super.bitmap_offset;
+	vbfs_ctx->data_queue = queue_create(reserved_bufs, hash_bits, data_offset);
+	if (IS_ERR(vbfs_ctx->data_queue)) {
+		ret = PTR_ERR(vbfs_ctx->data_queue);
 	}
 
 	return ret;
 }
 
-inline int get_disk_fd(void)
+int get_disk_fd(void)
+{
+	return vbfs_ctx->fd;
+}
+
+const size_t get_extend_size(void)
+{
+	return vbfs_ctx->super.s_extend_size;
+}
+
+uint32_t get_file_idx_size(void)
+{
+	return vbfs_ctx->super.s_file_idx_len;
+}
+
+uint32_t get_file_max_index(void)
+{
+	return vbfs_ctx->super.s_file_idx_len / 4;
+}
+
+uint32_t get_extend_count(void)
+{
+	return vbfs_ctx->super.s_extend_count;
+}
+
+/* extends the bitmaps hand out, as vbfs_format lays them out */
+uint32_t get_data_extend_count(void)
+{
+	return vbfs_ctx->super.s_extend_count - vbfs_ctx->super.bitmap_count
+			- vbfs_ctx->super.bitmap_offset - 1;
+}
+
+/* the bitmap callers update them under their lock, statfs reads bare */
+void add_free_count(uint32_t group, int nr)
+{
+	vbfs_ctx->super.group_free[group] += nr;
+	__atomic_add_fetch(&vbfs_ctx->super.s_free_count, nr, __ATOMIC_RELAXED);
+}
+
+uint32_t get_free_count(void)
+{
+	return __atomic_load_n(&vbfs_ctx->super.s_free_count, __ATOMIC_RELAXED);
+}
+
+uint32_t get_group_free(uint32_t group)
 {
-	return vbfs_ctx.fd;
+	return vbfs_ctx->super.group_free[group];
 }
 
-inline const size_t get_extend_size(void)
+/* data extends a bitmap group covers, the last one is short */
+uint32_t get_group_total(uint32_t group)
 {
-	return vbfs_ctx.super.s_extend_size;
+	uint64_t first = (uint64_t) group * get_bitmap_capacity();
+	uint32_t total = get_data_extend_count();
+
+	if (first >= total)
+		return 0;
+	if (total - first < get_bitmap_capacity())
+		return total - first;
+	return get_bitmap_capacity();
 }
 
-inline uint32_t get_file_idx_size(void)
+uint32_t get_full_stripe(void)
 {
-	return vbfs_ctx.super.s_file_idx_len;
+	return vbfs_ctx->super.full_stripe;
 }
 
-inline uint32_t get_file_max_index(void)
+uint32_t get_uninit_group(void)
 {
-	return vbfs_ctx.super.s_file_idx_len / 4;
+	return __atomic_load_n(&vbfs_ctx->super.s_uninit_group, __ATOMIC_ACQUIRE);
 }
 
-inline uint32_t get_bitmap_offset(void)
+/* on disk before the group before it is used, a crash must not redo it */
+int set_uninit_group(uint32_t group)
 {
-	return vbfs_ctx.super.bitmap_offset;
+	int ret;
+
+	if (group >= vbfs_ctx->super.bitmap_count)
+		group = 0;
+
+	pthread_mutex_lock(&vbfs_ctx->super.lock);
+	__atomic_store_n(&vbfs_ctx->super.s_uninit_group, group, __ATOMIC_RELEASE);
+	vbfs_ctx->super.super_vbfs_dirty = DIRTY;
+	ret = sync_super_unlocked();
+	pthread_mutex_unlock(&vbfs_ctx->super.lock);
+
+	return ret ? -EIO : 0;
 }
 
-inline struct queue *get_meta_queue(void)
+uint32_t get_bitmap_offset(void)
 {
-	return vbfs_ctx.meta_queue;
+	return vbfs_ctx->super.bitmap_offset;
 }
 
-inline struct queue *get_data_queue(void)
+struct queue *get_meta_queue(void)
 {
-	return vbfs_ctx.data_queue;
+	return vbfs_ctx->meta_queue;
 }
 
-inline struct active_inode *get_active_inode(void)
+struct queue *get_data_queue(void)
 {
-	return &vbfs_ctx.active_i;
+	return vbfs_ctx->data_queue;
+}
+
+struct active_inode *get_active_inode(void)
+{
+	return &vbfs_ctx->active_i;
 }
 
 void init_dir_bm_size(uint32_t dir_bm_size)
 {
-	vbfs_ctx.super.dir_bm_size = dir_bm_size;
+	vbfs_ctx->super.dir_bm_size = dir_bm_size;
 }
 
 void init_dir_capacity(uint32_t dir_capacity)
 {
-	vbfs_ctx.super.dir_capacity = dir_capacity;
+	vbfs_ctx->super.dir_capacity = dir_capacity;
+}
+
+uint32_t get_dir_bm_size(void)
+{
+	return vbfs_ctx->super.dir_bm_size;
+}
+
+uint32_t get_dir_capacity(void)
+{
+	return vbfs_ctx->super.dir_capacity;
+}
+
+uint32_t get_bitmap_capacity(void)
+{
+	return vbfs_ctx->super.bits_bm_capacity;
 }
 
-inline uint32_t get_dir_bm_size(void)
+/*
+ * split layout begin
+ *
+ * mkfs -m puts the superblock, bad list, bitmaps and the meta zone of
+ * the data extends on a device of its own. it comes first in the extend
+ * numbers, the bulk device with the file data follows it.
+ * */
+uint32_t get_meta_zone_end(void)
 {
-	return vbfs_ctx.super.dir_bm_size;
+	if (0 == vbfs_ctx->super.s_meta_extends)
+		return 0;
+
+	return vbfs_ctx->super.s_meta_extends - vbfs_ctx->super.bitmap_offset
+			- vbfs_ctx->super.bitmap_count;
+}
+
+/* the device and the byte offset of an extend */
+int get_extend_disk(uint32_t real_eno, uint64_t *offset)
+{
+	uint32_t meta = vbfs_ctx->super.s_meta_extends;
+
+	if (0 == meta || real_eno < meta) {
+		*offset = (uint64_t) real_eno * vbfs_ctx->super.s_extend_size;
+		return vbfs_ctx->fd;
+	}
+
+	*offset = (uint64_t) (real_eno - meta) * vbfs_ctx->super.s_extend_size;
+	return vbfs_ctx->data_fd;
 }
 
-inline uint32_t get_dir_capacity(void)
+/* the backup superblock at the end of the bulk device names the pair */
+static int check_data_dev(int fd)
 {
-	return vbfs_ctx.super.dir_capacity;
+	vbfs_superblock_dk_t *sd;
+	uint64_t offset;
+	int ret = 0;
+
+	sd = Valloc(VBFS_SUPER_SIZE);
+	if (NULL == sd)
+		return -ENOMEM;
+
+	offset = (uint64_t) (vbfs_ctx->super.s_extend_count - 1
+			- vbfs_ctx->super.s_meta_extends)
+			* vbfs_ctx->super.s_extend_size + VBFS_SUPER_OFFSET;
+	if (read_from_disk(fd, sd, offset, VBFS_SUPER_SIZE)) {
+		ret = -EIO;
+	} else if (le32_to_cpu(sd->vbfs_super.s_magic) != VBFS_SUPER_MAGIC
+			|| le32_to_cpu(sd->vbfs_super.s_ctime) != vbfs_ctx->super.s_ctime
+			|| le32_to_cpu(sd->vbfs_super.s_extend_count)
+				!= vbfs_ctx->super.s_extend_count
+			|| le32_to_cpu(sd->vbfs_super.s_meta_extends)
+				!= vbfs_ctx->super.s_meta_extends) {
+		ret = -EINVAL;
+	}
+	free(sd);
+
+	return ret;
 }
 
-inline uint32_t get_bitmap_capacity(void)
+int super_open_data_dev(const char *dev_name)
 {
-	return vbfs_ctx.super.bits_bm_capacity;
+	int fd, ret;
+
+	if (0 == vbfs_ctx->super.s_meta_extends) {
+		if (dev_name)
+			log_warning("one device image, %s is not used\n", dev_name);
+		return 0;
+	}
+	if (vbfs_ctx->data_fd >= 0)
+		return 0;
+
+	if (NULL == dev_name) {
+		log_err("file data is on a second device, no data device given\n");
+		return -EINVAL;
+	}
+
+	fd = open(dev_name, O_RDWR | O_DIRECT | O_LARGEFILE);
+	if (fd < 0) {
+		ret = -errno;
+		log_err("open %s error, %s\n", dev_name, strerror(errno));
+		return ret;
+	}
+
+	ret = check_data_dev(fd);
+	if (ret) {
+		log_err("%s is not the data device of this image\n", dev_name);
+		close(fd);
+		return ret;
+	}
+	vbfs_ctx->data_fd = fd;
+
+	return 0;
+}
+
+/*
+ * allocator summary begin
+ *
+ * free extends of every bitmap group, the allocator passes full groups
+ * without reading them. a clean umount leaves them as a checkpoint in
+ * the superblock, any other mount reads all bitmap headers in parallel.
+ * */
+#define SUMMARY_THREADS 8
+
+struct summary_worker {
+	pthread_t tid;
+	uint32_t first;
+	uint32_t step;
+	int ret;
+};
+
+static void *summary_fn(void *args)
+{
+	struct summary_worker *w = args;
+	bitmap_header_dk_t *hd;
+	uint64_t offset;
+	uint32_t i, uninit = get_uninit_group();
+
+	/* a whole page, the device is opened with O_DIRECT */
+	hd = Valloc(4096);
+	if (NULL == hd) {
+		w->ret = -ENOMEM;
+		return NULL;
+	}
+
+	for (i = w->first; i < vbfs_ctx->super.bitmap_count; i += w->step) {
+		/* not written yet, all of it is free */
+		if (uninit && i >= uninit) {
+			vbfs_ctx->super.group_free[i] = get_group_total(i);
+			continue;
+		}
+		offset = (uint64_t) (vbfs_ctx->super.bitmap_offset + i)
+				* vbfs_ctx->super.s_extend_size;
+		if (read_from_disk(vbfs_ctx->fd, hd, offset, 4096)) {
+			w->ret = -EIO;
+			break;
+		}
+		vbfs_ctx->super.group_free[i] = le32_to_cpu(hd->bitmap_dk.free_cnt);
+	}
+	free(hd);
+
+	return NULL;
+}
+
+static int read_summary(void)
+{
+	struct summary_worker w[SUMMARY_THREADS];
+	int started[SUMMARY_THREADS];
+	int i, nr, ret = 0;
+
+	nr = vbfs_ctx->super.bitmap_count < SUMMARY_THREADS ?
+		vbfs_ctx->super.bitmap_count : SUMMARY_THREADS;
+
+	for (i = 0; i < nr; i ++) {
+		w[i].first = i;
+		w[i].step = nr;
+		w[i].ret = 0;
+		started[i] = !pthread_create(&w[i].tid, NULL, summary_fn, &w[i]);
+		/* no thread, its share is read here */
+		if (!started[i])
+			summary_fn(&w[i]);
+	}
+
+	for (i = 0; i < nr; i ++) {
+		if (started[i])
+			pthread_join(w[i].tid, NULL);
+		if (w[i].ret)
+			ret = w[i].ret;
+	}
+
+	return ret;
+}
+
+/* the checkpoint of the last umount, when it was clean and adds up */
+static int load_checkpoint(void)
+{
+	struct vbfs_superblock_disk *sd = &vbfs_superblock_disk->vbfs_super;
+	__le32 *ckpt = (__le32 *) vbfs_superblock_disk->padding;
+	uint32_t i, nr = vbfs_ctx->super.bitmap_count;
+	uint64_t sum = 0;
+
+	if (le32_to_cpu(sd->s_state) != CLEAN || le32_to_cpu(sd->s_ckpt_groups) != nr)
+		return -ENOENT;
+
+	for (i = 0; i < nr; i ++) {
+		vbfs_ctx->super.group_free[i] = le32_to_cpu(ckpt[i]);
+		sum += vbfs_ctx->super.group_free[i];
+	}
+
+	return sum == le32_to_cpu(sd->s_free_count) ? 0 : -EINVAL;
+}
+
+int super_load_summary(void)
+{
+	uint64_t sum = 0;
+	uint32_t i;
+	int ret;
+
+	vbfs_ctx->super.group_free = calloc(vbfs_ctx->super.bitmap_count,
+					sizeof(uint32_t));
+	if (NULL == vbfs_ctx->super.group_free)
+		return -ENOMEM;
+
+	ret = load_checkpoint();
+	if (ret) {
+		ret = read_summary();
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < vbfs_ctx->super.bitmap_count; i ++)
+		sum += vbfs_ctx->super.group_free[i];
+	vbfs_ctx->super.s_free_count = sum;
+	log_dbg("%llu free extends in %u bitmaps\n", sum, i);
+
+	/* the image is in use on disk now, a crash drops the checkpoint */
+	pthread_mutex_lock(&vbfs_ctx->super.lock);
+	vbfs_ctx->super.super_vbfs_dirty = DIRTY;
+	ret = sync_super_unlocked();
+	pthread_mutex_unlock(&vbfs_ctx->super.lock);
+
+	return ret ? -EIO : 0;
 }
@@ -3,6 +3,8 @@
 
 #include "utils.h"
 
+struct vbfs;
+
 struct superblock_vbfs {
 	uint32_t s_magic;
 	uint32_t s_extend_size;
@@ -26,6 +28,11 @@ struct superblock_vbfs {
 
 	int super_vbfs_dirty;
 	uint32_t s_free_count;
+	uint32_t *group_free; /* free extends per bitmap group */
+	uint32_t s_uninit_group;
+	uint32_t full_stripe; /* bytes, 0 when not on a parity raid */
+	char *stripe_buf; /* the superblock written as a whole stripe */
+	uint32_t s_meta_extends;
 	pthread_mutex_t lock;
 
 	uint32_t dir_bm_size;
@@ -33,21 +40,36 @@ struct superblock_vbfs {
 	uint32_t bits_bm_capacity;
 };
 
-inline int get_disk_fd(void);
-inline const size_t get_extend_size(void);
-inline uint32_t get_file_idx_size(void);
-inline uint32_t get_file_max_index(void);
-inline struct queue *get_meta_queue(void);
-inline struct queue *get_data_queue(void);
-inline struct active_inode *get_active_inode(void);
-inline uint32_t get_dir_bm_size(void);
-inline uint32_t get_dir_capacity(void);
-inline uint32_t get_bitmap_capacity(void);
-inline uint32_t get_bitmap_offset(void);
+int get_disk_fd(void);
+const size_t get_extend_size(void);
+uint32_t get_file_idx_size(void);
+uint32_t get_file_max_index(void);
+uint32_t get_extend_count(void);
+uint32_t get_data_extend_count(void);
+void add_free_count(uint32_t group, int nr);
+uint32_t get_free_count(void);
+uint32_t get_group_free(uint32_t group);
+uint32_t get_group_total(uint32_t group);
+uint32_t get_uninit_group(void);
+int set_uninit_group(uint32_t group);
+uint32_t get_full_stripe(void);
+uint32_t get_meta_zone_end(void);
+int get_extend_disk(uint32_t real_eno, uint64_t *offset);
+int super_open_data_dev(const char *dev_name);
+int super_load_summary(void);
+struct queue *get_meta_queue(void);
+struct queue *get_data_queue(void);
+struct active_inode *get_active_inode(void);
+uint32_t get_dir_bm_size(void);
+uint32_t get_dir_capacity(void);
+uint32_t get_bitmap_capacity(void);
+uint32_t get_bitmap_offset(void);
 
 void init_dir_bm_size(uint32_t dir_bm_size);
 void init_dir_capacity(uint32_t dir_capacity);
-int init_super(const char *dev_name);
+int init_super(const char *dev_name, struct vbfs **ctxp);
+int super_check(const struct vbfs *fs);
+void super_release(void);
 int sync_super(void);
 int super_umount_clean(void);
 uint32_t get_bitmap_curr(void);
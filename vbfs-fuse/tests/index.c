@@ -0,0 +1,259 @@
+/*
+ * file index past the first extend through libvbfs, on an image with a
+ * 1K index so the indirect ranges are reached early:
+ *
+ *   vbfs_format -e 64 -x 1 img && index img
+ *
+ * one file is written across the flat, indirect and double indirect
+ * entries and read back before and after a remount, then truncated into
+ * each range from the end, appended again and read back. the extends all
+ * come back with the unlink.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "libvbfs.h"
+
+#define IDX_LEN 1024
+/* the last two entries of the array point to the indirect extends */
+#define FLAT_NR (IDX_LEN / 4 - 2)
+#define CHUNK (1024 * 1024)
+#define MAX_PARTS 8
+
+static size_t esize;
+static char *buf, *got, *ramp;
+
+/* the file is parts written with a seed each, from their start on */
+static struct {
+	off_t start;
+	int seed;
+} parts[MAX_PARTS];
+static int nr_parts;
+
+/* the byte at @off is its offset mod 251, its extend and its part added */
+static void fill(char *p, off_t off, size_t len)
+{
+	off_t end = off + len, next;
+	char add;
+	size_t k;
+	int i;
+
+	for (i = nr_parts - 1; i > 0 && parts[i].start > off; i --)
+		;
+
+	while (off < end) {
+		next = (off / esize + 1) * esize;
+		if (i + 1 < nr_parts && parts[i + 1].start < next)
+			next = parts[i + 1].start;
+		if (next > end)
+			next = end;
+
+		add = off / esize * 13 + parts[i].seed;
+		for (k = 0; k < next - off; k ++)
+			p[k] = ramp[off % 251 + k] + add;
+
+		p += next - off;
+		off = next;
+		if (i + 1 < nr_parts && parts[i + 1].start == off)
+			i ++;
+	}
+}
+
+/* index entry @i holds the bytes from here */
+static off_t entry_off(off_t i)
+{
+	return (i + 1) * esize - IDX_LEN;
+}
+
+static int append(vbfs_file_t *fp, off_t off, off_t end, int seed)
+{
+	size_t len;
+
+	parts[nr_parts].start = off;
+	parts[nr_parts ++].seed = seed;
+
+	for (; off < end; off += len) {
+		len = end - off < CHUNK ? end - off : CHUNK;
+		fill(buf, off, len);
+		if (vbfs_append(fp, buf, len) != (ssize_t) len) {
+			printf("append at %lld failed\n", (long long) off);
+			return -EIO;
+		}
+	}
+
+	return vbfs_fsync(fp);
+}
+
+/* bytes from @from on of a file of @size */
+static int check(vbfs_file_t *fp, off_t from, off_t size, const char *when)
+{
+	struct stat st;
+	off_t off;
+	size_t len, i;
+	ssize_t ret;
+
+	vbfs_fstat(fp, &st);
+	if (st.st_size != size) {
+		printf("%s: size %lld, want %lld\n", when,
+			(long long) st.st_size, (long long) size);
+		return -EIO;
+	}
+
+	for (off = from; off < size; off += len) {
+		len = size - off < CHUNK ? size - off : CHUNK;
+		ret = vbfs_pread(fp, got, len, off);
+		if (ret != (ssize_t) len) {
+			printf("%s: read at %lld returned %zd\n", when,
+				(long long) off, ret);
+			return -EIO;
+		}
+
+		fill(buf, off, len);
+		if (memcmp(got, buf, len)) {
+			for (i = 0; got[i] == buf[i]; i ++)
+				;
+			printf("%s: mismatch at %lld\n", when,
+				(long long) (off + i));
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * cut the file at @size, append @more bytes and read back from an extend
+ * before the cut, the whole file is read after the remount
+ * */
+static int cut(vbfs_file_t *fp, off_t size, off_t more, int seed,
+		const char *when)
+{
+	int ret;
+
+	ret = vbfs_ftruncate(fp, size);
+	if (ret)
+		return ret;
+	while (nr_parts > 1 && parts[nr_parts - 1].start >= size)
+		nr_parts --;
+
+	ret = append(fp, size, size + more, seed);
+	if (0 == ret)
+		ret = check(fp, size - esize, size + more, when);
+
+	return ret;
+}
+
+static unsigned long free_extends(vbfs_t *fs)
+{
+	struct statvfs st;
+
+	vbfs_statfs(fs, &st);
+
+	return st.f_bfree;
+}
+
+int main(int argc, char **argv)
+{
+	struct statvfs st;
+	vbfs_t *fs;
+	vbfs_file_t *fp;
+	unsigned long nr_free;
+	off_t indirect, dindirect, size;
+	int i, ret;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s image\n", argv[0]);
+		return 2;
+	}
+
+	buf = malloc(CHUNK);
+	got = malloc(CHUNK);
+	ramp = malloc(251 + CHUNK);
+	if (NULL == buf || NULL == got || NULL == ramp)
+		return 1;
+	for (i = 0; i < 251 + CHUNK; i ++)
+		ramp[i] = i % 251;
+
+	ret = vbfs_mount(argv[1], NULL, &fs);
+	if (ret) {
+		fprintf(stderr, "mount %s error, %s\n", argv[1], strerror(-ret));
+		return 1;
+	}
+	vbfs_statfs(fs, &st);
+	esize = st.f_bsize;
+	nr_free = st.f_bfree;
+
+	indirect = entry_off(FLAT_NR);
+	dindirect = entry_off(FLAT_NR + esize / 4);
+	size = dindirect + 40 * esize + 77;
+
+	ret = vbfs_open(fs, "/i", O_CREAT | O_TRUNC | O_RDWR, &fp);
+	if (ret)
+		goto out;
+	ret = append(fp, 0, size, 1);
+	if (0 == ret)
+		ret = check(fp, 0, size, "written");
+	vbfs_close(fp);
+	if (ret)
+		goto out;
+
+	vbfs_umount(fs);
+	ret = vbfs_mount(argv[1], NULL, &fs);
+	if (ret) {
+		fprintf(stderr, "remount error, %s\n", strerror(-ret));
+		return 1;
+	}
+
+	ret = vbfs_open(fs, "/i", O_RDWR, &fp);
+	if (ret)
+		goto out;
+	ret = check(fp, 0, size, "remounted");
+	if (0 == ret)
+		ret = cut(fp, dindirect + 10 * esize + 123, 5 * esize, 2,
+				"double indirect cut");
+	if (0 == ret)
+		ret = cut(fp, indirect + 100 * esize + 7, 3 * esize, 3,
+				"indirect cut");
+	if (0 == ret)
+		ret = cut(fp, entry_off(100) + 5, 2 * esize, 4, "flat cut");
+	size = entry_off(100) + 5 + 2 * esize;
+	vbfs_close(fp);
+	if (ret)
+		goto out;
+
+	vbfs_umount(fs);
+	ret = vbfs_mount(argv[1], NULL, &fs);
+	if (ret) {
+		fprintf(stderr, "remount error, %s\n", strerror(-ret));
+		return 1;
+	}
+
+	ret = vbfs_open(fs, "/i", O_RDONLY, &fp);
+	if (0 == ret) {
+		ret = check(fp, 0, size, "cut remounted");
+		vbfs_close(fp);
+	}
+
+	if (0 == ret)
+		ret = vbfs_unlink(fs, "/i");
+	if (0 == ret && free_extends(fs) != nr_free) {
+		printf("%lu extends free after unlink, %lu before\n",
+			free_extends(fs), nr_free);
+		ret = -EIO;
+	}
+
+out:
+	vbfs_umount(fs);
+	free(ramp);
+	free(got);
+	free(buf);
+	if (ret) {
+		printf("index: failed, %s\n", strerror(-ret));
+		return 1;
+	}
+	printf("index: ok\n");
+
+	return 0;
+}
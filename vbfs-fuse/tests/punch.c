@@ -0,0 +1,241 @@
+/*
+ * hole punching through libvbfs, on a freshly formatted image:
+ *
+ *   vbfs_format -e 1024 img && punch img
+ *
+ * /a fills the image but a few extends at its end and gets its first
+ * extends punched, /b then takes the last extends and wraps to the low
+ * ones /a gave back. a hole in /b that ends on such an extend is as long
+ * as the number of that extend, every byte of /b is checked after it,
+ * after a write into the hole and after a remount.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/falloc.h>
+
+#include "libvbfs.h"
+
+#define HIGH_EXTENDS 16
+#define LOW_EXTENDS 10
+/* the first file of an image has its inode in extend 1, data from 2 on */
+#define FIRST_DATA 2
+
+static size_t esize;
+
+static unsigned long free_extends(vbfs_t *fs)
+{
+	struct statvfs st;
+
+	vbfs_statfs(fs, &st);
+
+	return st.f_bfree;
+}
+
+static void fill(char *buf, off_t off, size_t len, int seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (off + i) % 251 + seed;
+}
+
+static int check(vbfs_file_t *fp, const char *want, off_t off, size_t len,
+		const char *when)
+{
+	char *got;
+	size_t i, done;
+	ssize_t ret;
+
+	got = malloc(len);
+	if (NULL == got)
+		return -ENOMEM;
+
+	for (done = 0; done < len; done += ret) {
+		ret = vbfs_pread(fp, got + done, len - done, off + done);
+		if (ret <= 0) {
+			printf("%s: read at %lld returned %zd\n", when,
+				(long long) (off + done), ret);
+			free(got);
+			return -EIO;
+		}
+	}
+
+	for (i = 0; i < len; i++) {
+		if (got[i] != want[i]) {
+			printf("%s: mismatch at %lld (got %d want %d)\n", when,
+				(long long) (off + i), got[i], want[i]);
+			free(got);
+			return -EIO;
+		}
+	}
+
+	free(got);
+
+	return 0;
+}
+
+static int punch(vbfs_file_t *fp, char *want, off_t off, off_t len)
+{
+	if (want)
+		memset(want + off, 0, len);
+
+	return vbfs_fallocate(fp, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				off, len);
+}
+
+/* leaves HIGH_EXTENDS free at the end and LOW_EXTENDS from FIRST_DATA */
+static int make_room(vbfs_t *fs, unsigned long nr_free)
+{
+	vbfs_file_t *fp;
+	char *buf, *zero;
+	unsigned long i;
+	int ret;
+
+	buf = malloc(esize);
+	zero = calloc(1, LOW_EXTENDS * esize);
+	if (NULL == buf || NULL == zero)
+		return -ENOMEM;
+
+	ret = vbfs_open(fs, "/a", O_CREAT | O_TRUNC | O_RDWR, &fp);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < nr_free - HIGH_EXTENDS - 1; i++) {
+		fill(buf, i * esize, esize, 1);
+		if (vbfs_append(fp, buf, esize) != (ssize_t) esize) {
+			ret = -EIO;
+			goto out_close;
+		}
+	}
+
+	ret = vbfs_fsync(fp);
+	if (0 == ret && free_extends(fs) != HIGH_EXTENDS)
+		ret = -EINVAL;
+	if (0 == ret)
+		ret = punch(fp, NULL, 0, LOW_EXTENDS * esize);
+	if (0 == ret)
+		ret = check(fp, zero, 0, LOW_EXTENDS * esize, "/a punched");
+	if (0 == ret) {
+		/* the tail extend of the range is only zeroed */
+		fill(buf, (LOW_EXTENDS + 1) * esize, esize, 1);
+		ret = check(fp, buf, (LOW_EXTENDS + 1) * esize, esize, "/a kept");
+	}
+
+out_close:
+	vbfs_close(fp);
+out:
+	free(zero);
+	free(buf);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct statvfs st;
+	vbfs_t *fs;
+	vbfs_file_t *fp;
+	unsigned long nr_free;
+	off_t size, hole, hole_len, at;
+	int wrap, ret;
+	char *want;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s image\n", argv[0]);
+		return 2;
+	}
+
+	ret = vbfs_mount(argv[1], NULL, &fs);
+	if (ret) {
+		fprintf(stderr, "mount %s error, %s\n", argv[1], strerror(-ret));
+		return 1;
+	}
+	vbfs_statfs(fs, &st);
+	esize = st.f_bsize;
+	nr_free = st.f_bfree;
+
+	ret = make_room(fs, nr_free);
+	if (ret)
+		goto out;
+
+	/* the inode of /b takes one of the high extends */
+	wrap = HIGH_EXTENDS - 1;
+	size = (wrap + LOW_EXTENDS - 2) * esize;
+	want = malloc(size);
+	if (NULL == want) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	fill(want, 0, size, 3);
+
+	ret = vbfs_open(fs, "/b", O_CREAT | O_TRUNC | O_RDWR, &fp);
+	if (ret)
+		goto out_free;
+	if (vbfs_pwrite(fp, want, size, 0) != size) {
+		ret = -EIO;
+		goto out_close;
+	}
+
+	/*
+	 * index entries from wrap - FIRST_DATA on: the entry right after
+	 * the hole holds extend FIRST_DATA + 3, the hole is 3 + FIRST_DATA
+	 * long. the edges are off the entries by half an extend, the file
+	 * index in the first extend is less than that.
+	 * */
+	hole = (wrap - FIRST_DATA + 1) * esize - esize / 2;
+	hole_len = (FIRST_DATA + 3) * esize;
+	ret = punch(fp, want, hole, hole_len);
+	if (0 == ret)
+		ret = check(fp, want, 0, size, "/b punched");
+
+	/* the extend for this one comes from the low ones as well */
+	at = hole + esize;
+	fill(want + at, at, esize, 5);
+	if (0 == ret && vbfs_pwrite(fp, want + at, esize, at) != (ssize_t) esize)
+		ret = -EIO;
+	if (0 == ret)
+		ret = check(fp, want, 0, size, "/b written");
+
+out_close:
+	vbfs_close(fp);
+	if (ret)
+		goto out_free;
+
+	vbfs_umount(fs);
+	ret = vbfs_mount(argv[1], NULL, &fs);
+	if (ret) {
+		free(want);
+		fprintf(stderr, "remount error, %s\n", strerror(-ret));
+		return 1;
+	}
+
+	ret = vbfs_open(fs, "/b", O_RDONLY, &fp);
+	if (0 == ret) {
+		ret = check(fp, want, 0, size, "/b remounted");
+		vbfs_close(fp);
+	}
+
+	if (0 == ret)
+		ret = vbfs_unlink(fs, "/a");
+	if (0 == ret)
+		ret = vbfs_unlink(fs, "/b");
+	if (0 == ret && free_extends(fs) != nr_free) {
+		printf("%lu extends free after unlink, %lu before\n",
+			free_extends(fs), nr_free);
+		ret = -EIO;
+	}
+
+out_free:
+	free(want);
+out:
+	vbfs_umount(fs);
+	if (ret) {
+		printf("punch: failed, %s\n", strerror(-ret));
+		return 1;
+	}
+	printf("punch: ok\n");
+
+	return 0;
+}
@@ -0,0 +1,194 @@
+/*
+ * small tail writes against readers of the same file, on a freshly
+ * formatted image:
+ *
+ *   vbfs_format -e 1024 img && tail img
+ *
+ * one thread appends in small pieces with small_tail set, so pages of
+ * extends not cached go to disk directly, while readers go over the
+ * last bytes written and pull those extends into the cache. every byte
+ * is checked while the file grows, after the writer is done and after a
+ * remount, a cached copy gone stale would be read or written back.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "libvbfs.h"
+
+#define NR_READERS 2
+#define MAX_PIECE 6000
+#define CHUNK (1024 * 1024)
+
+static vbfs_t *fs;
+static off_t total;
+static int done, bad;
+
+static unsigned char byte_at(off_t off)
+{
+	return off * 7 + (off >> 16);
+}
+
+static int check(const char *p, off_t off, size_t len, const char *when)
+{
+	size_t i;
+
+	for (i = 0; i < len; i ++) {
+		if ((unsigned char) p[i] != byte_at(off + i)) {
+			printf("%s: mismatch at %lld\n", when,
+				(long long) (off + i));
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+/* the last few pages before the end of file, over and over */
+static void *reader(void *arg)
+{
+	vbfs_file_t *fp;
+	struct stat st;
+	char *buf;
+	off_t off;
+	ssize_t ret;
+
+	buf = malloc(3 * MAX_PIECE);
+	if (NULL == buf || vbfs_open(fs, "/t", O_RDONLY, &fp)) {
+		__atomic_store_n(&bad, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	while (! __atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		vbfs_fstat(fp, &st);
+		off = st.st_size > 3 * MAX_PIECE ? st.st_size - 3 * MAX_PIECE : 0;
+		ret = vbfs_pread(fp, buf, st.st_size - off, off);
+		if (ret < 0 || check(buf, off, ret, "growing")) {
+			__atomic_store_n(&bad, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+
+	vbfs_close(fp);
+	free(buf);
+
+	return NULL;
+}
+
+static int check_file(const char *when)
+{
+	vbfs_file_t *fp;
+	struct stat st;
+	char *buf;
+	off_t off;
+	size_t len;
+	int ret;
+
+	buf = malloc(CHUNK);
+	if (NULL == buf)
+		return -ENOMEM;
+
+	ret = vbfs_open(fs, "/t", O_RDONLY, &fp);
+	if (ret) {
+		free(buf);
+		return ret;
+	}
+
+	vbfs_fstat(fp, &st);
+	if (st.st_size != total) {
+		printf("%s: size %lld, want %lld\n", when,
+			(long long) st.st_size, (long long) total);
+		ret = -EIO;
+	}
+
+	for (off = 0; 0 == ret && off < total; off += len) {
+		len = total - off < CHUNK ? total - off : CHUNK;
+		if (vbfs_pread(fp, buf, len, off) != (ssize_t) len)
+			ret = -EIO;
+		else
+			ret = check(buf, off, len, when);
+	}
+
+	vbfs_close(fp);
+	free(buf);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct vbfs_mount_opts opts = { .small_tail = 1 };
+	pthread_t threads[NR_READERS];
+	struct statvfs st;
+	vbfs_file_t *fp;
+	char buf[MAX_PIECE];
+	off_t end;
+	size_t len, i;
+	int n, ret;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s image\n", argv[0]);
+		return 2;
+	}
+
+	ret = vbfs_mount(argv[1], &opts, &fs);
+	if (ret) {
+		fprintf(stderr, "mount %s error, %s\n", argv[1], strerror(-ret));
+		return 1;
+	}
+	/* a quarter of the image, past many extends */
+	vbfs_statfs(fs, &st);
+	end = (off_t) st.f_bfree * st.f_bsize / 4;
+
+	ret = vbfs_open(fs, "/t", O_CREAT | O_TRUNC | O_WRONLY, &fp);
+	if (ret)
+		goto out;
+
+	for (n = 0; n < NR_READERS; n ++)
+		pthread_create(&threads[n], NULL, reader, NULL);
+
+	srand(1);
+	while (total < end && ! __atomic_load_n(&bad, __ATOMIC_RELAXED)) {
+		len = 1 + rand() % MAX_PIECE;
+		for (i = 0; i < len; i ++)
+			buf[i] = byte_at(total + i);
+		if (vbfs_append(fp, buf, len) != (ssize_t) len) {
+			printf("append at %lld failed\n", (long long) total);
+			ret = -EIO;
+			break;
+		}
+		total += len;
+	}
+
+	__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+	for (n = 0; n < NR_READERS; n ++)
+		pthread_join(threads[n], NULL);
+	vbfs_close(fp);
+	if (bad)
+		ret = -EIO;
+
+	if (0 == ret)
+		ret = check_file("written");
+	if (ret)
+		goto out;
+
+	vbfs_umount(fs);
+	ret = vbfs_mount(argv[1], NULL, &fs);
+	if (ret) {
+		fprintf(stderr, "remount error, %s\n", strerror(-ret));
+		return 1;
+	}
+	ret = check_file("remounted");
+
+out:
+	vbfs_umount(fs);
+	if (ret) {
+		printf("tail: failed, %s\n", strerror(-ret));
+		return 1;
+	}
+	printf("tail: ok\n");
+
+	return 0;
+}
@@ -3,58 +3,13 @@
 #include "log.h"
 #include "super.h"
 
-/*
- * memory operations begin
- * */
-void *Valloc(unsigned int size)
-{
-	void *p = NULL;
-
-	if ((p = valloc(size)) != NULL) {
-		return p;
-	} else {
-		log_err("valloc error, no memory\n");
-		return NULL;
-	}
-}
-
-void *Malloc(unsigned int size)
-{
-	void *p = NULL;
-
-	if ((p = malloc(size)) != NULL) {
-		return p;
-	} else {
-		log_err("malloc error, no memory\n");
-		return NULL;
-	}
-}
-
-void *mp_malloc(unsigned int size)
-{
-	return Malloc(size);
-}
-
-void *mp_valloc(unsigned int size)
-{
-	return Valloc(size);
-}
-
-void mp_free(void *p)
-{
-	free(p);
-}
-
 /*
  * file operations begin 
  * */
+/* positioned io, the io threads share one fd */
 int write_to_disk(int fd, void *buf, uint64_t offset, size_t len)
 {
-	if (lseek64(fd, offset, SEEK_SET) < 0) {
-		log_err("lseek error %s\n", strerror(errno));
-		return -1;
-	}
-	if (write(fd, buf, len) < 0) {
+	if (pwrite64(fd, buf, len, offset) < 0) {
 		log_err("write error %s\n", strerror(errno));
 		return -1;
 	}
@@ -64,11 +19,7 @@ int write_to_disk(int fd, void *buf, uint64_t offset, size_t len)
 
 int read_from_disk(int fd, void *buf, uint64_t offset, size_t len)
 {
-	if (lseek64(fd, offset, SEEK_SET) < 0) {
-		log_err("lseek error %s\n", strerror(errno));
-		return -1;
-	}
-	if (read(fd, buf, len) < 0) {
+	if (pread64(fd, buf, len, offset) < 0) {
 		log_err("read error %s\n", strerror(errno));
 		return -1;
 	}
@@ -78,8 +29,8 @@ int read_from_disk(int fd, void *buf, uint64_t offset, size_t len)
 int write_extend(uint32_t extend_no, void *buf)
 {
 	size_t len = get_extend_size();
-	int fd = get_disk_fd();
-	off64_t offset = (uint64_t)extend_no * len;
+	uint64_t offset;
+	int fd = get_extend_disk(extend_no, &offset);
 
 	//log_dbg("%u", extend_no);
 
@@ -92,8 +43,8 @@ int write_extend(uint32_t extend_no, void *buf)
 int read_extend(uint32_t extend_no, void *buf)
 {
 	size_t len = get_extend_size();
-	int fd = get_disk_fd();
-	off64_t offset = (uint32_t)extend_no * len;
+	uint64_t offset;
+	int fd = get_extend_disk(extend_no, &offset);
 
 	//log_dbg("%u", extend_no);
 
@@ -15,7 +15,6 @@
 #include <pthread.h>
 #include <time.h>
 #include <sys/time.h>
-#include <fuse.h>
 #include <errno.h>
 #include <assert.h>
 
@@ -79,14 +78,6 @@ static inline unsigned long get_curtime()
 	return curtime.tv_sec;
 }
 
-void *Valloc(unsigned int size);
-void *Malloc(unsigned int size);
-
-void *mp_malloc(unsigned int size);
-void *mp_valloc(unsigned int size);
-void mp_free(void *p);
-
-
 int write_to_disk(int fd, void *buf, uint64_t offset, size_t len);
 int read_from_disk(int fd, void *buf, uint64_t offset, size_t len);
 int write_extend(uint32_t extend_no, void *buf);
@@ -1,9 +1,13 @@
 #define FUSE_USE_VERSION 29
 
-#include "vbfs-fuse.h"
-#include "err.h"
-#include "ioengine.h"
+#include <fuse.h>
+#include <stddef.h>
+#include <poll.h>
+
+#include "libvbfs.h"
 #include "log.h"
+#include "mempool.h"
+#include "stats.h"
 
 static int vbfs_fuse_getattr(const char *path, struct stat *stbuf);
 static int vbfs_fuse_fgetattr(const char *path, struct stat *stbuf,
@@ -28,14 +32,60 @@ static int vbfs_fuse_read(const char *path, char *buf, size_t size, off_t offset
 				struct fuse_file_info *fi);
 static int vbfs_fuse_write(const char *path, const char *buf, size_t size, off_t offset,
 				struct fuse_file_info *);
+static int vbfs_fuse_poll(const char *path, struct fuse_file_info *fi,
+				struct fuse_pollhandle *ph, unsigned *reventsp);
 static int vbfs_fuse_statfs(const char *path, struct statvfs *stbuf);
 static int vbfs_fuse_flush(const char *path, struct fuse_file_info *fi);
 static int vbfs_fuse_release(const char *path, struct fuse_file_info *fi);
 static int vbfs_fuse_fsync(const char *path, int isdatasync, struct fuse_file_info *fi);
+static int vbfs_fuse_fallocate(const char *path, int mode, off_t offset, off_t len,
+				struct fuse_file_info *fi);
+static int vbfs_fuse_setxattr(const char *path, const char *name, const char *value,
+				size_t size, int flags);
+static int vbfs_fuse_getxattr(const char *path, const char *name, char *value,
+				size_t size);
 
 static void *vbfs_fuse_init(struct fuse_conn_info *conn);
 static void vbfs_fuse_destroy(void *data);
 
+struct vbfs_options {
+	char *hugepages;
+	int membench;
+	char *loglevel;
+	char *ringsock;
+	int small_tail;
+	unsigned int tail_idle;
+	int recycle;
+	char *datadev;
+	unsigned int record_deadline;
+	unsigned int read_limit;
+	unsigned int read_total;
+	unsigned int write_budget;
+	unsigned int stream_rate;
+};
+
+static struct vbfs_options vbfs_opts;
+static vbfs_t *vbfs_fs;
+
+#define VBFS_OPT(t, p) { t, offsetof(struct vbfs_options, p), 1 }
+
+static const struct fuse_opt vbfs_opt_spec[] = {
+	VBFS_OPT("hugepages=%s", hugepages),
+	VBFS_OPT("membench", membench),
+	VBFS_OPT("loglevel=%s", loglevel),
+	VBFS_OPT("ringsock=%s", ringsock),
+	VBFS_OPT("small_tail", small_tail),
+	VBFS_OPT("tail_idle=%u", tail_idle),
+	VBFS_OPT("recycle", recycle),
+	VBFS_OPT("datadev=%s", datadev),
+	VBFS_OPT("record_deadline=%u", record_deadline),
+	VBFS_OPT("read_limit=%u", read_limit),
+	VBFS_OPT("read_total=%u", read_total),
+	VBFS_OPT("write_budget=%u", write_budget),
+	VBFS_OPT("stream_rate=%u", stream_rate),
+	FUSE_OPT_END
+};
+
 static struct fuse_operations vbfs_op = {
 	.getattr	= vbfs_fuse_getattr,
 	.fgetattr	= vbfs_fuse_fgetattr,
@@ -58,51 +108,51 @@ static struct fuse_operations vbfs_op = {
 	//.read_buf	= vbfs_fuse_read_buf,
 	.write		= vbfs_fuse_write,
 	//.write_buf	= vbfs_fuse_write_buf,
+	.poll		= vbfs_fuse_poll,
 
 	.statfs		= vbfs_fuse_statfs,
 	.flush		= vbfs_fuse_flush,
 	.release	= vbfs_fuse_release,
 	.fsync		= vbfs_fuse_fsync,
+	.fallocate	= vbfs_fuse_fallocate,
+
+	.setxattr	= vbfs_fuse_setxattr,
+	.getxattr	= vbfs_fuse_getxattr,
 
 	.init		= vbfs_fuse_init,
 	.destroy	= vbfs_fuse_destroy,
 };
 
+#define FI_FILE(fi) ((vbfs_file_t *) (fi)->fh)
+
 static int vbfs_fuse_getattr(const char *path, struct stat *stbuf)
 {
-	struct inode_info *inode;
-
 	log_dbg("vbfs_fuse_getattr %s\n", path);
 
-	inode = pathname_to_inode(path);
-	if (IS_ERR(inode))
-		return PTR_ERR(inode);
-
-	fill_stbuf_by_dirent(stbuf, inode->dirent);
+	if (is_stats_path(path))
+		return stats_getattr(path, stbuf);
 
-	vbfs_inode_close(inode);
-
-	return 0;
+	return vbfs_stat(vbfs_fs, path, stbuf);
 }
 
 static int vbfs_fuse_fgetattr(const char *path, struct stat *stbuf,
 				struct fuse_file_info *fi)
 {
-	int ret = 0;
-	struct inode_info *inode;
-
 	log_dbg("vbfs_fuse_fgetattr %s\n", path);
 
-	if (fi->fh) {
-		inode = (struct inode_info *) fi->fh;
-		fill_stbuf_by_dirent(stbuf, inode->dirent);
-	}
+	if (is_stats_path(path))
+		return stats_getattr(path, stbuf);
 
-	return ret;
+	if (fi->fh)
+		return vbfs_fstat(FI_FILE(fi), stbuf);
+
+	return 0;
 }
 
 static int vbfs_fuse_access(const char *path, int mode)
 {
+	STATS_OP(STAT_ACCESS);
+
 	log_dbg("vbfs_fuse_access\n");
 
 	return 0;
@@ -110,15 +160,23 @@ static int vbfs_fuse_access(const char *path, int mode)
 
 static int vbfs_fuse_opendir(const char *path, struct fuse_file_info *fi)
 {
-	struct inode_info *inode = NULL;
+	int ret;
+	vbfs_file_t *dir;
 
 	log_dbg("vbfs_fuse_opendir %s\n", path);
 
-	inode = pathname_to_inode(path);
-	if (IS_ERR(inode))
-		return PTR_ERR(inode);
+	if (is_stats_path(path)) {
+		if (strcmp(path, VBFS_STATS_DIR))
+			return -ENOTDIR;
+		fi->fh = 0;
+		return 0;
+	}
+
+	ret = vbfs_open(vbfs_fs, path, O_RDONLY | O_DIRECTORY, &dir);
+	if (ret)
+		return ret;
 
-	fi->fh = (uint64_t) inode;
+	fi->fh = (uint64_t) dir;
 
 	return 0;
 }
@@ -126,90 +184,43 @@ static int vbfs_fuse_opendir(const char *path, struct fuse_file_info *fi)
 static int vbfs_fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 				off_t offset, struct fuse_file_info *fi)
 {
-	struct inode_info *inode;
-
 	log_dbg("vbfs_fuse_readdir %s\n", path);
 
+	if (is_stats_path(path))
+		return stats_readdir(buf, filler);
+
 	if (! fi->fh) {
 		log_err("BUG");
 		return -1;
 	}
 
-	inode = (struct inode_info *) fi->fh;
-	vbfs_readdir(inode, offset, filler, buf);
-	vbfs_update_times(inode, UPDATE_ATIME);
+	vbfs_readdir(FI_FILE(fi), offset, filler, buf);
 
 	return 0;
 }
 
 static int vbfs_fuse_releasedir(const char *path, struct fuse_file_info *fi)
 {
-	struct inode_info *inode;
-
 	log_dbg("vbfs_fuse_releasedir %s\n", path);
 
+	if (is_stats_path(path))
+		return 0;
+
 	if (! fi->fh) {
 		log_err("BUG");
 		return -1;
 	}
 
-	inode = (struct inode_info *) fi->fh;
-	vbfs_inode_close(inode);
-
-	return 0;
-}
-
-static int vbfs_create_obj(const char *path, uint32_t mode)
-{
-	int ret;
-	struct inode_info *inode;
-
-	char last_name[NAME_LEN];
-	char *name = NULL;
-	char *pos = NULL;
-
-	memset(last_name, 0, sizeof(last_name));
-	name = strdup(path);
-	if (NULL == name)
-		return -ENOMEM;
-	pos = name;
-
-	ret = get_lastname(pos, last_name, PATH_SEP);
-	if (ret) {
-		free(name);
-		return -EINVAL;
-	}
-	if (strlen(last_name) == 0) {
-		free(name);
-		return -EEXIST;
-	}
-
-	inode = pathname_to_inode(pos);
-	free(name);
-	if (IS_ERR(inode))
-		return PTR_ERR(inode);
-
-	ret = vbfs_create(inode, last_name, mode);
-	if (ret) {
-		vbfs_inode_close(inode);
-		return ret;
-	}
-
-	vbfs_update_times(inode, UPDATE_ATIME | UPDATE_MTIME);
-	vbfs_inode_close(inode);
+	vbfs_close(FI_FILE(fi));
 
 	return 0;
 }
 
 static int vbfs_fuse_mkdir(const char *path, mode_t mode)
 {
-	int ret;
-
 	log_dbg("vbfs_fuse_mkdir %s\n", path);
 
-	ret = vbfs_create_obj(path, VBFS_FT_DIR);
-
-	return ret;
+	return vbfs_mkdir(vbfs_fs, path);
 }
 
 /*
@@ -220,119 +231,72 @@ static int vbfs_fuse_mkdir(const char *path, mode_t mode)
  * */
 static int vbfs_fuse_rmdir(const char *path)
 {
-	int ret;
-	struct inode_info *inode;
-
 	log_dbg("vbfs_fuse_rmdir %s\n", path);
 
-	inode = pathname_to_inode(path);
-	if (IS_ERR(inode))
-		return PTR_ERR(inode);
-
-	ret = vbfs_rmdir(inode);
-
-	return ret;
+	return vbfs_rmdir(vbfs_fs, path);
 }
 
 static int vbfs_fuse_unlink(const char *path)
 {
-	int ret;
-	struct inode_info *inode;
-
 	log_dbg("vbfs_fuse_unlink %s\n", path);
 
-	inode = pathname_to_inode(path);
-	if (IS_ERR(inode))
-		return PTR_ERR(inode);
-
-	ret = vbfs_unlink(inode);
-
-	return ret;
+	return vbfs_unlink(vbfs_fs, path);
 }
 
 static int vbfs_fuse_rename(const char *from, const char *to)
 {
-	int ret;
-	struct inode_info *inode;
-
 	log_dbg("vbfs_fuse_rename from %s, to %s\n", from, to);
 
-	inode = pathname_to_inode(from);
-	if (IS_ERR(inode))
-		return PTR_ERR(inode);
-
-	ret = vbfs_rename(inode, to);
-	vbfs_inode_close(inode);
-	if (ret)
-		return ret;
-
-	return 0;
+	return vbfs_rename(vbfs_fs, from, to);
 }
 
 static int vbfs_fuse_truncate(const char *path, off_t size)
 {
-	int ret;
-	struct inode_info *inode;
-
 	log_dbg("vbfs_fuse_truncate\n");
 
-	inode = pathname_to_inode(path);
-	if (IS_ERR(inode))
-		return PTR_ERR(inode);
-
-	ret = vbfs_truncate(inode, size);
-	vbfs_inode_close(inode);
-	if (ret)
-		return -1;
-
-	return 0;
+	return vbfs_truncate(vbfs_fs, path, size);
 }
 
 static int vbfs_fuse_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
 {
-	int ret;
-	struct inode_info *inode;
-
 	log_dbg("vbfs_fuse_ftruncate\n");
 
+	if (is_stats_path(path))
+		return -EACCES;
 
-	if (fi->fh) {
-		inode = (struct inode_info *) fi->fh;
-		ret = vbfs_truncate(inode, size);
-		if (ret)
-			return -1;
-		//vbfs_update_times(inode, UPDATE_ATIME);
-	}
+	if (fi->fh)
+		return vbfs_ftruncate(FI_FILE(fi), size);
 
 	return 0;
 }
 
 static int vbfs_fuse_open(const char *path, struct fuse_file_info *fi)
 {
-	int ret = 0;
-	struct inode_info *inode;
+	int ret;
+	vbfs_file_t *file;
+	void *sf;
 
 	log_dbg("vbfs_fuse_open %s\n", path);
 
-	inode = pathname_to_inode(path);
-	if (IS_ERR(inode))
-		ret = PTR_ERR(inode);
-
-	if (-ENOENT == ret) {
-		if (fi->flags & O_CREAT) {
-			/* create file type inode */
-			ret = vbfs_create_obj(path, VBFS_FT_REG_FILE);
-			if (ret)
-				return ret;
-
-			inode = pathname_to_inode(path);
-			if (IS_ERR(inode))
-				return PTR_ERR(inode);
-		} else
+	if (is_stats_path(path)) {
+		ret = stats_open(path, fi->flags, &sf);
+		if (ret)
 			return ret;
+
+		/* size changes between snapshots, do not let the page cache trim it */
+		fi->direct_io = 1;
+		fi->fh = (uint64_t) sf;
+		return 0;
 	}
 
-	fi->fh = (uint64_t) inode;
+	ret = vbfs_open(vbfs_fs, path, fi->flags, &file);
+	if (ret)
+		return ret;
+
+	/* a file being recorded grows past the size the kernel has cached */
+	if ((fi->flags & O_ACCMODE) == O_RDONLY && vbfs_is_growing(file))
+		fi->direct_io = 1;
+	fi->fh = (uint64_t) file;
 
 	return 0;
 }
@@ -340,19 +304,18 @@ static int vbfs_fuse_open(const char *path, struct fuse_file_info *fi)
 static int vbfs_fuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
 	int ret;
-	struct inode_info *inode;
+	vbfs_file_t *file;
 
 	log_dbg("vbfs_fuse_create %s\n", path);
 
-	ret = vbfs_create_obj(path, VBFS_FT_REG_FILE);
+	if (is_stats_path(path))
+		return -EEXIST;
+
+	ret = vbfs_open(vbfs_fs, path, fi->flags | O_CREAT, &file);
 	if (ret)
 		return ret;
 
-	inode = pathname_to_inode(path);
-	if (IS_ERR(inode))
-		return PTR_ERR(inode);
-
-	fi->fh = (uint64_t) inode;
+	fi->fh = (uint64_t) file;
 
 	return 0;
 }
@@ -360,101 +323,242 @@ static int vbfs_fuse_create(const char *path, mode_t mode, struct fuse_file_info
 static int vbfs_fuse_read(const char *path, char *buf, size_t size, off_t offset,
 				struct fuse_file_info *fi)
 {
-	int ret = 0;
-	struct inode_info *inode;
+	if (is_stats_path(path))
+		return stats_read((void *) fi->fh, buf, size, offset);
 
-	if (fi->fh) {
-		inode = (struct inode_info *) fi->fh;
-		ret = vbfs_read_buf(inode, buf, size, offset);
-		//vbfs_update_times(inode, UPDATE_ATIME);
-	}
+	if (fi->fh)
+		return vbfs_pread(FI_FILE(fi), buf, size, offset);
 
-	return ret;
+	return 0;
 }
 
 static int vbfs_fuse_write(const char *path, const char *buf, size_t size, off_t offset,
 				struct fuse_file_info *fi)
 {
-	int ret = 0;
-	struct inode_info *inode;
-
 	//log_dbg("%s, %u, %d\n", path, size, offset);
 
-	if (fi->fh) {
-		inode = (struct inode_info *) fi->fh;
-		ret = vbfs_write_buf(inode, buf, size, offset);
-		//vbfs_update_times(inode, UPDATE_ATIME | UPDATE_MTIME);
+	if (fi->fh)
+		return vbfs_pwrite(FI_FILE(fi), buf, size, offset);
+
+	return 0;
+}
+
+static void vbfs_fuse_poll_notify(void *arg, int ready)
+{
+	struct fuse_pollhandle *ph = arg;
+
+	if (ready)
+		fuse_notify_poll(ph);
+	fuse_pollhandle_destroy(ph);
+}
+
+/*
+ * a tail reader at the end of a file being recorded polls for more, the
+ * handle is woken when the file grows. fuse 2.9 has no inode to notify
+ * from the path api, the growing file is opened direct_io instead.
+ * */
+static int vbfs_fuse_poll(const char *path, struct fuse_file_info *fi,
+				struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+	vbfs_file_t *file = FI_FILE(fi);
+
+	if (is_stats_path(path) || NULL == file) {
+		*reventsp |= POLLIN | POLLRDNORM;
+		goto out;
 	}
 
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		*reventsp |= POLLOUT | POLLWRNORM;
+	if (vbfs_watch(file, ph ? vbfs_fuse_poll_notify : NULL, ph)) {
+		*reventsp |= POLLIN | POLLRDNORM;
+		goto out;
+	}
+
+	return 0;
+
+out:
+	if (ph)
+		fuse_pollhandle_destroy(ph);
+	return 0;
+}
+
+/*
+ * segment template of a directory, in bytes as decimal text.
+ * seek table of a file: set "time offset" to add an entry, get
+ * user.vbfs.seek.<time> for the offset of <time>.
+ * */
+#define VBFS_XATTR_SEGMENT "user.vbfs.segment_size"
+#define VBFS_XATTR_SEEK "user.vbfs.seek"
+
+static int vbfs_fuse_seek_add(const char *path, const char *buf)
+{
+	unsigned long long time, offset;
+	vbfs_file_t *fp;
+	int ret;
+
+	if (sscanf(buf, "%llu %llu", &time, &offset) != 2)
+		return -EINVAL;
+
+	ret = vbfs_open(vbfs_fs, path, O_WRONLY, &fp);
+	if (ret)
+		return ret;
+	ret = vbfs_seek_add(fp, time, offset);
+	vbfs_close(fp);
+
 	return ret;
 }
 
+static int vbfs_fuse_seek_get(const char *path, const char *name, char *buf,
+				size_t len)
+{
+	unsigned long long time;
+	vbfs_file_t *fp;
+	char *end;
+	off_t offset;
+	int ret;
+
+	time = strtoull(name, &end, 10);
+	if (*name == '\0' || *end != '\0')
+		return -ENODATA;
+
+	ret = vbfs_open(vbfs_fs, path, O_RDONLY, &fp);
+	if (ret)
+		return ret;
+	offset = vbfs_seek_time(fp, time);
+	vbfs_close(fp);
+
+	if (offset < 0)
+		return offset == -ENOENT ? -ENODATA : offset;
+
+	return snprintf(buf, len, "%llu", (unsigned long long) offset);
+}
+
+static int vbfs_fuse_setxattr(const char *path, const char *name, const char *value,
+				size_t size, int flags)
+{
+	char buf[32];
+	char *end;
+	unsigned long long seg;
+
+	if (strcmp(name, VBFS_XATTR_SEGMENT) && strcmp(name, VBFS_XATTR_SEEK))
+		return -ENOTSUP;
+	if (size == 0 || size >= sizeof(buf))
+		return -EINVAL;
+
+	memcpy(buf, value, size);
+	buf[size] = '\0';
+	if (0 == strcmp(name, VBFS_XATTR_SEEK))
+		return vbfs_fuse_seek_add(path, buf);
+
+	seg = strtoull(buf, &end, 10);
+	if (*end != '\0' && *end != '\n')
+		return -EINVAL;
+
+	return vbfs_set_segment(vbfs_fs, path, seg);
+}
+
+static int vbfs_fuse_getxattr(const char *path, const char *name, char *value,
+				size_t size)
+{
+	char buf[32];
+	off_t seg;
+	int ret, len;
+
+	if (0 == strncmp(name, VBFS_XATTR_SEEK ".", strlen(VBFS_XATTR_SEEK) + 1)) {
+		len = vbfs_fuse_seek_get(path, name + strlen(VBFS_XATTR_SEEK) + 1,
+					buf, sizeof(buf));
+		if (len < 0)
+			return len;
+		goto out;
+	}
+
+	if (strcmp(name, VBFS_XATTR_SEGMENT))
+		return -ENODATA;
+
+	ret = vbfs_get_segment(vbfs_fs, path, &seg);
+	if (ret)
+		return ret;
+	if (0 == seg)
+		return -ENODATA;
+
+	len = snprintf(buf, sizeof(buf), "%llu", (unsigned long long) seg);
+out:
+	if (0 == size)
+		return len;
+	if (size < len)
+		return -ERANGE;
+	memcpy(value, buf, len);
+
+	return len;
+}
+
 static int vbfs_fuse_statfs(const char *path, struct statvfs *stbuf)
 {
+	STATS_OP(STAT_STATFS);
+
 	log_dbg("vbfs_fuse_statfs %s\n", path);
 
-	return 0;
+	return vbfs_statfs(vbfs_fs, stbuf);
 }
 
 static int vbfs_fuse_flush(const char *path, struct fuse_file_info *fi)
 {
-	int ret = 0;
-	struct inode_info *inode;
-
 	log_dbg("vbfs_fuse_flush %s\n", path);
 
-	if (fi->fh) {
-		inode = (struct inode_info *) fi->fh;
-		vbfs_update_times(inode, UPDATE_ATIME | UPDATE_MTIME);
-		ret = sync_file(inode);
-	}
+	if (is_stats_path(path))
+		return 0;
 
-	return ret;
+	if (fi->fh)
+		return vbfs_flush(FI_FILE(fi));
+
+	return 0;
 }
 
 static int vbfs_fuse_release(const char *path, struct fuse_file_info *fi)
 {
-	struct inode_info *inode;
-	int ret = 0;
-
 	log_dbg("vbfs_fuse_release %s\n", path);
 
-	if (fi->fh) {
-		inode = (struct inode_info *) fi->fh;
+	if (is_stats_path(path))
+		return stats_release((void *) fi->fh);
 
-		ret = vbfs_inode_close(inode);
-		if (ret)
-			return ret;
-	}
+	if (fi->fh)
+		return vbfs_close(FI_FILE(fi));
 
 	return 0;
 }
 
 static int vbfs_fuse_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
 {
-	int ret = 0;
-	struct inode_info *inode;
-
 	log_dbg("vbfs_fuse_fsync\n");
 
-	if (fi->fh) {
-		inode = (struct inode_info *) fi->fh;
-		vbfs_update_times(inode, UPDATE_ATIME | UPDATE_MTIME);
-		ret = sync_file(inode);
-	}
+	if (is_stats_path(path))
+		return 0;
 
-	return ret;
+	if (fi->fh)
+		return vbfs_fsync(FI_FILE(fi));
+
+	return 0;
+}
+
+static int vbfs_fuse_fallocate(const char *path, int mode, off_t offset, off_t len,
+				struct fuse_file_info *fi)
+{
+	log_dbg("vbfs_fuse_fallocate %s\n", path);
+
+	if (is_stats_path(path))
+		return -EACCES;
+
+	if (fi->fh)
+		return vbfs_fallocate(FI_FILE(fi), mode, offset, len);
+
+	return -EBADF;
 }
 
 static void vbfs_fuse_destroy(void *data)
 {
 	log_dbg("vbfs_fuse_destroy\n");
 
-	queue_destroy(get_meta_queue());
-	queue_destroy(get_data_queue());
-	ioengine->io_exit();
-
-	super_umount_clean();
+	vbfs_umount(vbfs_fs);
 
 	log_close();
 }
@@ -462,43 +566,47 @@ static void vbfs_fuse_destroy(void *data)
 static void *vbfs_fuse_init(struct fuse_conn_info *conn)
 {
 	int ret;
+	struct vbfs_mount_opts opts = {
+		.hugepages = vbfs_opts.hugepages,
+		.membench = vbfs_opts.membench,
+		.small_tail = vbfs_opts.small_tail,
+		.tail_idle_ms = vbfs_opts.tail_idle,
+		.recycle = vbfs_opts.recycle,
+		.data_dev = vbfs_opts.datadev,
+		.record_deadline_ms = vbfs_opts.record_deadline,
+		.read_limit_kbps = vbfs_opts.read_limit,
+		.read_total_kbps = vbfs_opts.read_total,
+		.write_budget_kbps = vbfs_opts.write_budget,
+		.stream_kbps = vbfs_opts.stream_rate,
+	};
+
+	ret = log_async_start();
+	if (ret)
+		log_err("async log start error, %s\n", strerror(-ret));
 
 	log_dbg("vbfs_fuse_init\n");
 
-	ret = meta_queue_create();
+	/* threads do not survive the daemonize fork, start them here */
+	ret = vbfs_start(vbfs_fs, &opts);
 	if (ret) {
-		log_err("meta queue create error\n");
+		log_err("vbfs start error, %s\n", strerror(-ret));
 		exit(1);
 	}
 
-	ret = data_queue_create();
-	if (ret) {
-		log_err("data queue create error\n");
-		exit(1);
-	}
-
-	ret = ioengine->io_init();
-	if (ret) {
-		log_err("io thread init error\n");
-		exit(1);
-	}
-
-	ret = init_root_inode();
-	if (ret < 0) {
-		log_err("root inode init error\n");
-		exit(1);
+	if (vbfs_opts.ringsock) {
+		ret = vbfs_ring_serve(vbfs_fs, vbfs_opts.ringsock);
+		if (ret)
+			log_err("ring socket %s error, %s\n", vbfs_opts.ringsock,
+				strerror(-ret));
 	}
 
-	sync_super();
-
 	return NULL;
 }
 
 int main(int argc, char **argv)
 {
 	int ret = 0;
-	int i_argc;
-	char **s_argv;
+	struct fuse_args args;
 
 	if (argc < 3) {
 		fprintf(stderr, "argument error: %s <mountpoint> [options] <device>\n", argv[0]);
@@ -506,21 +614,39 @@ int main(int argc, char **argv)
 	}
 
 	log_init();
-	rdwr_register();
 
-	ret = init_super(argv[argc - 1]);
+	ret = vbfs_load(argv[argc - 1], &vbfs_fs);
 	if (ret < 0) {
 		fprintf(stderr, "Invalidate filesystem\n");
 		exit(1);
 	}
 
-	i_argc = argc - 1;
-	s_argv = argv;
-	s_argv[argc - 1] = NULL;
+	argv[argc - 1] = NULL;
+	args.argc = argc - 1;
+	args.argv = argv;
+	args.allocated = 0;
+
+	if (fuse_opt_parse(&args, &vbfs_opts, vbfs_opt_spec, NULL) == -1)
+		exit(1);
+
+	if (vbfs_opts.hugepages && mp_parse_backing(vbfs_opts.hugepages) < 0) {
+		fprintf(stderr, "hugepages should be none, thp or hugetlb\n");
+		exit(1);
+	}
+
+	if (vbfs_opts.loglevel) {
+		ret = log_parse_level(vbfs_opts.loglevel);
+		if (ret < 0) {
+			fprintf(stderr, "loglevel should be error, warning or debug\n");
+			exit(1);
+		}
+		log_set_level(ret);
+	}
 
-	ret = fuse_main(i_argc, s_argv, &vbfs_op, NULL);
+	ret = fuse_main(args.argc, args.argv, &vbfs_op, NULL);
 	log_err("fuse_main end\n");
 
+	fuse_opt_free_args(&args);
+
 	return ret;
 }
-
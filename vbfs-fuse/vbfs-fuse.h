@@ -2,7 +2,9 @@
 #define __VBFS_FUSE_H__
 
 #include "../vbfs_fs.h"
+#include "libvbfs.h"
 #include "utils.h"
+#include "mempool.h"
 #include "super.h"
 #include "dir.h"
 #include "extend.h"
@@ -36,8 +38,10 @@ struct active_inode {
 	pthread_mutex_t lock;
 };
 
-typedef struct {
+typedef struct vbfs {
 	int fd;
+	int data_fd; /* bulk device of a split layout, -1 for none */
+	int started;
 
 	struct active_inode active_i;
 	struct superblock_vbfs super;
@@ -434,7 +434,7 @@ int dir_init_default_fst(struct inode_vbfs *inode_v)
 	}
 	dir[1] = mp_malloc(sizeof(struct dentry_vbfs));
 	if (NULL == dir[1]) {
-		free(dir[0]);
+		mp_free(dir[0]);
 		put_edata_by_inode(inode_v->i_extend, inode_v);
 		return -ENOMEM;
 	}
@@ -69,7 +69,7 @@ static struct extend_data *open_edata_unlocked(const __u32 extend_no, \
 		}
 	}
 
-	edata = malloc(sizeof(struct extend_data));
+	edata = mp_malloc(sizeof(struct extend_data));
 	if (NULL == edata) {
 		*ret = -ENOMEM;
 		return NULL;
@@ -137,8 +137,8 @@ int close_edata(struct extend_data *edata)
 
 	pthread_mutex_destroy(&edata->ed_lock);
 	if (BUFFER_NOT_READY != edata->status)
-		free(edata->buf);
-	free(edata);
+		mp_free(edata->buf);
+	mp_free(edata);
 
 	return ret;
 }
@@ -3,9 +3,27 @@
 
 #define LOG_LINE_LEN 512
 
-extern int is_debug;
+enum {
+	LOG_LV_ERR,
+	LOG_LV_WARNING,
+	LOG_LV_DEBUG,
+};
+
+/*
+ * messages above LOG_LV_MAX are compiled out,
+ * build with -DLOG_LV_MAX=0 to keep only the errors
+ * */
+#ifndef LOG_LV_MAX
+#define LOG_LV_MAX LOG_LV_DEBUG
+#endif
+
+/* runtime level, messages above it are dropped before formatting */
+extern int log_level;
 
 int log_init(void);
+int log_async_start(void);
+void log_set_level(int level);
+int log_parse_level(const char *name);
 void log_debug(const char *fmt, ...);
 void log_warning(const char *fmt, ...);
 void log_error(const char *fmt, ...);
@@ -18,7 +36,8 @@ do { \
 
 #define log_dbg(fmt, args...) \
 do { \
-	if (is_debug) \
+	if (LOG_LV_MAX >= LOG_LV_DEBUG && \
+	    __builtin_expect(log_level >= LOG_LV_DEBUG, 0)) \
 		log_debug("%s(%d) " fmt, __FUNCTION__, __LINE__, ##args); \
 } while(0)
 
@@ -39,6 +39,19 @@ static int vbfs_fuse_fsync(const char *path, int isdatasync, struct fuse_file_in
 static void *vbfs_fuse_init(struct fuse_conn_info *conn);
 static void vbfs_fuse_destroy(void *data);
 
+struct vbfs_options {
+	char *loglevel;
+};
+
+static struct vbfs_options vbfs_opts;
+
+#define VBFS_OPT(t, p) { t, offsetof(struct vbfs_options, p), 1 }
+
+static const struct fuse_opt vbfs_opt_spec[] = {
+	VBFS_OPT("loglevel=%s", loglevel),
+	FUSE_OPT_END
+};
+
 static struct fuse_operations vbfs_op = {
 	.getattr	= vbfs_fuse_getattr,
 	.fgetattr	= vbfs_fuse_fgetattr,
@@ -100,7 +113,7 @@ static int vbfs_fuse_fgetattr(const char *path, struct stat *stbuf,
 
 	if (fi->fh) {
 		inode_v = (struct inode_vbfs *) fi->fh;
-		log_err("addr %p", inode_v);
+		log_dbg("addr %p\n", inode_v);
 		fill_stbuf_by_inode(stbuf, inode_v);
 	}
 
@@ -343,7 +356,7 @@ static int vbfs_fuse_read(const char *path, char *buf, size_t size, off_t offset
 
 	if (fi->fh) {
 		inode_v = (struct inode_vbfs *) fi->fh;
-		log_err("addr %p", inode_v);
+		log_dbg("addr %p\n", inode_v);
 		ret = vbfs_read_buf(inode_v, buf, size, offset);
 	}
 
@@ -360,7 +373,7 @@ static int vbfs_fuse_write(const char *path, const char *buf, size_t size, off_t
 
 	if (fi->fh) {
 		inode_v = (struct inode_vbfs *) fi->fh;
-		log_err("addr %p", inode_v);
+		log_dbg("addr %p\n", inode_v);
 		ret = vbfs_write_buf(inode_v, buf, size, offset);
 	}
 
@@ -413,6 +426,12 @@ static int vbfs_fuse_fsync(const char *path, int isdatasync, struct fuse_file_in
 
 static void *vbfs_fuse_init(struct fuse_conn_info *conn)
 {
+	int ret;
+
+	ret = log_async_start();
+	if (ret)
+		log_err("async log start error, %s\n", strerror(-ret));
+
 	log_dbg("vbfs_fuse_init\n");
 
 	return NULL;
@@ -447,8 +466,7 @@ static void ctx_equeue_init()
 int main(int argc, char **argv)
 {
 	int ret = 0;
-	int i_argc;
-	char **s_argv;
+	struct fuse_args args;
 
 	if (argc < 3) {
 		fprintf(stderr, "argument error: %s <mountpoint> [options] <device>\n", argv[0]);
@@ -463,9 +481,22 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	i_argc = argc - 1;
-	s_argv = argv;
-	s_argv[argc - 1] = NULL;
+	argv[argc - 1] = NULL;
+	args.argc = argc - 1;
+	args.argv = argv;
+	args.allocated = 0;
+
+	if (fuse_opt_parse(&args, &vbfs_opts, vbfs_opt_spec, NULL) == -1)
+		exit(1);
+
+	if (vbfs_opts.loglevel) {
+		ret = log_parse_level(vbfs_opts.loglevel);
+		if (ret < 0) {
+			fprintf(stderr, "loglevel should be error, warning or debug\n");
+			exit(1);
+		}
+		log_set_level(ret);
+	}
 
 	ctx_equeue_init();
 
@@ -476,9 +507,11 @@ int main(int argc, char **argv)
 	}
 	vbfs_init_bitmap();
 
-	ret = fuse_main(i_argc, s_argv, &vbfs_op, NULL);
+	ret = fuse_main(args.argc, args.argv, &vbfs_op, NULL);
 	log_err("fuse_main end\n");
 
+	fuse_opt_free_args(&args);
+
 	return ret;
 }
 
@@ -0,0 +1,1330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef HAVE_LIBVBFS
+#include "libvbfs.h"
+#endif
+
+/*
+ * simulate camera recording against a vbfs mount point:
+ * every stream writes paced segments, rotates them, and deletes the
+ * oldest beyond the retention count, while playback readers read the
+ * closed segments back and tail readers follow the segments being
+ * written. a file backed image is benched by mounting it
+ * with vbfs_fuse first, or, when built with libvbfs, opened in process
+ * with -D.
+ * */
+
+#define SUB_BITS 5
+#define SUB_COUNT (1 << SUB_BITS)
+#define MAX_BITS 40
+#define NR_BUCKETS ((MAX_BITS - SUB_BITS + 1) * SUB_COUNT)
+
+#define MAX_SEGMENTS 1024
+
+struct bench_paramters {
+	char *dir;
+	char *device;
+	char *ring_sock;
+	int nr_streams;
+	double bitrate_mbit;	/* per stream, 0: as fast as possible */
+	unsigned int write_size;
+	unsigned long segment_size;
+	int retention;
+	int nr_readers;
+	int nr_tails;		/* live readers of the open segments */
+	double playback_speed;	/* 0: as fast as possible */
+	int duration;
+	int fsync_on_rotate;
+	int keep;
+	pid_t fs_pid;
+	char *output;
+	int tail_idle_ms;	/* small tail mode of libvbfs, -1: off */
+	int recycle;		/* the filesystem drops old segments when full */
+	int seg_template;	/* stream dirs get a segment template of -s */
+	int seek_table;		/* writers index every second, readers seek */
+};
+
+struct hist {
+	unsigned long count;
+	unsigned long sum;
+	unsigned long max;
+	unsigned long buckets[NR_BUCKETS];
+};
+
+enum {
+	SEG_CREATING,	/* slot taken, the file may not exist yet */
+	SEG_OPEN,
+	SEG_CLOSED,
+	SEG_DELETED,
+};
+
+struct segment {
+	unsigned int no;
+	unsigned long size;
+	int state;
+	int readers;
+};
+
+struct stream {
+	int id;
+	pthread_t tid;
+
+	/* protected by seg_lock */
+	struct segment segs[MAX_SEGMENTS];
+	unsigned int seg_head;	/* oldest not deleted */
+	unsigned int seg_tail;	/* next to create */
+
+	unsigned long bytes;
+	unsigned long late;
+	unsigned long created;
+	unsigned long deleted;
+	unsigned long recycled;	/* gone before retention got to them */
+	unsigned long errors;
+	struct hist write_lat;
+	struct hist rotate_lat;
+};
+
+struct reader {
+	int id;
+	pthread_t tid;
+
+	unsigned long bytes;
+	unsigned long segments;
+	unsigned long errors;
+	struct hist read_lat;
+	struct hist seek_lat;
+};
+
+static struct bench_paramters params;
+static struct stream *streams;
+static struct reader *readers;
+static struct reader *tails;
+static pthread_mutex_t seg_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int stop;
+static char *pattern;
+
+static void bench_init_paramters()
+{
+	params.dir = NULL;
+	params.device = NULL;
+	params.ring_sock = NULL;
+	params.nr_streams = 16;
+	params.bitrate_mbit = 4;
+	params.write_size = 64 * 1024;
+	params.segment_size = 64UL * 1024 * 1024;
+	params.retention = 4;
+	params.nr_readers = 2;
+	params.nr_tails = 0;
+	params.playback_speed = 1;
+	params.duration = 30;
+	params.fsync_on_rotate = 0;
+	params.keep = 0;
+	params.fs_pid = 0;
+	params.output = NULL;
+	params.tail_idle_ms = -1;
+	params.recycle = 0;
+	params.seg_template = 0;
+	params.seek_table = 0;
+}
+
+static void cmd_usage()
+{
+	fprintf(stderr, "Usage: vbfs_bench [options] -d dir\n");
+#ifdef HAVE_LIBVBFS
+	fprintf(stderr, "       vbfs_bench [options] -D device\n");
+#endif
+	fprintf(stderr, "[options]\n");
+	fprintf(stderr, "-d directory on the vbfs mount to record into\n");
+#ifdef HAVE_LIBVBFS
+	fprintf(stderr, "-D vbfs device or image, opened with libvbfs,\n");
+	fprintf(stderr, "\t\t-d is then a directory inside it\n");
+	fprintf(stderr, "-S append through the ring socket of the vbfs,\n");
+	fprintf(stderr, "\t\t-d must be its root, served here with -D\n");
+	fprintf(stderr, "-T small tail mode of -D, tails idle this many ms\n");
+	fprintf(stderr, "\t\tare written out, 0 for the default\n");
+#endif
+	fprintf(stderr, "-n number of camera streams\n");
+	fprintf(stderr, "\t\tdefault 16\n");
+	fprintf(stderr, "-b bitrate of one stream in Mbit/s, 0 unpaced\n");
+	fprintf(stderr, "\t\tdefault 4\n");
+	fprintf(stderr, "-w write size in bytes\n");
+	fprintf(stderr, "\t\tdefault 65536\n");
+	fprintf(stderr, "-s segment size in MB\n");
+	fprintf(stderr, "\t\tdefault 64\n");
+	fprintf(stderr, "-r segments kept per stream, older ones are deleted\n");
+	fprintf(stderr, "\t\tdefault 4\n");
+	fprintf(stderr, "-R number of playback readers\n");
+	fprintf(stderr, "\t\tdefault 2\n");
+	fprintf(stderr, "-L number of tail readers, each follows the segment\n");
+	fprintf(stderr, "\t\ta stream is writing from its start, default 0\n");
+	fprintf(stderr, "-p playback speed, 1 realtime, 0 unpaced\n");
+	fprintf(stderr, "\t\tdefault 1\n");
+	fprintf(stderr, "-t duration in seconds\n");
+	fprintf(stderr, "\t\tdefault 30\n");
+	fprintf(stderr, "-f fsync a segment when it is rotated\n");
+	fprintf(stderr, "-k keep the files after the run\n");
+	fprintf(stderr, "-C the filesystem recycles the oldest segments when full\n");
+	fprintf(stderr, "\t\t(-D mounts with recycle), segments it took are not errors\n");
+	fprintf(stderr, "-G give every stream dir a segment template of the segment size\n");
+	fprintf(stderr, "-I writers add a seek table entry per second of stream,\n");
+	fprintf(stderr, "\t\treaders start at a random second looked up in it\n");
+	fprintf(stderr, "-P pid of vbfs_fuse, to report its cpu per GB\n");
+	fprintf(stderr, "-o write the json report to a file\n");
+	exit(1);
+}
+
+static void parse_options(int argc, char **argv)
+{
+	static const char *option_string = "d:D:S:T:n:b:w:s:r:R:L:p:t:fkCGIP:o:h";
+	int option = 0;
+
+	while ((option = getopt(argc, argv, option_string)) != EOF) {
+		switch (option) {
+			case 'd':
+				params.dir = optarg;
+				break;
+#ifdef HAVE_LIBVBFS
+			case 'D':
+				params.device = optarg;
+				break;
+			case 'S':
+				params.ring_sock = optarg;
+				break;
+			case 'T':
+				params.tail_idle_ms = atoi(optarg);
+				break;
+#endif
+			case 'n':
+				params.nr_streams = atoi(optarg);
+				break;
+			case 'b':
+				params.bitrate_mbit = atof(optarg);
+				break;
+			case 'w':
+				params.write_size = atoi(optarg);
+				break;
+			case 's':
+				params.segment_size = atol(optarg) * 1024 * 1024;
+				break;
+			case 'r':
+				params.retention = atoi(optarg);
+				break;
+			case 'R':
+				params.nr_readers = atoi(optarg);
+				break;
+			case 'L':
+				params.nr_tails = atoi(optarg);
+				break;
+			case 'p':
+				params.playback_speed = atof(optarg);
+				break;
+			case 't':
+				params.duration = atoi(optarg);
+				break;
+			case 'f':
+				params.fsync_on_rotate = 1;
+				break;
+			case 'k':
+				params.keep = 1;
+				break;
+			case 'C':
+				params.recycle = 1;
+				break;
+			case 'G':
+				params.seg_template = 1;
+				break;
+			case 'I':
+				params.seek_table = 1;
+				break;
+			case 'P':
+				params.fs_pid = atoi(optarg);
+				break;
+			case 'o':
+				params.output = optarg;
+				break;
+			default:
+				cmd_usage();
+		}
+	}
+
+	if (NULL == params.dir) {
+		if (NULL == params.device)
+			cmd_usage();
+		params.dir = "";
+	}
+
+	if (params.nr_streams <= 0 || params.write_size == 0 ||
+	    params.segment_size < params.write_size || params.duration <= 0 ||
+	    params.retention <= 0 || params.retention >= MAX_SEGMENTS - 1 ||
+	    params.nr_readers < 0 || params.nr_tails < 0 ||
+	    params.bitrate_mbit < 0 ||
+	    params.playback_speed < 0) {
+		fprintf(stderr, "invalid parameters\n");
+		exit(1);
+	}
+}
+
+/*
+ * histogram, same bucket layout as vbfs-fuse/stats.c
+ * */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int value_to_bucket(uint64_t v)
+{
+	int msb, shift;
+
+	if (v < SUB_COUNT)
+		return v;
+
+	msb = 63 - __builtin_clzll(v);
+	if (msb >= MAX_BITS)
+		return NR_BUCKETS - 1;
+
+	shift = msb - SUB_BITS;
+
+	return (shift + 1) * SUB_COUNT + (v >> shift) - SUB_COUNT;
+}
+
+static uint64_t bucket_to_value(int idx)
+{
+	int shift;
+
+	if (idx < SUB_COUNT)
+		return idx;
+
+	shift = idx / SUB_COUNT - 1;
+
+	return ((uint64_t) (SUB_COUNT + idx % SUB_COUNT) << shift)
+		+ ((1ULL << shift) >> 1);
+}
+
+static void hist_add(struct hist *h, uint64_t ns)
+{
+	h->buckets[value_to_bucket(ns)]++;
+	h->count++;
+	h->sum += ns;
+	if (ns > h->max)
+		h->max = ns;
+}
+
+static void hist_merge(struct hist *to, struct hist *from)
+{
+	int i;
+
+	for (i = 0; i < NR_BUCKETS; i++)
+		to->buckets[i] += from->buckets[i];
+	to->count += from->count;
+	to->sum += from->sum;
+	if (from->max > to->max)
+		to->max = from->max;
+}
+
+static double hist_percentile_us(struct hist *h, double q)
+{
+	unsigned long target, seen = 0;
+	uint64_t v;
+	int i;
+
+	if (0 == h->count)
+		return 0;
+
+	target = (unsigned long) (h->count * q);
+	if (target == 0)
+		target = 1;
+
+	for (i = 0; i < NR_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target) {
+			v = bucket_to_value(i);
+			return (v < h->max ? v : h->max) / 1000.0;
+		}
+	}
+
+	return h->max / 1000.0;
+}
+
+/*
+ * pacing
+ * */
+static void sleep_until(uint64_t deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline / 1000000000;
+	ts.tv_nsec = deadline % 1000000000;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* ns to move @bytes at @mbit Mbit/s, 0 when unpaced */
+static uint64_t pace_ns(unsigned long bytes, double mbit)
+{
+	if (mbit <= 0)
+		return 0;
+
+	return (uint64_t) (bytes * 8 * 1000.0 / mbit);
+}
+
+/*
+ * file access, through the mount point or in process with libvbfs
+ * */
+struct bench_file {
+	int fd;
+#ifdef HAVE_LIBVBFS
+	vbfs_file_t *vf;
+	vbfs_ring_t *ring;
+	int conn; /* ring connection of a writer, -1 otherwise */
+#endif
+	off_t off;
+};
+
+#ifdef HAVE_LIBVBFS
+static vbfs_t *vbfs;
+#endif
+
+static void bench_file_init(struct bench_file *f, int conn)
+{
+	memset(f, 0, sizeof(*f));
+	f->fd = -1;
+#ifdef HAVE_LIBVBFS
+	f->conn = conn;
+#endif
+}
+
+static int bench_open(struct bench_file *f, const char *path, int flags)
+{
+	f->off = 0;
+#ifdef HAVE_LIBVBFS
+	f->ring = NULL;
+	/* ring paths are inside the vbfs, -d is its root */
+	if (f->conn >= 0)
+		return vbfs_ring_open(f->conn, path + strlen(params.dir),
+					flags & O_TRUNC, 0, &f->ring);
+	if (vbfs)
+		return vbfs_open(vbfs, path, flags, &f->vf);
+#endif
+	f->fd = open(path, flags, 0644);
+
+	return f->fd < 0 ? -errno : 0;
+}
+
+static ssize_t bench_write(struct bench_file *f, const void *buf, size_t len)
+{
+#ifdef HAVE_LIBVBFS
+	ssize_t ret;
+
+	if (f->ring) {
+		/* the drain thread frees room within a few ms */
+		while ((ret = vbfs_ring_append(f->ring, buf, len)) == -EAGAIN)
+			usleep(200);
+		return ret;
+	}
+	if (vbfs)
+		return vbfs_append(f->vf, buf, len);
+#endif
+	return write(f->fd, buf, len);
+}
+
+static ssize_t bench_read(struct bench_file *f, void *buf, size_t len)
+{
+	ssize_t ret;
+
+#ifdef HAVE_LIBVBFS
+	if (vbfs) {
+		ret = vbfs_pread(f->vf, buf, len, f->off);
+		if (ret > 0)
+			f->off += ret;
+		return ret;
+	}
+#endif
+	ret = read(f->fd, buf, len);
+
+	return ret;
+}
+
+static void bench_fsync(struct bench_file *f)
+{
+#ifdef HAVE_LIBVBFS
+	if (f->ring) {
+		vbfs_ring_fsync(f->ring);
+		return;
+	}
+	if (vbfs) {
+		vbfs_fsync(f->vf);
+		return;
+	}
+#endif
+	fsync(f->fd);
+}
+
+static void bench_close(struct bench_file *f)
+{
+#ifdef HAVE_LIBVBFS
+	if (f->ring) {
+		vbfs_ring_close(f->ring);
+		return;
+	}
+	if (vbfs) {
+		vbfs_close(f->vf);
+		return;
+	}
+#endif
+	close(f->fd);
+}
+
+/* @time in ms since the segment was opened */
+static int bench_seek_add(struct bench_file *f, uint64_t time, off_t offset)
+{
+	char buf[64];
+	int len;
+
+#ifdef HAVE_LIBVBFS
+	/* the ring carries data only */
+	if (f->ring)
+		return 0;
+	if (vbfs)
+		return vbfs_seek_add(f->vf, time, offset);
+#endif
+	len = snprintf(buf, sizeof(buf), "%llu %llu", (unsigned long long) time,
+			(unsigned long long) offset);
+
+	return fsetxattr(f->fd, "user.vbfs.seek", buf, len, 0) < 0 ? -errno : 0;
+}
+
+/* move the read offset to the entry at or before @time */
+static int bench_seek_time(struct bench_file *f, uint64_t time)
+{
+	char name[64], buf[32];
+	ssize_t len;
+	off_t off;
+
+#ifdef HAVE_LIBVBFS
+	if (vbfs) {
+		off = vbfs_seek_time(f->vf, time);
+		if (off < 0)
+			return off;
+		f->off = off;
+		return 0;
+	}
+#endif
+	snprintf(name, sizeof(name), "user.vbfs.seek.%llu", (unsigned long long) time);
+	len = fgetxattr(f->fd, name, buf, sizeof(buf) - 1);
+	if (len < 0)
+		return errno == ENODATA ? -ENOENT : -errno;
+	buf[len] = '\0';
+	off = strtoll(buf, NULL, 10);
+	if (lseek(f->fd, off, SEEK_SET) < 0)
+		return -errno;
+	f->off = off;
+
+	return 0;
+}
+
+static int bench_unlink(const char *path)
+{
+#ifdef HAVE_LIBVBFS
+	if (vbfs)
+		return vbfs_unlink(vbfs, path);
+#endif
+	return unlink(path) < 0 ? -errno : 0;
+}
+
+static int bench_mkdir(const char *path)
+{
+#ifdef HAVE_LIBVBFS
+	if (vbfs)
+		return vbfs_mkdir(vbfs, path);
+#endif
+	return mkdir(path, 0755) < 0 ? -errno : 0;
+}
+
+static int bench_set_segment(const char *path, unsigned long size)
+{
+	char buf[32];
+	int len;
+
+#ifdef HAVE_LIBVBFS
+	if (vbfs)
+		return vbfs_set_segment(vbfs, path, size);
+#endif
+	len = snprintf(buf, sizeof(buf), "%lu", size);
+
+	return setxattr(path, "user.vbfs.segment_size", buf, len, 0) < 0 ? -errno : 0;
+}
+
+static int bench_rmdir(const char *path)
+{
+#ifdef HAVE_LIBVBFS
+	if (vbfs)
+		return vbfs_rmdir(vbfs, path);
+#endif
+	return rmdir(path) < 0 ? -errno : 0;
+}
+
+static void segment_path(char *path, size_t len, int stream, unsigned int no)
+{
+	snprintf(path, len, "%s/cam%04d/seg%08u.ts", params.dir, stream, no);
+}
+
+/*
+ * stream writer begin
+ * */
+static void retention_delete(struct stream *s)
+{
+	struct segment *seg;
+	char path[4096];
+	unsigned int closed;
+	int ret;
+
+	pthread_mutex_lock(&seg_lock);
+	while (1) {
+		/* called between a close and the next open, all are closed */
+		closed = s->seg_tail - s->seg_head;
+		if (closed <= (unsigned int) params.retention)
+			break;
+
+		seg = &s->segs[s->seg_head % MAX_SEGMENTS];
+		/* being played back, retry after the next rotation */
+		if (seg->readers)
+			break;
+
+		seg->state = SEG_DELETED;
+		s->seg_head++;
+		pthread_mutex_unlock(&seg_lock);
+
+		segment_path(path, sizeof(path), s->id, seg->no);
+		ret = bench_unlink(path);
+		if (0 == ret)
+			s->deleted++;
+		else if (-ENOENT == ret && params.recycle)
+			s->recycled++;
+		else
+			s->errors++;
+
+		pthread_mutex_lock(&seg_lock);
+	}
+	pthread_mutex_unlock(&seg_lock);
+}
+
+static int open_segment(struct stream *s, struct bench_file *f)
+{
+	struct segment *seg;
+	char path[4096];
+	int ret;
+
+	pthread_mutex_lock(&seg_lock);
+	if (s->seg_tail - s->seg_head >= MAX_SEGMENTS) {
+		/* every old segment is pinned by a reader */
+		pthread_mutex_unlock(&seg_lock);
+		return -EBUSY;
+	}
+	seg = &s->segs[s->seg_tail % MAX_SEGMENTS];
+	seg->no = s->seg_tail;
+	seg->size = 0;
+	seg->state = SEG_CREATING;
+	seg->readers = 0;
+	s->seg_tail++;
+	pthread_mutex_unlock(&seg_lock);
+
+	segment_path(path, sizeof(path), s->id, seg->no);
+	ret = bench_open(f, path, O_WRONLY | O_CREAT | O_TRUNC);
+	if (ret < 0)
+		return ret;
+
+	/* tail readers only look for it once it is there */
+	pthread_mutex_lock(&seg_lock);
+	seg->state = SEG_OPEN;
+	pthread_mutex_unlock(&seg_lock);
+
+	s->created++;
+
+	return 0;
+}
+
+static void close_segment(struct stream *s, struct bench_file *f, unsigned long size)
+{
+	struct segment *seg;
+
+	if (params.fsync_on_rotate)
+		bench_fsync(f);
+	bench_close(f);
+
+	pthread_mutex_lock(&seg_lock);
+	seg = &s->segs[(s->seg_tail - 1) % MAX_SEGMENTS];
+	seg->size = size;
+	seg->state = SEG_CLOSED;
+	pthread_mutex_unlock(&seg_lock);
+}
+
+/* bytes in one second of a stream, 1M when unpaced */
+static unsigned long seek_step(void)
+{
+	if (params.bitrate_mbit > 0)
+		return params.bitrate_mbit * 1000000 / 8;
+
+	return 1024 * 1024;
+}
+
+static void *stream_fn(void *args)
+{
+	struct stream *s = args;
+	uint64_t next, start, interval;
+	unsigned long seg_bytes = 0, seek_next = 0;
+	struct bench_file f;
+	ssize_t ret;
+	int conn = -1;
+
+	interval = pace_ns(params.write_size, params.bitrate_mbit);
+
+#ifdef HAVE_LIBVBFS
+	if (params.ring_sock) {
+		conn = vbfs_ring_connect(params.ring_sock);
+		if (conn < 0) {
+			s->errors++;
+			return NULL;
+		}
+	}
+#endif
+	bench_file_init(&f, conn);
+
+	if (open_segment(s, &f) < 0) {
+		s->errors++;
+		if (conn >= 0)
+			close(conn);
+		return NULL;
+	}
+
+	/* spread the streams out over one interval */
+	next = now_ns() + interval * s->id / params.nr_streams;
+
+	while (!stop) {
+		if (interval) {
+			if (now_ns() > next + interval)
+				s->late++;
+			else
+				sleep_until(next);
+			next += interval;
+		}
+
+		if (seg_bytes + params.write_size > params.segment_size) {
+			start = now_ns();
+			close_segment(s, &f, seg_bytes);
+			retention_delete(s);
+			ret = open_segment(s, &f);
+			hist_add(&s->rotate_lat, now_ns() - start);
+			if (ret < 0) {
+				s->errors++;
+				return NULL;
+			}
+			seg_bytes = 0;
+			seek_next = 0;
+		}
+
+		/* one entry per second of stream, by the bytes written */
+		if (params.seek_table && seg_bytes >= seek_next) {
+			if (bench_seek_add(&f, seg_bytes * 1000 / seek_step(),
+						seg_bytes) < 0)
+				s->errors++;
+			seek_next += seek_step();
+		}
+
+		start = now_ns();
+		ret = bench_write(&f, pattern, params.write_size);
+		hist_add(&s->write_lat, now_ns() - start);
+		if (ret != params.write_size) {
+			s->errors++;
+			break;
+		}
+
+		seg_bytes += ret;
+		s->bytes += ret;
+	}
+
+	close_segment(s, &f, seg_bytes);
+	if (conn >= 0)
+		close(conn);
+
+	return NULL;
+}
+
+/*
+ * playback reader begin
+ * */
+
+/* pin the newest closed segment of a random stream */
+static struct segment *pick_segment(struct reader *r, unsigned int *seed, int *stream)
+{
+	struct segment *seg;
+	struct stream *s;
+	unsigned int i;
+	int tries;
+
+	pthread_mutex_lock(&seg_lock);
+	for (tries = 0; tries < params.nr_streams; tries++) {
+		s = &streams[rand_r(seed) % params.nr_streams];
+		for (i = s->seg_tail; i != s->seg_head; i--) {
+			seg = &s->segs[(i - 1) % MAX_SEGMENTS];
+			if (SEG_CLOSED == seg->state) {
+				seg->readers++;
+				*stream = s->id;
+				pthread_mutex_unlock(&seg_lock);
+				return seg;
+			}
+		}
+	}
+	pthread_mutex_unlock(&seg_lock);
+
+	return NULL;
+}
+
+static void *reader_fn(void *args)
+{
+	struct reader *r = args;
+	struct segment *seg;
+	uint64_t next, start, interval;
+	unsigned int seed = r->id + 1;
+	struct bench_file f;
+	char path[4096];
+	char *buf;
+	ssize_t ret;
+	int stream;
+	unsigned long secs;
+
+	buf = malloc(params.write_size);
+	if (NULL == buf) {
+		r->errors++;
+		return NULL;
+	}
+	bench_file_init(&f, -1);
+
+	interval = pace_ns(params.write_size,
+		params.playback_speed * params.bitrate_mbit);
+
+	while (!stop) {
+		seg = pick_segment(r, &seed, &stream);
+		if (NULL == seg) {
+			usleep(100000);
+			continue;
+		}
+
+		segment_path(path, sizeof(path), stream, seg->no);
+		if (bench_open(&f, path, O_RDONLY) < 0) {
+			r->errors++;
+			goto unpin;
+		}
+
+		/* a segment has an entry at every whole second */
+		secs = seg->size / seek_step();
+		if (params.seek_table && !params.ring_sock && secs) {
+			start = now_ns();
+			ret = bench_seek_time(&f, (rand_r(&seed) % secs) * 1000);
+			hist_add(&r->seek_lat, now_ns() - start);
+			if (ret < 0)
+				r->errors++;
+		}
+
+		next = now_ns();
+		while (!stop) {
+			if (interval) {
+				sleep_until(next);
+				next += interval;
+			}
+
+			start = now_ns();
+			ret = bench_read(&f, buf, params.write_size);
+			if (ret <= 0) {
+				if (ret < 0)
+					r->errors++;
+				break;
+			}
+			hist_add(&r->read_lat, now_ns() - start);
+			r->bytes += ret;
+		}
+		bench_close(&f);
+		r->segments++;
+unpin:
+		pthread_mutex_lock(&seg_lock);
+		seg->readers--;
+		pthread_mutex_unlock(&seg_lock);
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+/*
+ * tail reader begin
+ * */
+
+/* pin the segment stream @id is writing */
+static struct segment *pin_open_segment(int id)
+{
+	struct stream *s = &streams[id];
+	struct segment *seg = NULL;
+
+	pthread_mutex_lock(&seg_lock);
+	if (s->seg_tail != s->seg_head) {
+		seg = &s->segs[(s->seg_tail - 1) % MAX_SEGMENTS];
+		if (SEG_OPEN == seg->state)
+			seg->readers++;
+		else
+			seg = NULL;
+	}
+	pthread_mutex_unlock(&seg_lock);
+
+	return seg;
+}
+
+static int segment_open(struct segment *seg)
+{
+	int ret;
+
+	pthread_mutex_lock(&seg_lock);
+	ret = SEG_OPEN == seg->state;
+	pthread_mutex_unlock(&seg_lock);
+
+	return ret;
+}
+
+/*
+ * reads the open segment of a stream from its start as fast as it can,
+ * then at the end waits one write interval for more until the stream
+ * rotates. the writer of the file must not slow down for it.
+ * */
+static void *tail_fn(void *args)
+{
+	struct reader *r = args;
+	struct segment *seg;
+	struct bench_file f;
+	uint64_t start, interval;
+	char path[4096];
+	char *buf;
+	ssize_t ret;
+	int closed, id = r->id % params.nr_streams;
+
+	buf = malloc(params.write_size);
+	if (NULL == buf) {
+		r->errors++;
+		return NULL;
+	}
+	bench_file_init(&f, -1);
+
+	interval = pace_ns(params.write_size, params.bitrate_mbit);
+	if (0 == interval)
+		interval = 1000000;
+
+	while (!stop) {
+		seg = pin_open_segment(id);
+		if (NULL == seg) {
+			usleep(interval / 1000);
+			continue;
+		}
+
+		segment_path(path, sizeof(path), id, seg->no);
+		if (bench_open(&f, path, O_RDONLY) < 0) {
+			r->errors++;
+			goto unpin;
+		}
+
+		while (!stop) {
+			/* the end of a rotated segment is final, go on to the next */
+			closed = ! segment_open(seg);
+
+			start = now_ns();
+			ret = bench_read(&f, buf, params.write_size);
+			if (ret < 0) {
+				r->errors++;
+				break;
+			}
+			if (ret > 0) {
+				hist_add(&r->read_lat, now_ns() - start);
+				r->bytes += ret;
+				continue;
+			}
+
+			if (closed)
+				break;
+			usleep(interval / 1000);
+		}
+		bench_close(&f);
+		r->segments++;
+unpin:
+		pthread_mutex_lock(&seg_lock);
+		seg->readers--;
+		pthread_mutex_unlock(&seg_lock);
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+/*
+ * report begin
+ * */
+
+/* utime + stime of @pid in seconds, -1 on error */
+static double proc_cpu_seconds(pid_t pid)
+{
+	unsigned long utime, stime;
+	char path[64], buf[1024], *p;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	fp = fopen(path, "r");
+	if (NULL == fp)
+		return -1;
+
+	if (NULL == fgets(buf, sizeof(buf), fp)) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	/* comm may contain spaces, fields restart after the last ')' */
+	p = strrchr(buf, ')');
+	if (NULL == p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u "
+			"%*u %*u %lu %lu", &utime, &stime) != 2)
+		return -1;
+
+	return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double self_cpu_seconds(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* resident set of /proc/@pid in MB, -1 on error */
+static double proc_rss_mb(const char *pid)
+{
+	char path[64], buf[256];
+	unsigned long kb;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%s/status", pid);
+	fp = fopen(path, "r");
+	if (NULL == fp)
+		return -1;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		if (1 == sscanf(buf, "VmRSS: %lu kB", &kb)) {
+			fclose(fp);
+			return kb / 1024.0;
+		}
+	}
+	fclose(fp);
+
+	return -1;
+}
+
+static void print_hist(FILE *fp, const char *name, struct hist *h, const char *end)
+{
+	fprintf(fp, "    \"%s\": {\"count\": %lu, \"avg\": %.1f, \"p50\": %.1f, "
+		"\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}%s\n", name,
+		h->count, h->count ? h->sum / h->count / 1000.0 : 0.0,
+		hist_percentile_us(h, 0.5), hist_percentile_us(h, 0.99),
+		hist_percentile_us(h, 0.999), h->max / 1000.0, end);
+}
+
+static void report(FILE *fp, double elapsed, double self_cpu, double fs_cpu)
+{
+	struct hist *write_lat, *rotate_lat, *read_lat, *seek_lat, *tail_lat;
+	unsigned long wbytes = 0, rbytes = 0, tbytes = 0, late = 0, errors = 0;
+	unsigned long created = 0, deleted = 0, recycled = 0, played = 0;
+	double wgb, cpu_gb, fs_rss = -1;
+	char pid[16];
+	int i;
+
+	write_lat = calloc(5, sizeof(struct hist));
+	if (NULL == write_lat) {
+		fprintf(stderr, "no memory for the report\n");
+		return;
+	}
+	rotate_lat = write_lat + 1;
+	read_lat = write_lat + 2;
+	seek_lat = write_lat + 3;
+	tail_lat = write_lat + 4;
+
+	for (i = 0; i < params.nr_streams; i++) {
+		wbytes += streams[i].bytes;
+		late += streams[i].late;
+		errors += streams[i].errors;
+		created += streams[i].created;
+		deleted += streams[i].deleted;
+		recycled += streams[i].recycled;
+		hist_merge(write_lat, &streams[i].write_lat);
+		hist_merge(rotate_lat, &streams[i].rotate_lat);
+	}
+	for (i = 0; i < params.nr_readers; i++) {
+		rbytes += readers[i].bytes;
+		played += readers[i].segments;
+		errors += readers[i].errors;
+		hist_merge(read_lat, &readers[i].read_lat);
+		hist_merge(seek_lat, &readers[i].seek_lat);
+	}
+	for (i = 0; i < params.nr_tails; i++) {
+		tbytes += tails[i].bytes;
+		errors += tails[i].errors;
+		hist_merge(tail_lat, &tails[i].read_lat);
+	}
+
+	wgb = (wbytes + rbytes + tbytes) / (1024.0 * 1024 * 1024);
+	cpu_gb = wgb > 0 ? 1 / wgb : 0;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"config\": {\"streams\": %d, \"bitrate_mbit\": %.2f, "
+		"\"write_size\": %u, \"segment_mb\": %lu, \"retention\": %d, "
+		"\"readers\": %d, \"tail_readers\": %d, \"playback_speed\": %.2f, "
+		"\"duration_s\": %d, \"fsync_on_rotate\": %d, \"backend\": \"%s\"},\n",
+		params.nr_streams, params.bitrate_mbit, params.write_size,
+		params.segment_size / (1024 * 1024), params.retention,
+		params.nr_readers, params.nr_tails, params.playback_speed,
+		params.duration,
+		params.fsync_on_rotate, params.ring_sock ? "ring" :
+		params.device ? "libvbfs" : "fuse");
+	fprintf(fp, "  \"elapsed_s\": %.3f,\n", elapsed);
+	fprintf(fp, "  \"write_mb_s\": %.2f,\n", wbytes / elapsed / (1024 * 1024));
+	fprintf(fp, "  \"read_mb_s\": %.2f,\n", rbytes / elapsed / (1024 * 1024));
+	fprintf(fp, "  \"tail_mb_s\": %.2f,\n", tbytes / elapsed / (1024 * 1024));
+	fprintf(fp, "  \"write_ops_s\": %.0f,\n", write_lat->count / elapsed);
+	fprintf(fp, "  \"total_mb_s\": %.2f,\n",
+		(wbytes + rbytes + tbytes) / elapsed / (1024 * 1024));
+	fprintf(fp, "  \"write_bytes\": %lu,\n", wbytes);
+	fprintf(fp, "  \"read_bytes\": %lu,\n", rbytes);
+	fprintf(fp, "  \"late_writes\": %lu,\n", late);
+	fprintf(fp, "  \"segments_created\": %lu,\n", created);
+	fprintf(fp, "  \"segments_deleted\": %lu,\n", deleted);
+	fprintf(fp, "  \"segments_recycled\": %lu,\n", recycled);
+	fprintf(fp, "  \"segments_played\": %lu,\n", played);
+	fprintf(fp, "  \"errors\": %lu,\n", errors);
+	fprintf(fp, "  \"latency_us\": {\n");
+	print_hist(fp, "write", write_lat, ",");
+	print_hist(fp, "rotate", rotate_lat, ",");
+	print_hist(fp, "read", read_lat, ",");
+	print_hist(fp, "seek", seek_lat, ",");
+	print_hist(fp, "tail", tail_lat, "");
+	fprintf(fp, "  },\n");
+	fprintf(fp, "  \"cpu_s_per_gb\": {\"bench\": %.3f, \"fs\": ",
+		self_cpu * cpu_gb);
+	if (fs_cpu >= 0)
+		fprintf(fp, "%.3f},\n", fs_cpu * cpu_gb);
+	else
+		fprintf(fp, "null},\n");
+
+	/* with libvbfs the filesystem is part of the bench */
+	if (params.fs_pid) {
+		snprintf(pid, sizeof(pid), "%d", params.fs_pid);
+		fs_rss = proc_rss_mb(pid);
+	}
+	fprintf(fp, "  \"rss_mb\": {\"bench\": %.1f, \"fs\": ", proc_rss_mb("self"));
+	if (fs_rss >= 0)
+		fprintf(fp, "%.1f}\n", fs_rss);
+	else
+		fprintf(fp, "null}\n");
+	fprintf(fp, "}\n");
+
+	free(write_lat);
+}
+
+/*
+ * setup and cleanup
+ * */
+static int make_stream_dirs(void)
+{
+	char path[4096];
+	int i, ret;
+
+	for (i = 0; i < params.nr_streams; i++) {
+		snprintf(path, sizeof(path), "%s/cam%04d", params.dir, i);
+		ret = bench_mkdir(path);
+		if (ret < 0 && ret != -EEXIST) {
+			fprintf(stderr, "mkdir %s: %s\n", path, strerror(-ret));
+			return -1;
+		}
+
+		if (params.seg_template) {
+			ret = bench_set_segment(path, params.segment_size);
+			if (ret < 0) {
+				fprintf(stderr, "segment template %s: %s\n", path,
+					strerror(-ret));
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void cleanup_streams(void)
+{
+	struct stream *s;
+	char path[4096];
+	unsigned int i;
+	int j;
+
+	for (j = 0; j < params.nr_streams; j++) {
+		s = &streams[j];
+		for (i = s->seg_head; i != s->seg_tail; i++) {
+			segment_path(path, sizeof(path), j, s->segs[i % MAX_SEGMENTS].no);
+			bench_unlink(path);
+		}
+		snprintf(path, sizeof(path), "%s/cam%04d", params.dir, j);
+		bench_rmdir(path);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	double fs_cpu_start = -1, fs_cpu = -1, self_cpu;
+	uint64_t start, end;
+	FILE *fp = stdout;
+	int i, ret;
+
+	bench_init_paramters();
+	parse_options(argc, argv);
+
+	pattern = malloc(params.write_size);
+	streams = calloc(params.nr_streams, sizeof(struct stream));
+	readers = calloc(params.nr_readers ? params.nr_readers : 1,
+			sizeof(struct reader));
+	tails = calloc(params.nr_tails ? params.nr_tails : 1, sizeof(struct reader));
+	if (NULL == pattern || NULL == streams || NULL == readers || NULL == tails) {
+		fprintf(stderr, "no memory\n");
+		exit(1);
+	}
+	for (i = 0; i < params.write_size; i++)
+		pattern[i] = i * 31 + 7;
+
+#ifdef HAVE_LIBVBFS
+	if (params.device) {
+		struct vbfs_mount_opts opts = {
+			.small_tail = params.tail_idle_ms >= 0,
+			.tail_idle_ms = params.tail_idle_ms > 0 ? params.tail_idle_ms : 0,
+			.recycle = params.recycle,
+		};
+
+		ret = vbfs_mount(params.device, &opts, &vbfs);
+		if (ret) {
+			fprintf(stderr, "mount %s: %s\n", params.device, strerror(-ret));
+			exit(1);
+		}
+
+		if (params.ring_sock) {
+			ret = vbfs_ring_serve(vbfs, params.ring_sock);
+			if (ret) {
+				fprintf(stderr, "serve %s: %s\n", params.ring_sock,
+					strerror(-ret));
+				exit(1);
+			}
+		}
+	}
+#endif
+
+	if (make_stream_dirs())
+		exit(1);
+
+	if (params.fs_pid) {
+		fs_cpu_start = proc_cpu_seconds(params.fs_pid);
+		if (fs_cpu_start < 0)
+			fprintf(stderr, "can't read cpu time of pid %d\n", params.fs_pid);
+	}
+	self_cpu = self_cpu_seconds();
+	start = now_ns();
+
+	for (i = 0; i < params.nr_streams; i++) {
+		streams[i].id = i;
+		ret = pthread_create(&streams[i].tid, NULL, stream_fn, &streams[i]);
+		if (ret) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < params.nr_readers; i++) {
+		readers[i].id = i;
+		ret = pthread_create(&readers[i].tid, NULL, reader_fn, &readers[i]);
+		if (ret) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < params.nr_tails; i++) {
+		tails[i].id = i;
+		ret = pthread_create(&tails[i].tid, NULL, tail_fn, &tails[i]);
+		if (ret) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+	}
+
+	sleep(params.duration);
+	stop = 1;
+
+	for (i = 0; i < params.nr_streams; i++)
+		pthread_join(streams[i].tid, NULL);
+	for (i = 0; i < params.nr_readers; i++)
+		pthread_join(readers[i].tid, NULL);
+	for (i = 0; i < params.nr_tails; i++)
+		pthread_join(tails[i].tid, NULL);
+
+	end = now_ns();
+	self_cpu = self_cpu_seconds() - self_cpu;
+	if (fs_cpu_start >= 0) {
+		fs_cpu = proc_cpu_seconds(params.fs_pid);
+		if (fs_cpu >= 0)
+			fs_cpu -= fs_cpu_start;
+	}
+
+	if (params.output) {
+		fp = fopen(params.output, "w");
+		if (NULL == fp) {
+			fprintf(stderr, "open %s: %s\n", params.output, strerror(errno));
+			fp = stdout;
+		}
+	}
+	report(fp, (end - start) / 1e9, self_cpu, fs_cpu);
+	if (fp != stdout)
+		fclose(fp);
+
+	if (!params.keep)
+		cleanup_streams();
+
+#ifdef HAVE_LIBVBFS
+	if (vbfs)
+		vbfs_umount(vbfs);
+#endif
+
+	free(pattern);
+	free(streams);
+	free(readers);
+	free(tails);
+
+	return 0;
+}
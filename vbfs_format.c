@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +13,7 @@
 #include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "vbfs_format.h"
 
@@ -19,6 +21,23 @@
 #define CHAR_BIT 8
 #endif
 
+#define DEF_JOBS 4
+#define MAX_JOBS 64
+
+/* from linux/fs.h, which does not mix with sys/mount.h */
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12, 119)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12, 127)
+#endif
+#ifndef BLKIOMIN
+#define BLKIOMIN _IO(0x12, 120)
+#endif
+#ifndef BLKIOOPT
+#define BLKIOOPT _IO(0x12, 121)
+#endif
+
 struct vbfs_paramters vbfs_params;
 struct vbfs_superblock vbfs_superblk;
 
@@ -30,8 +49,19 @@ static void vbfs_init_paramters()
 	vbfs_params.file_idx_len = 256;
 
 	vbfs_params.bad_ratio = 2048;
+	vbfs_params.lazy_init = 0;
+	vbfs_params.discard = 0;
+	vbfs_params.jobs = DEF_JOBS;
+	vbfs_params.stripe_unit = 0;
+	vbfs_params.stripe_width = 0;
 
 	vbfs_params.fd = -1;
+	vbfs_params.is_blk = 0;
+
+	vbfs_params.meta_name = NULL;
+	vbfs_params.meta_size = 0;
+	vbfs_params.meta_fd = -1;
+	vbfs_params.meta_is_blk = 0;
 }
 
 static void cmd_usage()
@@ -43,86 +73,93 @@ static void cmd_usage()
 	fprintf(stderr, "\t\tdefaut 1:2048\n");
 	fprintf(stderr, "-x assign file index size of first extend in KB\n");
 	fprintf(stderr, "\t\tdefaut 256KB\n");
+	fprintf(stderr, "-l lazy init, bitmap groups past the first are\n");
+	fprintf(stderr, "\t\twritten by the filesystem after mount\n");
+	fprintf(stderr, "-d discard the whole device first\n");
+	fprintf(stderr, "-j extends written in parallel\n");
+	fprintf(stderr, "\t\tdefaut %d\n", DEF_JOBS);
+	fprintf(stderr, "-s raid stripe as unit KB,data disks, e.g. 256,4\n");
+	fprintf(stderr, "\t\tdefaut from the device, extend size is\n");
+	fprintf(stderr, "\t\trounded up to whole stripes\n");
+	fprintf(stderr, "-m metadata device, superblock, bitmaps, dirs and\n");
+	fprintf(stderr, "\t\tfile indexes go there, file data to device\n");
 	exit(1);
 }
 
-static int is_raid5_friendly()
+/*
+ * raid geometry of a block device: md and most raid controllers report
+ * the chunk as the minimum and the full stripe as the optimal io size
+ * */
+static void get_stripe_info()
 {
-	int fd;
-	char name[8], buf[32], attr[128];
-	int chunk_size, raid_disks, stripe_size_kb;
+	unsigned int io_min = 0, io_opt = 0;
 
-	name[7] = 0;
-	buf[31] = 0;
+	if (vbfs_params.stripe_unit)
+		return;
 
-	/* Fix */
-	strncpy(name, vbfs_params.dev_name + 5, sizeof(name) - 1);
-	if (0 == strncmp(name, "md", 2)) {
-		snprintf(attr, sizeof(attr), "/sys/block/%s/md/chunk_size", name);
-		fd = open(attr, O_RDONLY);
-		if (fd < 0) {
-			fprintf(stderr, "open %s failed\n", attr);
-			return 1;
-		}
-		read(fd, buf, sizeof(buf) - 1);
-		chunk_size = atoi(buf);
-
-		snprintf(attr, sizeof(attr), "/sys/block/%s/md/raid_disks", name);
-		fd = open(attr, O_RDONLY);
-		if (fd < 0) {
-			fprintf(stderr, "open %s failed\n", attr);
-			return 1;
-		}
-		read(fd, buf, sizeof(buf) - 1);
-		raid_disks = atoi(buf);
-
-		stripe_size_kb = (raid_disks - 1) * chunk_size / 1024;
-		if (vbfs_params.extend_size_kb == stripe_size_kb) {
-			return 0;
-		} else {
-			return 1;
-		}
-	}
-	return 0;
+	if (ioctl(vbfs_params.fd, BLKIOMIN, &io_min) < 0
+			|| ioctl(vbfs_params.fd, BLKIOOPT, &io_opt) < 0)
+		return;
+
+	if (0 == io_min || io_min % 4096 || io_opt <= io_min || io_opt % io_min)
+		return;
+
+	vbfs_params.stripe_unit = io_min;
+	vbfs_params.stripe_width = io_opt / io_min;
 }
 
-static int get_device_info()
+static int open_device(const char *name, int *fdp, __u64 *size, int *is_blk)
 {
 	int fd = 0;
 	struct stat stat_buf;
 
-	fd = open(vbfs_params.dev_name, O_RDWR|O_LARGEFILE);
+	fd = open(name, O_RDWR|O_LARGEFILE);
 	if (fd < 0) {
-		fprintf(stderr, "Can't open %s\n", vbfs_params.dev_name);
+		fprintf(stderr, "Can't open %s\n", name);
 		return -1;
 	}
-	vbfs_params.fd = fd;
+	*fdp = fd;
 
 	if (fstat(fd, &stat_buf) < 0) {
-		fprintf(stderr, "Can't get %s stat\n", vbfs_params.dev_name);
+		fprintf(stderr, "Can't get %s stat\n", name);
 		return -1;
 	} 
 
 	if (S_ISREG(stat_buf.st_mode)) {
-		vbfs_params.total_size = stat_buf.st_size;
+		*size = stat_buf.st_size;
 	} else if (S_ISBLK(stat_buf.st_mode)) {
-		if (ioctl(fd, BLKGETSIZE64, &vbfs_params.total_size) < 0) {
+		*is_blk = 1;
+		if (ioctl(fd, BLKGETSIZE64, size) < 0) {
 			fprintf(stderr, "Can't get disk size\n");
 		}
-		if (0 != is_raid5_friendly()) {
-			fprintf(stderr, "extend size is not a full stripe size\n");
-		}
 	} else {
-		fprintf(stderr, "%s is not a block device\n", vbfs_params.dev_name);
+		fprintf(stderr, "%s is not a block device\n", name);
 		return -1;
 	}
 
 	return 0;
 }
 
+static int get_device_info()
+{
+	if (open_device(vbfs_params.dev_name, &vbfs_params.fd,
+			&vbfs_params.total_size, &vbfs_params.is_blk) < 0)
+		return -1;
+
+	/* the stripe is the one of the data, the bulk device */
+	if (vbfs_params.is_blk)
+		get_stripe_info();
+
+	if (NULL == vbfs_params.meta_name)
+		return 0;
+
+	return open_device(vbfs_params.meta_name, &vbfs_params.meta_fd,
+			&vbfs_params.meta_size, &vbfs_params.meta_is_blk);
+}
+
 static void parse_options(int argc, char **argv)
 {
-	static const char *option_string = "e:b:x";
+	static const char *option_string = "e:b:x:ldj:s:m:";
 	int option = 0;
 
 	while ((option = getopt(argc, argv, option_string)) != EOF) {
@@ -136,6 +173,28 @@ static void parse_options(int argc, char **argv)
 			case 'x':
 				vbfs_params.file_idx_len = atoi(optarg);
 				break;
+			case 'l':
+				vbfs_params.lazy_init = 1;
+				break;
+			case 'd':
+				vbfs_params.discard = 1;
+				break;
+			case 'j':
+				vbfs_params.jobs = atoi(optarg);
+				break;
+			case 's':
+				if (sscanf(optarg, "%u,%u", &vbfs_params.stripe_unit,
+						&vbfs_params.stripe_width) != 2
+						|| 0 == vbfs_params.stripe_unit
+						|| 0 == vbfs_params.stripe_width) {
+					fprintf(stderr, "bad stripe %s\n", optarg);
+					cmd_usage();
+				}
+				vbfs_params.stripe_unit *= 1024;
+				break;
+			case 'm':
+				vbfs_params.meta_name = optarg;
+				break;
 			default:
 				fprintf(stderr, "Unknown option %c\n", option);
 				cmd_usage();
@@ -157,6 +216,11 @@ static void parse_options(int argc, char **argv)
 		cmd_usage();
 	}
 
+	if (vbfs_params.jobs < 1 || vbfs_params.jobs > MAX_JOBS) {
+		fprintf(stderr, "jobs must be 1 to %d\n", MAX_JOBS);
+		cmd_usage();
+	}
+
 	if ((optind + 1) != argc) {
 		cmd_usage();
 	}
@@ -177,6 +241,33 @@ __u32 calc_div(__u32 dividend, __u32 divisor)
 	return result;
 }
 
+/*
+ * an extend of whole stripes starts and ends on a stripe, so parity
+ * raids see no partial stripe writes from the write-behind
+ * */
+static void align_to_stripe()
+{
+	__u32 stripe_kb;
+
+	if (0 == vbfs_params.stripe_unit)
+		return;
+
+	stripe_kb = vbfs_params.stripe_unit / 1024 * vbfs_params.stripe_width;
+	printf("stripe unit %u KB, %u data disks\n",
+		vbfs_params.stripe_unit / 1024, vbfs_params.stripe_width);
+
+	if (0 == vbfs_params.extend_size_kb % stripe_kb)
+		return;
+
+	vbfs_params.extend_size_kb = calc_div(vbfs_params.extend_size_kb, stripe_kb)
+					* stripe_kb;
+	printf("extend size rounded up to %u KB, whole stripes\n",
+		vbfs_params.extend_size_kb);
+	if (vbfs_params.extend_size_kb > 8192) {
+		fprintf(stderr, "\nWARN: extend size exceeds 8M\n\n");
+	}
+}
+
 static void set_first_bits(char *bitmap, __u32 bit_num)
 {
 	__u32 *bm = 0;
@@ -196,12 +287,14 @@ static int vbfs_prepare_superblock()
 {
 	__u32 extend_size = 0;
 	__u64 disk_size = 0;
+	__u64 total = 0;
 
 	__u32 extend_count = 0;
 	__u32 bad_max_count = 0;
 	__u32 bad_extend_count = 0;
 	__u32 bm_capacity = 0;
 	__u32 bitmap_cnt = 0;
+	__u32 meta_extends = 0;
 
 	extend_size = vbfs_params.extend_size_kb * 1024;
 	disk_size = vbfs_params.total_size;
@@ -209,7 +302,23 @@ static int vbfs_prepare_superblock()
 	printf("disk size %llu, extend size %u\n", disk_size, extend_size);
 
 	/* extend_count */
-	extend_count = disk_size / extend_size;
+	total = disk_size / extend_size;
+
+	/* the metadata device comes first in the extend numbers */
+	if (vbfs_params.meta_name) {
+		meta_extends = vbfs_params.meta_size / extend_size;
+		total += meta_extends;
+		printf("metadata device %llu, %u extends\n",
+			vbfs_params.meta_size, meta_extends);
+	}
+
+	/* bit 31 of a file index entry is EXTEND_UNWRITTEN */
+	if (total > EXTEND_COUNT_MAX) {
+		fprintf(stderr, "%llu extends, at most %u, use larger extends\n",
+			total, EXTEND_COUNT_MAX);
+		return -1;
+	}
+	extend_count = total;
 
 	printf("extend count %u\n", extend_count);
 
@@ -223,6 +332,13 @@ static int vbfs_prepare_superblock()
 	bm_capacity = (extend_size - BITMAP_META_SIZE) * 8;
 	bitmap_cnt = calc_div(extend_count, bm_capacity);
 
+	/* the root dentry and at least one more dir or index */
+	if (meta_extends && meta_extends < bad_extend_count + 1 + bitmap_cnt + 2) {
+		fprintf(stderr, "metadata device too small, %u extends needed\n",
+			bad_extend_count + 1 + bitmap_cnt + 2);
+		return -1;
+	}
+
 	memset(&vbfs_superblk, 0, sizeof(vbfs_superblk));
 
 	/* 
@@ -232,6 +348,9 @@ static int vbfs_prepare_superblock()
 	vbfs_superblk.s_extend_size = extend_size;
 	vbfs_superblk.s_extend_count = extend_count;
 	vbfs_superblk.s_file_idx_len = vbfs_params.file_idx_len * 1024;
+	vbfs_superblk.s_stripe_unit = vbfs_params.stripe_unit;
+	vbfs_superblk.s_stripe_width = vbfs_params.stripe_width;
+	vbfs_superblk.s_meta_extends = meta_extends;
 
 	/* bad extend */
 	vbfs_superblk.bad_count = 0;
@@ -250,30 +369,63 @@ static int vbfs_prepare_superblock()
 	/* 0 represent clean, 1 unclean */
 	vbfs_superblk.s_state = 0;
 
+	/* data extends less the root dentry and the superblock backup */
+	vbfs_superblk.s_free_count = extend_count - bitmap_cnt
+			- vbfs_superblk.bitmap_offset - 2;
+
+	/* group 0 holds the root dentry bit, it is always written */
+	if (vbfs_params.lazy_init && bitmap_cnt > 1)
+		vbfs_superblk.s_uninit_group = 1;
+
 	uuid_generate(vbfs_superblk.uuid);
 
 	return 0;
 }
 
+/* positioned, the writer threads share the fd */
 int write_to_disk(int fd, void *buf, __u64 offset, size_t len)
 {
-	if (lseek64(fd, offset, SEEK_SET) < 0) {
-		fprintf(stderr, "lseek error %llu, %s\n", offset, strerror(errno));
-		return -1;
-	}
-	if (write(fd, buf, len) < 0) {
-		fprintf(stderr, "write error %s\n", strerror(errno));
-		return -1;
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite64(fd, buf, len, offset);
+		if (ret < 0) {
+			if (EINTR == errno)
+				continue;
+			fprintf(stderr, "write error %llu, %s\n", offset, strerror(errno));
+			return -1;
+		}
+		buf = (char *) buf + ret;
+		offset += ret;
+		len -= ret;
 	}
 
 	return 0;
 }
 
+/* the device of an extend and its offset there */
+static int extend_disk(__u32 extend_no, __u64 *offset, int *is_blk)
+{
+	__u64 len = vbfs_params.extend_size_kb * 1024;
+	__u32 meta = vbfs_superblk.s_meta_extends;
+
+	if (meta && extend_no < meta) {
+		*offset = extend_no * len;
+		*is_blk = vbfs_params.meta_is_blk;
+		return vbfs_params.meta_fd;
+	}
+
+	*offset = (extend_no - meta) * len;
+	*is_blk = vbfs_params.is_blk;
+	return vbfs_params.fd;
+}
+
 static int write_extend(__u32 extend_no, void *buf)
 {
 	size_t len = vbfs_params.extend_size_kb * 1024;
-	int fd = vbfs_params.fd;
-	off64_t offset = (__u64)extend_no * len;
+	__u64 offset;
+	int is_blk;
+	int fd = extend_disk(extend_no, &offset, &is_blk);
 
 	if (write_to_disk(fd, buf, offset, len)) {
 		return -1;
@@ -282,34 +434,182 @@ static int write_extend(__u32 extend_no, void *buf)
 	return 0;
 }
 
-static int write_bad_extend()
+/*
+ * writer pool: each thread builds extends in a buffer of its own and
+ * writes them, vbfs_params.jobs of them are in flight. @prepare fills
+ * the buffer for the n-th extend of a region and returns its number.
+ * */
+typedef __u32 (*prepare_fn_t)(__u32 n, char *buf);
+
+struct write_pool {
+	const char *name;
+	prepare_fn_t prepare;
+	__u32 count;
+	__u32 next;
+	__u32 done;
+	int error;
+
+	/* whichever worker gets the lock reports, once a second */
+	pthread_mutex_t report_lock;
+	double start;
+	double last;
+};
+
+static double now_sec()
 {
-	int ret = 0;
-	char *extend = NULL;
-	int extend_size = 0;
-	int extend_no = 0;
-	int i;
+	struct timespec ts;
 
-	extend_size = vbfs_params.extend_size_kb * 1024;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-	if ((extend = valloc(extend_size)) == NULL) {
+static void report_progress(struct write_pool *pool, double now, int last)
+{
+	double secs = now - pool->start;
+	double mb = (double) pool->done * vbfs_params.extend_size_kb / 1024;
+
+	if (! last && ! isatty(STDOUT_FILENO))
+		return;
+
+	/* a terminal gets one line rewritten in place */
+	printf("%s%s %u/%u extends, %.0f MB in %.2f s, %.0f MB/s%s",
+		isatty(STDOUT_FILENO) ? "\r" : "", pool->name, pool->done,
+		pool->count, mb, secs, secs > 0 ? mb / secs : 0,
+		last ? "\n" : "");
+	fflush(stdout);
+}
+
+static void *pool_worker(void *args)
+{
+	struct write_pool *pool = args;
+	char *buf = NULL;
+	__u32 n, extend_no;
+	double now;
+
+	if ((buf = valloc(vbfs_params.extend_size_kb * 1024)) == NULL) {
 		fprintf(stderr, "No mem\n");
-		return -1;
+		__atomic_store_n(&pool->error, 1, __ATOMIC_RELAXED);
+		return NULL;
 	}
 
-	extend_no = vbfs_superblk.bad_extend_offset;
+	while (! __atomic_load_n(&pool->error, __ATOMIC_RELAXED)) {
+		n = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+		if (n >= pool->count)
+			break;
 
-	memset(extend, 0, extend_size);
-	for (i = 0; i < vbfs_superblk.bad_extend_count; i ++) {
-		if (write_extend(extend_no, extend)) {
-			free(extend);
-			return -1;
+		extend_no = pool->prepare(n, buf);
+		if (write_extend(extend_no, buf)) {
+			__atomic_store_n(&pool->error, 1, __ATOMIC_RELAXED);
+			break;
 		}
-		extend_no ++;
+		__atomic_fetch_add(&pool->done, 1, __ATOMIC_RELAXED);
+
+		if (pthread_mutex_trylock(&pool->report_lock))
+			continue;
+		now = now_sec();
+		if (now - pool->last >= 1) {
+			pool->last = now;
+			report_progress(pool, now, 0);
+		}
+		pthread_mutex_unlock(&pool->report_lock);
 	}
 
-	free(extend);
-	return ret;
+	free(buf);
+	return NULL;
+}
+
+static int run_pool(const char *name, __u32 count, prepare_fn_t prepare)
+{
+	pthread_t tids[MAX_JOBS];
+	struct write_pool pool;
+	int i, nr = 0;
+
+	if (0 == count)
+		return 0;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.name = name;
+	pool.prepare = prepare;
+	pool.count = count;
+	pthread_mutex_init(&pool.report_lock, NULL);
+	pool.start = now_sec();
+	pool.last = pool.start;
+
+	for (i = 0; i < vbfs_params.jobs && i < count; i ++) {
+		if (pthread_create(&tids[i], NULL, pool_worker, &pool))
+			break;
+		nr ++;
+	}
+	/* no thread at all, write them here */
+	if (0 == nr)
+		pool_worker(&pool);
+
+	for (i = 0; i < nr; i ++)
+		pthread_join(tids[i], NULL);
+	pthread_mutex_destroy(&pool.report_lock);
+
+	if (pool.error)
+		return -1;
+
+	report_progress(&pool, now_sec(), 1);
+	return 0;
+}
+
+/*
+ * zeroes without the data going down: BLKZEROOUT on a block device, a
+ * punched hole in an image file. -1 when neither works here. the
+ * extends are on one device.
+ * */
+static int zero_range(__u32 extend_no, __u32 count)
+{
+	__u64 range[2], offset;
+	__u64 len = (__u64) count * vbfs_params.extend_size_kb * 1024;
+	int fd, is_blk;
+
+	fd = extend_disk(extend_no, &offset, &is_blk);
+	if (is_blk) {
+		range[0] = offset;
+		range[1] = len;
+		return ioctl(fd, BLKZEROOUT, range) < 0 ? -1 : 0;
+	}
+
+	return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			offset, len) < 0 ? -1 : 0;
+}
+
+/* a hint only, discarded blocks need not read back as zeroes */
+static void discard_device(const char *name, int fd, int is_blk, __u64 size)
+{
+	__u64 range[2];
+	int ret;
+
+	if (is_blk) {
+		range[0] = 0;
+		range[1] = size;
+		ret = ioctl(fd, BLKDISCARD, range);
+	} else
+		ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				0, size);
+
+	if (ret < 0)
+		fprintf(stderr, "discard %s failed, %s\n", name, strerror(errno));
+}
+
+static __u32 prepare_bad_extend(__u32 n, char *buf)
+{
+	memset(buf, 0, vbfs_params.extend_size_kb * 1024);
+
+	return vbfs_superblk.bad_extend_offset + n;
+}
+
+static int write_bad_extend()
+{
+	if (0 == zero_range(vbfs_superblk.bad_extend_offset,
+			vbfs_superblk.bad_extend_count))
+		return 0;
+
+	return run_pool("bad extend", vbfs_superblk.bad_extend_count,
+			prepare_bad_extend);
 }
 
 static void bitmap_header_to_disk(bitmap_header_dk_t *bm_header_dk, struct bitmap_header *bitmap)
@@ -352,49 +652,40 @@ static void bitmap_prepare(__u32 group_no, __u32 total_cnt, char *buf)
 	memcpy(buf, &bm_header_dk, sizeof(bm_header_dk));
 }
 
-static int write_bitmap()
+static __u32 prepare_bitmap(__u32 n, char *buf)
 {
-	char *buf = NULL;
-	int extend_size = 0;
-	int extend_no = 0;
-	__u32 i = 0;
-
 	__u32 count = 0;
 	__u32 one_bm_capacity = 0;
 	__u32 total_cnt = 0;
+	__u64 first;
 
-	extend_size = vbfs_params.extend_size_kb * 1024;
 	/* minus 1 to backup superblock */
 	total_cnt = vbfs_superblk.s_extend_count
 			- vbfs_superblk.bitmap_count
 			- vbfs_superblk.bitmap_offset - 1;
-	one_bm_capacity = (extend_size - BITMAP_META_SIZE) * 8;
+	one_bm_capacity = (vbfs_params.extend_size_kb * 1024 - BITMAP_META_SIZE) * 8;
 
-	if ((buf = valloc(extend_size)) == NULL) {
-		fprintf(stderr, "No mem\n");
-		return -1;
+	first = (__u64) one_bm_capacity * n;
+	if (total_cnt > first) {
+		count = total_cnt - first;
+		if (count > one_bm_capacity)
+			count = one_bm_capacity;
 	}
+	bitmap_prepare(n, count, buf);
 
-	extend_no = vbfs_superblk.bitmap_offset;
-
-	for (i = 0; i < vbfs_superblk.bitmap_count; i ++) {
-                if (total_cnt > one_bm_capacity * i) {
-                        count = total_cnt - one_bm_capacity * i;
-                        if (count > one_bm_capacity)
-                                count = one_bm_capacity;
-                } else {
-                        count = 0;
-                }
-		bitmap_prepare(i, count, buf);
-		if (write_extend(extend_no, buf)) {
-			free(buf);
-			return -1;
-		}
-		extend_no ++;
-	}
+	return vbfs_superblk.bitmap_offset + n;
+}
 
-	free(buf);
-	return 0;
+static int write_bitmap()
+{
+	__u32 write_cnt = 0;
+
+	/* the uninitialized ones are written by the filesystem */
+	write_cnt = vbfs_superblk.bitmap_count;
+	if (vbfs_superblk.s_uninit_group)
+		write_cnt = vbfs_superblk.s_uninit_group;
+
+	return run_pool("bitmap", write_cnt, prepare_bitmap);
 }
 
 static void save_dirent_header(vbfs_dir_header_dk_t *vbfs_header_dk,
@@ -418,7 +709,7 @@ static void save_dirent(struct vbfs_dirent_disk *dirent_dk, struct vbfs_dirent *
 	dirent_dk->i_atime = cpu_to_le32(dir->i_atime);
 	dirent_dk->i_ctime = cpu_to_le32(dir->i_ctime);
 	dirent_dk->i_mtime = cpu_to_le32(dir->i_mtime);
-	dirent_dk->padding = cpu_to_le32(dir->padding);
+	dirent_dk->i_reserved = cpu_to_le32(dir->i_reserved);
 	memcpy(dir->name, dirent_dk->name, NAME_LEN);
 }
 
@@ -459,7 +750,7 @@ static void prepare_root_dentry(char *buf)
 	dirent.i_atime = time(NULL);
 	dirent.i_ctime = time(NULL);
 	dirent.i_mtime = time(NULL);
-	dirent.padding = 0;
+	dirent.i_reserved = 0;
 	memset(dirent.name, 0, NAME_LEN);
 	pos = buf + VBFS_DIR_META_SIZE + dir_header.bitmap_size * VBFS_DIR_SIZE;
 	save_dirent((struct vbfs_dirent_disk *) pos, &dirent);
@@ -514,6 +805,11 @@ static void superblk_to_disk(struct vbfs_superblock_disk *super_dk,
 	super_dk->s_ctime = cpu_to_le32(super->s_ctime);
 	super_dk->s_mount_time = cpu_to_le32(super->s_mount_time);
 	super_dk->s_state = cpu_to_le32(super->s_state);
+	super_dk->s_free_count = cpu_to_le32(super->s_free_count);
+	super_dk->s_uninit_group = cpu_to_le32(super->s_uninit_group);
+	super_dk->s_stripe_unit = cpu_to_le32(super->s_stripe_unit);
+	super_dk->s_stripe_width = cpu_to_le32(super->s_stripe_width);
+	super_dk->s_meta_extends = cpu_to_le32(super->s_meta_extends);
 
 	memcpy(super->uuid, super_dk->uuid, sizeof(super_dk->uuid));
 }
@@ -562,7 +858,16 @@ static int vbfs_format_device()
 {
 	int ret = 0;
 
-	vbfs_prepare_superblock();
+	if (vbfs_prepare_superblock() < 0)
+		return -1;
+
+	if (vbfs_params.discard) {
+		discard_device(vbfs_params.dev_name, vbfs_params.fd,
+				vbfs_params.is_blk, vbfs_params.total_size);
+		if (vbfs_params.meta_name)
+			discard_device(vbfs_params.meta_name, vbfs_params.meta_fd,
+					vbfs_params.meta_is_blk, vbfs_params.meta_size);
+	}
 
 	ret = write_root_dentry();
 	if (ret < 0)
@@ -582,6 +887,10 @@ static int vbfs_format_device()
 
 	fsync(vbfs_params.fd);
 	close(vbfs_params.fd);
+	if (vbfs_params.meta_fd >= 0) {
+		fsync(vbfs_params.meta_fd);
+		close(vbfs_params.meta_fd);
+	}
 
 	return 0;
 }
@@ -593,6 +902,7 @@ int main(int argc, char **argv)
 
 	if (get_device_info() < 0)
 		return -1;
+	align_to_stripe();
 
 	if (vbfs_format_device() < 0)
 		return -1;
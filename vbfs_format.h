@@ -27,8 +27,20 @@ struct vbfs_paramters {
 	char *dev_name;
 	int bad_ratio;
 	int file_idx_len;
+	int lazy_init; /* bitmap groups past the first left to the fs */
+	int discard;
+	int jobs; /* writer threads */
+	__u32 stripe_unit; /* bytes, 0 for no raid */
+	__u32 stripe_width; /* data disks */
 
 	int fd;
+	int is_blk;
+
+	/* metadata device of a split layout, NULL for one device */
+	char *meta_name;
+	__u64 meta_size;
+	int meta_fd;
+	int meta_is_blk;
 };
 
 /* 4k */
@@ -57,6 +69,11 @@ struct vbfs_superblock {
 	__u32 s_mount_time; /* the time of last mount */
 	__u32 s_state; /* clean or unclean */
 	__u8 uuid[16];
+	__u32 s_free_count;
+	__u32 s_uninit_group;
+	__u32 s_stripe_unit;
+	__u32 s_stripe_width;
+	__u32 s_meta_extends;
 };
 
 struct bitmap_header {
@@ -75,7 +92,7 @@ struct vbfs_dirent {
 	__u32 i_ctime;
 	__u32 i_mtime;
 
-	__u32 padding;
+	__u32 i_reserved;
 
 	char name[NAME_LEN];
 };
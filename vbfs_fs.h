@@ -36,7 +36,26 @@ enum {
  *
  *	256K can record 8G size
  *	default s_file_idx_len is set to 256K
+ *
+ *	the seek table of a file takes the end of the address array:
+ *	|index 0|index 1|......|seek n-1|...|seek 1|seek 0|
+ *
+ *	a file outgrowing the array keeps i_flat_nr entries in it, the next
+ *	two point to an indirect extend of entries and a double indirect
+ *	extend of indirect extends:
+ *	|index 0|...|index i_flat_nr - 1|indirect|double indirect|
+ *
+ *	an entry with EXTEND_UNWRITTEN set holds an extend reserved below
+ *	i_size and never written, it reads as zeros until the first write
+ *	zeroes it on disk and clears the flag, extend numbers stay below it
  * */
+#define EXTEND_UNWRITTEN 0x80000000
+#define EXTEND_COUNT_MAX 0x7fffffff
+
+struct vbfs_seek_disk {
+	__le64 time;
+	__le64 offset;
+};
 
 /*
  * directory type layout in a extend:
@@ -72,6 +91,22 @@ struct vbfs_superblock_disk {
 	__le32 s_mount_time; /* the time of last mount */
 	__le32 s_state; /* clean or unclean */
 	__u8 uuid[16];
+
+	/* free data extends, trusted after a clean umount, 0: count again */
+	__le32 s_free_count;
+
+	/* bitmap groups in the allocator checkpoint, 0 for none */
+	__le32 s_ckpt_groups;
+
+	/* first bitmap group mkfs -l left unwritten, 0 when all are written */
+	__le32 s_uninit_group;
+
+	/* raid stripe unit in bytes and data disks per stripe, 0 for none */
+	__le32 s_stripe_unit;
+	__le32 s_stripe_width;
+
+	/* extends on the metadata device of a split layout, 0 for one device */
+	__le32 s_meta_extends;
 };
 #define VBFS_SUPER_ST_SIZE sizeof(struct vbfs_superblock_disk)
 typedef struct {
@@ -79,6 +114,12 @@ typedef struct {
 	char padding[VBFS_SUPER_SIZE - VBFS_SUPER_ST_SIZE];
 } vbfs_superblock_dk_t;
 
+/*
+ * allocator checkpoint: free extends of every bitmap group as __le32,
+ * written to the superblock padding at a clean umount when they fit
+ * */
+#define VBFS_CKPT_MAX ((VBFS_SUPER_SIZE - VBFS_SUPER_ST_SIZE) / 4)
+
 
 struct bitmap_header_disk {
 	__le32 group_no;
@@ -103,9 +144,14 @@ struct vbfs_dirent_disk {
 	__le32 i_ctime;
 	__le32 i_mtime;
 
-	__le32 padding;
+	__le32 i_reserved; /* index entries filled ahead of i_size */
 
 	char name[NAME_LEN];
+
+	/* entries of the seek table, in the spare room of the slot */
+	__le32 i_seek_nr;
+	/* entries in the first extend once indirect, 0 while all are */
+	__le32 i_flat_nr;
 } __attribute__((packed));
 
 
@@ -119,6 +165,9 @@ struct vbfs_dir_header_disk {
 	__le32 next_extend;
 	__le32 dir_capacity;
 	__le32 bitmap_size;
+
+	/* first extend only, extends per file of the segment template */
+	__le32 seg_extends;
 } __attribute__((packed));
 #define VBFS_DIR_META_ST_SIZE sizeof(struct vbfs_dir_header_disk)
 typedef struct {